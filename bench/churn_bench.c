@@ -0,0 +1,268 @@
+/*! \file   churn_bench.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Session churn benchmark of the rtpforward plugin
+ *
+ * \details Builds the plugin into a standalone program against the stubs of
+ * janus_stubs.c, like rtpforward-bench. Churn threads attach, configure and
+ * destroy sessions as fast as they can, as during a storm of calls coming and
+ * going, while lookup threads keep querying a set of long-lived sessions the
+ * way the admin API and the message handler look sessions up. Reported are
+ * the rates of both, and the latencies of destroy_session() and of the
+ * lookups, which suffer whenever the session table is held by a teardown.
+ *
+ * rtpforward-churn-bench-unsharded is the same program with a single session
+ * table, for comparison.
+ *
+ * Usage: rtpforward-churn-bench [-t churn threads] [-l lookup threads] [-s sessions] [-d seconds] [-v log level]
+*/
+
+#include "../janus_rtpforward.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CHURN_LATENCY_BUCKETS 100000 // tenths of microseconds, the last one counts everything longer
+
+typedef struct churn_histogram {
+	guint64 *buckets; // CHURN_LATENCY_BUCKETS
+	guint64 count;
+	gint64 max_ns;
+} churn_histogram;
+
+typedef struct churn_thread {
+	GThread *thread;
+	guint index;
+	churn_histogram latency;
+	guint64 failures;
+} churn_thread;
+
+static volatile gint churn_stop = 0;
+static janus_plugin_session **churn_handles = NULL; // the long-lived sessions
+static guint churn_handle_count = 0;
+
+static gint64 churn_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void churn_histogram_add(churn_histogram *histogram, gint64 ns) {
+	histogram->buckets[MIN(ns / 100, CHURN_LATENCY_BUCKETS - 1)]++;
+	histogram->count++;
+	if(ns > histogram->max_ns)
+		histogram->max_ns = ns;
+}
+
+static double churn_percentile(churn_histogram *histogram, double percentile) {
+	guint64 rank = (guint64)(histogram->count * percentile / 100.0), seen = 0;
+	guint i;
+	for(i = 0; i < CHURN_LATENCY_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if(seen > rank)
+			return i / 10.0;
+	}
+	return (CHURN_LATENCY_BUCKETS - 1) / 10.0;
+}
+
+static void churn_histogram_print(const char *name, churn_histogram *histogram, double seconds) {
+	printf("%-10s %10.0f/s   p50 %.1f, p99 %.1f, p99.9 %.1f, max %.1f us\n", name, histogram->count / seconds,
+		churn_percentile(histogram, 50), churn_percentile(histogram, 99), churn_percentile(histogram, 99.9),
+		histogram->max_ns / 1000.0);
+}
+
+/* Janus core stand-ins */
+
+static int churn_push_event(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction, json_t *message, json_t *jsep) {
+	return 0;
+}
+
+static void churn_relay_rtcp(janus_plugin_session *handle, janus_plugin_rtcp *packet) {
+}
+
+static void churn_send_pli(janus_plugin_session *handle) {
+}
+
+static void churn_send_remb(janus_plugin_session *handle, guint32 bitrate) {
+}
+
+static janus_callbacks churn_gateway = {
+	.push_event = churn_push_event,
+	.relay_rtcp = churn_relay_rtcp,
+	.send_pli = churn_send_pli,
+	.send_remb = churn_send_remb,
+};
+
+static void churn_handle_free(const janus_refcount *handle_ref) {
+	janus_plugin_session *handle = janus_refcount_containerof(handle_ref, janus_plugin_session, ref);
+	g_free(handle);
+}
+
+// Attaches and configures a session, which opens its socket. The session owns the handle's reference.
+static janus_plugin_session *churn_session_new(void) {
+	janus_plugin_session *handle = g_malloc0(sizeof(janus_plugin_session));
+	janus_refcount_init(&handle->ref, churn_handle_free);
+	int error = 0;
+	rtpforward_create_session(handle, &error);
+	if(error) {
+		g_free(handle);
+		return NULL;
+	}
+	json_t *body = json_pack("{sssssisisisi}", "request", "configure", "sendipv4", "127.0.0.1",
+		"sendport_audio_rtp", 9, "sendport_audio_rtcp", 9, "sendport_video_rtp", 9, "sendport_video_rtcp", 9);
+	janus_plugin_result *result = rtpforward_handle_message(handle, g_strdup("churn"), body, NULL);
+	gboolean configured = result && result->content && json_object_get(result->content, "configured");
+	janus_plugin_result_destroy(result);
+	if(!configured) {
+		rtpforward_destroy_session(handle, &error);
+		return NULL;
+	}
+	return handle;
+}
+
+static void *churn_thread_run(void *data) {
+	churn_thread *thread = (churn_thread *)data;
+	while(!g_atomic_int_get(&churn_stop)) {
+		janus_plugin_session *handle = churn_session_new();
+		if(!handle) {
+			thread->failures++;
+			continue;
+		}
+		int error = 0;
+		gint64 start = churn_now_ns();
+		rtpforward_destroy_session(handle, &error);
+		churn_histogram_add(&thread->latency, churn_now_ns() - start);
+	}
+	return NULL;
+}
+
+static void *churn_lookup_run(void *data) {
+	churn_thread *thread = (churn_thread *)data;
+	guint32 state = 2463534242u + thread->index;
+	while(!g_atomic_int_get(&churn_stop)) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		janus_plugin_session *handle = churn_handles[state % churn_handle_count];
+		gint64 start = churn_now_ns();
+		json_t *info = rtpforward_query_session(handle);
+		churn_histogram_add(&thread->latency, churn_now_ns() - start);
+		if(info)
+			json_decref(info);
+		else
+			thread->failures++;
+	}
+	return NULL;
+}
+
+static void churn_usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-t churn threads] [-l lookup threads] [-s sessions] [-d seconds] [-v log level]\n", program);
+}
+
+static churn_thread *churn_threads_start(guint count, GThreadFunc func) {
+	churn_thread *threads = g_malloc0(count * sizeof(churn_thread));
+	guint i;
+	for(i = 0; i < count; i++) {
+		threads[i].index = i;
+		threads[i].latency.buckets = g_malloc0(CHURN_LATENCY_BUCKETS * sizeof(guint64));
+		threads[i].thread = g_thread_new("churn", func, &threads[i]);
+	}
+	return threads;
+}
+
+// Waits for the threads, and merges their histograms and failures
+static void churn_threads_join(churn_thread *threads, guint count, churn_histogram *total, guint64 *failures) {
+	total->buckets = g_malloc0(CHURN_LATENCY_BUCKETS * sizeof(guint64));
+	guint i, b;
+	for(i = 0; i < count; i++) {
+		g_thread_join(threads[i].thread);
+		for(b = 0; b < CHURN_LATENCY_BUCKETS; b++)
+			total->buckets[b] += threads[i].latency.buckets[b];
+		total->count += threads[i].latency.count;
+		total->max_ns = MAX(total->max_ns, threads[i].latency.max_ns);
+		*failures += threads[i].failures;
+		g_free(threads[i].latency.buckets);
+	}
+	g_free(threads);
+}
+
+int main(int argc, char *argv[]) {
+	int churners = 4, lookups = 2, session_count = 1000, seconds = 5;
+	int opt;
+	while((opt = getopt(argc, argv, "t:l:s:d:v:h")) != -1) {
+		switch(opt) {
+			case 't':
+				churners = atoi(optarg);
+				break;
+			case 'l':
+				lookups = atoi(optarg);
+				break;
+			case 's':
+				session_count = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			case 'v':
+				janus_log_level = atoi(optarg);
+				break;
+			default:
+				churn_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(churners < 1 || lookups < 0 || session_count < 1 || seconds < 1) {
+		fprintf(stderr, "Need at least one churn thread, session and second\n");
+		return 1;
+	}
+
+	if(rtpforward_init(&churn_gateway, "/nonexistent") < 0) {
+		fprintf(stderr, "Plugin initialization failed\n");
+		return 1;
+	}
+	churn_handles = g_malloc0(session_count * sizeof(janus_plugin_session *));
+	for(churn_handle_count = 0; churn_handle_count < (guint)session_count; churn_handle_count++) {
+		churn_handles[churn_handle_count] = churn_session_new();
+		if(!churn_handles[churn_handle_count]) {
+			fprintf(stderr, "Could not create session %u\n", churn_handle_count);
+			return 1;
+		}
+	}
+
+	printf("%d session tables, %d churn threads, %d lookup threads over %d sessions, %d s\n",
+		RTPFORWARD_SESSION_SHARDS, churners, lookups, session_count, seconds);
+	gint64 start = churn_now_ns();
+	churn_thread *churn = churn_threads_start(churners, churn_thread_run);
+	churn_thread *lookup = lookups > 0 ? churn_threads_start(lookups, churn_lookup_run) : NULL;
+	sleep(seconds);
+	g_atomic_int_set(&churn_stop, 1);
+	churn_histogram destroyed, looked_up;
+	guint64 failures = 0;
+	memset(&destroyed, 0, sizeof(destroyed));
+	memset(&looked_up, 0, sizeof(looked_up));
+	churn_threads_join(churn, churners, &destroyed, &failures);
+	if(lookup)
+		churn_threads_join(lookup, lookups, &looked_up, &failures);
+	double elapsed = (churn_now_ns() - start) / 1e9;
+
+	churn_histogram_print("churn", &destroyed, elapsed);
+	if(lookups > 0)
+		churn_histogram_print("lookup", &looked_up, elapsed);
+	if(failures > 0)
+		printf("%-10s %10" G_GUINT64_FORMAT "\n", "failures", failures);
+
+	guint i;
+	for(i = 0; i < churn_handle_count; i++) {
+		int error = 0;
+		rtpforward_destroy_session(churn_handles[i], &error);
+	}
+	rtpforward_destroy();
+	g_free(churn_handles);
+	g_free(destroyed.buckets);
+	g_free(looked_up.buckets);
+	return failures > 0 ? 1 : 0;
+}
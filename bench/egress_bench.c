@@ -0,0 +1,340 @@
+/*! \file   egress_bench.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Compares the egress backends of the rtpforward plugin on loopback
+ *
+ * \details Sends the same amount of RTP-sized datagrams to a local UDP sink
+ * with sendto(), sendmmsg(), io_uring SENDMSG and io_uring SEND_ZC, and
+ * reports the CPU time spent per forwarded Mbit. The CPU time of the sink
+ * thread is not included.
+ *
+ * Usage: rtpforward-egress-bench [-b backend] [-n packets] [-s size] [-v vector]
+ * where backend is one of sendto, sendmmsg, uring, uring-zc or all (default).
+*/
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "../rtpforward_uring.h"
+
+#define BENCH_MAX_VECTOR 64
+#define BENCH_BUFFERS 256
+
+typedef enum bench_backend {
+	BACKEND_SENDTO,
+	BACKEND_SENDMMSG,
+	BACKEND_URING,
+	BACKEND_URING_ZC,
+	BACKEND_COUNT
+} bench_backend;
+
+static const char *backend_names[BACKEND_COUNT] = { "sendto", "sendmmsg", "uring", "uring-zc" };
+
+typedef struct bench_sink {
+	int fd;
+	struct sockaddr_in addr;
+	volatile int stop;
+	unsigned long received;
+	double cpu;
+	pthread_t thread;
+} bench_sink;
+
+typedef struct bench_result {
+	unsigned long sent;
+	unsigned long errors;
+	double wall;
+	double cpu;
+} bench_result;
+
+static double bench_clock(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_process_cpu(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void *bench_sink_thread(void *data) {
+	bench_sink *sink = (bench_sink *)data;
+	static char buffers[BENCH_MAX_VECTOR][2048];
+	struct mmsghdr msgs[BENCH_MAX_VECTOR];
+	struct iovec iovs[BENCH_MAX_VECTOR];
+	int i;
+	for(i = 0; i < BENCH_MAX_VECTOR; i++) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = sizeof(buffers[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while(!sink->stop) {
+		int res = recvmmsg(sink->fd, msgs, BENCH_MAX_VECTOR, 0, NULL);
+		if(res > 0)
+			sink->received += res;
+	}
+	sink->cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+static int bench_sink_start(bench_sink *sink) {
+	memset(sink, 0, sizeof(*sink));
+	sink->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int rcvbuf = 8 * 1024 * 1024;
+	setsockopt(sink->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+	setsockopt(sink->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	sink->addr.sin_family = AF_INET;
+	sink->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(sink->addr);
+	if(bind(sink->fd, (struct sockaddr *)&sink->addr, len) < 0 || getsockname(sink->fd, (struct sockaddr *)&sink->addr, &len) < 0) {
+		perror("sink");
+		return -1;
+	}
+	return pthread_create(&sink->thread, NULL, bench_sink_thread, sink);
+}
+
+static void bench_sink_stop(bench_sink *sink) {
+	usleep(200000); // let the sink drain its receive buffer
+	sink->stop = 1;
+	pthread_join(sink->thread, NULL);
+	close(sink->fd);
+}
+
+static void bench_sendto(int fd, bench_sink *sink, char *buffers, size_t size, unsigned long packets, bench_result *result) {
+	unsigned long i;
+	for(i = 0; i < packets; i++) {
+		char *buf = buffers + (i % BENCH_BUFFERS) * size;
+		if(sendto(fd, buf, size, 0, (struct sockaddr *)&sink->addr, sizeof(sink->addr)) < 0)
+			result->errors++;
+		else
+			result->sent++;
+	}
+}
+
+static void bench_sendmmsg(int fd, bench_sink *sink, char *buffers, size_t size, unsigned long packets, unsigned vector, bench_result *result) {
+	struct mmsghdr msgs[BENCH_MAX_VECTOR];
+	struct iovec iovs[BENCH_MAX_VECTOR];
+	unsigned long i = 0;
+	while(i < packets) {
+		unsigned count = 0;
+		for(; count < vector && i < packets; count++, i++) {
+			iovs[count].iov_base = buffers + (i % BENCH_BUFFERS) * size;
+			iovs[count].iov_len = size;
+			memset(&msgs[count], 0, sizeof(msgs[count]));
+			msgs[count].msg_hdr.msg_name = &sink->addr;
+			msgs[count].msg_hdr.msg_namelen = sizeof(sink->addr);
+			msgs[count].msg_hdr.msg_iov = &iovs[count];
+			msgs[count].msg_hdr.msg_iovlen = 1;
+		}
+		unsigned done = 0;
+		while(done < count) {
+			int res = sendmmsg(fd, msgs + done, count - done, 0);
+			if(res < 0) {
+				result->errors++;
+				res = 1;
+			} else {
+				result->sent += res;
+			}
+			done += res;
+		}
+	}
+}
+
+typedef struct bench_uring_state {
+	struct msghdr msgs[BENCH_BUFFERS];
+	struct iovec iovs[BENCH_BUFFERS];
+	int busy[BENCH_BUFFERS];
+	unsigned inflight;
+	bench_result *result;
+} bench_uring_state;
+
+static void bench_uring_complete(unsigned long long user_data, int res, unsigned flags, void *data) {
+	bench_uring_state *state = (bench_uring_state *)data;
+#ifdef HAVE_LINUX_IO_URING_H
+	if(!(flags & IORING_CQE_F_NOTIF)) {
+		if(res < 0)
+			state->result->errors++;
+		else
+			state->result->sent++;
+	}
+	if(flags & IORING_CQE_F_MORE)
+		return; // the buffer is still in use until the notification
+#endif
+	state->busy[user_data] = 0;
+	state->inflight--;
+}
+
+static int bench_uring_run(int fd, bench_sink *sink, char *buffers, size_t size, unsigned long packets, unsigned vector, int zc, bench_result *result) {
+	rtpforward_uring ring;
+	int res = rtpforward_uring_init(&ring, BENCH_BUFFERS);
+	if(res < 0) {
+		fprintf(stderr, "io_uring not available: %s\n", strerror(-res));
+		return -1;
+	}
+	if(zc && !ring.send_zc) {
+		fprintf(stderr, "IORING_OP_SEND_ZC not supported by this kernel\n");
+		rtpforward_uring_exit(&ring);
+		return -1;
+	}
+	int buf_index = -1;
+	if(zc && rtpforward_uring_register_buffers(&ring, 1) == 0 && rtpforward_uring_set_buffer(&ring, 0, buffers, BENCH_BUFFERS * size) == 0)
+		buf_index = 0;
+
+	bench_uring_state *state = calloc(1, sizeof(bench_uring_state));
+	state->result = result;
+	unsigned long queued = 0;
+	unsigned next = 0;
+	while(queued < packets || state->inflight > 0) {
+		unsigned count = 0;
+		while(count < vector && queued < packets && !state->busy[next]) {
+			struct io_uring_sqe *sqe = rtpforward_uring_get_sqe(&ring);
+			if(!sqe)
+				break;
+			char *buf = buffers + next * size;
+			if(zc) {
+				rtpforward_uring_prep_send_zc(sqe, fd, buf, size, (struct sockaddr *)&sink->addr, sizeof(sink->addr), buf_index, next);
+			} else {
+				state->iovs[next].iov_base = buf;
+				state->iovs[next].iov_len = size;
+				memset(&state->msgs[next], 0, sizeof(struct msghdr));
+				state->msgs[next].msg_name = &sink->addr;
+				state->msgs[next].msg_namelen = sizeof(sink->addr);
+				state->msgs[next].msg_iov = &state->iovs[next];
+				state->msgs[next].msg_iovlen = 1;
+				rtpforward_uring_prep_sendmsg(sqe, fd, &state->msgs[next], next);
+			}
+			state->busy[next] = 1;
+			state->inflight++;
+			queued++;
+			count++;
+			next = (next + 1) % BENCH_BUFFERS;
+		}
+		// Only block for completions if nothing could be queued
+		rtpforward_uring_submit(&ring, count == 0 ? 1 : 0);
+		rtpforward_uring_reap(&ring, bench_uring_complete, state);
+	}
+	free(state);
+	rtpforward_uring_exit(&ring);
+	return 0;
+}
+
+static int bench_run(bench_backend backend, size_t size, unsigned long packets, unsigned vector) {
+	bench_sink sink;
+	if(bench_sink_start(&sink) < 0)
+		return -1;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int sndbuf = 4 * 1024 * 1024;
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	char *buffers = aligned_alloc(4096, ((BENCH_BUFFERS * size + 4095) / 4096) * 4096);
+	unsigned long i;
+	for(i = 0; i < BENCH_BUFFERS * size; i++)
+		buffers[i] = (char)i;
+
+	bench_result result;
+	memset(&result, 0, sizeof(result));
+	double wall = bench_clock(CLOCK_MONOTONIC);
+	double cpu = bench_process_cpu();
+	int res = 0;
+	switch(backend) {
+		case BACKEND_SENDTO:
+			bench_sendto(fd, &sink, buffers, size, packets, &result);
+			break;
+		case BACKEND_SENDMMSG:
+			bench_sendmmsg(fd, &sink, buffers, size, packets, vector, &result);
+			break;
+		case BACKEND_URING:
+		case BACKEND_URING_ZC:
+			res = bench_uring_run(fd, &sink, buffers, size, packets, vector, backend == BACKEND_URING_ZC, &result);
+			break;
+		default:
+			break;
+	}
+	result.wall = bench_clock(CLOCK_MONOTONIC) - wall;
+	result.cpu = bench_process_cpu() - cpu;
+	bench_sink_stop(&sink);
+	// The sink kept running while we were measuring: take its share out
+	result.cpu -= sink.cpu;
+	if(result.cpu < 0)
+		result.cpu = 0;
+	close(fd);
+	free(buffers);
+	if(res < 0)
+		return -1;
+
+	double mbit = result.sent * size * 8 / 1e6;
+	printf("%-10s %10lu %8lu %10lu %8.3f %10.1f %8.3f %12.2f\n",
+		backend_names[backend], result.sent, result.errors, sink.received,
+		result.wall, mbit / result.wall, result.cpu, mbit > 0 ? result.cpu * 1e6 / mbit : 0.0);
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int backend = -1;
+	size_t size = 1200;
+	unsigned long packets = 1000000;
+	unsigned vector = 32;
+	int opt;
+	while((opt = getopt(argc, argv, "b:n:s:v:h")) != -1) {
+		switch(opt) {
+			case 'b':
+				if(!strcmp(optarg, "all")) {
+					backend = -1;
+					break;
+				}
+				for(backend = 0; backend < BACKEND_COUNT; backend++)
+					if(!strcmp(optarg, backend_names[backend]))
+						break;
+				if(backend == BACKEND_COUNT) {
+					fprintf(stderr, "Unknown backend %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'n':
+				packets = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				size = strtoul(optarg, NULL, 10);
+				if(size < 12 || size > 2048) {
+					fprintf(stderr, "Size must be between 12 and 2048\n");
+					return 1;
+				}
+				break;
+			case 'v':
+				vector = strtoul(optarg, NULL, 10);
+				if(vector < 1 || vector > BENCH_MAX_VECTOR) {
+					fprintf(stderr, "Vector must be between 1 and %d\n", BENCH_MAX_VECTOR);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-b sendto|sendmmsg|uring|uring-zc|all] [-n packets] [-s size] [-v vector]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	printf("%lu packets of %zu bytes, vectors of %u\n", packets, size, vector);
+	printf("%-10s %10s %8s %10s %8s %10s %8s %12s\n", "backend", "sent", "errors", "received", "wall s", "Mbit/s", "cpu s", "cpu us/Mbit");
+	int failed = 0;
+	if(backend >= 0)
+		return bench_run(backend, size, packets, vector) < 0;
+	for(backend = 0; backend < BACKEND_COUNT; backend++)
+		failed |= (bench_run(backend, size, packets, vector) < 0);
+	return failed;
+}
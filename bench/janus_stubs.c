@@ -0,0 +1,179 @@
+/*! \file   janus_stubs.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Minimal stand-ins for the Janus core functions used by the plugin
+ *
+ * \details The plugin is normally resolved against the symbols of the janus
+ * binary. The benchmarks link it into standalone programs instead, so the
+ * few core functions it calls are provided here. Only what the media path
+ * needs actually works: logging, plugin results, the monotonic clock,
+ * parsing booleans, finding the RTP payload and building FIR packets. The
+ * plugin detects keyframes itself, with no help of the core.
+ * Configuration files and SDP are not supported; the benchmarks don't
+ * negotiate media.
+ *
+ * The Janus headers are deliberately not included, as this file only has to
+ * satisfy the linker.
+*/
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+#include <jansson.h>
+
+/* Logging */
+
+int janus_log_level = 3; // LOG_WARN
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+char *janus_log_global_prefix = NULL;
+const char *janus_log_prefix[] = {
+	"", "[FATAL] ", "[ERR] ", "[WARN] ", "", "", "", "",
+	"", "[FATAL] ", "[ERR] ", "[WARN] ", "", "", "", ""
+};
+int lock_debug = 0;
+int refcount_debug = 0;
+
+void janus_vprintf(const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+}
+
+const char *janus_get_api_error(int error) {
+	return "Janus API error (benchmark)";
+}
+
+/* Plugin results, laid out like struct janus_plugin_result */
+
+typedef struct janus_stub_plugin_result {
+	int type;
+	const char *text;
+	json_t *content;
+} janus_stub_plugin_result;
+
+void *janus_plugin_result_new(int type, const char *text, json_t *content) {
+	janus_stub_plugin_result *result = g_malloc(sizeof(janus_stub_plugin_result));
+	result->type = type;
+	result->text = text;
+	result->content = content;
+	return result;
+}
+
+void janus_plugin_result_destroy(void *result) {
+	janus_stub_plugin_result *stub = (janus_stub_plugin_result *)result;
+	if(stub == NULL)
+		return;
+	if(stub->content)
+		json_decref(stub->content);
+	g_free(stub);
+}
+
+/* Clock */
+
+gint64 janus_get_monotonic_time(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * G_GINT64_CONSTANT(1000000)) + (ts.tv_nsec / G_GINT64_CONSTANT(1000));
+}
+
+/* Configuration values */
+
+gboolean janus_is_true(const char *value) {
+	return value && (!strcasecmp(value, "yes") || !strcasecmp(value, "true") || !strcasecmp(value, "1"));
+}
+
+/* RTP and RTCP */
+
+char *janus_rtp_payload(char *buf, int len, int *plen) {
+	if(!buf || len < 12)
+		return NULL;
+	int skip = 12 + 4 * (buf[0] & 0x0f);
+	if((buf[0] & 0x10) && len >= skip + 4) {
+		uint16_t words;
+		memcpy(&words, buf + skip + 2, sizeof(words));
+		skip += 4 + 4 * ntohs(words);
+	}
+	if(skip > len)
+		return NULL;
+	if(plen)
+		*plen = len - skip;
+	return buf + skip;
+}
+
+void janus_rtp_switching_context_reset(void *context) {
+	// The plugin allocates its sessions zeroed, which is all the reset would do here
+}
+
+void janus_rtp_header_update(void *header, void *context, gboolean video, int step) {
+	// A capture replays a single SSRC per stream, so there is no switch for the rewriting to hide
+}
+
+int janus_rtcp_fir(char *packet, int len, int *seqnr) {
+	if(packet == NULL || len != 20 || seqnr == NULL)
+		return -1;
+	memset(packet, 0, len);
+	packet[0] = (char)(0x80 | 4); // version 2, FMT 4
+	packet[1] = (char)206; // payload-specific feedback
+	packet[3] = 4; // length in 32-bit words minus one
+	*seqnr = *seqnr + 1;
+	if(*seqnr < 0 || *seqnr >= 256)
+		*seqnr = 0;
+	packet[16] = (char)*seqnr;
+	return 20;
+}
+
+/* Configuration and SDP are not available to the benchmark */
+
+void *janus_config_parse(const char *config_file) {
+	return NULL;
+}
+
+void *janus_config_get(void *config, void *parent, int type, const char *name) {
+	return NULL;
+}
+
+void *janus_config_get_create(void *config, void *parent, int type, const char *name) {
+	return NULL;
+}
+
+void janus_config_print(void *config) {
+}
+
+void janus_config_destroy(void *config) {
+}
+
+void *janus_sdp_parse(const char *sdp, char *error, size_t errlen) {
+	if(error && errlen > 0)
+		g_snprintf(error, errlen, "SDP is not supported by the benchmark");
+	return NULL;
+}
+
+char *janus_sdp_write(void *sdp) {
+	return NULL;
+}
+
+void janus_sdp_destroy(void *sdp) {
+}
+
+int janus_sdp_find_first_codecs(void *sdp, const char **acodec, const char **vcodec) {
+	if(acodec)
+		*acodec = NULL;
+	if(vcodec)
+		*vcodec = NULL;
+	return -1;
+}
+
+void *janus_sdp_generate_answer(void *offer, ...) {
+	return NULL;
+}
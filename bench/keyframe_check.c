@@ -0,0 +1,354 @@
+/*! \file   keyframe_check.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Correctness corpus and benchmark of the keyframe detection of the rtpforward plugin
+ *
+ * \details Generates a corpus of well-formed payloads of every packetization
+ * the plugin sees: VP8 descriptors with and without extensions, VP9 flexible
+ * and non-flexible descriptors, H.264 single NAL units, STAP-A and FU-A, AV1
+ * OBU elements with and without length fields, continued OBUs and the N bit,
+ * and H.265 single NAL units, AP and FU, keyframes and not. Every payload is
+ * built to show a keyframe or not, as the payload formats and bitstreams
+ * define it, and rtpforward_keyframe_parse() must find a keyframe in exactly
+ * those which do. Random mutations and truncations of them have no known
+ * answer, and only have to be parsed without reading past their end, which
+ * valgrind or ASan then catch, as they are parsed from a copy of their exact
+ * length. It then plays streams of frames through
+ * rtpforward_keyframe_detect() and checks that it reports each keyframe once,
+ * on a packet of that frame, and compares the time per packet of the parser
+ * and the cached detection. The plugin is built in, with the Janus core
+ * replaced by stubs (see janus_stubs.c), which don't detect keyframes: the
+ * plugin has its own parser. Fails on any mismatch.
+ *
+ * Usage: rtpforward-keyframe-check [-n mutations] [-s seed]
+*/
+
+#include "../janus_rtpforward.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CHECK_PAYLOAD_MAX 1200
+#define CHECK_FRAMES 4096
+#define CHECK_PACKETS_PER_FRAME 8
+#define CHECK_KEYFRAME_INTERVAL 30 // frames
+
+static const char *check_codec_names[] = { "none", "vp8", "vp9", "h264", "av1", "h265" };
+
+typedef struct check_payload {
+	guint8 data[CHECK_PAYLOAD_MAX];
+	int length;
+} check_payload;
+
+static void check_fill(guint8 *data, int length) {
+	int i;
+	for(i = 0; i < length; i++)
+		data[i] = (guint8)g_random_int();
+}
+
+/* Writes value as LEB128, as AV1 sizes its OBU elements. Returns the number of bytes. */
+static int check_leb128(guint8 *data, guint value) {
+	int n = 0;
+	do {
+		data[n] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+		value >>= 7;
+		n++;
+	} while(value > 0);
+	return n;
+}
+
+/* One well-formed payload of the codec. variant picks the packetization, first whether it starts the frame.
+ * Returns whether the payload shows that its frame is a keyframe.
+ */
+static gboolean check_build(rtpforward_video_codec codec, guint variant, gboolean first, gboolean keyframe, check_payload *p) {
+	p->length = 100 + g_random_int_range(0, 1000);
+	check_fill(p->data, p->length);
+	int o = 0;
+	if(codec == CODEC_VP8) {
+		guint8 x = (variant & 1) ? (guint8)(g_random_int() & 0xf0) : 0;
+		p->data[o++] = (x ? 0x80 : 0) | (first ? 0x10 : 0) | ((variant & 2) ? 0x20 : 0);
+		if(x) {
+			p->data[o++] = x;
+			if(x & 0x80) {
+				gboolean m = g_random_boolean();
+				p->data[o++] = m ? 0x80 : 0x00;
+				if(m)
+					o++;
+			}
+			if(x & 0x40)
+				o++;
+			if(x & 0x30)
+				o++;
+		}
+		if(first) {
+			p->data[o] = (p->data[o] & 0xfe) | (keyframe ? 0x00 : 0x01);
+			if(keyframe || (variant & 4)) {
+				p->data[o + 3] = 0x9d;
+				p->data[o + 4] = 0x01;
+				p->data[o + 5] = 0x2a;
+			}
+		}
+		// Only the start of partition 0 has the frame header, with the key frame flag
+		return first && keyframe;
+	} else if(codec == CODEC_VP9) {
+		guint8 flags = (guint8)(g_random_int() & 0xb7); // I, L, F, E, V, Z: anything but P and B
+		p->data[0] = flags | (keyframe ? 0 : 0x40) | (first ? 0x08 : 0);
+		// Not inter-picture predicted, at the beginning of a frame
+		return first && keyframe;
+	} else if(codec == CODEC_H264) {
+		guint8 nri = 0x60;
+		switch(variant % 3) {
+			case 0: // single NAL unit: IDR or non-IDR slice, or SEI
+				p->data[0] = nri | (keyframe ? 5 : ((variant & 4) ? 6 : 1));
+				return keyframe;
+			case 1: { // STAP-A of SPS, PPS (and maybe SEI)
+				int units = 1 + g_random_int_range(0, 4);
+				gboolean parameters = FALSE;
+				p->data[o++] = nri | 24;
+				while(units-- > 0 && o + 40 < p->length) {
+					int size = 1 + g_random_int_range(0, 30);
+					p->data[o++] = size >> 8;
+					p->data[o++] = size & 0xff;
+					guint8 types[] = { 7, 8, 6, 9 };
+					guint8 type = keyframe ? types[g_random_int_range(0, 4)] : types[1 + g_random_int_range(0, 3)];
+					parameters |= type == 7;
+					p->data[o] = nri | type;
+					o += size;
+				}
+				p->length = o;
+				// An SPS starts a keyframe, a PPS or SEI alone doesn't tell
+				return parameters;
+			}
+			default: // FU-A of an IDR or non-IDR slice
+				p->data[0] = nri | 28;
+				p->data[1] = (first ? 0x80 : 0) | (keyframe ? 5 : 1);
+				// Only the first fragment has the start bit
+				return keyframe && first;
+		}
+	} else if(codec == CODEC_AV1) {
+		if(!first) {
+			// The rest of an OBU of the previous packet (Z), maybe continued in the next one (Y), in one element
+			p->data[0] = 0x80 | (g_random_boolean() ? 0x40 : 0) | 0x10;
+			return FALSE;
+		}
+		// A temporal unit: maybe metadata, a sequence header if it's a keyframe, and a frame
+		guint8 types[3];
+		int count = 0;
+		if(variant & 2)
+			types[count++] = 5; // OBU_METADATA
+		if(keyframe)
+			types[count++] = 1; // OBU_SEQUENCE_HEADER
+		types[count++] = (variant & 4) ? 3 : 6; // OBU_FRAME_HEADER or OBU_FRAME
+		gboolean sized = variant & 1; // W = 0: every element has a length; otherwise W = count, the last has none
+		gboolean new_sequence = keyframe && (variant & 8);
+		p->data[o++] = (new_sequence ? 0x08 : 0) | (sized ? 0 : (count << 4));
+		int e;
+		for(e = 0; e < count; e++) {
+			int size = 1 + g_random_int_range(0, e < count - 1 ? 40 : 300);
+			if(sized || e < count - 1)
+				o += check_leb128(p->data + o, size);
+			p->data[o] = (types[e] << 3) | (g_random_boolean() ? 0x04 : 0) | 0x02;
+			o += size;
+		}
+		p->length = o;
+		return keyframe;
+	} else if(codec == CODEC_H265) {
+		// NAL unit header: F, type (6 bits), layer id (6 bits), temporal id + 1 (3 bits)
+		switch(variant % 3) {
+			case 0: { // single NAL unit: IDR_W_RADL or CRA, TRAIL_R, or SEI
+				guint8 type = keyframe ? ((variant & 4) ? 21 : 19) : ((variant & 8) ? 39 : 1);
+				p->data[0] = type << 1;
+				p->data[1] = 0x01;
+				return keyframe;
+			}
+			case 1: { // AP of VPS, SPS, PPS and SEI, or only of PPS and SEI
+				int units = 1 + g_random_int_range(0, 4);
+				gboolean parameters = FALSE;
+				p->data[o++] = 48 << 1;
+				p->data[o++] = 0x01;
+				while(units-- > 0 && o + 40 < p->length) {
+					int size = 2 + g_random_int_range(0, 30);
+					p->data[o++] = size >> 8;
+					p->data[o++] = size & 0xff;
+					guint8 types[] = { 32, 33, 34, 39 };
+					guint8 type = keyframe ? types[g_random_int_range(0, 4)] : types[2 + g_random_int_range(0, 2)];
+					parameters |= type == 32 || type == 33;
+					p->data[o] = type << 1;
+					p->data[o + 1] = 0x01;
+					o += size;
+				}
+				p->length = o;
+				return parameters;
+			}
+			default: // FU of an IDR or non-IDR slice
+				p->data[0] = 49 << 1;
+				p->data[1] = 0x01;
+				p->data[2] = (first ? 0x80 : 0) | (keyframe ? 19 : 1);
+				return keyframe && first;
+		}
+	}
+	return FALSE;
+}
+
+static int check_corpus(guint mutations) {
+	int failures = 0;
+	guint64 checked = 0, keyframes = 0;
+	rtpforward_video_codec codec;
+	for(codec = CODEC_VP8; codec <= CODEC_H265; codec++) {
+		guint i;
+		for(i = 0; i < 4096 + mutations; i++) {
+			check_payload p;
+			gboolean built = check_build(codec, i, g_random_boolean(), g_random_boolean(), &p);
+			if(i >= 4096) {
+				// Flip a few bits, or cut it short
+				int flips = g_random_int_range(1, 4);
+				while(flips-- > 0)
+					p.data[g_random_int_range(0, MIN(p.length, 48))] ^= 1 << g_random_int_range(0, 8);
+				if(g_random_int_range(0, 4) == 0)
+					p.length = g_random_int_range(0, p.length + 1);
+			}
+			// An exact copy, so reads past the end are caught
+			guint8 *copy = g_malloc(MAX(p.length, 1));
+			memcpy(copy, p.data, p.length);
+			gboolean got = rtpforward_keyframe_parse(codec, copy, p.length) == KEYFRAME_YES;
+			g_free(copy);
+			if(i >= 4096)
+				continue;
+			gboolean expected = built;
+			checked++;
+			keyframes += expected;
+			if(expected != got && failures++ < 10) {
+				int b;
+				fprintf(stderr, "%s payload of %d bytes: expected %d, rtpforward %d:", check_codec_names[codec], p.length, expected, got);
+				for(b = 0; b < MIN(p.length, 16); b++)
+					fprintf(stderr, " %02x", p.data[b]);
+				fprintf(stderr, "\n");
+			}
+		}
+	}
+	printf("corpus: %" G_GUINT64_FORMAT " payloads, %" G_GUINT64_FORMAT " keyframe packets, %d mismatches\n", checked, keyframes, failures);
+	return failures;
+}
+
+/* A stream of frames of CHECK_PACKETS_PER_FRAME packets each, as RTP packets */
+typedef struct check_stream {
+	char packets[CHECK_FRAMES * CHECK_PACKETS_PER_FRAME][12 + CHECK_PAYLOAD_MAX];
+	int lengths[CHECK_FRAMES * CHECK_PACKETS_PER_FRAME];
+	gboolean keyframe[CHECK_FRAMES];
+} check_stream;
+
+static void check_stream_fill(check_stream *stream, rtpforward_video_codec codec) {
+	guint f, n;
+	for(f = 0; f < CHECK_FRAMES; f++) {
+		stream->keyframe[f] = (f % CHECK_KEYFRAME_INTERVAL) == 0;
+		for(n = 0; n < CHECK_PACKETS_PER_FRAME; n++) {
+			guint index = f * CHECK_PACKETS_PER_FRAME + n;
+			char *buffer = stream->packets[index];
+			memset(buffer, 0, 12);
+			janus_rtp_header *header = (janus_rtp_header *)buffer;
+			header->version = 2;
+			header->type = 96;
+			header->markerbit = n == CHECK_PACKETS_PER_FRAME - 1;
+			header->seq_number = htons((guint16)index);
+			header->timestamp = htonl(f * 3000);
+			check_payload p;
+			// H.264 and H.265 keyframes: parameter sets in an aggregation packet, then the IDR slice in fragments;
+			// otherwise fragments of a non-IDR slice
+			gboolean nal = codec == CODEC_H264 || codec == CODEC_H265;
+			guint variant = nal ? ((stream->keyframe[f] && n == 0) ? 1 : 2) : f;
+			check_build(codec, variant, n == 0 || (nal && n == 1), stream->keyframe[f], &p);
+			memcpy(buffer + 12, p.data, p.length);
+			stream->lengths[index] = 12 + p.length;
+		}
+	}
+}
+
+static int check_detect(rtpforward_session *session, check_stream *stream) {
+	int failures = 0;
+	guint f, n;
+	session->keyframe_frame_known = FALSE;
+	for(f = 0; f < CHECK_FRAMES; f++) {
+		guint detected = 0;
+		for(n = 0; n < CHECK_PACKETS_PER_FRAME; n++) {
+			guint index = f * CHECK_PACKETS_PER_FRAME + n;
+			detected += rtpforward_keyframe_detect(session, stream->packets[index], stream->lengths[index]);
+		}
+		if(detected != (stream->keyframe[f] ? 1 : 0) && failures++ < 10)
+			fprintf(stderr, "%s frame %u: keyframe %d, detected %u times\n", check_codec_names[session->vcodec], f, stream->keyframe[f], detected);
+	}
+	return failures;
+}
+
+static gint64 check_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static volatile guint64 check_sink;
+
+static void check_bench(rtpforward_session *session, check_stream *stream) {
+	guint total = CHECK_FRAMES * CHECK_PACKETS_PER_FRAME, i, r;
+	double parse = 0, detect = 0;
+	for(r = 0; r < 5; r++) {
+		guint64 sum = 0;
+		gint64 start = check_now_ns();
+		for(i = 0; i < total; i++) {
+			int plen = 0;
+			char *payload = janus_rtp_payload(stream->packets[i], stream->lengths[i], &plen);
+			sum += rtpforward_keyframe_parse(session->vcodec, (guint8 *)payload, plen) == KEYFRAME_YES;
+		}
+		gint64 end = check_now_ns();
+		session->keyframe_frame_known = FALSE;
+		for(i = 0; i < total; i++)
+			sum += rtpforward_keyframe_detect(session, stream->packets[i], stream->lengths[i]);
+		gint64 last = check_now_ns();
+		check_sink += sum;
+		double p = (double)(end - start) / total, d = (double)(last - end) / total;
+		if(r == 0 || p < parse)
+			parse = p;
+		if(r == 0 || d < detect)
+			detect = d;
+	}
+	printf("%-5s ns/packet: parse %6.2f, cached detect %6.2f\n", check_codec_names[session->vcodec], parse, detect);
+}
+
+int main(int argc, char *argv[]) {
+	guint mutations = 200000;
+	guint32 seed = 1;
+	int opt;
+	while((opt = getopt(argc, argv, "n:s:h")) != -1) {
+		switch(opt) {
+			case 'n':
+				mutations = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n mutations] [-s seed]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	g_random_set_seed(seed);
+
+	int failures = check_corpus(mutations);
+	rtpforward_session *session = g_malloc0(sizeof(rtpforward_session));
+	check_stream *stream = g_malloc(sizeof(check_stream));
+	rtpforward_video_codec codec;
+	for(codec = CODEC_VP8; codec <= CODEC_H265; codec++) {
+		session->vcodec = codec;
+		check_stream_fill(stream, codec);
+		int detect_failures = check_detect(session, stream);
+		printf("%-5s stream: %d frames, %d detection mismatches\n", check_codec_names[codec], CHECK_FRAMES, detect_failures);
+		failures += detect_failures;
+		check_bench(session, stream);
+	}
+	g_free(stream);
+	g_free(session);
+	return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,472 @@
+/*! \file   microbench.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Micro-benchmarks of the per-packet stages of the rtpforward plugin
+ *
+ * \details Times the stages of rtpforward_incoming_rtp() in isolation, on
+ * synthetic packets, and counts the heap allocations they make. The plugin
+ * is built in, with the Janus core replaced by stubs (see janus_stubs.c).
+ * Sending is mocked: sendmmsg() and sendto() are replaced by functions which
+ * only account for the datagrams, so the send stages measure the plugin and
+ * not the kernel.
+ *
+ * With -w, the results are written to a baseline file. With -b, they are
+ * compared to one, and the program fails if any stage got slower than the
+ * baseline by more than the margin given with -m, or allocates more. Stages
+ * without a baseline, and all of them if the baseline file doesn't exist
+ * yet, are not timed against anything, but must not allocate at all, which
+ * is what "make check" runs.
+ *
+ * Usage: rtpforward-microbench [-n packets] [-r repeats] [-s stage] [-w file] [-b file] [-m percent]
+*/
+
+#include "../janus_rtpforward.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define MICROBENCH_PACKETS 1024 // distinct synthetic packets, cycled through
+#define MICROBENCH_PAYLOAD 1100
+#define MICROBENCH_KEYFRAME_INTERVAL 128 // packets
+#define MICROBENCH_MARGIN_DEFAULT 20 // percent
+
+/* Heap allocations, counted by interposing the allocator (glibc) */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static __thread guint64 microbench_allocations = 0;
+
+void *malloc(size_t size) {
+	microbench_allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+	microbench_allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+	microbench_allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) {
+	__libc_free(ptr);
+}
+
+/* Mocked socket: every datagram is accepted right away */
+
+static guint64 microbench_datagrams = 0;
+
+int sendmmsg(int fd, struct mmsghdr *msgvec, unsigned int vlen, int flags) {
+	unsigned int i;
+	size_t j;
+	for(i = 0; i < vlen; i++) {
+		msgvec[i].msg_len = 0;
+		for(j = 0; j < msgvec[i].msg_hdr.msg_iovlen; j++)
+			msgvec[i].msg_len += msgvec[i].msg_hdr.msg_iov[j].iov_len;
+	}
+	microbench_datagrams += vlen;
+	return vlen;
+}
+
+ssize_t sendto(int fd, const void *buf, size_t len, int flags, const struct sockaddr *addr, socklen_t addrlen) {
+	microbench_datagrams++;
+	return len;
+}
+
+/* Synthetic packets */
+
+typedef struct microbench_packets {
+	char buffers[MICROBENCH_PACKETS][RTPFORWARD_MAX_PACKET_SIZE];
+	guint16 lengths[MICROBENCH_PACKETS];
+} microbench_packets;
+
+/* Builds a video stream of the given codec: one frame per 8 packets with the marker bit on the last one,
+ * a keyframe every MICROBENCH_KEYFRAME_INTERVAL packets, and every 16th pair of packets swapped */
+static void microbench_packets_fill(microbench_packets *packets, rtpforward_video_codec codec) {
+	guint i;
+	memset(packets, 0, sizeof(microbench_packets));
+	for(i = 0; i < MICROBENCH_PACKETS; i++) {
+		guint n = (i % 16 == 14) ? i + 1 : (i % 16 == 15) ? i - 1 : i;
+		char *buffer = packets->buffers[i];
+		janus_rtp_header *header = (janus_rtp_header *)buffer;
+		header->version = 2;
+		header->type = 96;
+		header->markerbit = (n % 8) == 7;
+		header->seq_number = htons((guint16)n);
+		header->timestamp = htonl((n / 8) * 3000);
+		header->ssrc = htonl(0x12345678);
+		guint8 *payload = (guint8 *)buffer + 12;
+		gboolean frame_start = (n % 8) == 0, keyframe = (n % MICROBENCH_KEYFRAME_INTERVAL) == 0;
+		guint j;
+		for(j = 0; j < MICROBENCH_PAYLOAD; j++)
+			payload[j] = (guint8)(n + j);
+		if(codec == CODEC_VP8) {
+			payload[0] = 0x80 | (frame_start ? 0x10 : 0); // X, S, partition 0
+			payload[1] = 0x80; // I: 15 bit picture id
+			payload[2] = 0x80 | ((n / 8) >> 8 & 0x7f);
+			payload[3] = (n / 8) & 0xff;
+			payload[4] = keyframe ? 0x00 : 0x01; // inverse key frame flag
+			payload[7] = 0x9d;
+			payload[8] = 0x01;
+			payload[9] = 0x2a;
+		} else if(codec == CODEC_VP9) {
+			payload[0] = (keyframe ? 0x00 : 0x40) | (frame_start ? 0x08 : 0) | 0x80; // P, B, I
+			payload[1] = 0x80 | ((n / 8) >> 8 & 0x7f);
+			payload[2] = (n / 8) & 0xff;
+		} else if(codec == CODEC_H264) {
+			if(keyframe) {
+				// STAP-A with SPS and PPS
+				payload[0] = 24;
+				payload[1] = 0;
+				payload[2] = 10;
+				payload[3] = 0x67;
+				payload[13] = 0;
+				payload[14] = 4;
+				payload[15] = 0x68;
+			} else {
+				// FU-A of a non-IDR slice
+				payload[0] = 28;
+				payload[1] = (frame_start ? 0x80 : 0) | 1;
+			}
+		}
+		packets->lengths[i] = 12 + MICROBENCH_PAYLOAD;
+	}
+}
+
+/* Stages */
+
+typedef struct microbench_context {
+	microbench_packets *packets;
+	rtpforward_session *session;
+	janus_plugin_session *handle;
+	rtpforward_seqwin seqwin;
+	volatile guint64 sink; // keeps the compiler from optimizing the work away
+} microbench_context;
+
+typedef struct microbench_stage {
+	const char *name;
+	rtpforward_video_codec codec;
+	void (*setup)(microbench_context *context);
+	void (*run)(microbench_context *context, guint64 count);
+	void (*teardown)(microbench_context *context);
+} microbench_stage;
+
+static void microbench_seqwin_setup(microbench_context *context) {
+	memset(&context->seqwin, 0, sizeof(rtpforward_seqwin));
+}
+
+static void microbench_seqwin_run(microbench_context *context, guint64 count) {
+	guint64 i, sum = 0;
+	for(i = 0; i < count; i++) {
+		char *buffer = context->packets->buffers[i % MICROBENCH_PACKETS];
+		janus_rtp_header *header = (janus_rtp_header *)buffer;
+		// Continue the sequence across laps of the packet set
+		guint16 seq = ntohs(header->seq_number) + (guint16)((i / MICROBENCH_PACKETS) * MICROBENCH_PACKETS);
+		guint missed;
+		guint32 extended;
+		rtpforward_seqwin_update(&context->seqwin, seq, RTPFORWARD_REORDER_TOLERANCE_DEFAULT, &missed, &extended);
+		sum += missed + extended + header->markerbit;
+	}
+	context->sink += sum;
+}
+
+static void microbench_keyframe_parse_run(microbench_context *context, guint64 count) {
+	rtpforward_video_codec codec = context->session->vcodec;
+	guint64 i, keyframes = 0;
+	for(i = 0; i < count; i++) {
+		guint index = i % MICROBENCH_PACKETS;
+		int plen = 0;
+		char *payload = janus_rtp_payload(context->packets->buffers[index], context->packets->lengths[index], &plen);
+		keyframes += rtpforward_keyframe_parse(codec, (const guint8 *)payload, plen) == KEYFRAME_YES;
+	}
+	context->sink += keyframes;
+}
+
+static void microbench_keyframe_detect_setup(microbench_context *context) {
+	context->session->keyframe_frame_known = FALSE;
+}
+
+static void microbench_keyframe_detect_run(microbench_context *context, guint64 count) {
+	guint64 i, keyframes = 0;
+	for(i = 0; i < count; i++) {
+		guint index = i % MICROBENCH_PACKETS;
+		keyframes += rtpforward_keyframe_detect(context->session, context->packets->buffers[index], context->packets->lengths[index]);
+	}
+	context->sink += keyframes;
+}
+
+static void microbench_drop_run(microbench_context *context, guint64 count) {
+	guint64 i, drops = 0;
+	for(i = 0; i < count; i++)
+		drops += context->session->drop_permille > g_random_int_range(0, 1000);
+	context->sink += drops;
+}
+
+static void microbench_send_run(microbench_context *context, guint64 count) {
+	guint64 i;
+	for(i = 0; i < count; i++) {
+		guint index = i % MICROBENCH_PACKETS;
+		char *buffer = context->packets->buffers[index];
+		rtpforward_send(context->session, STREAM_VIDEO_RTP, buffer, context->packets->lengths[index],
+			((janus_rtp_header *)buffer)->markerbit);
+	}
+}
+
+static void microbench_send_batch_setup(microbench_context *context) {
+	rtpforward_session *session = context->session;
+	janus_mutex_lock(&session->egress_mutex);
+	rtpforward_batch_free(session->batch);
+	session->batch_size = 16;
+	session->batch = rtpforward_batch_new(session->batch_size, FALSE);
+	janus_mutex_unlock(&session->egress_mutex);
+}
+
+static void microbench_send_batch_teardown(microbench_context *context) {
+	rtpforward_session *session = context->session;
+	janus_mutex_lock(&session->egress_mutex);
+	rtpforward_batch_flush(session);
+	rtpforward_batch_free(session->batch);
+	session->batch = NULL;
+	session->batch_size = 1;
+	janus_mutex_unlock(&session->egress_mutex);
+}
+
+static void microbench_incoming_rtp_setup(microbench_context *context) {
+	memset(&context->session->seqwin_video, 0, sizeof(rtpforward_seqwin));
+}
+
+static void microbench_incoming_rtp_run(microbench_context *context, guint64 count) {
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+	guint64 i;
+	for(i = 0; i < count; i++) {
+		guint index = i % MICROBENCH_PACKETS;
+		// Janus hands over its own copy of every packet
+		memcpy(buffer, context->packets->buffers[index], context->packets->lengths[index]);
+		janus_rtp_header *header = (janus_rtp_header *)buffer;
+		header->seq_number = htons(ntohs(header->seq_number) + (guint16)((i / MICROBENCH_PACKETS) * MICROBENCH_PACKETS));
+		janus_plugin_rtp rtp;
+		memset(&rtp, 0, sizeof(rtp));
+		rtp.video = TRUE;
+		rtp.buffer = buffer;
+		rtp.length = context->packets->lengths[index];
+		rtpforward_incoming_rtp(context->handle, &rtp);
+	}
+}
+
+static const microbench_stage microbench_stages[] = {
+	{ "seqwin", CODEC_VP8, microbench_seqwin_setup, microbench_seqwin_run, NULL },
+	{ "keyframe_parse_vp8", CODEC_VP8, NULL, microbench_keyframe_parse_run, NULL },
+	{ "keyframe_parse_vp9", CODEC_VP9, NULL, microbench_keyframe_parse_run, NULL },
+	{ "keyframe_parse_h264", CODEC_H264, NULL, microbench_keyframe_parse_run, NULL },
+	{ "keyframe_detect_vp8", CODEC_VP8, microbench_keyframe_detect_setup, microbench_keyframe_detect_run, NULL },
+	{ "keyframe_detect_vp9", CODEC_VP9, microbench_keyframe_detect_setup, microbench_keyframe_detect_run, NULL },
+	{ "keyframe_detect_h264", CODEC_H264, microbench_keyframe_detect_setup, microbench_keyframe_detect_run, NULL },
+	{ "drop_simulation", CODEC_VP8, NULL, microbench_drop_run, NULL },
+	{ "send", CODEC_VP8, NULL, microbench_send_run, NULL },
+	{ "send_batch", CODEC_VP8, microbench_send_batch_setup, microbench_send_run, microbench_send_batch_teardown },
+	{ "incoming_rtp", CODEC_VP8, microbench_incoming_rtp_setup, microbench_incoming_rtp_run, NULL },
+};
+#define MICROBENCH_STAGES (sizeof(microbench_stages) / sizeof(microbench_stages[0]))
+
+typedef struct microbench_result {
+	double ns; // per packet, best of the repeats
+	double allocations; // per packet
+	gboolean measured;
+} microbench_result;
+
+static gint64 microbench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static void microbench_run(const microbench_stage *stage, microbench_context *context, microbench_packets *packets,
+		guint64 count, guint repeats, microbench_result *result) {
+	microbench_packets_fill(packets, stage->codec);
+	context->session->vcodec = stage->codec;
+	if(stage->setup)
+		stage->setup(context);
+	stage->run(context, MICROBENCH_PACKETS); // warm up
+	guint r;
+	result->ns = 0;
+	result->allocations = 0;
+	for(r = 0; r < repeats; r++) {
+		guint64 allocations = microbench_allocations;
+		gint64 start = microbench_now_ns();
+		stage->run(context, count);
+		double ns = (double)(microbench_now_ns() - start) / count;
+		if(r == 0 || ns < result->ns)
+			result->ns = ns;
+		result->allocations = MAX(result->allocations, (double)(microbench_allocations - allocations) / count);
+	}
+	if(stage->teardown)
+		stage->teardown(context);
+	result->measured = TRUE;
+}
+
+static int microbench_baseline_read(const char *path, microbench_result *baseline) {
+	FILE *file = fopen(path, "r");
+	if(!file && errno == ENOENT) {
+		// Not recorded on this machine yet
+		fprintf(stderr, "No baseline in %s, only checking that no stage allocates\n", path);
+		return 0;
+	}
+	if(!file) {
+		perror(path);
+		return -1;
+	}
+	char name[64];
+	double ns, allocations;
+	while(fscanf(file, "%63s %lf %lf", name, &ns, &allocations) == 3) {
+		guint i;
+		for(i = 0; i < MICROBENCH_STAGES; i++) {
+			if(!strcmp(name, microbench_stages[i].name)) {
+				baseline[i].ns = ns;
+				baseline[i].allocations = allocations;
+				baseline[i].measured = TRUE;
+			}
+		}
+	}
+	fclose(file);
+	return 0;
+}
+
+static int microbench_baseline_write(const char *path, microbench_result *results) {
+	FILE *file = fopen(path, "w");
+	if(!file) {
+		perror(path);
+		return -1;
+	}
+	guint i;
+	fprintf(file, "# stage ns/packet allocations/packet, written by rtpforward-microbench\n");
+	for(i = 0; i < MICROBENCH_STAGES; i++) {
+		if(results[i].measured)
+			fprintf(file, "%s %.2f %.4f\n", microbench_stages[i].name, results[i].ns, results[i].allocations);
+	}
+	fclose(file);
+	return 0;
+}
+
+static void microbench_handle_free(const janus_refcount *handle_ref) {
+	janus_plugin_session *handle = janus_refcount_containerof(handle_ref, janus_plugin_session, ref);
+	g_free(handle);
+}
+
+static janus_callbacks microbench_gateway;
+
+int main(int argc, char *argv[]) {
+	guint64 count = 1000000;
+	guint repeats = 5;
+	double margin = MICROBENCH_MARGIN_DEFAULT;
+	const char *only = NULL, *baseline_path = NULL, *write_path = NULL;
+	int opt;
+	while((opt = getopt(argc, argv, "n:r:s:b:w:m:h")) != -1) {
+		switch(opt) {
+			case 'n':
+				count = strtoull(optarg, NULL, 10);
+				break;
+			case 'r':
+				repeats = strtoul(optarg, NULL, 10);
+				break;
+			case 's':
+				only = optarg;
+				break;
+			case 'b':
+				baseline_path = optarg;
+				break;
+			case 'w':
+				write_path = optarg;
+				break;
+			case 'm':
+				margin = strtod(optarg, NULL);
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n packets] [-r repeats] [-s stage] [-w baseline] [-b baseline] [-m percent]\n", argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(count < 1 || repeats < 1 || margin < 0) {
+		fprintf(stderr, "Need at least one packet and repeat, and a positive margin\n");
+		return 1;
+	}
+	microbench_result baseline[MICROBENCH_STAGES], results[MICROBENCH_STAGES];
+	memset(baseline, 0, sizeof(baseline));
+	memset(results, 0, sizeof(results));
+	if(baseline_path && microbench_baseline_read(baseline_path, baseline) < 0)
+		return 1;
+
+	/* One configured session, sending to the mocked socket */
+	if(rtpforward_init(&microbench_gateway, "/nonexistent") < 0) {
+		fprintf(stderr, "Plugin initialization failed\n");
+		return 1;
+	}
+	microbench_context context;
+	memset(&context, 0, sizeof(context));
+	context.handle = g_malloc0(sizeof(janus_plugin_session));
+	janus_refcount_init(&context.handle->ref, microbench_handle_free);
+	int error = 0;
+	rtpforward_create_session(context.handle, &error);
+	if(error) {
+		fprintf(stderr, "Session creation failed\n");
+		return 1;
+	}
+	context.session = (rtpforward_session *)context.handle->plugin_handle;
+	json_t *body = json_pack("{sssssisisisi}", "request", "configure", "sendipv4", "127.0.0.1",
+		"sendport_audio_rtp", 9, "sendport_audio_rtcp", 9, "sendport_video_rtp", 9, "sendport_video_rtcp", 9);
+	janus_plugin_result *result = rtpforward_handle_message(context.handle, g_strdup("microbench"), body, NULL);
+	if(!result || !result->content || !json_object_get(result->content, "configured")) {
+		fprintf(stderr, "Session configuration failed\n");
+		return 1;
+	}
+	janus_plugin_result_destroy(result);
+	microbench_packets *packets = g_malloc(sizeof(microbench_packets));
+	context.packets = packets;
+
+	printf("%" G_GUINT64_FORMAT " packets of %d bytes, best of %u\n", count, 12 + MICROBENCH_PAYLOAD, repeats);
+	printf("%-22s %10s %12s %10s %8s\n", "stage", "ns/packet", "allocs/pkt", "baseline", "change");
+	int regressions = 0;
+	guint i;
+	for(i = 0; i < MICROBENCH_STAGES; i++) {
+		const microbench_stage *stage = &microbench_stages[i];
+		if(only && strcmp(only, stage->name))
+			continue;
+		microbench_run(stage, &context, packets, count, repeats, &results[i]);
+		printf("%-22s %10.1f %12.4f", stage->name, results[i].ns, results[i].allocations);
+		if(baseline[i].measured) {
+			double change = baseline[i].ns > 0 ? (results[i].ns / baseline[i].ns - 1) * 100 : 0;
+			// Allocations are deterministic: a single extra one per hundred packets is a regression
+			gboolean regressed = change > margin || results[i].allocations > baseline[i].allocations + 0.01;
+			printf(" %10.1f %+7.1f%%%s", baseline[i].ns, change, regressed ? "  REGRESSION" : "");
+			regressions += regressed;
+		} else if(results[i].allocations > 0.01) {
+			// No stage of the packet path allocates per packet
+			printf(" %10s %8s  REGRESSION", "-", "-");
+			regressions++;
+		}
+		printf("\n");
+	}
+	context.sink += microbench_datagrams;
+
+	if(write_path && microbench_baseline_write(write_path, results) < 0)
+		return 1;
+
+	rtpforward_destroy_session(context.handle, &error);
+	rtpforward_destroy();
+	g_free(packets);
+	if(regressions > 0) {
+		fprintf(stderr, "%d stage(s) regressed by more than %.0f%% (or allocate more) compared to %s\n", regressions, margin,
+			baseline_path ? baseline_path : "no allocations");
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,252 @@
+/*! \file   mux_demux.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Reference demuxer of the multiplexed framing of the rtpforward plugin
+ *
+ * \details Receives the messages the plugin sends to a mux target, either
+ * as UDP datagrams on a port or over a Unix stream socket the plugin connects
+ * to, and unpacks the records with the parser in rtpforward_mux.h. With -f,
+ * every packet is sent on as a UDP datagram of its own, to port
+ * base + 4 * stream id + type, so a receiver of the plain RTP streams, like
+ * GStreamer, works unchanged. Prints the messages, records per type and
+ * streams seen once per second.
+ *
+ * Usage: rtpforward-mux-demux [-d seconds] [-f address:base] (-u port | -s socket)
+*/
+
+#include "../rtpforward_mux.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define DEMUX_BUFFER_SIZE 65536
+#define DEMUX_STREAMS_MAX 4096 // distinct stream ids counted per second
+
+static const char *demux_type_names[] = { "audio_rtp", "audio_rtcp", "video_rtp", "video_rtcp" };
+
+typedef struct demux_stats {
+	uint64_t messages;
+	uint64_t bytes;
+	uint64_t records[4];
+	uint64_t invalid; // messages or records which didn't parse
+	uint32_t streams[DEMUX_STREAMS_MAX];
+	unsigned int stream_count;
+} demux_stats;
+
+typedef struct demux_forward {
+	int fd;
+	struct sockaddr_in addr;
+	uint16_t base;
+} demux_forward;
+
+static uint64_t demux_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void demux_usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-d seconds] [-f address:base] (-u port | -s socket)\n", program);
+}
+
+static void demux_print(demux_stats *stats) {
+	uint64_t records = 0;
+	int t;
+	for(t = 0; t < 4; t++)
+		records += stats->records[t];
+	printf("%8" PRIu64 " messages %10" PRIu64 " bytes %8" PRIu64 " records", stats->messages, stats->bytes, records);
+	if(stats->messages > 0)
+		printf(" (%.1f per message)", (double)records / stats->messages);
+	printf(", %u streams, %" PRIu64 " invalid\n", stats->stream_count, stats->invalid);
+	for(t = 0; t < 4; t++) {
+		if(stats->records[t] > 0)
+			printf("  %-10s %8" PRIu64 "\n", demux_type_names[t], stats->records[t]);
+	}
+	fflush(stdout);
+}
+
+static void demux_count_stream(demux_stats *stats, uint32_t id) {
+	unsigned int i;
+	for(i = 0; i < stats->stream_count; i++) {
+		if(stats->streams[i] == id)
+			return;
+	}
+	if(stats->stream_count < DEMUX_STREAMS_MAX)
+		stats->streams[stats->stream_count++] = id;
+}
+
+/* Unpacks one whole message. */
+static void demux_message(const uint8_t *message, size_t size, demux_stats *stats, demux_forward *forward) {
+	rtpforward_mux_header header;
+	long length = rtpforward_mux_parse_header(message, size, &header);
+	if(length <= 0 || (size_t)length != size) {
+		stats->invalid++;
+		return;
+	}
+	stats->messages++;
+	stats->bytes += size;
+	const uint8_t *cursor = message + header.header_size, *end = message + size, *packet;
+	rtpforward_mux_record record;
+	unsigned int count = 0;
+	while((packet = rtpforward_mux_next(&cursor, end, &record)) != NULL) {
+		count++;
+		if(record.type < 4)
+			stats->records[record.type]++;
+		demux_count_stream(stats, record.stream_id);
+		if(forward->fd >= 0 && record.type < 4) {
+			struct sockaddr_in addr = forward->addr;
+			addr.sin_port = htons((uint16_t)(forward->base + 4 * record.stream_id + record.type));
+			sendto(forward->fd, packet, record.length, 0, (struct sockaddr *)&addr, sizeof(addr));
+		}
+	}
+	if(count != header.count || cursor != end)
+		stats->invalid++;
+}
+
+int main(int argc, char *argv[]) {
+	const char *socket_path = NULL, *forward_to = NULL;
+	int port = 0, seconds = 0, opt;
+	while((opt = getopt(argc, argv, "u:s:f:d:h")) != -1) {
+		switch(opt) {
+			case 'u':
+				port = atoi(optarg);
+				break;
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'f':
+				forward_to = optarg;
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			default:
+				demux_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if((port > 0) == (socket_path != NULL) || port > 65535) {
+		demux_usage(argv[0]);
+		return 1;
+	}
+
+	demux_forward forward = { .fd = -1 };
+	if(forward_to) {
+		char address[64];
+		const char *colon = strrchr(forward_to, ':');
+		if(!colon || (size_t)(colon - forward_to) >= sizeof(address)) {
+			demux_usage(argv[0]);
+			return 1;
+		}
+		memcpy(address, forward_to, colon - forward_to);
+		address[colon - forward_to] = '\0';
+		forward.addr.sin_family = AF_INET;
+		forward.base = (uint16_t)atoi(colon + 1);
+		if(inet_pton(AF_INET, address, &forward.addr.sin_addr) != 1 || (forward.fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+			fprintf(stderr, "Could not forward to %s\n", forward_to);
+			return 1;
+		}
+	}
+
+	int fd;
+	if(port > 0) {
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		fd = socket(AF_INET, SOCK_DGRAM, 0);
+		int size = 4 * 1024 * 1024;
+		if(fd >= 0)
+			setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+			fprintf(stderr, "Could not bind to port %d: %s\n", port, strerror(errno));
+			return 1;
+		}
+	} else {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if(strlen(socket_path) >= sizeof(addr.sun_path)) {
+			fprintf(stderr, "Socket path too long: %s\n", socket_path);
+			return 1;
+		}
+		strcpy(addr.sun_path, socket_path);
+		unlink(socket_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+			fprintf(stderr, "Could not listen on %s: %s\n", socket_path, strerror(errno));
+			return 1;
+		}
+	}
+
+	static uint8_t buffer[DEMUX_BUFFER_SIZE];
+	static demux_stats stats;
+	size_t buffered = 0;
+	int listener = port > 0 ? -1 : fd, connection = -1;
+	uint64_t start = demux_now_us(), next_print = start + 1000000;
+	while(seconds <= 0 || demux_now_us() < start + (uint64_t)seconds * 1000000) {
+		struct pollfd pfd = { .fd = listener >= 0 && connection < 0 ? listener : (port > 0 ? fd : connection), .events = POLLIN };
+		if(poll(&pfd, 1, 100) > 0) {
+			if(pfd.fd == listener) {
+				connection = accept(listener, NULL, NULL);
+				buffered = 0;
+			} else if(port > 0) {
+				ssize_t received = recv(fd, buffer, sizeof(buffer), 0);
+				if(received > 0)
+					demux_message(buffer, received, &stats, &forward);
+			} else {
+				ssize_t received = recv(connection, buffer + buffered, sizeof(buffer) - buffered, 0);
+				if(received <= 0) {
+					// The plugin closed the mux, wait for the next one
+					close(connection);
+					connection = -1;
+				} else {
+					buffered += received;
+					// The stream holds whole messages back to back
+					rtpforward_mux_header header;
+					long length;
+					size_t offset = 0;
+					while((length = rtpforward_mux_parse_header(buffer + offset, buffered - offset, &header)) > 0 &&
+							(size_t)length <= buffered - offset) {
+						demux_message(buffer + offset, length, &stats, &forward);
+						offset += length;
+					}
+					if(length < 0 || (size_t)length > sizeof(buffer)) {
+						fprintf(stderr, "Lost the message boundaries, closing the connection\n");
+						close(connection);
+						connection = -1;
+						buffered = 0;
+					} else {
+						memmove(buffer, buffer + offset, buffered - offset);
+						buffered -= offset;
+					}
+				}
+			}
+		}
+		uint64_t now = demux_now_us();
+		if(now >= next_print) {
+			demux_print(&stats);
+			memset(&stats, 0, sizeof(stats));
+			next_print += 1000000;
+		}
+	}
+	demux_print(&stats);
+	if(connection >= 0)
+		close(connection);
+	close(fd);
+	if(socket_path)
+		unlink(socket_path);
+	return 0;
+}
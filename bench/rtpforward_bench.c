@@ -0,0 +1,788 @@
+/*! \file   rtpforward_bench.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Offline end-to-end benchmark of the rtpforward plugin
+ *
+ * \details Builds the plugin into a standalone program, with the Janus core
+ * replaced by stubs (see janus_stubs.c) and a fake janus_plugin_session per
+ * simulated session. The RTP and RTCP packets of a pcap or rtpdump capture
+ * are fed to every session from a pool of driver threads, the way the Janus
+ * media threads would call incoming_rtp() and incoming_rtcp(), and the
+ * forwarded packets are received by UDP sinks on loopback. No network and no
+ * browser are involved.
+ *
+ * Each session rewrites the SSRC of its packets to its own index, so the
+ * sinks can tell the sessions apart and measure the latency from the call
+ * into the plugin until reception. When looping, sequence numbers and
+ * timestamps are shifted so that every loop continues the previous one.
+ *
+ * Usage: rtpforward-bench [options] capture.pcap|capture.rtpdump
+ * See main() or -h for the options.
+*/
+
+#include "../janus_rtpforward.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/resource.h>
+
+#define BENCH_STREAMS_MAX 16
+#define BENCH_SESSIONS_MAX 65536
+#define BENCH_SENT_TIMES 1024 // per stream and session, indexed by sequence number
+#define BENCH_LATENCY_BUCKETS 65536 // microseconds, the last one counts everything longer
+#define BENCH_SINK_VECTOR 64
+
+/* Capture */
+
+typedef struct bench_stream {
+	guint32 ssrc;
+	gboolean video;
+	guint32 seq_first; // extended
+	guint32 seq_highest;
+	guint32 ts_first;
+	guint32 ts_last;
+} bench_stream;
+
+typedef struct bench_packet {
+	gint64 offset_us; // since the first packet of the capture
+	char *data;
+	guint16 length;
+	guint8 stream;
+	gboolean rtcp;
+	gboolean video;
+	guint32 seq; // extended, relative to seq_first of the stream
+	guint32 ts; // relative to ts_first of the stream
+} bench_packet;
+
+typedef struct bench_capture {
+	GArray *packets;
+	bench_stream streams[BENCH_STREAMS_MAX];
+	guint stream_count;
+	gint64 duration_us;
+	gint64 first_us;
+	gboolean audio_pt[128];
+	guint skipped;
+} bench_capture;
+
+/* Sessions, drivers and sinks */
+
+typedef struct bench_session {
+	janus_plugin_session *handle;
+	guint index;
+	gint64 *sent; // [stream][BENCH_SENT_TIMES] monotonic nanoseconds
+} bench_session;
+
+typedef struct bench_driver {
+	pthread_t thread;
+	bench_capture *capture;
+	bench_session **sessions;
+	guint session_count;
+	guint loops;
+	gboolean realtime;
+	guint64 packets;
+} bench_driver;
+
+typedef struct bench_sink {
+	pthread_t thread;
+	int fd;
+	struct sockaddr_in addr;
+	volatile int stop;
+	bench_session *sessions;
+	guint session_count;
+	guint64 received;
+	guint64 measured;
+	guint64 *latency; // BENCH_LATENCY_BUCKETS
+	gint64 latency_max_us;
+	double cpu;
+} bench_sink;
+
+static guint bench_stream_count = 1;
+
+static gint64 bench_now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * G_GINT64_CONSTANT(1000000000) + ts.tv_nsec;
+}
+
+static double bench_clock(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double bench_process_cpu(void) {
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static gboolean bench_is_rtcp(const guint8 *data, guint length) {
+	// RFC 5761: RTCP packet types 192-223 collide with the RTP marker bit and payload types 64-95
+	return length >= 8 && data[1] >= 192 && data[1] <= 223;
+}
+
+static gint bench_stream_find(bench_capture *capture, guint32 ssrc) {
+	guint i;
+	for(i = 0; i < capture->stream_count; i++) {
+		if(capture->streams[i].ssrc == ssrc)
+			return i;
+	}
+	return -1;
+}
+
+/* Adds one UDP payload of the capture, if it is RTP or RTCP */
+static void bench_capture_add(bench_capture *capture, const guint8 *data, guint length, gint64 time_us) {
+	if(length < 12 || length > RTPFORWARD_MAX_PACKET_SIZE || (data[0] >> 6) != 2) {
+		capture->skipped++;
+		return;
+	}
+	if(capture->packets->len == 0)
+		capture->first_us = time_us;
+
+	bench_packet packet;
+	memset(&packet, 0, sizeof(packet));
+	packet.offset_us = MAX(time_us - capture->first_us, 0);
+	packet.length = length;
+
+	guint32 ssrc;
+	memcpy(&ssrc, data + (bench_is_rtcp(data, length) ? 4 : 8), sizeof(ssrc));
+	ssrc = ntohl(ssrc);
+	gint stream = bench_stream_find(capture, ssrc);
+
+	if(bench_is_rtcp(data, length)) {
+		// Attribute RTCP to the stream of its sender or of its first report block
+		if(stream < 0 && length >= 12) {
+			memcpy(&ssrc, data + (data[1] == 200 ? 28 : 8), sizeof(ssrc));
+			if((data[1] != 200 || length >= 32))
+				stream = bench_stream_find(capture, ntohl(ssrc));
+		}
+		packet.rtcp = TRUE;
+		packet.video = stream >= 0 ? capture->streams[stream].video : TRUE;
+		packet.stream = stream >= 0 ? stream : 0;
+	} else {
+		guint16 seq;
+		guint32 ts;
+		memcpy(&seq, data + 2, sizeof(seq));
+		memcpy(&ts, data + 4, sizeof(ts));
+		seq = ntohs(seq);
+		ts = ntohl(ts);
+		if(stream < 0) {
+			if(capture->stream_count == BENCH_STREAMS_MAX) {
+				capture->skipped++;
+				return;
+			}
+			stream = capture->stream_count++;
+			bench_stream *s = &capture->streams[stream];
+			s->ssrc = ssrc;
+			s->video = !capture->audio_pt[data[1] & 0x7f];
+			s->seq_first = seq + 65536; // room for packets reordered before the first one
+			s->seq_highest = s->seq_first;
+			s->ts_first = ts;
+			s->ts_last = ts;
+		}
+		bench_stream *s = &capture->streams[stream];
+		// Extend the sequence number relative to the highest one so far
+		guint32 extended = s->seq_highest + (gint16)(seq - (guint16)s->seq_highest);
+		if(extended < s->seq_first) {
+			capture->skipped++;
+			return;
+		}
+		if(extended > s->seq_highest)
+			s->seq_highest = extended;
+		if((gint32)(ts - s->ts_last) > 0)
+			s->ts_last = ts;
+		packet.stream = stream;
+		packet.video = s->video;
+		packet.seq = extended - s->seq_first;
+		packet.ts = ts - s->ts_first;
+	}
+	packet.data = g_malloc(length);
+	memcpy(packet.data, data, length);
+	g_array_append_val(capture->packets, packet);
+	if(packet.offset_us > capture->duration_us)
+		capture->duration_us = packet.offset_us;
+}
+
+/* Extracts the UDP payload of a link layer frame: Ethernet, Linux cooked (v1 and v2), raw IP or BSD loopback */
+static void bench_pcap_frame(bench_capture *capture, guint32 linktype, const guint8 *frame, guint length, gint64 time_us) {
+	guint offset;
+	guint16 ethertype = 0x0800;
+	switch(linktype) {
+		case 0: // BSD loopback: the address family in host order
+			offset = 4;
+			ethertype = (length >= 4 && (frame[0] == 2 || frame[3] == 2)) ? 0x0800 : 0x86dd;
+			break;
+		case 1: // Ethernet
+			offset = 14;
+			if(length < offset)
+				return;
+			ethertype = (frame[12] << 8) | frame[13];
+			while(ethertype == 0x8100 && length >= offset + 4) { // VLAN tags
+				ethertype = (frame[offset + 2] << 8) | frame[offset + 3];
+				offset += 4;
+			}
+			break;
+		case 101: // raw IP
+			offset = 0;
+			ethertype = (length > 0 && (frame[0] >> 4) == 6) ? 0x86dd : 0x0800;
+			break;
+		case 113: // Linux cooked capture
+			offset = 16;
+			if(length < offset)
+				return;
+			ethertype = (frame[14] << 8) | frame[15];
+			break;
+		case 276: // Linux cooked capture v2
+			offset = 20;
+			if(length < offset)
+				return;
+			ethertype = (frame[0] << 8) | frame[1];
+			break;
+		default:
+			return;
+	}
+	if(length < offset)
+		return;
+	frame += offset;
+	length -= offset;
+
+	if(ethertype == 0x0800) {
+		if(length < 20 || (frame[0] >> 4) != 4 || frame[9] != 17)
+			return;
+		if(((frame[6] << 8) | frame[7]) & 0x3fff)
+			return; // fragments
+		offset = (frame[0] & 0x0f) * 4;
+	} else if(ethertype == 0x86dd) {
+		if(length < 40 || frame[6] != 17)
+			return; // extension headers aren't worth it here
+		offset = 40;
+	} else {
+		return;
+	}
+	if(length < offset + 8)
+		return;
+	guint udp_length = (frame[offset + 4] << 8) | frame[offset + 5];
+	if(udp_length < 8 || offset + udp_length > length)
+		return;
+	bench_capture_add(capture, frame + offset + 8, udp_length - 8, time_us);
+}
+
+static guint32 bench_read32(const guint8 *p, gboolean swapped) {
+	guint32 value;
+	memcpy(&value, p, sizeof(value));
+	return swapped ? GUINT32_SWAP_LE_BE(value) : value;
+}
+
+static int bench_load_pcap(bench_capture *capture, FILE *file) {
+	guint8 header[24];
+	if(fread(header, 1, sizeof(header), file) != sizeof(header))
+		return -1;
+	guint32 magic;
+	memcpy(&magic, header, sizeof(magic));
+	gboolean swapped = FALSE, nanoseconds = FALSE;
+	if(magic == 0xa1b2c3d4 || magic == 0xa1b23c4d) {
+		nanoseconds = magic == 0xa1b23c4d;
+	} else if(magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1) {
+		swapped = TRUE;
+		nanoseconds = magic == 0x4d3cb2a1;
+	} else {
+		fprintf(stderr, "Not a pcap file (pcapng is not supported, convert it with editcap -F pcap)\n");
+		return -1;
+	}
+	guint32 linktype = bench_read32(header + 20, swapped) & 0x0fffffff;
+	guint8 *frame = g_malloc(65536);
+	guint8 record[16];
+	while(fread(record, 1, sizeof(record), file) == sizeof(record)) {
+		guint32 length = bench_read32(record + 8, swapped);
+		if(length > 65536 || fread(frame, 1, length, file) != length)
+			break;
+		gint64 time_us = (gint64)bench_read32(record, swapped) * 1000000 +
+			(nanoseconds ? bench_read32(record + 4, swapped) / 1000 : bench_read32(record + 4, swapped));
+		bench_pcap_frame(capture, linktype, frame, length, time_us);
+	}
+	g_free(frame);
+	return 0;
+}
+
+/* rtpdump, as written by rtptools and Wireshark */
+static int bench_load_rtpdump(bench_capture *capture, FILE *file) {
+	char line[256];
+	if(!fgets(line, sizeof(line), file) || strncmp(line, "#!rtpplay1.0 ", 13))
+		return -1;
+	guint8 header[16];
+	if(fread(header, 1, sizeof(header), file) != sizeof(header))
+		return -1;
+	guint8 *data = g_malloc(65536);
+	guint8 record[8];
+	while(fread(record, 1, sizeof(record), file) == sizeof(record)) {
+		guint16 length = (record[0] << 8) | record[1];
+		if(length < sizeof(record))
+			break;
+		length -= sizeof(record);
+		if(fread(data, 1, length, file) != length)
+			break;
+		guint32 offset_ms = (record[4] << 24) | (record[5] << 16) | (record[6] << 8) | record[7];
+		bench_capture_add(capture, data, length, (gint64)offset_ms * 1000);
+	}
+	g_free(data);
+	return 0;
+}
+
+static int bench_load(bench_capture *capture, const char *path) {
+	FILE *file = fopen(path, "rb");
+	if(!file) {
+		perror(path);
+		return -1;
+	}
+	char start[2];
+	int res = -1;
+	if(fread(start, 1, sizeof(start), file) == sizeof(start)) {
+		rewind(file);
+		res = (start[0] == '#' && start[1] == '!') ? bench_load_rtpdump(capture, file) : bench_load_pcap(capture, file);
+	}
+	fclose(file);
+	if(res < 0 || capture->packets->len == 0) {
+		fprintf(stderr, "%s: no RTP or RTCP packets found\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Driver threads, in place of the Janus media threads */
+
+static void bench_wait_until(gint64 ns) {
+	struct timespec ts = { .tv_sec = ns / 1000000000, .tv_nsec = ns % 1000000000 };
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void *bench_driver_thread(void *data) {
+	bench_driver *driver = (bench_driver *)data;
+	bench_capture *capture = driver->capture;
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+	gint64 start = bench_now_ns();
+	guint loop, i, s;
+	for(loop = 0; loop < driver->loops; loop++) {
+		for(i = 0; i < capture->packets->len; i++) {
+			bench_packet *packet = &g_array_index(capture->packets, bench_packet, i);
+			if(driver->realtime)
+				bench_wait_until(start + (loop * (capture->duration_us + 20000) + packet->offset_us) * 1000);
+			bench_stream *stream = &capture->streams[packet->stream];
+			for(s = 0; s < driver->session_count; s++) {
+				bench_session *session = driver->sessions[s];
+				// Janus hands over a decrypted copy, and the plugin may rewrite it
+				memcpy(buffer, packet->data, packet->length);
+				if(packet->rtcp) {
+					janus_plugin_rtcp rtcp = { .video = packet->video, .buffer = buffer, .length = packet->length };
+					rtpforward_incoming_rtcp(session->handle, &rtcp);
+				} else {
+					janus_rtp_header *header = (janus_rtp_header *)buffer;
+					guint32 seq = packet->seq + loop * (stream->seq_highest - stream->seq_first + 1);
+					guint32 ts = packet->ts + loop * (stream->ts_last - stream->ts_first + 1);
+					guint16 wire_seq = (guint16)(stream->seq_first + seq);
+					header->seq_number = htons(wire_seq);
+					header->timestamp = htonl(stream->ts_first + ts);
+					header->ssrc = htonl((session->index << 8) | packet->stream);
+					__atomic_store_n(&session->sent[packet->stream * BENCH_SENT_TIMES + (wire_seq % BENCH_SENT_TIMES)],
+						bench_now_ns(), __ATOMIC_RELAXED);
+					janus_plugin_rtp rtp;
+					memset(&rtp, 0, sizeof(rtp));
+					rtp.video = packet->video;
+					rtp.buffer = buffer;
+					rtp.length = packet->length;
+					rtpforward_incoming_rtp(session->handle, &rtp);
+				}
+				driver->packets++;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* UDP sinks, in place of the downstream receivers */
+
+static void bench_sink_packet(bench_sink *sink, const guint8 *data, guint length, gint64 now) {
+	sink->received++;
+	if(length < 12 || bench_is_rtcp(data, length))
+		return;
+	guint16 seq;
+	guint32 ssrc;
+	memcpy(&seq, data + 2, sizeof(seq));
+	memcpy(&ssrc, data + 8, sizeof(ssrc));
+	ssrc = ntohl(ssrc);
+	guint index = ssrc >> 8, stream = ssrc & 0xff;
+	if(index >= sink->session_count || stream >= bench_stream_count)
+		return;
+	bench_session *session = &sink->sessions[index];
+	gint64 sent = __atomic_load_n(&session->sent[stream * BENCH_SENT_TIMES + (ntohs(seq) % BENCH_SENT_TIMES)], __ATOMIC_RELAXED);
+	if(sent <= 0 || sent > now)
+		return;
+	gint64 us = (now - sent) / 1000;
+	sink->latency[MIN(us, BENCH_LATENCY_BUCKETS - 1)]++;
+	if(us > sink->latency_max_us)
+		sink->latency_max_us = us;
+	sink->measured++;
+}
+
+static void *bench_sink_thread(void *data) {
+	bench_sink *sink = (bench_sink *)data;
+	static __thread char buffers[BENCH_SINK_VECTOR][2048];
+	struct mmsghdr msgs[BENCH_SINK_VECTOR];
+	struct iovec iovs[BENCH_SINK_VECTOR];
+	int i;
+	for(i = 0; i < BENCH_SINK_VECTOR; i++) {
+		iovs[i].iov_base = buffers[i];
+		iovs[i].iov_len = sizeof(buffers[i]);
+		memset(&msgs[i], 0, sizeof(msgs[i]));
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+	while(!sink->stop) {
+		int res = recvmmsg(sink->fd, msgs, BENCH_SINK_VECTOR, 0, NULL);
+		gint64 now = bench_now_ns();
+		for(i = 0; i < res; i++)
+			bench_sink_packet(sink, (guint8 *)buffers[i], msgs[i].msg_len, now);
+	}
+	sink->cpu = bench_clock(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+static int bench_sink_start(bench_sink *sink, bench_session *sessions, guint session_count) {
+	sink->sessions = sessions;
+	sink->session_count = session_count;
+	sink->latency = g_malloc0(BENCH_LATENCY_BUCKETS * sizeof(guint64));
+	sink->fd = socket(AF_INET, SOCK_DGRAM, 0);
+	int rcvbuf = 16 * 1024 * 1024;
+	setsockopt(sink->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+	struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+	setsockopt(sink->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	sink->addr.sin_family = AF_INET;
+	sink->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	socklen_t len = sizeof(sink->addr);
+	if(bind(sink->fd, (struct sockaddr *)&sink->addr, len) < 0 || getsockname(sink->fd, (struct sockaddr *)&sink->addr, &len) < 0) {
+		perror("sink");
+		return -1;
+	}
+	return pthread_create(&sink->thread, NULL, bench_sink_thread, sink);
+}
+
+static void bench_sink_stop(bench_sink *sink) {
+	sink->stop = 1;
+	pthread_join(sink->thread, NULL);
+	close(sink->fd);
+}
+
+/* The parts of the gateway the plugin calls back into */
+
+static volatile gint bench_keyframe_requests = 0;
+
+static int bench_push_event(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction, json_t *message, json_t *jsep) {
+	return 0;
+}
+
+static void bench_relay_rtcp(janus_plugin_session *handle, janus_plugin_rtcp *packet) {
+	g_atomic_int_inc(&bench_keyframe_requests); // the plugin only relays FIR
+}
+
+static void bench_send_pli(janus_plugin_session *handle) {
+	g_atomic_int_inc(&bench_keyframe_requests);
+}
+
+static void bench_send_remb(janus_plugin_session *handle, guint32 bitrate) {
+}
+
+static janus_callbacks bench_gateway = {
+	.push_event = bench_push_event,
+	.relay_rtcp = bench_relay_rtcp,
+	.send_pli = bench_send_pli,
+	.send_remb = bench_send_remb,
+};
+
+static void bench_handle_free(const janus_refcount *handle_ref) {
+	janus_plugin_session *handle = janus_refcount_containerof(handle_ref, janus_plugin_session, ref);
+	g_free(handle);
+}
+
+static int bench_configure(bench_session *session, bench_sink *sink, json_t *options) {
+	json_t *body = json_object();
+	json_object_set_new(body, "request", json_string("configure"));
+	json_object_set_new(body, "sendipv4", json_string("127.0.0.1"));
+	int port = ntohs(sink->addr.sin_port);
+	json_object_set_new(body, "sendport_audio_rtp", json_integer(port));
+	json_object_set_new(body, "sendport_audio_rtcp", json_integer(port));
+	json_object_set_new(body, "sendport_video_rtp", json_integer(port));
+	json_object_set_new(body, "sendport_video_rtcp", json_integer(port));
+	if(options)
+		json_object_update(body, options);
+	janus_plugin_result *result = rtpforward_handle_message(session->handle, g_strdup("bench"), body, NULL);
+	int res = 0;
+	if(!result || result->type != JANUS_PLUGIN_OK || !result->content || !json_object_get(result->content, "configured")) {
+		char *text = result && result->content ? json_dumps(result->content, 0) : NULL;
+		fprintf(stderr, "Session %u: configure failed: %s\n", session->index, text ? text : "no response");
+		free(text);
+		res = -1;
+	}
+	janus_plugin_result_destroy(result);
+	return res;
+}
+
+static double bench_percentile(guint64 *histogram, guint64 total, double percentile) {
+	guint64 rank = (guint64)(total * percentile / 100.0), seen = 0;
+	guint i;
+	for(i = 0; i < BENCH_LATENCY_BUCKETS; i++) {
+		seen += histogram[i];
+		if(seen > rank)
+			return i;
+	}
+	return BENCH_LATENCY_BUCKETS - 1;
+}
+
+static void bench_usage(const char *name) {
+	fprintf(stderr,
+		"Usage: %s [options] capture.pcap|capture.rtpdump\n"
+		"  -n sessions   simulated sessions (default 1)\n"
+		"  -t threads    driver threads calling into the plugin (default 1)\n"
+		"  -k sinks      UDP sink threads (default 1)\n"
+		"  -l loops      times to replay the capture (default 1)\n"
+		"  -r            replay at the pace of the capture instead of as fast as possible\n"
+		"  -C codec      video codec for keyframe detection: vp8, vp9 or h264 (default none)\n"
+		"  -A pts        comma separated audio payload types (default 0,8,9,109,111)\n"
+		"  -c json       extra keys for the configure request, e.g. '{\"batch_size\": 16}'\n"
+		"  -T threads    egress worker threads (default 0)\n"
+		"  -B backend    egress backend: sendmmsg or io_uring\n"
+		"  -Q size       egress queue size\n"
+		"  -v level      Janus log level (default 3, warnings)\n", name);
+}
+
+int main(int argc, char *argv[]) {
+	guint session_count = 1, thread_count = 1, sink_count = 1, loops = 1;
+	gboolean realtime = FALSE;
+	rtpforward_video_codec vcodec = CODEC_NONE;
+	const char *audio_pts = "0,8,9,109,111";
+	json_t *options = NULL;
+	int threads = 0, queue_size = RTPFORWARD_EGRESS_QUEUE_SIZE_DEFAULT;
+	int opt;
+	while((opt = getopt(argc, argv, "n:t:k:l:rC:A:c:T:B:Q:v:h")) != -1) {
+		switch(opt) {
+			case 'n':
+				session_count = strtoul(optarg, NULL, 10);
+				break;
+			case 't':
+				thread_count = strtoul(optarg, NULL, 10);
+				break;
+			case 'k':
+				sink_count = strtoul(optarg, NULL, 10);
+				break;
+			case 'l':
+				loops = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				realtime = TRUE;
+				break;
+			case 'C':
+				if(!strcmp(optarg, "vp8")) {
+					vcodec = CODEC_VP8;
+				} else if(!strcmp(optarg, "vp9")) {
+					vcodec = CODEC_VP9;
+				} else if(!strcmp(optarg, "h264")) {
+					vcodec = CODEC_H264;
+				} else {
+					fprintf(stderr, "Unknown codec %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'A':
+				audio_pts = optarg;
+				break;
+			case 'c': {
+				json_error_t error;
+				options = json_loads(optarg, 0, &error);
+				if(!json_is_object(options)) {
+					fprintf(stderr, "Invalid -c: %s\n", error.text);
+					return 1;
+				}
+				break;
+			}
+			case 'T':
+				threads = atoi(optarg);
+				break;
+			case 'B':
+				if(!strcmp(optarg, "io_uring")) {
+					egress_backend = EGRESS_BACKEND_IO_URING;
+				} else if(!strcmp(optarg, "sendmmsg")) {
+					egress_backend = EGRESS_BACKEND_SENDMMSG;
+				} else {
+					fprintf(stderr, "Unknown backend %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'Q':
+				queue_size = atoi(optarg);
+				break;
+			case 'v':
+				janus_log_level = atoi(optarg);
+				break;
+			default:
+				bench_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(optind != argc - 1) {
+		bench_usage(argv[0]);
+		return 1;
+	}
+	if(session_count < 1 || session_count > BENCH_SESSIONS_MAX || thread_count < 1 || sink_count < 1 || loops < 1) {
+		fprintf(stderr, "Need 1 to %d sessions, and at least one thread, sink and loop\n", BENCH_SESSIONS_MAX);
+		return 1;
+	}
+	if(threads < 0 || threads > RTPFORWARD_EGRESS_THREADS_MAX ||
+			queue_size < 2 || queue_size > RTPFORWARD_EGRESS_QUEUE_SIZE_MAX || (queue_size & (queue_size - 1))) {
+		fprintf(stderr, "Invalid egress worker settings\n");
+		return 1;
+	}
+	// Set directly, as the stubs don't read the configuration file
+	egress_threads = threads;
+	egress_queue_size = queue_size;
+	if(egress_backend == EGRESS_BACKEND_IO_URING && egress_threads == 0)
+		egress_threads = 1;
+
+	/* Load the capture */
+	bench_capture capture;
+	memset(&capture, 0, sizeof(capture));
+	capture.packets = g_array_new(FALSE, FALSE, sizeof(bench_packet));
+	gchar **pts = g_strsplit(audio_pts, ",", -1), **pt;
+	for(pt = pts; *pt; pt++) {
+		int value = atoi(*pt);
+		if(value >= 0 && value < 128)
+			capture.audio_pt[value] = TRUE;
+	}
+	g_strfreev(pts);
+	if(bench_load(&capture, argv[optind]) < 0)
+		return 1;
+	bench_stream_count = MAX(capture.stream_count, 1);
+	guint i;
+	printf("%u packets in %u RTP streams over %.3f s (%u skipped)\n", capture.packets->len, capture.stream_count,
+		capture.duration_us / 1e6, capture.skipped);
+	for(i = 0; i < capture.stream_count; i++)
+		printf("  stream %u: ssrc %08x, %s, %u packets\n", i, capture.streams[i].ssrc, capture.streams[i].video ? "video" : "audio",
+			capture.streams[i].seq_highest - capture.streams[i].seq_first + 1);
+
+	/* Plugin, sinks and sessions */
+	if(rtpforward_init(&bench_gateway, "/nonexistent") < 0) {
+		fprintf(stderr, "Plugin initialization failed\n");
+		return 1;
+	}
+	bench_session *sessions = g_malloc0(session_count * sizeof(bench_session));
+	bench_sink *sinks = g_malloc0(sink_count * sizeof(bench_sink));
+	for(i = 0; i < sink_count; i++) {
+		if(bench_sink_start(&sinks[i], sessions, session_count) < 0)
+			return 1;
+	}
+	for(i = 0; i < session_count; i++) {
+		bench_session *session = &sessions[i];
+		session->index = i;
+		session->sent = g_malloc0(bench_stream_count * BENCH_SENT_TIMES * sizeof(gint64));
+		session->handle = g_malloc0(sizeof(janus_plugin_session));
+		janus_refcount_init(&session->handle->ref, bench_handle_free);
+		int error = 0;
+		rtpforward_create_session(session->handle, &error);
+		if(error) {
+			fprintf(stderr, "Session %u: creation failed\n", i);
+			return 1;
+		}
+		((rtpforward_session *)session->handle->plugin_handle)->vcodec = vcodec;
+		if(bench_configure(session, &sinks[i % sink_count], options) < 0)
+			return 1;
+	}
+
+	/* Run */
+	bench_driver *drivers = g_malloc0(thread_count * sizeof(bench_driver));
+	for(i = 0; i < thread_count; i++) {
+		drivers[i].capture = &capture;
+		drivers[i].sessions = g_malloc0(session_count * sizeof(bench_session *));
+		drivers[i].loops = loops;
+		drivers[i].realtime = realtime;
+	}
+	for(i = 0; i < session_count; i++) {
+		bench_driver *driver = &drivers[i % thread_count];
+		driver->sessions[driver->session_count++] = &sessions[i];
+	}
+	double wall = bench_clock(CLOCK_MONOTONIC);
+	double cpu = bench_process_cpu();
+	for(i = 0; i < thread_count; i++)
+		pthread_create(&drivers[i].thread, NULL, bench_driver_thread, &drivers[i]);
+	guint64 packets = 0;
+	for(i = 0; i < thread_count; i++) {
+		pthread_join(drivers[i].thread, NULL);
+		packets += drivers[i].packets;
+	}
+	wall = bench_clock(CLOCK_MONOTONIC) - wall;
+	usleep(200000); // let the egress workers and sinks drain
+	cpu = bench_process_cpu() - cpu;
+	for(i = 0; i < sink_count; i++) {
+		bench_sink_stop(&sinks[i]);
+		cpu -= sinks[i].cpu; // the sinks are not part of the forwarding cost
+	}
+
+	/* Report */
+	guint64 forwarded = 0, errors = 0, received = 0, measured = 0, latency_max = 0;
+	guint64 *latency = g_malloc0(BENCH_LATENCY_BUCKETS * sizeof(guint64));
+	for(i = 0; i < session_count; i++) {
+		rtpforward_stats *stats = &((rtpforward_session *)sessions[i].handle->plugin_handle)->stats;
+		int stream;
+		for(stream = 0; stream < STREAM_COUNT; stream++)
+			forwarded += RTPFORWARD_STAT_GET(stats->packets[stream]);
+		errors += RTPFORWARD_STAT_GET(stats->errors_eagain) + RTPFORWARD_STAT_GET(stats->errors_enobufs) +
+			RTPFORWARD_STAT_GET(stats->errors_econnrefused) + RTPFORWARD_STAT_GET(stats->errors_other);
+	}
+	for(i = 0; i < sink_count; i++) {
+		guint b;
+		for(b = 0; b < BENCH_LATENCY_BUCKETS; b++)
+			latency[b] += sinks[i].latency[b];
+		received += sinks[i].received;
+		measured += sinks[i].measured;
+		latency_max = MAX(latency_max, (guint64)sinks[i].latency_max_us);
+	}
+	printf("%u sessions, %u driver threads, %u sinks, %u loops%s, %d egress threads (%s)\n",
+		session_count, thread_count, sink_count, loops, realtime ? " in real time" : "",
+		egress_threads, egress_backend == EGRESS_BACKEND_IO_URING ? "io_uring" : "sendmmsg");
+	printf("%-12s %12" G_GUINT64_FORMAT "\n", "incoming", packets);
+	printf("%-12s %12" G_GUINT64_FORMAT "\n", "forwarded", forwarded);
+	printf("%-12s %12" G_GUINT64_FORMAT "\n", "send errors", errors);
+	printf("%-12s %12" G_GUINT64_FORMAT "\n", "received", received);
+	printf("%-12s %12.0f packets/s\n", "throughput", packets / wall);
+	printf("%-12s %12.3f us/packet (%.3f s in %.3f s)\n", "cpu", packets ? cpu * 1e6 / packets : 0.0, cpu, wall);
+	if(measured > 0) {
+		printf("%-12s p50 %.0f, p90 %.0f, p99 %.0f, p99.9 %.0f, max %" G_GUINT64_FORMAT " us (%" G_GUINT64_FORMAT " RTP packets)\n", "latency",
+			bench_percentile(latency, measured, 50), bench_percentile(latency, measured, 90),
+			bench_percentile(latency, measured, 99), bench_percentile(latency, measured, 99.9), latency_max, measured);
+	}
+	if(g_atomic_int_get(&bench_keyframe_requests) > 0)
+		printf("%-12s %12d\n", "kf requests", g_atomic_int_get(&bench_keyframe_requests));
+
+	/* Tear down */
+	for(i = 0; i < session_count; i++) {
+		int error = 0;
+		rtpforward_destroy_session(sessions[i].handle, &error);
+		g_free(sessions[i].sent);
+	}
+	rtpforward_destroy();
+	for(i = 0; i < thread_count; i++)
+		g_free(drivers[i].sessions);
+	for(i = 0; i < sink_count; i++)
+		g_free(sinks[i].latency);
+	for(i = 0; i < capture.packets->len; i++)
+		g_free(g_array_index(capture.packets, bench_packet, i).data);
+	g_array_free(capture.packets, TRUE);
+	g_free(latency);
+	g_free(drivers);
+	g_free(sinks);
+	g_free(sessions);
+	if(options)
+		json_decref(options);
+	return 0;
+}
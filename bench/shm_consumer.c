@@ -0,0 +1,131 @@
+/*! \file   shm_consumer.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Test consumer of the shared-memory egress of the rtpforward plugin
+ *
+ * \details Reads a session's ring with the reader library, the way a
+ * co-located recorder or transcoder would, and prints once per second the
+ * packets received per stream, the packets lost by falling behind, the gaps
+ * in the RTP sequence numbers, and the latency from the plugin forwarding a
+ * packet to the consumer having it.
+ *
+ * Usage: rtpforward-shm-consumer [-d seconds] (/proc/<pid>/fd/<fd> | -s socket)
+*/
+
+#include "../rtpforward_shm_reader.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char *consumer_stream_names[] = { "audio_rtp", "audio_rtcp", "video_rtp", "video_rtcp" };
+
+typedef struct consumer_stats {
+	uint64_t packets[4];
+	uint64_t bytes[4];
+	uint64_t seq_gaps[4]; // RTP packets missing between consecutive sequence numbers
+	uint64_t latency_us_total;
+	uint64_t latency_us_max;
+} consumer_stats;
+
+static uint64_t consumer_now_us(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void consumer_usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-d seconds] (/proc/<pid>/fd/<fd> | -s socket)\n", program);
+}
+
+static void consumer_print(consumer_stats *stats, rtpforward_shm_reader *reader) {
+	uint64_t packets = 0;
+	int s;
+	for(s = 0; s < 4; s++) {
+		packets += stats->packets[s];
+		if(stats->packets[s] == 0)
+			continue;
+		printf("%-10s %8" PRIu64 " packets %10" PRIu64 " bytes", consumer_stream_names[s], stats->packets[s], stats->bytes[s]);
+		if(s == RTPFORWARD_SHM_STREAM_AUDIO_RTP || s == RTPFORWARD_SHM_STREAM_VIDEO_RTP)
+			printf(" %6" PRIu64 " seq gaps", stats->seq_gaps[s]);
+		printf("\n");
+	}
+	printf("lost %" PRIu64 ", dropped %" PRIu64, rtpforward_shm_reader_lost(reader), rtpforward_shm_reader_dropped(reader));
+	if(packets > 0)
+		printf(", latency avg %.1f, max %" PRIu64 " us", (double)stats->latency_us_total / packets, stats->latency_us_max);
+	printf("\n\n");
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+	const char *socket_path = NULL;
+	int seconds = 0, opt;
+	while((opt = getopt(argc, argv, "s:d:h")) != -1) {
+		switch(opt) {
+			case 's':
+				socket_path = optarg;
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			default:
+				consumer_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(!socket_path == (optind >= argc)) {
+		consumer_usage(argv[0]);
+		return 1;
+	}
+	rtpforward_shm_reader *reader = socket_path ? rtpforward_shm_reader_connect(socket_path) :
+		rtpforward_shm_reader_open_path(argv[optind]);
+	if(!reader) {
+		fprintf(stderr, "Could not open the ring: %s\n", strerror(errno));
+		return 1;
+	}
+
+	static rtpforward_shm_packet packet;
+	consumer_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	uint16_t last_seq[4];
+	int seen[4] = { 0 };
+	uint64_t start = consumer_now_us(), next_print = start + 1000000;
+	while(seconds <= 0 || consumer_now_us() < start + (uint64_t)seconds * 1000000) {
+		int res = rtpforward_shm_reader_read(reader, &packet, 100);
+		if(res < 0) {
+			fprintf(stderr, "Could not read the ring: %s\n", strerror(errno));
+			break;
+		}
+		uint64_t now = consumer_now_us();
+		if(res > 0 && packet.stream < 4) {
+			stats.packets[packet.stream]++;
+			stats.bytes[packet.stream] += packet.length;
+			if(packet.stream == RTPFORWARD_SHM_STREAM_AUDIO_RTP || packet.stream == RTPFORWARD_SHM_STREAM_VIDEO_RTP) {
+				uint16_t gap = packet.rtp_seq - last_seq[packet.stream] - 1;
+				if(seen[packet.stream] && gap < 0x8000)
+					stats.seq_gaps[packet.stream] += gap;
+				last_seq[packet.stream] = packet.rtp_seq;
+				seen[packet.stream] = 1;
+			}
+			uint64_t latency = now > packet.timestamp_us ? now - packet.timestamp_us : 0;
+			stats.latency_us_total += latency;
+			if(latency > stats.latency_us_max)
+				stats.latency_us_max = latency;
+		}
+		if(now >= next_print) {
+			consumer_print(&stats, reader);
+			memset(&stats, 0, sizeof(stats));
+			next_print += 1000000;
+		}
+	}
+	consumer_print(&stats, reader);
+	rtpforward_shm_reader_close(reader);
+	return 0;
+}
@@ -0,0 +1,240 @@
+/*! \file   timer_stress.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Stress test of the timer wheel of the rtpforward plugin
+ *
+ * \details Builds the plugin into a standalone program against the stubs of
+ * janus_stubs.c, like rtpforward-bench, and runs its timer thread. Worker
+ * threads then schedule and cancel a set of refcounted timers as fast as they
+ * can, the way the media threads, the egress workers and the handler threads
+ * arm the batch, pacing, feedback and bitrate timers of a session, while the
+ * callbacks reschedule their own and other timers. Afterwards, the wheel must
+ * be consistent, and empty once all timers are cancelled, and every reference
+ * an armed timer took must have been released exactly once. Before that, a
+ * timer cancelled or moved by the callback of another timer expiring in the
+ * same tick must not fire in that tick.
+ *
+ * Usage: rtpforward-timer-stress [-t threads] [-n timers] [-d seconds]
+*/
+
+#include "../janus_rtpforward.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define STRESS_DEADLINE_MAX_US 2000 // timers are scheduled up to this far ahead
+
+typedef struct stress_timer {
+	janus_refcount ref; // one held by the test, plus the one the armed timer holds
+	rtpforward_timer timer;
+	janus_mutex mutex; // serializes schedule and cancel per timer, like the owners' locks do in the plugin
+	gint64 deadline; // of the last schedule, 0 if cancelled since
+	volatile gint freed;
+} stress_timer;
+
+static stress_timer *stress_timers = NULL;
+static guint stress_timer_count = 0;
+static volatile gint stress_stop = 0;
+static volatile gint stress_fired = 0;
+static volatile gint stress_errors = 0;
+
+static void stress_error(const char *format, ...) {
+	va_list ap;
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	g_atomic_int_inc(&stress_errors);
+}
+
+static void stress_timer_free(const janus_refcount *ref) {
+	stress_timer *timer = janus_refcount_containerof(ref, stress_timer, ref);
+	// Only the test's own reference may be the last one, and it is never dropped
+	g_atomic_int_set(&timer->freed, 1);
+}
+
+static void stress_schedule(stress_timer *timer, gint64 deadline) {
+	janus_mutex_lock(&timer->mutex);
+	timer->deadline = deadline;
+	rtpforward_timer_schedule(&timer->timer, deadline);
+	janus_mutex_unlock(&timer->mutex);
+}
+
+static void stress_cancel(stress_timer *timer) {
+	janus_mutex_lock(&timer->mutex);
+	timer->deadline = 0;
+	rtpforward_timer_cancel(&timer->timer);
+	janus_mutex_unlock(&timer->mutex);
+}
+
+static void stress_timeout(rtpforward_timer *wheel_timer, gint64 now) {
+	stress_timer *timer = (stress_timer *)wheel_timer->data;
+	g_atomic_int_inc(&stress_fired);
+	if(g_atomic_int_get(&timer->freed))
+		stress_error("Timer %ld fired after it was freed\n", (long)(timer - stress_timers));
+	// Callbacks arm timers too: their own, and other sessions'
+	guint32 dice = g_random_int();
+	if(dice % 4 == 0)
+		stress_schedule(timer, now + dice % STRESS_DEADLINE_MAX_US);
+	else if(dice % 4 == 1)
+		stress_cancel(&stress_timers[dice % stress_timer_count]);
+}
+
+/* Two timers expiring in the same tick: the first one to fire cancels or moves the other, which must then
+ * not fire in that tick.
+ */
+static volatile gint stress_pair_fired = 0;
+static gboolean stress_pair_move = FALSE;
+
+static void stress_pair_timeout(rtpforward_timer *wheel_timer, gint64 now) {
+	stress_timer *timer = (stress_timer *)wheel_timer->data;
+	stress_timer *partner = &stress_timers[timer == &stress_timers[0] ? 1 : 0];
+	if(now < timer->deadline)
+		stress_error("Timer %ld fired %" G_GINT64_FORMAT " us early\n", (long)(timer - stress_timers), timer->deadline - now);
+	if(g_atomic_int_add(&stress_pair_fired, 1) > 0)
+		return;
+	if(stress_pair_move)
+		stress_schedule(partner, now + 5000);
+	else
+		stress_cancel(partner);
+}
+
+static void stress_pair(gboolean move) {
+	stress_pair_move = move;
+	g_atomic_int_set(&stress_pair_fired, 0);
+	rtpforward_timer_init(&stress_timers[0].timer, stress_pair_timeout, &stress_timers[0], &stress_timers[0].ref);
+	rtpforward_timer_init(&stress_timers[1].timer, stress_pair_timeout, &stress_timers[1], &stress_timers[1].ref);
+	gint64 deadline = janus_get_monotonic_time() + 1000;
+	stress_schedule(&stress_timers[0], deadline);
+	stress_schedule(&stress_timers[1], deadline);
+	usleep(50000);
+	gint fired = g_atomic_int_get(&stress_pair_fired);
+	if(fired != (move ? 2 : 1))
+		stress_error("%d of two timers fired after one %s the other in the same tick\n", fired, move ? "moved" : "cancelled");
+	rtpforward_timer_init(&stress_timers[0].timer, stress_timeout, &stress_timers[0], &stress_timers[0].ref);
+	rtpforward_timer_init(&stress_timers[1].timer, stress_timeout, &stress_timers[1], &stress_timers[1].ref);
+}
+
+static void *stress_thread_run(void *data) {
+	GRand *rand = g_rand_new();
+	while(!g_atomic_int_get(&stress_stop)) {
+		stress_timer *timer = &stress_timers[g_rand_int_range(rand, 0, stress_timer_count)];
+		if(g_rand_int_range(rand, 0, 4) == 0)
+			stress_cancel(timer);
+		else
+			stress_schedule(timer, janus_get_monotonic_time() + g_rand_int_range(rand, 0, STRESS_DEADLINE_MAX_US));
+		// Leave timers alone long enough to expire, so they are also moved and cancelled while firing
+		if(g_rand_int_range(rand, 0, 16) == 0)
+			g_usleep(g_rand_int_range(rand, 0, 100));
+	}
+	g_rand_free(rand);
+	return NULL;
+}
+
+// Walks the wheel, which must hold exactly the armed timers, each once, with consistent links
+static guint stress_check_wheel(void) {
+	guint slot, found = 0;
+	janus_mutex_lock(&timer_mutex);
+	for(slot = 0; slot < RTPFORWARD_TIMER_SLOTS; slot++) {
+		rtpforward_timer *timer, *prev = NULL;
+		for(timer = timer_wheel[slot]; timer; prev = timer, timer = timer->next) {
+			if(timer->prev != prev || timer->slot != slot || !timer->armed) {
+				stress_error("Wheel slot %u is corrupted\n", slot);
+				break;
+			}
+			if(++found > stress_timer_count) {
+				stress_error("Wheel holds more timers than there are\n");
+				janus_mutex_unlock(&timer_mutex);
+				return found;
+			}
+		}
+	}
+	if(found != timer_count)
+		stress_error("Wheel holds %u timers, but counts %u\n", found, timer_count);
+	janus_mutex_unlock(&timer_mutex);
+	return found;
+}
+
+static void stress_usage(const char *program) {
+	fprintf(stderr, "Usage: %s [-t threads] [-n timers] [-d seconds]\n", program);
+}
+
+static janus_callbacks stress_gateway = { 0 };
+
+int main(int argc, char *argv[]) {
+	int threads = 4, timers = 64, seconds = 3;
+	int opt;
+	while((opt = getopt(argc, argv, "t:n:d:h")) != -1) {
+		switch(opt) {
+			case 't':
+				threads = atoi(optarg);
+				break;
+			case 'n':
+				timers = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atoi(optarg);
+				break;
+			default:
+				stress_usage(argv[0]);
+				return opt == 'h' ? 0 : 1;
+		}
+	}
+	if(threads < 1 || timers < 2 || seconds < 1) {
+		fprintf(stderr, "Need at least one thread, two timers and one second\n");
+		return 1;
+	}
+
+	if(rtpforward_init(&stress_gateway, "/nonexistent") < 0) {
+		fprintf(stderr, "Plugin initialization failed\n");
+		return 1;
+	}
+	stress_timer_count = timers;
+	stress_timers = g_malloc0(stress_timer_count * sizeof(stress_timer));
+	guint i;
+	for(i = 0; i < stress_timer_count; i++) {
+		janus_refcount_init(&stress_timers[i].ref, stress_timer_free);
+		janus_mutex_init(&stress_timers[i].mutex);
+		rtpforward_timer_init(&stress_timers[i].timer, stress_timeout, &stress_timers[i], &stress_timers[i].ref);
+	}
+
+	stress_pair(FALSE);
+	stress_pair(TRUE);
+	// A wheel corrupted into a loop would hang the test instead of failing it
+	alarm(seconds + 10);
+
+	printf("%d threads on %d timers, %d s\n", threads, timers, seconds);
+	GThread **workers = g_malloc0(threads * sizeof(GThread *));
+	for(i = 0; i < (guint)threads; i++)
+		workers[i] = g_thread_new("stress", stress_thread_run, NULL);
+	sleep(seconds);
+	g_atomic_int_set(&stress_stop, 1);
+	for(i = 0; i < (guint)threads; i++)
+		g_thread_join(workers[i]);
+	g_free(workers);
+	stress_check_wheel();
+
+	// Cancel everything, and give callbacks which are still running time to drop their references
+	for(i = 0; i < stress_timer_count; i++)
+		stress_cancel(&stress_timers[i]);
+	usleep(20000);
+	for(i = 0; i < stress_timer_count; i++)
+		stress_cancel(&stress_timers[i]);
+	if(stress_check_wheel() > 0)
+		stress_error("Timers are left armed after cancelling all of them\n");
+	for(i = 0; i < stress_timer_count; i++) {
+		gint count = g_atomic_int_get(&stress_timers[i].ref.count);
+		if(count != 1 || g_atomic_int_get(&stress_timers[i].freed))
+			stress_error("Timer %u has %d references instead of 1\n", i, count);
+	}
+	printf("%d callbacks, %d errors\n", g_atomic_int_get(&stress_fired), g_atomic_int_get(&stress_errors));
+
+	rtpforward_destroy();
+	for(i = 0; i < stress_timer_count; i++)
+		janus_mutex_destroy(&stress_timers[i].mutex);
+	g_free(stress_timers);
+	return g_atomic_int_get(&stress_errors) > 0 ? 1 : 0;
+}
@@ -13,8 +13,25 @@
 #include <plugins/plugin.h>
 #include <debug.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <linux/net_tstamp.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 
 #include <poll.h>
 
@@ -28,6 +45,11 @@
 #include "sdp-utils.h"
 #include "utils.h"
 
+#include "rtpforward_uring.h"
+#include "rtpforward_shm.h"
+#include "rtpforward_frame.h"
+#include "rtpforward_mux.h"
+
 #define RTPFORWARD_VERSION 1
 #define RTPFORWARD_VERSION_STRING	"0.9.2"
 #define RTPFORWARD_DESCRIPTION "Forwards RTP and RTCP to an external UDP receiver/decoder"
@@ -88,51 +110,786 @@ janus_plugin *create(void) {
 
 static volatile gint initialized = 0, stopping = 0;
 static janus_callbacks *gateway = NULL;
-static GThread *handler_thread;
 static GThread *watchdog_thread;
+static GThread *timer_thread;
+static GThread *capture_thread;
+static GThread *reaper_thread;
+static GThread *shm_thread;
+static GThread *feedback_thread;
 
 static void *rtpforward_handler_thread(void *data);
+static void *rtpforward_timer_thread(void *data);
+static void *rtpforward_capture_thread(void *data);
+static void *rtpforward_reaper_thread(void *data);
+static void *rtpforward_shm_thread(void *data);
+static void *rtpforward_feedback_thread(void *data);
+
 
+#define RTPFORWARD_CODEC_STR_LEN 10
 
 typedef struct rtpforward_message {
 	janus_plugin_session *handle;
 	char *transaction;
 	json_t *body;
 	json_t *jsep;
+	gint64 queued; // monotonic time
 } rtpforward_message;
-static GAsyncQueue *messages = NULL;
 static rtpforward_message exit_message;
 
-#define RTPFORWARD_CODEC_STR_LEN 10
+/* Asynchronous messages, mostly SDP offers, are handled by a pool of handler threads. All messages of a handle
+ * go to the same thread, so they are handled in the order they arrived.
+ */
+#define RTPFORWARD_HANDLER_THREADS_DEFAULT 1
+#define RTPFORWARD_HANDLER_THREADS_MAX 64
+
+typedef struct rtpforward_handler {
+	guint id;
+	GThread *thread;
+	GAsyncQueue *messages;
+} rtpforward_handler;
+
+static rtpforward_handler *handlers = NULL;
+static guint handler_threads = RTPFORWARD_HANDLER_THREADS_DEFAULT;
+
+// Plugin-wide, updated with relaxed atomic operations like the session statistics
+static struct {
+	guint64 negotiations; // answers pushed
+	guint64 negotiation_us_last; // from queueing the offer until the answer was pushed
+	guint64 negotiation_us_max;
+	guint64 negotiation_us_total;
+	guint64 sdp_cache_hits;
+	guint64 sdp_cache_misses;
+} handler_stats;
+
+/* Cache of SDP answers. Offers of browsers of the same kind only differ in a few lines: the origin, session name
+ * and connection lines, the mids, and the ICE and DTLS attributes, which the Janus core takes care of. Everything
+ * else, together with the codecs the session negotiates, is the shape of the offer. The answer to an offer of a
+ * known shape is the cached answer with the offer's own origin, session name, connection and mid lines put in.
+ * The least recently used answers are evicted.
+ */
+#define RTPFORWARD_SDP_CACHE_SIZE_DEFAULT 64
+#define RTPFORWARD_SDP_CACHE_SIZE_MAX 4096
+#define RTPFORWARD_SDP_MEDIA_MAX 16
+
+typedef enum rtpforward_sdp_line_kind {
+	SDP_LINE_LITERAL,
+	SDP_LINE_ORIGIN,
+	SDP_LINE_SESSION_NAME,
+	SDP_LINE_CONNECTION,
+	SDP_LINE_MID
+} rtpforward_sdp_line_kind;
+
+typedef struct rtpforward_sdp_offer {
+	char *key;
+	gchar **lines;
+	/* Index into lines of the lines of each kind, -1 if absent. Media 0 is the session level. */
+	int origin;
+	int session_name;
+	int connection[RTPFORWARD_SDP_MEDIA_MAX + 1];
+	int mid[RTPFORWARD_SDP_MEDIA_MAX + 1];
+	guint media_count;
+} rtpforward_sdp_offer;
+
+typedef struct rtpforward_sdp_template_line {
+	rtpforward_sdp_line_kind kind;
+	guint media;
+	char *text; // literal lines only
+} rtpforward_sdp_template_line;
+
+typedef struct rtpforward_sdp_answer {
+	char *key;
+	rtpforward_sdp_template_line *lines;
+	guint line_count;
+	char acodec[RTPFORWARD_CODEC_STR_LEN];
+	char vcodec[RTPFORWARD_CODEC_STR_LEN];
+	GList link; // in sdp_cache_lru
+} rtpforward_sdp_answer;
+
+static GHashTable *sdp_cache = NULL; // shape key -> rtpforward_sdp_answer
+static GQueue sdp_cache_lru = G_QUEUE_INIT; // most recently used first
+static guint sdp_cache_size = RTPFORWARD_SDP_CACHE_SIZE_DEFAULT; // 0 disables the cache
+static janus_mutex sdp_cache_mutex = JANUS_MUTEX_INITIALIZER;
+static void rtpforward_sdp_answer_free(rtpforward_sdp_answer *answer);
 
 typedef enum rtpforward_video_codec {
 	CODEC_NONE,
 	CODEC_VP8,
 	CODEC_VP9,
-	CODEC_H264
+	CODEC_H264,
+	CODEC_AV1,
+	CODEC_H265
 } rtpforward_video_codec;
 
+// The four forwarded streams, each one going to its own destination port
+typedef enum rtpforward_stream {
+	STREAM_AUDIO_RTP,
+	STREAM_AUDIO_RTCP,
+	STREAM_VIDEO_RTP,
+	STREAM_VIDEO_RTCP,
+	STREAM_COUNT
+} rtpforward_stream;
+
+// Largest packet which can be staged for batched sending. Bigger packets are sent immediately.
+#define RTPFORWARD_MAX_PACKET_SIZE 1500
+
+/* Automatic keyframe requests while video is disabled because of packet loss. The first one is sent at
+ * once (but not sooner than the minimum interval after the previous one), then with exponential backoff.
+ */
+#define RTPFORWARD_KEYFRAME_REQUEST_INTERVAL_MS_DEFAULT 500
+#define RTPFORWARD_KEYFRAME_REQUEST_BACKOFF_MAX_MS 8000
+
+typedef enum rtpforward_keyframe_request {
+	KEYFRAME_REQUEST_NONE,
+	KEYFRAME_REQUEST_PLI,
+	KEYFRAME_REQUEST_FIR
+} rtpforward_keyframe_request;
+
+/* Token bucket pacing of the video RTP sent to one destination, for receivers which can't take the bursts
+ * of keyframes. Packets beyond the burst wait in a queue for the pacing timer or, with SO_TXTIME, are handed
+ * to the kernel at once with the time to send them. Audio and RTCP are never paced, so they overtake video.
+ */
+#define RTPFORWARD_PACING_QUEUE_SIZE 256
+#define RTPFORWARD_PACING_BURST_KB_DEFAULT 16
+#define RTPFORWARD_PACING_BURST_KB_MAX 1024
+#define RTPFORWARD_PACING_KBPS_MAX (10 * 1000 * 1000) // 10 Gbit/s
+#define RTPFORWARD_PACING_DELAY_MAX_US 500000 // packets which would wait longer are dropped
+
+typedef struct rtpforward_pacer_slot {
+	gint64 queued;
+	guint16 length;
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+} rtpforward_pacer_slot;
+
+typedef struct rtpforward_pacer {
+	guint32 rate_kbps;
+	guint32 burst; // bytes
+	gint64 tokens; // bytes, negative while transmit times ahead have been handed out
+	gint64 refilled; // up to when tokens were added
+	guint head;
+	guint count;
+	rtpforward_pacer_slot slots[RTPFORWARD_PACING_QUEUE_SIZE];
+} rtpforward_pacer;
+
+typedef enum rtpforward_pacer_verdict {
+	PACER_SEND, // now, or at the transmit time handed out
+	PACER_QUEUED, // sent later by the pacing timer
+	PACER_DROPPED
+} rtpforward_pacer_verdict;
+
+// How a packet fared at its destinations: it counts as forwarded unless all of them dropped it
+#define RTPFORWARD_OUTCOME_TAKEN 0x01
+#define RTPFORWARD_OUTCOME_DROPPED 0x02
+
+/* A destination of the forwarded streams: an IPv4 address and one port per stream. Audio, video and
+ * RTCP can be switched off per destination. The destination set by "configure" has id 0.
+ */
+#define RTPFORWARD_DESTINATIONS_MAX 16
+
+typedef struct rtpforward_destination {
+	guint id;
+	struct sockaddr_in addr;
+	guint16 ports[STREAM_COUNT];
+	gboolean audio, video, rtcp;
+	gboolean enabled[STREAM_COUNT]; // derived from audio, video and rtcp
+	rtpforward_pacer *pacer; // NULL unless video is paced
+} rtpforward_destination;
+
+
+/* Timer wheel shared by all sessions and driven by a single thread.
+ * Timers are embedded in the structures which own them, so arming one never allocates.
+ */
+#define RTPFORWARD_TIMER_TICK_US 250
+#define RTPFORWARD_TIMER_SLOTS 1024
+
+typedef struct rtpforward_timer {
+	gint64 deadline; // monotonic time in us
+	guint rounds; // full wheel turns to wait before firing
+	guint slot;
+	gboolean armed; // in the wheel
+	gboolean firing; // expired, and waiting for the timer thread to call back
+	void (*callback)(struct rtpforward_timer *timer, gint64 now);
+	void *data;
+	janus_refcount *ref; // optional, held while the timer is armed or firing
+	struct rtpforward_timer *prev;
+	struct rtpforward_timer *next;
+	struct rtpforward_timer *expired_next; // owned by the timer thread, so rescheduling can't relink it
+} rtpforward_timer;
+
+static rtpforward_timer *timer_wheel[RTPFORWARD_TIMER_SLOTS];
+static guint timer_wheel_pos = 0;
+static gint64 timer_wheel_time = 0; // monotonic time of timer_wheel_pos
+static guint timer_count = 0;
+static janus_mutex timer_mutex = JANUS_MUTEX_INITIALIZER;
+static janus_condition timer_cond;
+
+
+/* Per-session forwarding statistics. Every counter is only ever touched with relaxed atomic operations,
+ * so the media thread, the egress worker and the handler thread never contend for a lock.
+ */
+#define RTPFORWARD_STATS_HISTOGRAM_BUCKETS 24 // bucket i counts durations in [2^i, 2^(i+1)) ns, the last one all above
+
+#define RTPFORWARD_STAT_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#define RTPFORWARD_STAT_GET(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define RTPFORWARD_STAT_SUB(counter, n) __atomic_fetch_sub(&(counter), (n), __ATOMIC_RELAXED)
+
+typedef struct rtpforward_stats {
+	guint64 packets[STREAM_COUNT];
+	guint64 bytes[STREAM_COUNT];
+	guint64 simulated_drops;
+	guint64 video_disabled_on_loss;
+	guint64 keyframes;
+	guint64 lost[STREAM_COUNT]; // only RTP streams
+	guint64 late[STREAM_COUNT];
+	guint64 duplicates[STREAM_COUNT];
+	guint64 reorder_late[STREAM_COUNT]; // arrived after the reorder buffer had moved on
+	guint64 reorder_skipped[STREAM_COUNT]; // missing packets the reorder buffer stopped waiting for
+	guint64 keyframe_requests; // sent automatically after packet loss
+	guint64 recoveries;
+	guint64 recovery_ms_last; // from disabling video until the next keyframe
+	guint64 recovery_ms_max;
+	guint64 recovery_ms_total;
+	guint64 gop_replays;
+	guint64 gop_replayed_packets;
+	guint64 capture_packets;
+	guint64 capture_dropped; // the capture writer fell behind, or its file could not be created
+	guint64 capture_failures; // captures ended because the next file could not be created
+	guint64 shm_packets;
+	guint64 shm_dropped; // too large for a slot
+	guint64 paced_packets; // video packets held back by a pacer
+	guint64 paced_delay_us_total;
+	guint64 paced_delay_us_max;
+	guint64 paced_dropped; // the pacing queue was full, the packet would have waited too long, or its destination was removed
+	guint64 frames; // assembled in frame mode
+	guint64 frames_incomplete; // missing packets, or too large for the arena
+	guint64 frames_dropped; // too large for a datagram, or the frame socket was full
+	guint64 mux_packets;
+	guint64 mux_dropped; // too large for a mux message
+	guint64 feedback_packets; // RTCP packets received from the destinations
+	guint64 feedback_invalid; // not RTCP, or not from a destination
+	guint64 feedback_keyframe_requests; // sent for PLI and FIR of the receivers
+	guint64 feedback_keyframe_coalesced; // PLI and FIR merged into a pending request
+	guint64 feedback_rembs;
+	guint64 feedback_nacks; // NACK messages relayed
+	guint64 feedback_nacks_dropped; // over the budget, with rewritten headers, or not for the forwarded video
+	guint64 slow_links; // slow_link notifications of the core
+	guint64 abr_decreases;
+	guint64 abr_rembs;
+	guint64 errors_eagain; // also EWOULDBLOCK
+	guint64 errors_enobufs;
+	guint64 errors_econnrefused;
+	guint64 errors_other;
+	guint64 uring_fallbacks; // sent with sendto() because the worker's ring was full
+	guint64 incoming_rtp_ns[RTPFORWARD_STATS_HISTOGRAM_BUCKETS];
+} rtpforward_stats;
+
+
+/* Loss detection on an RTP stream. Sequence numbers are extended to 32 bits, and the reception of
+ * the last RTPFORWARD_SEQWIN_SIZE packets is kept in a bitmap, bit 0 being the highest sequence number
+ * seen. A missing packet is only declared lost once reorder_tolerance newer packets have arrived,
+ * so mere reordering doesn't count as loss.
+ */
+#define RTPFORWARD_SEQWIN_SIZE 64
+#define RTPFORWARD_REORDER_TOLERANCE_DEFAULT 8
+#define RTPFORWARD_SEQ_MAX_DROPOUT 3000 // larger jumps restart the window, see RFC 3550 A.1
+
+typedef enum rtpforward_seq_status {
+	SEQ_IN_ORDER, // newer than anything seen so far, maybe after a gap
+	SEQ_LATE, // older than the highest sequence number, but not seen before
+	SEQ_LATE_LOST, // late, and already counted as lost
+	SEQ_DUPLICATE
+} rtpforward_seq_status;
+
+typedef struct rtpforward_seqwin {
+	gboolean started;
+	guint32 highest; // extended sequence number
+	guint64 received;
+	guint64 counted; // missing packets already counted as lost, same positions as received
+} rtpforward_seqwin;
+
+
+/* Optional reorder buffer of an RTP stream, between reception and egress. Packets are released in
+ * sequence order, but none is held longer than reorder_buffer_ms, and at most reorder_buffer_packets
+ * sequence numbers are spanned. Slots are indexed by the extended sequence number.
+ * The deadline of the oldest held packet is kept on the shared timer wheel.
+ */
+#define RTPFORWARD_REORDER_SLOTS RTPFORWARD_SEQWIN_SIZE
+#define RTPFORWARD_REORDER_MS_MAX 1000
+
+typedef struct rtpforward_reorder_slot {
+	gboolean present;
+	gboolean end_of_frame;
+	guint32 seq;
+	gint64 arrival;
+	guint16 length;
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+} rtpforward_reorder_slot;
+
+typedef struct rtpforward_reorder {
+	struct rtpforward_session *session;
+	rtpforward_stream stream;
+	gboolean started;
+	guint32 next; // extended sequence number to be released next
+	guint count; // packets held
+	rtpforward_reorder_slot *slots; // NULL if the reorder buffer is disabled
+	rtpforward_timer timer;
+} rtpforward_reorder;
+
+/* Cache of the video RTP packets since the most recent keyframe, so a restarted receiver gets a decodable
+ * picture without a round trip to the browser. Packets are stored back to back in a preallocated arena,
+ * each one prefixed with its length. Caching stops when the arena is full; packet loss invalidates the
+ * cache until the next keyframe.
+ */
+#define RTPFORWARD_GOP_CACHE_KB_MAX (16 * 1024)
+#define RTPFORWARD_GOP_REPLAY_TICK_US 1000
+
+typedef struct rtpforward_gop_cache {
+	guint8 *arena; // NULL if disabled
+	gsize size;
+	gsize used;
+	guint count;
+	gboolean valid; // starts with a keyframe and has no holes
+	guint32 keyframe_timestamp;
+	guint generation; // incremented whenever the cache restarts
+	/* Paced replay */
+	guint32 replay_kbps; // 0 replays at line rate
+	gsize replay_offset;
+	guint replay_generation;
+	gboolean replaying;
+	rtpforward_timer replay_timer;
+} rtpforward_gop_cache;
+
+/* Capture of the forwarded packets into pcap files, for debugging receivers. Packets are copied into a
+ * bounded lock-free ring, a multi-producer variant of the egress ring since the timer thread forwards too,
+ * and written by a single background thread into a memory-mapped file of fixed size. Forwarding never
+ * waits for the disk: if the writer falls behind, packets are left out of the capture and counted.
+ * Packets are written with made-up IPv4 and UDP headers addressed to the first destination. Files are only
+ * created in capture_dir, and never over an existing one.
+ */
+#define RTPFORWARD_CAPTURE_QUEUE_SIZE 1024 // power of two
+#define RTPFORWARD_CAPTURE_FILE_MB_DEFAULT 64
+#define RTPFORWARD_CAPTURE_FILE_MB_MAX 4096
+#define RTPFORWARD_CAPTURE_WRITE_INTERVAL_US 5000
+#define RTPFORWARD_CAPTURE_HEADERS_SIZE (20 + 8) // IPv4 and UDP
+#define RTPFORWARD_CAPTURE_FILES_MAX 10000 // <prefix>-0000.pcap to <prefix>-9999.pcap
+#define RTPFORWARD_PCAP_LINKTYPE_IPV4 228
+
+typedef enum rtpforward_capture_state {
+	CAPTURE_IDLE,
+	CAPTURE_RUNNING,
+	CAPTURE_STOPPING // the writer finishes the file and goes back to idle
+} rtpforward_capture_state;
+
+typedef struct rtpforward_pcap_header {
+	guint32 magic;
+	guint16 version_major;
+	guint16 version_minor;
+	gint32 thiszone;
+	guint32 sigfigs;
+	guint32 snaplen;
+	guint32 linktype;
+} rtpforward_pcap_header;
+
+typedef struct rtpforward_pcap_record {
+	guint32 ts_sec;
+	guint32 ts_usec;
+	guint32 incl_len;
+	guint32 orig_len;
+} rtpforward_pcap_record;
+
+typedef struct rtpforward_capture_slot {
+	volatile gint sequence;
+	guint generation;
+	gint64 time; // wall clock, in microseconds
+	rtpforward_stream stream;
+	guint16 length;
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+} rtpforward_capture_slot;
+
+typedef struct rtpforward_capture {
+	volatile gint state;
+	volatile gint generation; // records of an earlier capture are skipped
+	volatile gint head;
+	guint tail; // only touched by the writer
+	/* Output, only touched by the writer while capturing */
+	char *prefix; // files are named <prefix>-<index>.pcap, in capture_dir
+	guint file_index;
+	gsize file_size;
+	gint64 file_duration_us; // 0 only rotates by size
+	gint64 file_started;
+	int fd;
+	guint8 *map;
+	gsize used;
+	struct in_addr addr;
+	guint16 ports[STREAM_COUNT];
+	rtpforward_capture_slot slots[RTPFORWARD_CAPTURE_QUEUE_SIZE];
+} rtpforward_capture;
+
+static char *capture_dir = NULL; // without it, captures are refused
+static GList *capture_sessions = NULL; // served by the capture thread, each holding a reference
+static janus_mutex capture_mutex = JANUS_MUTEX_INITIALIZER;
+static janus_condition capture_cond;
+
+/* Shared-memory egress, see rtpforward_shm.h. The ring is written under the session's shm_mutex,
+ * which only serializes the plugin's own threads; readers take no lock.
+ */
+#define RTPFORWARD_SHM_SLOTS_DEFAULT 1024
+#define RTPFORWARD_SHM_SLOTS_MIN 16
+#define RTPFORWARD_SHM_SLOTS_MAX 65536
+#define RTPFORWARD_SHM_SOCKET_MODE 0660
+
+// A Unix socket handing the memfd of a ring to every client. Owned by the shm thread.
+typedef struct rtpforward_shm_listener {
+	int fd;
+	int memfd; // a duplicate, so the socket outlives the ring
+	char *path;
+	volatile gint closing;
+} rtpforward_shm_listener;
+
+typedef struct rtpforward_shm {
+	int memfd;
+	gsize size;
+	void *mapping;
+	rtpforward_shm_writer writer; // the geometry and write position, which readers can't touch
+	rtpforward_shm_listener *listener; // NULL without a socket
+} rtpforward_shm;
+
+static GList *shm_listeners = NULL;
+static janus_mutex shm_listeners_mutex = JANUS_MUTEX_INITIALIZER;
+static int shm_eventfd = -1; // wakes the shm thread up when listeners come and go
+
+/* Frame mode: the video RTP packets are reassembled into complete frames, each of which is sent as a single
+ * message (see rtpforward_frame.h). The frame is depacketized into an arena allocated when frame mode is
+ * configured, behind room for the header, so it is sent without another copy.
+ */
+#define RTPFORWARD_FRAME_KB_DEFAULT 1024
+#define RTPFORWARD_FRAME_KB_MAX 16384
+#define RTPFORWARD_FRAME_UDP_MAX 65507 // largest frame and header in one datagram
+
+typedef struct rtpforward_frame_assembler {
+	guint8 *arena; // header, then the frame
+	gsize size; // room for the frame
+	gsize length;
+	gboolean active; // a frame is being assembled
+	gboolean broken; // a packet of it is missing, or it doesn't fit
+	gboolean ended; // the last frame ended with the marker bit, at next_seq - 1
+	gboolean keyframe;
+	guint32 timestamp;
+	guint32 ssrc;
+	guint16 first_seq;
+	guint16 next_seq;
+	guint16 packets;
+	int socket; // Unix SOCK_SEQPACKET socket, or -1
+	char *socket_path;
+} rtpforward_frame_assembler;
+
+static void rtpforward_frame_assembler_free(rtpforward_frame_assembler *frames);
+
+/* Multiplexing: the packets of all sessions with the same mux target are packed as records into shared
+ * messages (see rtpforward_mux.h), which are sent when the next record wouldn't fit into mux_size bytes, or
+ * when the first record has waited mux_latency_us. A target is a UDP address or a Unix stream socket.
+ */
+#define RTPFORWARD_MUX_SIZE_DEFAULT 1400
+#define RTPFORWARD_MUX_SIZE_MAX 65507
+#define RTPFORWARD_MUX_LATENCY_US_DEFAULT 1000
+#define RTPFORWARD_MUX_LATENCY_US_MAX 100000
+#define RTPFORWARD_MUX_PENDING_SIZE (256 * 1024) // bytes a stream socket may be behind before messages are dropped
+
+typedef struct rtpforward_mux {
+	char *target; // "udp:<address>:<port>" or "unix:<path>"
+	int fd; // a UDP socket connected to the target, or a Unix stream socket
+	gboolean stream;
+	guint users; // sessions sending to it, protected by muxes_mutex
+	janus_mutex mutex;
+	guint8 *buffer; // header, then the records
+	gsize length; // including the header
+	guint16 count;
+	gint64 first; // monotonic time of the first record
+	guint8 *pending; // messages the stream socket didn't take yet
+	gsize pending_length;
+	guint64 messages;
+	guint64 dropped_messages;
+	rtpforward_timer timer;
+	janus_refcount ref; // held by each user and by the armed timer
+} rtpforward_mux;
+
+static GHashTable *muxes = NULL; // target -> rtpforward_mux
+static janus_mutex muxes_mutex = JANUS_MUTEX_INITIALIZER;
+static guint mux_size = RTPFORWARD_MUX_SIZE_DEFAULT;
+static guint mux_latency_us = RTPFORWARD_MUX_LATENCY_US_DEFAULT;
+static guint32 mux_next_id = 1; // default mux_id of the sessions
+
+/* Downstream RTCP feedback: the sending socket of a session with rtcp_feedback is bound to a known port, and
+ * watched by a single thread with epoll for the RTCP its receivers send back. PLI and FIR become one keyframe
+ * request at most every feedback_keyframe_interval_us, REMB the lowest bitrate asked for at most every
+ * feedback_remb_interval_us, and NACKs are relayed to the browser up to a budget per second.
+ */
+#define RTPFORWARD_FEEDBACK_KEYFRAME_INTERVAL_MS_DEFAULT 500
+#define RTPFORWARD_FEEDBACK_REMB_INTERVAL_MS_DEFAULT 1000
+#define RTPFORWARD_FEEDBACK_INTERVAL_MS_MAX 60000
+#define RTPFORWARD_FEEDBACK_NACKS_PER_SECOND 50
+#define RTPFORWARD_FEEDBACK_NACK_SIZE 512 // bytes of NACK messages relayed from one packet
+#define RTPFORWARD_FEEDBACK_READS_MAX 16 // packets read from one socket before looking at the others
+#define RTPFORWARD_FEEDBACK_EVENTS 64
+
+typedef struct rtpforward_feedback_message {
+	gboolean pli;
+	gboolean fir;
+	guint32 remb; // lowest bitrate of the REMB messages, 0 if none
+	guint nacks; // NACK messages for the forwarded video, those which fit copied to nack
+	guint nacks_foreign; // NACK messages for other SSRCs, which the browser can't retransmit
+	int nack_length;
+	char nack[RTPFORWARD_FEEDBACK_NACK_SIZE];
+} rtpforward_feedback_message;
+
+static int feedback_epoll_fd = -1;
+static int feedback_eventfd = -1; // wakes the feedback thread up to stop, watched with id 0
+static GHashTable *feedback_sessions = NULL; // feedback_id -> rtpforward_session, holding a reference
+static janus_mutex feedback_sessions_mutex = JANUS_MUTEX_INITIALIZER;
+static guint32 feedback_next_id = 1;
+
+/* Adaptive bitrate: an AIMD controller per session with adaptive_bitrate, which cuts its estimate when the
+ * browser's media is lost on the way in (slow_link) or the egress can't keep up (send errors, drops, a half
+ * full egress queue), raises it slowly while neither happens, and tells the browser with REMB.
+ */
+#define RTPFORWARD_ABR_MIN_KBPS_DEFAULT 100
+#define RTPFORWARD_ABR_MAX_KBPS_DEFAULT 2500
+#define RTPFORWARD_ABR_KBPS_MAX 100000
+#define RTPFORWARD_ABR_TICK_MS 250
+#define RTPFORWARD_ABR_DECREASE 0.85
+#define RTPFORWARD_ABR_DECREASE_INTERVAL_MS 500 // for the browser to react to the previous cut
+#define RTPFORWARD_ABR_HOLD_MS 2000 // no increase after a cut
+#define RTPFORWARD_ABR_INCREASE_PER_SECOND 20 // the ceiling divided by this
+#define RTPFORWARD_ABR_REMB_INTERVAL_MS 1000 // between REMBs raising the bitrate; cuts are sent right away
+
+static void rtpforward_setup_multicast(int fd, struct in_addr addr);
+
+/* A vector of datagrams for one sendmmsg() call.
+ * With UDP generic segmentation offload (GSO), a run of equal-sized video RTP packets becomes a single
+ * datagram with one iovec per packet, which the kernel splits again into packets of segment_size.
+ * Only the last packet of a run may be shorter.
+ */
+#define RTPFORWARD_MSGVEC_SIZE 64
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#define SCM_TXTIME SO_TXTIME
+#endif
+#define RTPFORWARD_GSO_SEGMENTS_MAX 64 // UDP_MAX_SEGMENTS of the kernel
+#define RTPFORWARD_GSO_BYTES_MAX 65507 // largest UDP payload over IPv4
+
+typedef struct rtpforward_msgvec {
+	guint count;
+	guint iov_count;
+	gboolean gso; // coalesce runs of video RTP packets
+	struct mmsghdr msgs[RTPFORWARD_MSGVEC_SIZE];
+	struct iovec iovs[RTPFORWARD_MSGVEC_SIZE];
+	struct sockaddr_in addrs[RTPFORWARD_MSGVEC_SIZE];
+	guint16 segment_size[RTPFORWARD_MSGVEC_SIZE]; // 0 if no more packets can be appended to the datagram
+	guint32 bytes[RTPFORWARD_MSGVEC_SIZE];
+	char control[RTPFORWARD_MSGVEC_SIZE][CMSG_SPACE(sizeof(guint64))]; // UDP_SEGMENT or SCM_TXTIME
+} rtpforward_msgvec;
+
+
+/* Staging area for batched egress via sendmmsg(). The whole batch is flushed when it is full,
+ * when its oldest packet has waited batch_latency_us, or at the end of a video frame.
+ */
+#define RTPFORWARD_BATCH_SIZE_MAX RTPFORWARD_MSGVEC_SIZE
+#define RTPFORWARD_BATCH_LATENCY_US_DEFAULT 1000
+
+typedef struct rtpforward_batch_slot {
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+	guint16 length;
+	rtpforward_stream stream;
+} rtpforward_batch_slot;
+
+typedef struct rtpforward_batch {
+	guint size;
+	guint count;
+	gint64 first_queued; // monotonic time when the oldest staged packet was queued
+	rtpforward_batch_slot *slots;
+} rtpforward_batch;
+
+
+/* Egress worker threads. Each session hands its packets to one worker through a bounded
+ * lock-free ring whose slots double as the packet buffer pool, so the media thread never
+ * allocates and never blocks in a system call.
+ *
+ * The ring follows the bounded queue by Dmitry Vyukov: every slot carries a sequence number
+ * which tells whether it is free, filled or claimed. Producers claim a slot by moving head
+ * with a CAS: the media thread mostly, but the timer and handler threads also forward packets
+ * held by the reorder buffers or the GOP cache. The worker is the only regular consumer, but a
+ * producer may also consume the oldest packet itself to implement the drop-oldest overflow policy.
+ */
+#define RTPFORWARD_EGRESS_QUEUE_SIZE_DEFAULT 256
+#define RTPFORWARD_EGRESS_QUEUE_SIZE_MAX 8192
+#define RTPFORWARD_EGRESS_THREADS_MAX 64
+
+typedef enum rtpforward_overflow_policy {
+	OVERFLOW_DROP_OLDEST,
+	OVERFLOW_DROP_NEWEST
+} rtpforward_overflow_policy;
+
+typedef enum rtpforward_egress_backend {
+	EGRESS_BACKEND_SENDMMSG,
+	EGRESS_BACKEND_IO_URING
+} rtpforward_egress_backend;
+
+typedef struct rtpforward_egress_slot {
+	volatile gint sequence;
+	guint16 length;
+	guint16 inflight; // io_uring sends still reading the buffer, only touched by the worker
+	rtpforward_stream stream;
+	char buffer[RTPFORWARD_MAX_PACKET_SIZE];
+} rtpforward_egress_slot;
+
+typedef struct rtpforward_egress_ring {
+	guint size; // power of two
+	volatile gint head; // next position to fill
+	volatile gint tail; // next position to consume
+	volatile gint dropped_oldest;
+	volatile gint dropped_newest;
+	rtpforward_egress_slot *slots;
+} rtpforward_egress_ring;
+
+/* With the io_uring backend, every worker owns a ring. Each send operation keeps its ring slot
+ * claimed until the kernel is done with the buffer, so nothing is copied again. With SEND_ZC the
+ * session's whole slot array is a registered buffer, so the kernel doesn't even pin pages per send.
+ */
+#define RTPFORWARD_URING_ENTRIES 256
+#define RTPFORWARD_URING_BUFFERS 1024
+
+typedef struct rtpforward_uring_op {
+	struct rtpforward_session *session;
+	rtpforward_egress_slot *slot;
+	guint position;
+	gint next_free;
+	struct sockaddr_in addr;
+	struct iovec iov;
+	struct msghdr msg;
+} rtpforward_uring_op;
+
+typedef struct rtpforward_egress_worker {
+	guint id;
+	int cpu; // -1 if not pinned
+	GThread *thread;
+	GList *sessions; // only touched by the worker thread itself
+	GList *attaching; // sessions handed over by other threads, protected by mutex
+	volatile gint sleeping;
+	int wake_fd; // eventfd, also signalled by io_uring completions
+	janus_mutex mutex;
+	rtpforward_msgvec vec;
+	/* io_uring backend, only touched by the worker thread */
+	rtpforward_uring *uring; // NULL with the sendmmsg backend
+	rtpforward_uring_op ops[RTPFORWARD_URING_ENTRIES];
+	gint free_op;
+	guint free_ops;
+	guint inflight;
+	struct rtpforward_session *buffer_owners[RTPFORWARD_URING_BUFFERS];
+} rtpforward_egress_worker;
+
+static rtpforward_egress_worker *egress_workers = NULL;
+static guint egress_threads = 0;
+static guint egress_next_worker = 0;
+static guint egress_queue_size = RTPFORWARD_EGRESS_QUEUE_SIZE_DEFAULT;
+static rtpforward_overflow_policy egress_overflow = OVERFLOW_DROP_OLDEST;
+static rtpforward_egress_backend egress_backend = EGRESS_BACKEND_SENDMMSG;
+static gboolean pacing_txtime = FALSE; // pace with SO_TXTIME rather than the pacing timer
+
 typedef struct rtpforward_session {
 	janus_plugin_session *handle;
 
-	GThread *relay_thread;
-
-	guint16 sendport_video_rtp;
-	guint16 sendport_video_rtcp;
-	guint16 sendport_audio_rtp;
-	guint16 sendport_audio_rtcp;
-	guint16 seqnr_video_last; // to keep track of lost packets
-	guint16 seqnr_audio_last; // to keep track of lost packets
+	rtpforward_egress_worker *egress_worker; // NULL if packets are sent from the media thread
+	rtpforward_egress_ring *egress_ring;
+	volatile gint egress_detached;
+	int egress_buffer_index; // registered io_uring buffer of the ring slots, -1 if none
+	guint egress_inflight; // io_uring sends not completed yet
+
+	rtpforward_seqwin seqwin_video; // to keep track of lost packets
+	rtpforward_seqwin seqwin_audio;
+	guint16 reorder_tolerance;
+
+	guint32 reorder_buffer_us; // 0 disables the reorder buffers
+	guint16 reorder_buffer_packets;
+	rtpforward_reorder reorder_video;
+	rtpforward_reorder reorder_audio;
+	janus_mutex reorder_mutex; // protects both reorder buffers
 	guint16 drop_permille;
 	guint16 drop_video_packets;
 	guint16 drop_audio_packets;
 
-	int fir_seqnr;
+	int fir_seqnr; // protected by keyframe_mutex
+
+	rtpforward_keyframe_request keyframe_request_on_loss;
+	guint32 keyframe_request_interval_us; // minimum interval between automatic requests
+	gboolean recovering; // video is disabled by packet loss and keyframes are being requested
+	gint64 recovery_started;
+	gint64 keyframe_requested; // when the last automatic request was sent
+	guint32 keyframe_backoff_us;
+	rtpforward_timer keyframe_timer;
+	janus_mutex keyframe_mutex;
+	gboolean keyframe_frame_known; // keyframe detection has looked at a packet of the frame with this timestamp
+	guint32 keyframe_frame_timestamp;
+	gboolean keyframe_frame_decided; // whether that frame is a keyframe is known
+
+	rtpforward_gop_cache gop_cache;
+	janus_mutex gop_mutex; // protects gop_cache
+	rtpforward_capture *capture; // allocated by the first "capture" request
+	rtpforward_shm *shm; // NULL unless started by a "shm" request
+	janus_mutex shm_mutex; // protects shm and serializes writing to it
+	rtpforward_frame_assembler *frames; // NULL unless in frame mode
+	janus_mutex frames_mutex; // protects frames
+	rtpforward_mux *mux; // NULL unless multiplexing, protected by egress_mutex
+	guint32 mux_id; // stream id of the session in the mux records
 	int sendsockfd; // one socket for sento() several ports is enough
-	struct sockaddr_in sendsockaddr;
+	gboolean feedback; // bind the socket and relay the RTCP of the receivers
+	guint16 feedback_port; // 0 for any
+	janus_mutex feedback_mutex; // protects the feedback state, and serializes reading the socket
+	guint32 feedback_id; // key in feedback_sessions while the socket is watched, 0 if not
+	int feedback_fd; // the watched socket
+	guint32 feedback_keyframe_interval_us;
+	guint32 feedback_remb_interval_us;
+	gboolean feedback_keyframe_pending;
+	gboolean feedback_fir; // the pending request is a FIR
+	gint64 feedback_keyframe_sent;
+	guint32 feedback_remb; // lowest bitrate asked for since the last REMB, 0 if none
+	gint64 feedback_remb_sent;
+	gint64 feedback_nack_second; // start of the second the NACK budget is for
+	guint32 feedback_video_ssrc; // SSRC of the video last forwarded, written by the media thread, 0 before
+	guint feedback_nack_count;
+	guint32 feedback_remb_last; // the last bitrate the receivers asked for, 0 if none
+	rtpforward_timer feedback_timer;
+	gboolean abr; // adaptive bitrate, the controller state is protected by feedback_mutex too
+	guint32 abr_min_bps;
+	guint32 abr_max_bps;
+	guint32 abr_estimate_bps;
+	guint32 abr_sent_bps; // the last REMB sent, 0 if none yet
+	gint64 abr_sent;
+	gint64 abr_decreased; // when the estimate was last cut
+	guint64 abr_errors; // send errors and egress drops at the last tick
+	gint abr_slow_links; // slow_link notifications since the last tick
+	rtpforward_timer abr_timer;
+	rtpforward_destination destinations[RTPFORWARD_DESTINATIONS_MAX]; // protected by egress_mutex
+	guint destination_count;
+	guint destination_next_id;
+	rtpforward_msgvec vec; // for packets which are sent right away, protected by egress_mutex
 
 	rtpforward_video_codec vcodec;
 
+	rtpforward_stats stats;
+
+	gboolean gso; // send each run of equal-sized video packets as one UDP_SEGMENT datagram
+	guint16 batch_size; // 0 or 1 disables batching
+	guint32 batch_latency_us;
+	rtpforward_batch *batch;
+	rtpforward_timer batch_timer;
+	gboolean txtime; // SO_TXTIME is enabled on the socket
+	rtpforward_timer pacing_timer;
+	gint64 pacing_deadline; // when the pacing timer fires, 0 if not armed
+	janus_mutex egress_mutex; // protects the socket and the staged packets
+
 	char negotiate_acodec[RTPFORWARD_CODEC_STR_LEN];
 	char negotiate_vcodec[RTPFORWARD_CODEC_STR_LEN];
 
@@ -141,16 +898,50 @@ typedef struct rtpforward_session {
 	gboolean enable_video_on_keyframe;
 	gboolean disable_video_on_packetloss;
 
-	janus_rtp_switching_context context;
+	janus_rtp_switching_context context; // used with rewrite_headers
+	gboolean rewrite_headers; // one SSRC, sequence number and timestamp space per stream
+	guint32 rewrite_ssrc[2]; // audio and video, the first SSRC seen
+	guint32 rewrite_ts_offset[2]; // rewritten minus original RTP timestamp, for the sender reports
+	gint8 rewrite_pt[2]; // payload types to put into audio and video packets, -1 to keep them
 	volatile gint hangingup;
 	volatile gint destroyed;
 	janus_refcount ref;
 } rtpforward_session;
 
+static void rtpforward_session_reap(rtpforward_session *session);
+
+
+/* Sessions are spread over several hash tables by the address of their handle, so that creating,
+ * destroying and looking up sessions of different handles rarely wait for the same lock.
+ */
+#ifndef RTPFORWARD_SESSION_SHARDS
+#define RTPFORWARD_SESSION_SHARDS 16
+#endif
+
+typedef struct rtpforward_session_shard {
+	GHashTable *sessions;
+	janus_mutex mutex;
+} rtpforward_session_shard;
 
-static GHashTable *sessions;
-static janus_mutex sessions_mutex = JANUS_MUTEX_INITIALIZER;
+static rtpforward_session_shard session_shards[RTPFORWARD_SESSION_SHARDS];
+
+// Fibonacci hashing, as the low bits of heap addresses are all alike
+static guint32 rtpforward_handle_hash(janus_plugin_session *handle) {
+	return (guint32)(((guint64)GPOINTER_TO_SIZE(handle) * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15)) >> 32);
+}
+
+static rtpforward_session_shard *rtpforward_session_shard_get(janus_plugin_session *handle) {
+	return &session_shards[rtpforward_handle_hash(handle) % RTPFORWARD_SESSION_SHARDS];
+}
 
+/* Destroyed sessions are handed to the reaper thread, which closes their socket and lets go of their timers,
+ * egress worker and capture. The session is freed once the last of them has dropped its reference. Should
+ * sessions be destroyed faster than the reaper keeps up, their sockets would pile up: beyond
+ * RTPFORWARD_REAPER_BACKLOG_MAX, sessions are reaped by the thread which destroys them instead.
+ */
+#define RTPFORWARD_REAPER_BACKLOG_MAX 256
+static GAsyncQueue *reaper_queue = NULL;
+static int reaper_exit; // only its address is used
 
 
 static void rtpforward_session_destroy(rtpforward_session *session) {
@@ -159,11 +950,45 @@ static void rtpforward_session_destroy(rtpforward_session *session) {
 }
 
 
+static void rtpforward_batch_free(rtpforward_batch *batch) {
+	if(!batch)
+		return;
+	g_free(batch->slots);
+	g_free(batch);
+}
+
+static void rtpforward_egress_ring_free(rtpforward_egress_ring *ring) {
+	if(!ring)
+		return;
+	g_free(ring->slots);
+	g_free(ring);
+}
+
 static void rtpforward_session_free(const janus_refcount *session_ref) {
 	rtpforward_session *session = janus_refcount_containerof(session_ref, rtpforward_session, ref);
 	/* Remove the reference to the core plugin session */
 	janus_refcount_decrease(&session->handle->ref);
 	/* This session can be destroyed, free all the resources */
+	rtpforward_batch_free(session->batch);
+	rtpforward_egress_ring_free(session->egress_ring);
+	guint d;
+	for(d = 0; d < session->destination_count; d++)
+		g_free(session->destinations[d].pacer);
+	janus_mutex_destroy(&session->egress_mutex);
+	g_free(session->reorder_video.slots);
+	g_free(session->reorder_audio.slots);
+	janus_mutex_destroy(&session->reorder_mutex);
+	janus_mutex_destroy(&session->keyframe_mutex);
+	g_free(session->gop_cache.arena);
+	janus_mutex_destroy(&session->gop_mutex);
+	janus_mutex_destroy(&session->shm_mutex);
+	rtpforward_frame_assembler_free(session->frames);
+	janus_mutex_destroy(&session->frames_mutex);
+	janus_mutex_destroy(&session->feedback_mutex);
+	if(session->capture) {
+		g_free(session->capture->prefix);
+		g_free(session->capture);
+	}
 	g_free(session);
 }
 
@@ -192,215 +1017,3780 @@ static void rtpforward_message_free(rtpforward_message *msg) {
 #define RTPFORWARD_ERROR_INVALID_SDP			414
 #define RTPFORWARD_ERROR_MISSING_ELEMENT	415
 #define RTPFORWARD_ERROR_UNKNOWN_ERROR		416
+#define RTPFORWARD_ERROR_NO_SUCH_DESTINATION	417
+#define RTPFORWARD_ERROR_TOO_MANY_DESTINATIONS	418
+#define RTPFORWARD_ERROR_CAPTURE_FAILED	419
+#define RTPFORWARD_ERROR_SHM_FAILED	420
+#define RTPFORWARD_ERROR_FRAMES_FAILED	421
+#define RTPFORWARD_ERROR_MUX_FAILED	422
 
 
-int rtpforward_init(janus_callbacks *callback, const char *config_path) {
-	if(g_atomic_int_get(&stopping)) {
-		return -1;
+
+/* Timer wheel */
+
+static void rtpforward_timer_init(rtpforward_timer *timer, void (*callback)(rtpforward_timer *, gint64), void *data, janus_refcount *ref) {
+	memset(timer, 0, sizeof(*timer));
+	timer->callback = callback;
+	timer->data = data;
+	timer->ref = ref;
+}
+
+// must be called with timer_mutex held
+static void rtpforward_timer_unlink(rtpforward_timer *timer) {
+	if(timer->prev)
+		timer->prev->next = timer->next;
+	else
+		timer_wheel[timer->slot] = timer->next;
+	if(timer->next)
+		timer->next->prev = timer->prev;
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->armed = FALSE;
+	timer_count--;
+}
+
+// Arms the timer for the given monotonic time. An already armed timer is moved, as is one which expired but
+// hasn't been called back yet.
+static void rtpforward_timer_schedule(rtpforward_timer *timer, gint64 deadline) {
+	janus_mutex_lock(&timer_mutex);
+	if(timer->armed) {
+		rtpforward_timer_unlink(timer);
+	} else if(timer->ref) {
+		// A firing timer's reference is released by the timer thread
+		janus_refcount_increase(timer->ref);
 	}
+	timer->firing = FALSE;
 
-	if(callback == NULL || config_path == NULL) {
-		/* Invalid arguments */
-		return -1;
+	if(timer_count == 0) {
+		// The wheel was idle: restart it from now
+		timer_wheel_time = janus_get_monotonic_time();
 	}
 
-	sessions = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)rtpforward_session_destroy);
-	messages = g_async_queue_new_full((GDestroyNotify) rtpforward_message_free);
-	gateway = callback;
+	gint64 ticks = (deadline - timer_wheel_time + RTPFORWARD_TIMER_TICK_US - 1) / RTPFORWARD_TIMER_TICK_US;
+	if(ticks < 1)
+		ticks = 1;
+	timer->deadline = deadline;
+	timer->rounds = (guint)((ticks - 1) / RTPFORWARD_TIMER_SLOTS);
+	timer->slot = (timer_wheel_pos + ticks) % RTPFORWARD_TIMER_SLOTS;
+	timer->prev = NULL;
+	timer->next = timer_wheel[timer->slot];
+	if(timer->next)
+		timer->next->prev = timer;
+	timer_wheel[timer->slot] = timer;
+	timer->armed = TRUE;
+
+	if(timer_count++ == 0)
+		janus_condition_signal(&timer_cond);
+	janus_mutex_unlock(&timer_mutex);
+}
 
-	GError *error = NULL;
+// Disarms the timer. One which expired but hasn't been called back yet won't be; a callback already running
+// isn't waited for.
+static void rtpforward_timer_cancel(rtpforward_timer *timer) {
+	janus_mutex_lock(&timer_mutex);
+	gboolean was_armed = timer->armed;
+	if(was_armed)
+		rtpforward_timer_unlink(timer);
+	timer->firing = FALSE;
+	janus_mutex_unlock(&timer_mutex);
+	if(was_armed && timer->ref)
+		janus_refcount_decrease(timer->ref);
+}
 
-	handler_thread = g_thread_try_new("rtpforward message handler thread", rtpforward_handler_thread, NULL, &error);
-	if(error != NULL) {
-		JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the message handler thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
-		return -1;
+/* Thread to fire expired timers. Callbacks run outside of timer_mutex, so they may re-arm themselves, and other
+ * threads may schedule or cancel the expired timers before they are called back.
+ */
+static void *rtpforward_timer_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "%s Starting timer thread\n", RTPFORWARD_NAME);
+	rtpforward_timer *expired = NULL;
+
+	// Not waiting for initialized, which is only set once init has started all threads
+	while(!g_atomic_int_get(&stopping)) {
+		janus_mutex_lock(&timer_mutex);
+		if(timer_count == 0) {
+			// Nothing to do: sleep until a timer is armed (or periodically check for shutdown)
+			janus_condition_wait_until(&timer_cond, &timer_mutex, janus_get_monotonic_time() + G_USEC_PER_SEC);
+			janus_mutex_unlock(&timer_mutex);
+			continue;
+		}
+
+		gint64 now = janus_get_monotonic_time();
+		while(timer_wheel_time + RTPFORWARD_TIMER_TICK_US <= now) {
+			timer_wheel_time += RTPFORWARD_TIMER_TICK_US;
+			timer_wheel_pos = (timer_wheel_pos + 1) % RTPFORWARD_TIMER_SLOTS;
+			rtpforward_timer *timer = timer_wheel[timer_wheel_pos];
+			while(timer) {
+				rtpforward_timer *next = timer->next;
+				if(timer->rounds > 0) {
+					timer->rounds--;
+				} else {
+					rtpforward_timer_unlink(timer);
+					timer->firing = TRUE;
+					timer->expired_next = expired;
+					expired = timer;
+				}
+				timer = next;
+			}
+		}
+		janus_mutex_unlock(&timer_mutex);
+
+		while(expired) {
+			rtpforward_timer *timer = expired;
+			janus_mutex_lock(&timer_mutex);
+			expired = timer->expired_next;
+			timer->expired_next = NULL;
+			// Unless it was cancelled or moved in the meantime
+			gboolean fire = timer->firing;
+			timer->firing = FALSE;
+			janus_mutex_unlock(&timer_mutex);
+			janus_refcount *ref = timer->ref;
+			if(fire)
+				timer->callback(timer, now);
+			if(ref)
+				janus_refcount_decrease(ref);
+		}
+
+		janus_mutex_lock(&timer_mutex);
+		if(timer_count > 0)
+			janus_condition_wait_until(&timer_cond, &timer_mutex, timer_wheel_time + RTPFORWARD_TIMER_TICK_US);
+		janus_mutex_unlock(&timer_mutex);
 	}
 
-	g_atomic_int_set(&initialized, 1);
-	JANUS_LOG(LOG_INFO, "%s initialized!\n", RTPFORWARD_NAME);
-	return 0;
+	JANUS_LOG(LOG_VERB, "%s Leaving timer thread\n", RTPFORWARD_NAME);
+	return NULL;
 }
 
 
-void rtpforward_destroy(void) {
-	JANUS_LOG(LOG_INFO, "%s destroying...\n", RTPFORWARD_NAME);
+/* Egress */
 
-	if(!g_atomic_int_get(&initialized))
-		return;
-	g_atomic_int_set(&stopping, 1);
+static void rtpforward_destination_update(rtpforward_destination *destination) {
+	destination->enabled[STREAM_AUDIO_RTP] = destination->audio;
+	destination->enabled[STREAM_AUDIO_RTCP] = destination->audio && destination->rtcp;
+	destination->enabled[STREAM_VIDEO_RTP] = destination->video;
+	destination->enabled[STREAM_VIDEO_RTCP] = destination->video && destination->rtcp;
+}
 
-	g_async_queue_push(messages, &exit_message);
-	if(handler_thread != NULL) {
-		g_thread_join(handler_thread);
-		handler_thread = NULL;
+// Index of the destination with the given id, or -1. Must be called with egress_mutex held.
+static int rtpforward_destination_find(rtpforward_session *session, guint id) {
+	guint i;
+	for(i = 0; i < session->destination_count; i++) {
+		if(session->destinations[i].id == id)
+			return i;
 	}
-	if(watchdog_thread != NULL) {
-		g_thread_join(watchdog_thread);
-		watchdog_thread = NULL;
+	return -1;
+}
+
+/* Counts a packet handed to the destinations, the frame assembler or the mux. Packets dropped by a full egress
+ * queue, or by the pacers of all destinations they were for, are not counted.
+ */
+static void rtpforward_stats_forwarded(rtpforward_stats *stats, rtpforward_stream stream, int length) {
+	RTPFORWARD_STAT_ADD(stats->packets[stream], 1);
+	RTPFORWARD_STAT_ADD(stats->bytes[stream], length);
+}
+
+static void rtpforward_stats_send_error(rtpforward_stats *stats, int error) {
+	switch(error) {
+		case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+		case EWOULDBLOCK:
+#endif
+			RTPFORWARD_STAT_ADD(stats->errors_eagain, 1);
+			break;
+		case ENOBUFS:
+			RTPFORWARD_STAT_ADD(stats->errors_enobufs, 1);
+			break;
+		case ECONNREFUSED:
+			RTPFORWARD_STAT_ADD(stats->errors_econnrefused, 1);
+			break;
+		default:
+			RTPFORWARD_STAT_ADD(stats->errors_other, 1);
+			break;
 	}
+}
 
-	janus_mutex_lock(&sessions_mutex);
-	g_hash_table_destroy(sessions);
-	janus_mutex_unlock(&sessions_mutex);
-	g_async_queue_unref(messages);
-	messages = NULL;
-	sessions = NULL;
+// Sends all datagrams of the vector with as few sendmmsg() calls as possible
+static void rtpforward_msgvec_send(rtpforward_msgvec *vec, int fd, rtpforward_session *session) {
+	guint sent = 0;
+	while(sent < vec->count) {
+		int res = sendmmsg(fd, vec->msgs + sent, vec->count - sent, 0);
+		if(res < 0) {
+			if(errno == EINTR)
+				continue;
+			struct msghdr *hdr = &vec->msgs[sent].msg_hdr;
+			if(hdr->msg_iovlen > 1) {
+				// Segmentation offload refused (e.g. EIO without checksum offload): send the packets one by one
+				if(vec->gso)
+					JANUS_LOG(LOG_WARN, "%s UDP GSO failed (%s), sending packets individually\n", RTPFORWARD_NAME, strerror(errno));
+				vec->gso = FALSE;
+				size_t i;
+				for(i = 0; i < hdr->msg_iovlen; i++) {
+					if(sendto(fd, hdr->msg_iov[i].iov_base, hdr->msg_iov[i].iov_len, 0, (struct sockaddr *)hdr->msg_name, hdr->msg_namelen) < 0)
+						rtpforward_stats_send_error(&session->stats, errno);
+				}
+			} else {
+				rtpforward_stats_send_error(&session->stats, errno);
+			}
+			// The datagram at the head of the remaining vector failed. Like with sendto(), skip just that one.
+			res = 1;
+		}
+		sent += res;
+	}
+	vec->count = 0;
+	vec->iov_count = 0;
+}
 
-	g_atomic_int_set(&initialized, 0);
-	g_atomic_int_set(&stopping, 0);
+// Appends one packet to the last datagram as another GSO segment, if it fits and goes to the same address
+static gboolean rtpforward_msgvec_append(rtpforward_msgvec *vec, struct sockaddr_in *addr, char *buffer, guint16 length) {
+	if(vec->count == 0 || vec->iov_count == RTPFORWARD_MSGVEC_SIZE)
+		return FALSE;
+	guint i = vec->count - 1;
+	struct msghdr *hdr = &vec->msgs[i].msg_hdr;
+	if(vec->addrs[i].sin_addr.s_addr != addr->sin_addr.s_addr || vec->addrs[i].sin_port != addr->sin_port)
+		return FALSE;
+	if(length > vec->segment_size[i] || hdr->msg_iovlen == RTPFORWARD_GSO_SEGMENTS_MAX ||
+			vec->bytes[i] + length > RTPFORWARD_GSO_BYTES_MAX)
+		return FALSE;
+
+	// The iovecs of the last datagram always end at iov_count
+	guint j = vec->iov_count++;
+	vec->iovs[j].iov_base = buffer;
+	vec->iovs[j].iov_len = length;
+	hdr->msg_iovlen++;
+	vec->bytes[i] += length;
+	if(hdr->msg_iovlen == 2) {
+		hdr->msg_control = vec->control[i];
+		hdr->msg_controllen = sizeof(vec->control[i]);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type = UDP_SEGMENT;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(guint16));
+		memcpy(CMSG_DATA(cmsg), &vec->segment_size[i], sizeof(guint16));
+	}
+	if(length < vec->segment_size[i])
+		vec->segment_size[i] = 0; // a short segment ends the datagram
+	return TRUE;
+}
 
-	JANUS_LOG(LOG_INFO, "%s destroyed!\n", RTPFORWARD_NAME);
+/* Appends one packet of the given stream for one destination, to be sent at once or, if txtime is not 0,
+ * at that monotonic time in nanoseconds. The buffer is referenced, not copied.
+ */
+static void rtpforward_msgvec_push(rtpforward_msgvec *vec, int fd, rtpforward_session *session, rtpforward_destination *destination,
+		rtpforward_stream stream, char *buffer, guint16 length, guint64 txtime) {
+	struct sockaddr_in addr = destination->addr;
+	addr.sin_port = htons(destination->ports[stream]);
+	gboolean gso = vec->gso && stream == STREAM_VIDEO_RTP && txtime == 0;
+	if(gso && rtpforward_msgvec_append(vec, &addr, buffer, length))
+		return;
+	if(vec->count == RTPFORWARD_MSGVEC_SIZE || vec->iov_count == RTPFORWARD_MSGVEC_SIZE)
+		rtpforward_msgvec_send(vec, fd, session);
+	guint i = vec->count++;
+	guint j = vec->iov_count++;
+	vec->addrs[i] = addr;
+	vec->iovs[j].iov_base = buffer;
+	vec->iovs[j].iov_len = length;
+	vec->segment_size[i] = gso ? length : 0;
+	vec->bytes[i] = length;
+	struct msghdr *hdr = &vec->msgs[i].msg_hdr;
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->msg_name = &vec->addrs[i];
+	hdr->msg_namelen = sizeof(struct sockaddr_in);
+	hdr->msg_iov = &vec->iovs[j];
+	hdr->msg_iovlen = 1;
+	if(txtime) {
+		hdr->msg_control = vec->control[i];
+		hdr->msg_controllen = CMSG_SPACE(sizeof(guint64));
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_TXTIME;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(guint64));
+		memcpy(CMSG_DATA(cmsg), &txtime, sizeof(guint64));
+	}
 }
 
-int rtpforward_get_api_compatibility(void) {
-	return JANUS_PLUGIN_API_VERSION;
+
+/* Pacing */
+
+static rtpforward_pacer *rtpforward_pacer_new(guint32 rate_kbps, guint32 burst) {
+	rtpforward_pacer *pacer = g_malloc0(sizeof(rtpforward_pacer));
+	pacer->rate_kbps = rate_kbps;
+	pacer->burst = burst;
+	pacer->tokens = burst;
+	pacer->refilled = janus_get_monotonic_time();
+	return pacer;
 }
 
-int rtpforward_get_version(void) {
-	return RTPFORWARD_VERSION;
+static void rtpforward_pacer_refill(rtpforward_pacer *pacer, gint64 now) {
+	// After a long idle period the bucket is just full: the time beyond that isn't multiplied, so it can't overflow
+	gint64 fill_us = ((gint64)pacer->burst - pacer->tokens) * 8000 / pacer->rate_kbps + 1;
+	gint64 bytes = MIN(now - pacer->refilled, fill_us) * pacer->rate_kbps / 8000;
+	if(pacer->tokens + bytes >= pacer->burst) {
+		pacer->tokens = pacer->burst;
+		pacer->refilled = now;
+	} else if(bytes > 0) {
+		// Only the time worth whole bytes is used up, so slow rates still get their share
+		pacer->tokens += bytes;
+		pacer->refilled += bytes * 8000 / pacer->rate_kbps;
+	}
 }
 
-const char *rtpforward_get_version_string(void) {
-	return RTPFORWARD_VERSION_STRING;
+// Microseconds until there are enough tokens for a packet of the given length
+static gint64 rtpforward_pacer_wait(rtpforward_pacer *pacer, guint16 length) {
+	if(pacer->tokens >= length)
+		return 0;
+	return ((length - pacer->tokens) * 8000 + pacer->rate_kbps - 1) / pacer->rate_kbps;
 }
 
-const char *rtpforward_get_description(void) {
-	return RTPFORWARD_DESCRIPTION;
+static void rtpforward_pacer_delayed(rtpforward_session *session, gint64 delay_us) {
+	RTPFORWARD_STAT_ADD(session->stats.paced_packets, 1);
+	RTPFORWARD_STAT_ADD(session->stats.paced_delay_us_total, delay_us);
+	if((guint64)delay_us > RTPFORWARD_STAT_GET(session->stats.paced_delay_us_max))
+		__atomic_store_n(&session->stats.paced_delay_us_max, delay_us, __ATOMIC_RELAXED);
 }
 
-const char *rtpforward_get_name(void) {
-	return RTPFORWARD_NAME;
+/* Decides when a video RTP packet to a paced destination goes out: now or, if *txtime was set, at that time
+ * (PACER_SEND), later from the pacer's queue (PACER_QUEUED), or not at all (PACER_DROPPED). Callers which can't
+ * attach a transmit time pass NULL. Must be called with egress_mutex held.
+ */
+static rtpforward_pacer_verdict rtpforward_pacer_take(rtpforward_session *session, rtpforward_pacer *pacer, char *buffer, guint16 length, guint64 *txtime) {
+	gint64 now = janus_get_monotonic_time();
+	rtpforward_pacer_refill(pacer, now);
+	if(pacer->count == 0 && pacer->tokens >= length) {
+		pacer->tokens -= length;
+		return PACER_SEND;
+	}
+	if(pacer->count == 0 && txtime && session->txtime) {
+		gint64 wait = rtpforward_pacer_wait(pacer, length);
+		if(wait > RTPFORWARD_PACING_DELAY_MAX_US) {
+			RTPFORWARD_STAT_ADD(session->stats.paced_dropped, 1);
+			return PACER_DROPPED;
+		}
+		// The debt is paid back by the next refills
+		pacer->tokens -= length;
+		*txtime = (guint64)(now + wait) * 1000;
+		rtpforward_pacer_delayed(session, wait);
+		return PACER_SEND;
+	}
+	if(pacer->count == RTPFORWARD_PACING_QUEUE_SIZE || length > RTPFORWARD_MAX_PACKET_SIZE) {
+		RTPFORWARD_STAT_ADD(session->stats.paced_dropped, 1);
+		return PACER_DROPPED;
+	}
+	rtpforward_pacer_slot *slot = &pacer->slots[(pacer->head + pacer->count) % RTPFORWARD_PACING_QUEUE_SIZE];
+	memcpy(slot->buffer, buffer, length);
+	slot->length = length;
+	slot->queued = now;
+	if(pacer->count++ == 0) {
+		gint64 deadline = now + rtpforward_pacer_wait(pacer, length);
+		if(session->pacing_deadline == 0 || deadline < session->pacing_deadline) {
+			session->pacing_deadline = deadline;
+			rtpforward_timer_schedule(&session->pacing_timer, deadline);
+		}
+	}
+	return PACER_QUEUED;
 }
 
-const char *rtpforward_get_author(void) {
-	return RTPFORWARD_AUTHOR;
+/* Stages the queued packets the bucket allows, or all of them, in session->vec. Returns when the next one may go,
+ * or 0 if the queue is empty. Must be called with egress_mutex held.
+ */
+static gint64 rtpforward_pacer_flush(rtpforward_session *session, rtpforward_destination *destination, gint64 now, gboolean all) {
+	rtpforward_pacer *pacer = destination->pacer;
+	rtpforward_pacer_refill(pacer, now);
+	while(pacer->count > 0) {
+		rtpforward_pacer_slot *slot = &pacer->slots[pacer->head];
+		if(!all && pacer->tokens < slot->length)
+			return now + rtpforward_pacer_wait(pacer, slot->length);
+		if(now - slot->queued > RTPFORWARD_PACING_DELAY_MAX_US) {
+			RTPFORWARD_STAT_ADD(session->stats.paced_dropped, 1);
+		} else {
+			pacer->tokens -= slot->length;
+			if(session->sendsockfd >= 0)
+				rtpforward_msgvec_push(&session->vec, session->sendsockfd, session, destination, STREAM_VIDEO_RTP, slot->buffer, slot->length, 0);
+			rtpforward_pacer_delayed(session, now - slot->queued);
+		}
+		// The slot is not reused before the vector has been sent, as that happens under the same lock
+		pacer->head = (pacer->head + 1) % RTPFORWARD_PACING_QUEUE_SIZE;
+		pacer->count--;
+	}
+	return 0;
 }
 
-const char *rtpforward_get_package(void) {
-	return RTPFORWARD_PACKAGE;
+static void rtpforward_pacing_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_session *session = (rtpforward_session *)timer->data;
+	janus_mutex_lock(&session->egress_mutex);
+	session->pacing_deadline = 0;
+	if(!g_atomic_int_get(&session->destroyed)) {
+		gint64 next = 0;
+		guint d;
+		session->vec.gso = session->gso;
+		for(d = 0; d < session->destination_count; d++) {
+			if(!session->destinations[d].pacer)
+				continue;
+			gint64 deadline = rtpforward_pacer_flush(session, &session->destinations[d], now, FALSE);
+			if(deadline && (!next || deadline < next))
+				next = deadline;
+		}
+		if(session->sendsockfd >= 0) {
+			rtpforward_msgvec_send(&session->vec, session->sendsockfd, session);
+			session->gso = session->vec.gso;
+		}
+		if(next) {
+			session->pacing_deadline = next;
+			rtpforward_timer_schedule(timer, next);
+		}
+	}
+	janus_mutex_unlock(&session->egress_mutex);
 }
 
-void rtpforward_create_session(janus_plugin_session *handle, int *error) {
-	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
-		*error = -1;
+/* Sets the pacing of a destination, sending what was queued if pacing is switched off. 0 disables pacing.
+ * Must be called with egress_mutex held.
+ */
+static void rtpforward_pacer_configure(rtpforward_session *session, rtpforward_destination *destination, guint32 rate_kbps, guint32 burst) {
+	if(rate_kbps == 0) {
+		if(!destination->pacer)
+			return;
+		session->vec.gso = session->gso;
+		rtpforward_pacer_flush(session, destination, janus_get_monotonic_time(), TRUE);
+		if(session->sendsockfd >= 0)
+			rtpforward_msgvec_send(&session->vec, session->sendsockfd, session);
+		g_free(destination->pacer);
+		destination->pacer = NULL;
 		return;
 	}
+	if(!destination->pacer) {
+		destination->pacer = rtpforward_pacer_new(rate_kbps, burst);
+		return;
+	}
+	rtpforward_pacer_refill(destination->pacer, janus_get_monotonic_time());
+	destination->pacer->rate_kbps = rate_kbps;
+	destination->pacer->burst = burst;
+	if(destination->pacer->tokens > burst)
+		destination->pacer->tokens = burst;
+}
 
-	rtpforward_session *session = (rtpforward_session *)g_malloc0(sizeof(rtpforward_session));
-	session->handle = handle;
-	janus_refcount_init(&session->ref, rtpforward_session_free);
+/* Appends one packet of the given stream for one destination, unless its pacer holds it back. Returns FALSE if
+ * the pacer dropped it.
+ */
+static gboolean rtpforward_msgvec_add(rtpforward_msgvec *vec, int fd, rtpforward_session *session, rtpforward_destination *destination,
+		rtpforward_stream stream, char *buffer, guint16 length) {
+	guint64 txtime = 0;
+	if(destination->pacer && stream == STREAM_VIDEO_RTP) {
+		rtpforward_pacer_verdict verdict = rtpforward_pacer_take(session, destination->pacer, buffer, length, &txtime);
+		if(verdict != PACER_SEND)
+			return verdict == PACER_QUEUED;
+	}
+	rtpforward_msgvec_push(vec, fd, session, destination, stream, buffer, length, txtime);
+	return TRUE;
+}
 
-	session->sendport_video_rtp = 0;
-	session->sendport_video_rtcp = 0;
-	session->sendport_audio_rtp = 0;
-	session->sendport_audio_rtcp = 0;
+/* Allocates the staging area for batch_size packets, or returns NULL when batching is disabled.
+ * With GSO, video packets are staged up to the end of the frame even without batching.
+ */
+static rtpforward_batch *rtpforward_batch_new(guint size, gboolean gso) {
+	if(size < 2 && gso)
+		size = RTPFORWARD_BATCH_SIZE_MAX;
+	if(size < 2)
+		return NULL;
+	rtpforward_batch *batch = g_malloc0(sizeof(rtpforward_batch));
+	batch->size = size;
+	batch->slots = g_malloc0(size * sizeof(rtpforward_batch_slot));
+	return batch;
+}
 
-	session->sendsockfd = -1;
-	session->sendsockaddr = (struct sockaddr_in){ .sin_family = AF_INET };
+// Sends all staged packets. Must be called with egress_mutex held.
+static void rtpforward_batch_flush(rtpforward_session *session) {
+	rtpforward_batch *batch = session->batch;
+	if(!batch || batch->count == 0)
+		return;
 
-	strcpy(session->negotiate_acodec, "opus");
-	strcpy(session->negotiate_vcodec, "vp8");
+	// One destination after the other, so that GSO can coalesce each one's video packets
+	guint d, i;
+	guint8 outcome[RTPFORWARD_BATCH_SIZE_MAX] = { 0 };
+	session->vec.gso = session->gso;
+	for(d = 0; d < session->destination_count; d++) {
+		rtpforward_destination *destination = &session->destinations[d];
+		for(i = 0; i < batch->count; i++) {
+			rtpforward_batch_slot *slot = &batch->slots[i];
+			if(destination->enabled[slot->stream])
+				outcome[i] |= rtpforward_msgvec_add(&session->vec, session->sendsockfd, session, destination, slot->stream, slot->buffer, slot->length) ?
+					RTPFORWARD_OUTCOME_TAKEN : RTPFORWARD_OUTCOME_DROPPED;
+		}
+	}
+	rtpforward_msgvec_send(&session->vec, session->sendsockfd, session);
+	session->gso = session->vec.gso;
+	for(i = 0; i < batch->count; i++) {
+		if(outcome[i] != RTPFORWARD_OUTCOME_DROPPED)
+			rtpforward_stats_forwarded(&session->stats, batch->slots[i].stream, batch->slots[i].length);
+	}
+	batch->count = 0;
+}
 
-	session->video_enabled = TRUE;
-	session->audio_enabled = TRUE;
-	session->enable_video_on_keyframe = FALSE;
-	session->disable_video_on_packetloss = FALSE;
+static void rtpforward_batch_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_session *session = (rtpforward_session *)timer->data;
+	janus_mutex_lock(&session->egress_mutex);
+	rtpforward_batch *batch = session->batch;
+	if(batch && batch->count > 0 && !g_atomic_int_get(&session->destroyed)) {
+		gint64 deadline = batch->first_queued + session->batch_latency_us;
+		if(deadline <= now) {
+			rtpforward_batch_flush(session);
+		} else {
+			// The batch which armed the timer was already flushed, and a younger one is pending
+			rtpforward_timer_schedule(timer, deadline);
+		}
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+}
 
-	session->seqnr_video_last = 0;
-	session->seqnr_audio_last = 0;
+static rtpforward_egress_ring *rtpforward_egress_ring_new(guint size) {
+	rtpforward_egress_ring *ring = g_malloc0(sizeof(rtpforward_egress_ring));
+	ring->size = size;
+	ring->slots = g_malloc0(size * sizeof(rtpforward_egress_slot));
+	guint i;
+	for(i = 0; i < size; i++)
+		ring->slots[i].sequence = i;
+	return ring;
+}
 
-	session->fir_seqnr = 0;
+// Claims the oldest filled slot, or returns NULL if the ring is empty. The slot must be released after use.
+static rtpforward_egress_slot *rtpforward_egress_ring_claim(rtpforward_egress_ring *ring, guint *position) {
+	guint pos = (guint)g_atomic_int_get(&ring->tail);
+	while(TRUE) {
+		rtpforward_egress_slot *slot = &ring->slots[pos & (ring->size - 1)];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - (pos + 1));
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&ring->tail, (gint)pos, (gint)(pos + 1))) {
+				*position = pos;
+				return slot;
+			}
+		} else if(diff < 0) {
+			return NULL;
+		}
+		pos = (guint)g_atomic_int_get(&ring->tail);
+	}
+}
 
-	session->drop_permille = 0;
-	session->drop_video_packets = 0;
-	session->drop_audio_packets = 0;
+// Hands a claimed slot back to the producer
+static void rtpforward_egress_ring_release(rtpforward_egress_ring *ring, rtpforward_egress_slot *slot, guint position) {
+	g_atomic_int_set(&slot->sequence, (gint)(position + ring->size));
+}
 
-	janus_rtp_switching_context_reset(&session->context);
+// Copies a packet into the next free slot. Several threads may push at once: besides the media thread, the timer
+// thread flushes reorder buffers and the handler threads flush them and replay the GOP cache.
+static gboolean rtpforward_egress_ring_push(rtpforward_egress_ring *ring, rtpforward_stream stream, char *buffer, guint16 length) {
+	gboolean dropped_oldest = FALSE;
+	guint pos = (guint)g_atomic_int_get(&ring->head);
+	while(TRUE) {
+		rtpforward_egress_slot *slot = &ring->slots[pos & (ring->size - 1)];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - pos);
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&ring->head, (gint)pos, (gint)(pos + 1))) {
+				memcpy(slot->buffer, buffer, length);
+				slot->length = length;
+				slot->stream = stream;
+				g_atomic_int_set(&slot->sequence, (gint)(pos + 1));
+				return TRUE;
+			}
+		} else if(diff < 0) {
+			// The ring is full
+			if(egress_overflow == OVERFLOW_DROP_NEWEST || dropped_oldest)
+				break;
+			guint oldest_pos;
+			rtpforward_egress_slot *oldest = rtpforward_egress_ring_claim(ring, &oldest_pos);
+			if(!oldest)
+				break; // all slots are being sent right now
+			rtpforward_egress_ring_release(ring, oldest, oldest_pos);
+			g_atomic_int_inc(&ring->dropped_oldest);
+			dropped_oldest = TRUE;
+		}
+		// Another producer took the slot, or one was freed
+		pos = (guint)g_atomic_int_get(&ring->head);
+	}
+	g_atomic_int_inc(&ring->dropped_newest);
+	return FALSE;
+}
 
-	g_atomic_int_set(&session->destroyed, 0);
-	g_atomic_int_set(&session->hangingup, 0);
+static gboolean rtpforward_egress_ring_is_empty(rtpforward_egress_ring *ring) {
+	return g_atomic_int_get(&ring->head) == g_atomic_int_get(&ring->tail);
+}
 
-	handle->plugin_handle = session;
+static void rtpforward_egress_worker_wake(rtpforward_egress_worker *worker) {
+	if(g_atomic_int_get(&worker->sleeping))
+		eventfd_write(worker->wake_fd, 1);
+}
 
-	janus_mutex_lock(&sessions_mutex);
-	g_hash_table_insert(sessions, handle, session);
-	janus_mutex_unlock(&sessions_mutex);
+// Sends everything queued by one session, in vectors of up to RTPFORWARD_MSGVEC_SIZE packets
+static guint rtpforward_egress_worker_drain(rtpforward_egress_worker *worker, rtpforward_session *session) {
+	rtpforward_egress_ring *ring = session->egress_ring;
+	rtpforward_egress_slot *slots[RTPFORWARD_MSGVEC_SIZE];
+	guint positions[RTPFORWARD_MSGVEC_SIZE];
+	guint total = 0, count, d, i;
+	do {
+		for(count = 0; count < RTPFORWARD_MSGVEC_SIZE; count++) {
+			slots[count] = rtpforward_egress_ring_claim(ring, &positions[count]);
+			if(!slots[count])
+				break;
+		}
+		if(count == 0)
+			break;
 
-	JANUS_LOG(LOG_INFO, "%s Session created.\n", RTPFORWARD_NAME);
-	return;
+		guint8 outcome[RTPFORWARD_MSGVEC_SIZE] = { 0 };
+		janus_mutex_lock(&session->egress_mutex);
+		if(session->sendsockfd >= 0) {
+			worker->vec.gso = session->gso;
+			for(d = 0; d < session->destination_count; d++) {
+				rtpforward_destination *destination = &session->destinations[d];
+				for(i = 0; i < count; i++) {
+					if(destination->enabled[slots[i]->stream])
+						outcome[i] |= rtpforward_msgvec_add(&worker->vec, session->sendsockfd, session, destination, slots[i]->stream, slots[i]->buffer, slots[i]->length) ?
+							RTPFORWARD_OUTCOME_TAKEN : RTPFORWARD_OUTCOME_DROPPED;
+				}
+			}
+			rtpforward_msgvec_send(&worker->vec, session->sendsockfd, session);
+			session->gso = worker->vec.gso;
+		}
+		janus_mutex_unlock(&session->egress_mutex);
+
+		for(i = 0; i < count; i++) {
+			if(outcome[i] != RTPFORWARD_OUTCOME_DROPPED)
+				rtpforward_stats_forwarded(&session->stats, slots[i]->stream, slots[i]->length);
+			rtpforward_egress_ring_release(ring, slots[i], positions[i]);
+		}
+		total += count;
+	} while(count == RTPFORWARD_MSGVEC_SIZE);
+	return total;
 }
 
+static void rtpforward_egress_uring_start(rtpforward_egress_worker *worker) {
+	rtpforward_uring *uring = g_malloc0(sizeof(rtpforward_uring));
+	int res = rtpforward_uring_init(uring, RTPFORWARD_URING_ENTRIES);
+	if(res == 0)
+		res = rtpforward_uring_register_eventfd(uring, worker->wake_fd);
+	if(res < 0) {
+		JANUS_LOG(LOG_WARN, "%s Egress worker thread %u could not set up io_uring (%s), falling back to sendmmsg\n", RTPFORWARD_NAME, worker->id, strerror(-res));
+		rtpforward_uring_exit(uring);
+		g_free(uring);
+		return;
+	}
+	if(uring->send_zc && rtpforward_uring_register_buffers(uring, RTPFORWARD_URING_BUFFERS) < 0)
+		JANUS_LOG(LOG_VERB, "%s Egress worker thread %u can't register buffers, zero-copy sends will pin pages\n", RTPFORWARD_NAME, worker->id);
+
+	int i;
+	for(i = 0; i < RTPFORWARD_URING_ENTRIES; i++)
+		worker->ops[i].next_free = (i + 1 < RTPFORWARD_URING_ENTRIES) ? i + 1 : -1;
+	worker->free_op = 0;
+	worker->free_ops = RTPFORWARD_URING_ENTRIES;
+	worker->inflight = 0;
+	worker->uring = uring;
+	JANUS_LOG(LOG_INFO, "%s Egress worker thread %u uses io_uring with %s\n", RTPFORWARD_NAME, worker->id,
+		uring->send_zc ? "IORING_OP_SEND_ZC" : "IORING_OP_SENDMSG");
+}
 
-void rtpforward_destroy_session(janus_plugin_session *handle, int *error) {
-	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
-		*error = -1;
+// Registers the slots of a newly attached session's ring as a fixed buffer, if possible
+static void rtpforward_egress_uring_add_session(rtpforward_egress_worker *worker, rtpforward_session *session) {
+	session->egress_buffer_index = -1;
+	if(!worker->uring || !worker->uring->buffers)
 		return;
+	int i;
+	for(i = 0; i < RTPFORWARD_URING_BUFFERS; i++) {
+		if(worker->buffer_owners[i] == NULL)
+			break;
 	}
-	janus_mutex_lock(&sessions_mutex);
-	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
-	if(!session) {
-		janus_mutex_unlock(&sessions_mutex);
-		JANUS_LOG(LOG_ERR, "%s rtpforward_destroy_session: No session associated with this handle...\n", RTPFORWARD_NAME);
-		*error = -2;
+	if(i == RTPFORWARD_URING_BUFFERS)
+		return;
+	rtpforward_egress_ring *ring = session->egress_ring;
+	int res = rtpforward_uring_set_buffer(worker->uring, i, ring->slots, ring->size * sizeof(rtpforward_egress_slot));
+	if(res < 0) {
+		JANUS_LOG(LOG_VERB, "%s Could not register egress buffer: %s\n", RTPFORWARD_NAME, strerror(-res));
 		return;
 	}
+	worker->buffer_owners[i] = session;
+	session->egress_buffer_index = i;
+}
 
-	JANUS_LOG(LOG_INFO, "%s Destroy session...\n", RTPFORWARD_NAME);
-	close(session->sendsockfd);
+static void rtpforward_egress_uring_remove_session(rtpforward_egress_worker *worker, rtpforward_session *session) {
+	if(session->egress_buffer_index < 0)
+		return;
+	rtpforward_uring_set_buffer(worker->uring, session->egress_buffer_index, NULL, 0);
+	worker->buffer_owners[session->egress_buffer_index] = NULL;
+	session->egress_buffer_index = -1;
+}
 
-	if(session->relay_thread != NULL) {
-		JANUS_LOG(LOG_INFO, "%s Watchdog: Joining session's relay thread\n", RTPFORWARD_NAME);
-		g_thread_join(session->relay_thread); // blocking
-		session->relay_thread = NULL;
-		JANUS_LOG(LOG_INFO, "%s Watchdog: Session's relay thread joined\n", RTPFORWARD_NAME);
+static void rtpforward_egress_uring_complete(unsigned long long user_data, int res, unsigned flags, void *data) {
+	rtpforward_egress_worker *worker = (rtpforward_egress_worker *)data;
+	rtpforward_uring_op *op = &worker->ops[user_data];
+	if(!(flags & IORING_CQE_F_NOTIF) && res < 0 && worker->uring->send_zc && (res == -EOPNOTSUPP || res == -EINVAL)) {
+		JANUS_LOG(LOG_WARN, "%s Zero-copy send failed (%s), egress worker thread %u falls back to IORING_OP_SENDMSG\n",
+			RTPFORWARD_NAME, strerror(-res), worker->id);
+		worker->uring->send_zc = 0;
 	}
+	if(!(flags & IORING_CQE_F_NOTIF) && res < 0)
+		rtpforward_stats_send_error(&op->session->stats, -res);
+	if(flags & IORING_CQE_F_MORE)
+		return; // the kernel still holds the buffer until the notification
+
+	if(--op->slot->inflight == 0)
+		rtpforward_egress_ring_release(op->session->egress_ring, op->slot, op->position);
+	op->session->egress_inflight--;
+	op->session = NULL;
+	op->slot = NULL;
+	op->next_free = worker->free_op;
+	worker->free_op = (gint)user_data;
+	worker->free_ops++;
+	worker->inflight--;
+}
 
-	g_hash_table_remove(sessions, handle);
-
-	janus_mutex_unlock(&sessions_mutex);
+/* Queues one send operation of the claimed slot to one destination. If the ring has no room left, the
+ * packet is sent right away with sendto() instead. Must be called with egress_mutex held.
+ */
+static void rtpforward_egress_uring_send(rtpforward_egress_worker *worker, rtpforward_session *session, rtpforward_destination *destination,
+		rtpforward_egress_slot *slot, guint position) {
+	rtpforward_uring *uring = worker->uring;
+	struct io_uring_sqe *sqe = rtpforward_uring_get_sqe(uring);
+	if(!sqe) {
+		rtpforward_uring_submit(uring, 0);
+		sqe = rtpforward_uring_get_sqe(uring);
+	}
+	if(!sqe || worker->free_op < 0) {
+		struct sockaddr_in addr = destination->addr;
+		addr.sin_port = htons(destination->ports[slot->stream]);
+		if(sendto(session->sendsockfd, slot->buffer, slot->length, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			rtpforward_stats_send_error(&session->stats, errno);
+		RTPFORWARD_STAT_ADD(session->stats.uring_fallbacks, 1);
+		return;
+	}
 
-	JANUS_LOG(LOG_INFO, "%s Session destroyed.\n", RTPFORWARD_NAME);
-	return;
+	gint index = worker->free_op;
+	rtpforward_uring_op *op = &worker->ops[index];
+	worker->free_op = op->next_free;
+	worker->free_ops--;
+	worker->inflight++;
+	op->session = session;
+	op->slot = slot;
+	op->position = position;
+	op->addr = destination->addr;
+	op->addr.sin_port = htons(destination->ports[slot->stream]);
+	slot->inflight++;
+	session->egress_inflight++;
+
+	if(uring->send_zc) {
+		rtpforward_uring_prep_send_zc(sqe, session->sendsockfd, slot->buffer, slot->length,
+			(struct sockaddr *)&op->addr, sizeof(struct sockaddr_in), session->egress_buffer_index, index);
+	} else {
+		op->iov.iov_base = slot->buffer;
+		op->iov.iov_len = slot->length;
+		memset(&op->msg, 0, sizeof(op->msg));
+		op->msg.msg_name = &op->addr;
+		op->msg.msg_namelen = sizeof(struct sockaddr_in);
+		op->msg.msg_iov = &op->iov;
+		op->msg.msg_iovlen = 1;
+		rtpforward_uring_prep_sendmsg(sqe, session->sendsockfd, &op->msg, index);
+	}
 }
 
-json_t *rtpforward_query_session(janus_plugin_session *handle) {
-	return json_object();
+/* Queues send operations for everything queued by one session, as long as operations are available.
+ * All destinations share the slot's buffer, which is released after the last send has completed.
+ */
+static guint rtpforward_egress_uring_drain(rtpforward_egress_worker *worker, rtpforward_session *session) {
+	rtpforward_egress_ring *ring = session->egress_ring;
+	guint total = 0, d;
+	janus_mutex_lock(&session->egress_mutex);
+	while(worker->free_ops >= MAX(session->destination_count, 1)) {
+		guint position;
+		rtpforward_egress_slot *slot = rtpforward_egress_ring_claim(ring, &position);
+		if(!slot)
+			break;
+		guint8 outcome = 0;
+		for(d = 0; d < session->destination_count && session->sendsockfd >= 0; d++) {
+			rtpforward_destination *destination = &session->destinations[d];
+			if(!destination->enabled[slot->stream])
+				continue;
+			// Paced packets are copied into the pacer and sent by the pacing timer
+			if(destination->pacer && slot->stream == STREAM_VIDEO_RTP) {
+				rtpforward_pacer_verdict verdict = rtpforward_pacer_take(session, destination->pacer, slot->buffer, slot->length, NULL);
+				outcome |= verdict == PACER_DROPPED ? RTPFORWARD_OUTCOME_DROPPED : RTPFORWARD_OUTCOME_TAKEN;
+				if(verdict != PACER_SEND)
+					continue;
+			} else {
+				outcome |= RTPFORWARD_OUTCOME_TAKEN;
+			}
+			rtpforward_egress_uring_send(worker, session, destination, slot, position);
+		}
+		if(outcome != RTPFORWARD_OUTCOME_DROPPED)
+			rtpforward_stats_forwarded(&session->stats, slot->stream, slot->length);
+		if(slot->inflight == 0)
+			rtpforward_egress_ring_release(ring, slot, position);
+		total++;
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+	return total;
 }
 
+/* Thread which sends the packets queued by the sessions attached to it */
+static void *rtpforward_egress_worker_thread(void *data) {
+	rtpforward_egress_worker *worker = (rtpforward_egress_worker *)data;
+	JANUS_LOG(LOG_VERB, "%s Starting egress worker thread %u\n", RTPFORWARD_NAME, worker->id);
+
+	if(worker->cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		int res = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if(res != 0) {
+			JANUS_LOG(LOG_WARN, "%s Could not pin egress worker thread %u to CPU %d: %s\n", RTPFORWARD_NAME, worker->id, worker->cpu, strerror(res));
+		} else {
+			JANUS_LOG(LOG_INFO, "%s Egress worker thread %u pinned to CPU %d\n", RTPFORWARD_NAME, worker->id, worker->cpu);
+		}
+	}
+	if(egress_backend == EGRESS_BACKEND_IO_URING)
+		rtpforward_egress_uring_start(worker);
+
+	GList *l;
+	while(!g_atomic_int_get(&stopping)) {
+		// Take over newly attached sessions
+		janus_mutex_lock(&worker->mutex);
+		GList *attached = worker->attaching;
+		worker->attaching = NULL;
+		janus_mutex_unlock(&worker->mutex);
+		for(l = attached; l; l = l->next)
+			rtpforward_egress_uring_add_session(worker, (rtpforward_session *)l->data);
+		worker->sessions = g_list_concat(worker->sessions, attached);
+
+		guint sent = 0;
+		l = worker->sessions;
+		while(l) {
+			GList *next = l->next;
+			rtpforward_session *session = (rtpforward_session *)l->data;
+			if(g_atomic_int_get(&session->egress_detached)) {
+				// Sends in flight still use the session's ring: wait for their completion
+				if(session->egress_inflight == 0) {
+					rtpforward_egress_uring_remove_session(worker, session);
+					worker->sessions = g_list_delete_link(worker->sessions, l);
+					janus_refcount_decrease(&session->ref);
+				}
+			} else if(worker->uring) {
+				sent += rtpforward_egress_uring_drain(worker, session);
+			} else {
+				sent += rtpforward_egress_worker_drain(worker, session);
+			}
+			l = next;
+		}
+		if(worker->uring) {
+			rtpforward_uring_submit(worker->uring, 0);
+			sent += rtpforward_uring_reap(worker->uring, rtpforward_egress_uring_complete, worker);
+		}
+		if(sent > 0)
+			continue;
 
+		// Nothing to do: go to sleep, unless a producer queued something in the meantime
+		g_atomic_int_set(&worker->sleeping, 1);
+		janus_mutex_lock(&worker->mutex);
+		gboolean idle = (worker->attaching == NULL);
+		janus_mutex_unlock(&worker->mutex);
+		for(l = worker->sessions; l && idle; l = l->next) {
+			rtpforward_session *session = (rtpforward_session *)l->data;
+			if(!rtpforward_egress_ring_is_empty(session->egress_ring) ||
+					(g_atomic_int_get(&session->egress_detached) && session->egress_inflight == 0))
+				idle = FALSE;
+		}
+		if(worker->uring && rtpforward_uring_has_completions(worker->uring))
+			idle = FALSE;
+		if(idle && !g_atomic_int_get(&stopping)) {
+			struct pollfd pfd = { .fd = worker->wake_fd, .events = POLLIN };
+			poll(&pfd, 1, 1000);
+		}
+		eventfd_t value;
+		eventfd_read(worker->wake_fd, &value);
+		g_atomic_int_set(&worker->sleeping, 0);
+	}
 
-struct janus_plugin_result *rtpforward_handle_message(janus_plugin_session *handle, char *transaction, json_t *body, json_t *jsep) {
-	JANUS_LOG(LOG_INFO, "%s rtpforward_handle_message.\n", RTPFORWARD_NAME);
-
-	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
-		// Synchronous
-		return janus_plugin_result_new(JANUS_PLUGIN_ERROR, g_atomic_int_get(&stopping) ? "Shutting down" : "Plugin not initialized", NULL);
+	if(worker->uring) {
+		// Wait for the kernel to give all buffers back before the rings can be freed
+		while(worker->inflight > 0) {
+			if(rtpforward_uring_submit(worker->uring, 1) < 0)
+				break;
+			rtpforward_uring_reap(worker->uring, rtpforward_egress_uring_complete, worker);
+		}
+		rtpforward_uring_exit(worker->uring);
+		g_free(worker->uring);
+		worker->uring = NULL;
+	}
 
+	janus_mutex_lock(&worker->mutex);
+	worker->sessions = g_list_concat(worker->sessions, worker->attaching);
+	worker->attaching = NULL;
+	janus_mutex_unlock(&worker->mutex);
+	for(l = worker->sessions; l; l = l->next)
+		janus_refcount_decrease(&((rtpforward_session *)l->data)->ref);
+	g_list_free(worker->sessions);
+	worker->sessions = NULL;
 
-	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
-	int error_code = 0;
-	char *error_cause = g_malloc0(512);
-	json_t *response = NULL;
+	JANUS_LOG(LOG_VERB, "%s Leaving egress worker thread %u\n", RTPFORWARD_NAME, worker->id);
+	return NULL;
+}
 
-	json_t *enable_video_on_keyframe = json_object_get(body, "enable_video_on_keyframe");
-	if (enable_video_on_keyframe) {
-		session->enable_video_on_keyframe = (gboolean)json_is_true(enable_video_on_keyframe);
-		JANUS_LOG(LOG_INFO, "%s session->enable_video_on_keyframe %s\n", RTPFORWARD_NAME, (session->enable_video_on_keyframe ? "TRUE" : "FALSE"));
+// Parses a list like "2,3" or "2-5" into worker CPU assignments, round-robin
+static void rtpforward_egress_workers_set_cpus(const char *list) {
+	GArray *cpus = g_array_new(FALSE, FALSE, sizeof(int));
+	gchar **items = g_strsplit(list, ",", -1);
+	int i;
+	for(i = 0; items[i] != NULL; i++) {
+		int first = -1, last = -1;
+		int n = sscanf(items[i], "%d-%d", &first, &last);
+		if(n < 1 || first < 0)
+			continue;
+		if(n < 2 || last < first)
+			last = first;
+		for(; first <= last; first++)
+			g_array_append_val(cpus, first);
 	}
+	g_strfreev(items);
+	guint w;
+	for(w = 0; w < egress_threads; w++)
+		egress_workers[w].cpu = cpus->len ? g_array_index(cpus, int, w % cpus->len) : -1;
+	g_array_free(cpus, TRUE);
+}
 
-	json_t *disable_video_on_packetloss = json_object_get(body, "disable_video_on_packetloss");
-	if (disable_video_on_packetloss) {
-		session->disable_video_on_packetloss = (gboolean)json_is_true(disable_video_on_packetloss);
-		JANUS_LOG(LOG_INFO, "%s session->disable_video_on_packetloss %s\n", RTPFORWARD_NAME, (session->disable_video_on_packetloss ? "TRUE" : "FALSE"));
+static int rtpforward_egress_workers_start(const char *cpus) {
+	if(egress_threads == 0)
+		return 0;
+	egress_workers = g_malloc0(egress_threads * sizeof(rtpforward_egress_worker));
+	guint i;
+	for(i = 0; i < egress_threads; i++) {
+		rtpforward_egress_worker *worker = &egress_workers[i];
+		worker->id = i;
+		worker->cpu = -1;
+		worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(worker->wake_fd < 0) {
+			JANUS_LOG(LOG_ERR, "%s Could not create eventfd for egress worker thread %u: %s\n", RTPFORWARD_NAME, i, strerror(errno));
+			return -1;
+		}
+		janus_mutex_init(&worker->mutex);
+	}
+	if(cpus)
+		rtpforward_egress_workers_set_cpus(cpus);
+	for(i = 0; i < egress_threads; i++) {
+		rtpforward_egress_worker *worker = &egress_workers[i];
+		GError *error = NULL;
+		char name[32];
+		g_snprintf(name, sizeof(name), "rtpforward egress %u", i);
+		worker->thread = g_thread_try_new(name, rtpforward_egress_worker_thread, worker, &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch egress worker thread %u...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??", i);
+			g_error_free(error);
+			return -1;
+		}
 	}
+	JANUS_LOG(LOG_INFO, "%s Started %u egress worker threads\n", RTPFORWARD_NAME, egress_threads);
+	return 0;
+}
 
-	json_t *drop_probability = json_object_get(body, "drop_probability");
-	if (drop_probability) {
-		session->drop_permille = (guint16)json_integer_value(drop_probability);
-		JANUS_LOG(LOG_INFO, "%s session->drop_permille=%d\n", RTPFORWARD_NAME, session->drop_permille);
+// Must be called after stopping has been set
+static void rtpforward_egress_workers_stop(void) {
+	if(!egress_workers)
+		return;
+	guint i;
+	for(i = 0; i < egress_threads; i++) {
+		rtpforward_egress_worker *worker = &egress_workers[i];
+		if(worker->thread == NULL)
+			continue;
+		eventfd_write(worker->wake_fd, 1);
+		g_thread_join(worker->thread);
+		worker->thread = NULL;
+	}
+	for(i = 0; i < egress_threads; i++) {
+		if(egress_workers[i].wake_fd >= 0)
+			close(egress_workers[i].wake_fd);
+		janus_mutex_destroy(&egress_workers[i].mutex);
 	}
+	g_free(egress_workers);
+	egress_workers = NULL;
+	egress_threads = 0;
+}
 
-	json_t *drop_video_packets = json_object_get(body, "drop_video_packets");
+// Hands the session over to the next egress worker. The worker keeps a reference until the session is detached.
+static void rtpforward_egress_attach(rtpforward_session *session) {
+	if(!egress_workers || session->egress_worker)
+		return;
+	rtpforward_egress_worker *worker = &egress_workers[egress_next_worker++ % egress_threads];
+	session->egress_worker = worker;
+	g_atomic_pointer_set(&session->egress_ring, rtpforward_egress_ring_new(egress_queue_size));
+	janus_refcount_increase(&session->ref);
+	janus_mutex_lock(&worker->mutex);
+	worker->attaching = g_list_append(worker->attaching, session);
+	janus_mutex_unlock(&worker->mutex);
+	eventfd_write(worker->wake_fd, 1);
+	JANUS_LOG(LOG_INFO, "%s Session attached to egress worker thread %u\n", RTPFORWARD_NAME, worker->id);
+}
+
+static void rtpforward_egress_detach(rtpforward_session *session) {
+	rtpforward_egress_worker *worker = session->egress_worker;
+	if(!worker)
+		return;
+	g_atomic_int_set(&session->egress_detached, 1);
+	eventfd_write(worker->wake_fd, 1);
+}
+
+/* Packet capture */
+
+// Copies a forwarded packet into the capture ring. Never blocks: if the ring is full, the packet is only counted.
+static void rtpforward_capture_push(rtpforward_session *session, rtpforward_capture *capture, rtpforward_stream stream, char *buffer, int length) {
+	if(length > RTPFORWARD_MAX_PACKET_SIZE) {
+		RTPFORWARD_STAT_ADD(session->stats.capture_dropped, 1);
+		return;
+	}
+	guint position = (guint)g_atomic_int_get(&capture->head);
+	rtpforward_capture_slot *slot;
+	while(TRUE) {
+		slot = &capture->slots[position & (RTPFORWARD_CAPTURE_QUEUE_SIZE - 1)];
+		gint diff = (gint)((guint)g_atomic_int_get(&slot->sequence) - position);
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&capture->head, (gint)position, (gint)(position + 1)))
+				break;
+		} else if(diff < 0) {
+			RTPFORWARD_STAT_ADD(session->stats.capture_dropped, 1);
+			return;
+		}
+		position = (guint)g_atomic_int_get(&capture->head);
+	}
+	slot->generation = (guint)g_atomic_int_get(&capture->generation);
+	slot->time = g_get_real_time();
+	slot->stream = stream;
+	slot->length = (guint16)length;
+	memcpy(slot->buffer, buffer, length);
+	g_atomic_int_set(&slot->sequence, (gint)(position + 1));
+}
+
+static inline void rtpforward_capture_packet(rtpforward_session *session, rtpforward_stream stream, char *buffer, int length) {
+	rtpforward_capture *capture = (rtpforward_capture *)g_atomic_pointer_get(&session->capture);
+	if(capture && g_atomic_int_get(&capture->state) == CAPTURE_RUNNING)
+		rtpforward_capture_push(session, capture, stream, buffer, length);
+}
+
+// Unmaps the current file and cuts it down to what has been written
+static void rtpforward_capture_close_file(rtpforward_capture *capture) {
+	if(capture->fd < 0)
+		return;
+	munmap(capture->map, capture->file_size);
+	if(ftruncate(capture->fd, capture->used) < 0)
+		JANUS_LOG(LOG_WARN, "%s Could not truncate the capture file: %s\n", RTPFORWARD_NAME, strerror(errno));
+	close(capture->fd);
+	capture->fd = -1;
+	capture->map = NULL;
+	capture->used = 0;
+}
+
+/* Creates the next file which doesn't exist yet at its full size, maps it, and writes the pcap header.
+ * Returns -1 on failure.
+ */
+static int rtpforward_capture_open_file(rtpforward_capture *capture) {
+	char *filename = NULL;
+	int fd = -1;
+	while(capture->file_index < RTPFORWARD_CAPTURE_FILES_MAX) {
+		g_free(filename);
+		filename = g_strdup_printf("%s/%s-%04u.pcap", capture_dir, capture->prefix, capture->file_index++);
+		// Earlier captures, and whatever else is there, are left alone
+		fd = open(filename, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+		if(fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if(fd < 0) {
+		JANUS_LOG(LOG_ERR, "%s Could not create capture file %s: %s\n", RTPFORWARD_NAME,
+			filename ? filename : capture->prefix, filename ? strerror(errno) : "too many files");
+		g_free(filename);
+		return -1;
+	}
+	void *map = MAP_FAILED;
+	if(ftruncate(fd, capture->file_size) == 0)
+		map = mmap(NULL, capture->file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		JANUS_LOG(LOG_ERR, "%s Could not map capture file %s: %s\n", RTPFORWARD_NAME, filename, strerror(errno));
+		close(fd);
+		unlink(filename);
+		g_free(filename);
+		return -1;
+	}
+	// Native byte order, as told by the magic number; microsecond timestamps
+	rtpforward_pcap_header header = { 0xa1b2c3d4, 2, 4, 0, 0, 65535, RTPFORWARD_PCAP_LINKTYPE_IPV4 };
+	memcpy(map, &header, sizeof(header));
+	capture->fd = fd;
+	capture->map = (guint8 *)map;
+	capture->used = sizeof(header);
+	capture->file_started = janus_get_monotonic_time();
+	JANUS_LOG(LOG_VERB, "%s Capturing to %s\n", RTPFORWARD_NAME, filename);
+	g_free(filename);
+	return 0;
+}
+
+static guint16 rtpforward_ipv4_checksum(const guint8 *header) {
+	guint32 sum = 0;
+	int i;
+	for(i = 0; i < 20; i += 2)
+		sum += (header[i] << 8) | header[i + 1];
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return (guint16)~sum;
+}
+
+static void rtpforward_capture_write(rtpforward_capture *capture, rtpforward_capture_slot *slot) {
+	guint32 length = RTPFORWARD_CAPTURE_HEADERS_SIZE + slot->length;
+	rtpforward_pcap_record record = {
+		(guint32)(slot->time / G_USEC_PER_SEC), (guint32)(slot->time % G_USEC_PER_SEC), length, length
+	};
+	guint8 *p = capture->map + capture->used;
+	memcpy(p, &record, sizeof(record));
+	p += sizeof(record);
+	memset(p, 0, RTPFORWARD_CAPTURE_HEADERS_SIZE);
+	// IPv4 without options, from 0.0.0.0, don't fragment, TTL 64, UDP
+	p[0] = 0x45;
+	p[2] = length >> 8;
+	p[3] = length & 0xff;
+	p[6] = 0x40;
+	p[8] = 64;
+	p[9] = IPPROTO_UDP;
+	memcpy(p + 16, &capture->addr, 4);
+	guint16 checksum = rtpforward_ipv4_checksum(p);
+	p[10] = checksum >> 8;
+	p[11] = checksum & 0xff;
+	// UDP from and to the destination port, without checksum
+	guint16 port = htons(capture->ports[slot->stream]);
+	guint16 udp_length = htons(8 + slot->length);
+	memcpy(p + 20, &port, sizeof(port));
+	memcpy(p + 22, &port, sizeof(port));
+	memcpy(p + 24, &udp_length, sizeof(udp_length));
+	memcpy(p + RTPFORWARD_CAPTURE_HEADERS_SIZE, slot->buffer, slot->length);
+	capture->used += sizeof(record) + length;
+}
+
+// Writes out whatever the ring holds, rotating files as needed. Runs on the capture thread.
+static void rtpforward_capture_drain(rtpforward_session *session, rtpforward_capture *capture) {
+	guint generation = (guint)g_atomic_int_get(&capture->generation);
+	while(TRUE) {
+		rtpforward_capture_slot *slot = &capture->slots[capture->tail & (RTPFORWARD_CAPTURE_QUEUE_SIZE - 1)];
+		if((guint)g_atomic_int_get(&slot->sequence) != capture->tail + 1)
+			break; // empty, or a producer is still copying
+		if(slot->generation == generation) {
+			gsize needed = sizeof(rtpforward_pcap_record) + RTPFORWARD_CAPTURE_HEADERS_SIZE + slot->length;
+			if(capture->fd >= 0 && (capture->used + needed > capture->file_size || (capture->file_duration_us > 0 &&
+					janus_get_monotonic_time() - capture->file_started >= capture->file_duration_us))) {
+				rtpforward_capture_close_file(capture);
+				if(rtpforward_capture_open_file(capture) < 0 &&
+						g_atomic_int_compare_and_exchange(&capture->state, CAPTURE_RUNNING, CAPTURE_STOPPING)) {
+					// Rather than drop every packet from now on, end the capture, which can then be started again
+					JANUS_LOG(LOG_ERR, "%s Capture to %s ended, the next file could not be created\n", RTPFORWARD_NAME, capture->prefix);
+					RTPFORWARD_STAT_ADD(session->stats.capture_failures, 1);
+				}
+			}
+			if(capture->fd >= 0 && capture->used + needed <= capture->file_size) {
+				rtpforward_capture_write(capture, slot);
+				RTPFORWARD_STAT_ADD(session->stats.capture_packets, 1);
+			} else {
+				RTPFORWARD_STAT_ADD(session->stats.capture_dropped, 1);
+			}
+		}
+		g_atomic_int_set(&slot->sequence, (gint)(capture->tail + RTPFORWARD_CAPTURE_QUEUE_SIZE));
+		capture->tail++;
+	}
+}
+
+// Finishes a capture. Must be called with capture_mutex held; drops the session's reference.
+static void rtpforward_capture_finish(rtpforward_session *session) {
+	rtpforward_capture *capture = session->capture;
+	rtpforward_capture_drain(session, capture);
+	rtpforward_capture_close_file(capture);
+	g_atomic_int_set(&capture->state, CAPTURE_IDLE);
+	capture_sessions = g_list_remove(capture_sessions, session);
+	JANUS_LOG(LOG_INFO, "%s Capture to %s finished\n", RTPFORWARD_NAME, capture->prefix);
+	janus_refcount_decrease(&session->ref);
+}
+
+static void *rtpforward_capture_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "%s Starting capture thread\n", RTPFORWARD_NAME);
+	janus_mutex_lock(&capture_mutex);
+	while(!g_atomic_int_get(&stopping)) {
+		if(!capture_sessions) {
+			janus_condition_wait_until(&capture_cond, &capture_mutex, janus_get_monotonic_time() + G_USEC_PER_SEC);
+			continue;
+		}
+		GList *l = capture_sessions;
+		while(l) {
+			rtpforward_session *session = (rtpforward_session *)l->data;
+			l = l->next;
+			if(g_atomic_int_get(&session->capture->state) == CAPTURE_STOPPING)
+				rtpforward_capture_finish(session);
+			else
+				rtpforward_capture_drain(session, session->capture);
+		}
+		janus_condition_wait_until(&capture_cond, &capture_mutex, janus_get_monotonic_time() + RTPFORWARD_CAPTURE_WRITE_INTERVAL_US);
+	}
+	while(capture_sessions)
+		rtpforward_capture_finish((rtpforward_session *)capture_sessions->data);
+	janus_mutex_unlock(&capture_mutex);
+	JANUS_LOG(LOG_VERB, "%s Leaving capture thread\n", RTPFORWARD_NAME);
+	return NULL;
+}
+
+/* Starts capturing into <prefix>-0000.pcap, <prefix>-0001.pcap and so on in capture_dir, prefix being name
+ * without ".pcap", skipping the files which exist. The first file is created right away so errors can be
+ * reported. Returns -1 with error_cause set on failure.
+ */
+static int rtpforward_capture_start(rtpforward_session *session, const char *name, gsize file_size, gint64 file_duration_us, char *error_cause) {
+	if(!capture_dir) {
+		g_snprintf(error_cause, 512, "Captures are disabled (no capture_dir is configured)");
+		return -1;
+	}
+	janus_mutex_lock(&capture_mutex);
+	rtpforward_capture *capture = session->capture;
+	if(!capture) {
+		capture = (rtpforward_capture *)g_malloc0(sizeof(rtpforward_capture));
+		guint i;
+		for(i = 0; i < RTPFORWARD_CAPTURE_QUEUE_SIZE; i++)
+			capture->slots[i].sequence = (gint)i;
+		capture->fd = -1;
+	} else if(g_atomic_int_get(&capture->state) != CAPTURE_IDLE) {
+		janus_mutex_unlock(&capture_mutex);
+		g_snprintf(error_cause, 512, "Already capturing to %s", capture->prefix);
+		return -1;
+	}
+	g_free(capture->prefix);
+	capture->prefix = g_strdup(name);
+	if(g_str_has_suffix(capture->prefix, ".pcap"))
+		capture->prefix[strlen(capture->prefix) - strlen(".pcap")] = '\0';
+	capture->file_index = 0;
+	capture->file_size = file_size;
+	capture->file_duration_us = file_duration_us;
+	janus_mutex_lock(&session->egress_mutex);
+	memset(&capture->addr, 0, sizeof(capture->addr));
+	memset(capture->ports, 0, sizeof(capture->ports));
+	if(session->destination_count > 0) {
+		capture->addr = session->destinations[0].addr.sin_addr;
+		memcpy(capture->ports, session->destinations[0].ports, sizeof(capture->ports));
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+	if(rtpforward_capture_open_file(capture) < 0) {
+		if(!session->capture) {
+			g_free(capture->prefix);
+			g_free(capture);
+		}
+		janus_mutex_unlock(&capture_mutex);
+		g_snprintf(error_cause, 512, "Could not create the capture file for %s in %s", name, capture_dir);
+		return -1;
+	}
+	g_atomic_int_inc(&capture->generation);
+	g_atomic_pointer_set(&session->capture, capture);
+	g_atomic_int_set(&capture->state, CAPTURE_RUNNING);
+	janus_refcount_increase(&session->ref);
+	capture_sessions = g_list_append(capture_sessions, session);
+	janus_condition_signal(&capture_cond);
+	janus_mutex_unlock(&capture_mutex);
+	return 0;
+}
+
+// Asks the capture thread to finish the running capture. Returns FALSE if there is none.
+static gboolean rtpforward_capture_stop(rtpforward_session *session) {
+	rtpforward_capture *capture = (rtpforward_capture *)g_atomic_pointer_get(&session->capture);
+	if(!capture || !g_atomic_int_compare_and_exchange(&capture->state, CAPTURE_RUNNING, CAPTURE_STOPPING))
+		return FALSE;
+	janus_mutex_lock(&capture_mutex);
+	janus_condition_signal(&capture_cond);
+	janus_mutex_unlock(&capture_mutex);
+	return TRUE;
+}
+
+
+/* Shared-memory egress */
+
+static void rtpforward_shm_wake_thread(void) {
+	guint64 one = 1;
+	if(write(shm_eventfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		JANUS_LOG(LOG_WARN, "%s Could not wake up the shm thread: %s\n", RTPFORWARD_NAME, strerror(errno));
+}
+
+static void rtpforward_shm_listener_free(rtpforward_shm_listener *listener) {
+	close(listener->fd);
+	unlink(listener->path);
+	close(listener->memfd);
+	JANUS_LOG(LOG_VERB, "%s Closed shared-memory socket %s\n", RTPFORWARD_NAME, listener->path);
+	g_free(listener->path);
+	g_free(listener);
+}
+
+// Passes the memfd to the next client and hangs up; the client maps the ring on its own
+static void rtpforward_shm_accept(rtpforward_shm_listener *listener) {
+	int client = accept4(listener->fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if(client < 0) {
+		if(errno != EAGAIN && errno != EWOULDBLOCK)
+			JANUS_LOG(LOG_WARN, "%s Could not accept on %s: %s\n", RTPFORWARD_NAME, listener->path, strerror(errno));
+		return;
+	}
+	char byte = 0;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	memset(&control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &listener->memfd, sizeof(int));
+	if(sendmsg(client, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+		JANUS_LOG(LOG_WARN, "%s Could not pass the ring on %s: %s\n", RTPFORWARD_NAME, listener->path, strerror(errno));
+	close(client);
+}
+
+static void *rtpforward_shm_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "%s Starting shm thread\n", RTPFORWARD_NAME);
+	struct pollfd *fds = NULL;
+	rtpforward_shm_listener **polled = NULL;
+	guint allocated = 0;
+	while(!g_atomic_int_get(&stopping)) {
+		janus_mutex_lock(&shm_listeners_mutex);
+		GList *l = shm_listeners;
+		while(l) {
+			rtpforward_shm_listener *listener = (rtpforward_shm_listener *)l->data;
+			GList *next = l->next;
+			if(g_atomic_int_get(&listener->closing)) {
+				shm_listeners = g_list_delete_link(shm_listeners, l);
+				rtpforward_shm_listener_free(listener);
+			}
+			l = next;
+		}
+		guint count = g_list_length(shm_listeners) + 1, i = 1;
+		if(count > allocated) {
+			allocated = count * 2;
+			fds = g_realloc(fds, allocated * sizeof(struct pollfd));
+			polled = g_realloc(polled, allocated * sizeof(rtpforward_shm_listener *));
+		}
+		fds[0].fd = shm_eventfd;
+		fds[0].events = POLLIN;
+		for(l = shm_listeners; l; l = l->next, i++) {
+			polled[i] = (rtpforward_shm_listener *)l->data;
+			fds[i].fd = polled[i]->fd;
+			fds[i].events = POLLIN;
+		}
+		janus_mutex_unlock(&shm_listeners_mutex);
+		// Only this thread frees listeners, so the polled ones stay valid
+		if(poll(fds, count, 1000) <= 0)
+			continue;
+		if(fds[0].revents & POLLIN) {
+			guint64 value;
+			if(read(shm_eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+				JANUS_LOG(LOG_WARN, "%s Could not read the shm eventfd: %s\n", RTPFORWARD_NAME, strerror(errno));
+		}
+		for(i = 1; i < count; i++) {
+			if(fds[i].revents & POLLIN)
+				rtpforward_shm_accept(polled[i]);
+		}
+	}
+	janus_mutex_lock(&shm_listeners_mutex);
+	g_list_free_full(shm_listeners, (GDestroyNotify)rtpforward_shm_listener_free);
+	shm_listeners = NULL;
+	janus_mutex_unlock(&shm_listeners_mutex);
+	g_free(fds);
+	g_free(polled);
+	JANUS_LOG(LOG_VERB, "%s Leaving shm thread\n", RTPFORWARD_NAME);
+	return NULL;
+}
+
+static rtpforward_shm_listener *rtpforward_shm_listen(int memfd, const char *path, char *error_cause) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address.sun_path)) {
+		g_snprintf(error_cause, 512, "Socket path too long: %s", path);
+		return NULL;
+	}
+	g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		g_snprintf(error_cause, 512, "Could not listen on %s: %s", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return NULL;
+	}
+	// Whoever connects gets all the media: only Janus' own user and group may. Done before listening, as until
+	// then nobody can connect.
+	if(chmod(path, RTPFORWARD_SHM_SOCKET_MODE) < 0 || listen(fd, 16) < 0) {
+		g_snprintf(error_cause, 512, "Could not listen on %s: %s", path, strerror(errno));
+		close(fd);
+		unlink(path);
+		return NULL;
+	}
+	rtpforward_shm_listener *listener = (rtpforward_shm_listener *)g_malloc0(sizeof(rtpforward_shm_listener));
+	listener->fd = fd;
+	listener->memfd = fcntl(memfd, F_DUPFD_CLOEXEC, 0);
+	listener->path = g_strdup(path);
+	if(listener->memfd < 0) {
+		g_snprintf(error_cause, 512, "Could not duplicate the ring for %s: %s", path, strerror(errno));
+		rtpforward_shm_listener_free(listener);
+		return NULL;
+	}
+	return listener;
+}
+
+static void rtpforward_shm_free(rtpforward_shm *shm) {
+	if(shm->mapping)
+		munmap(shm->mapping, shm->size);
+	if(shm->memfd >= 0)
+		close(shm->memfd);
+	g_free(shm);
+}
+
+/* Creates the session's ring in a sealed memfd, and if socket_path is given, a Unix socket passing it on.
+ * Returns -1 with error_cause set on failure.
+ */
+static int rtpforward_shm_start(rtpforward_session *session, guint32 slot_count, const char *socket_path, char *error_cause) {
+	janus_mutex_lock(&session->shm_mutex);
+	if(session->shm) {
+		janus_mutex_unlock(&session->shm_mutex);
+		g_snprintf(error_cause, 512, "Shared memory already started");
+		return -1;
+	}
+	rtpforward_shm *shm = (rtpforward_shm *)g_malloc0(sizeof(rtpforward_shm));
+	shm->size = RTPFORWARD_SHM_SIZE(slot_count);
+	// Sealed, so that no reader can shrink it under the others
+	shm->memfd = memfd_create("rtpforward", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if(shm->memfd < 0 || ftruncate(shm->memfd, shm->size) < 0 ||
+			fcntl(shm->memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+		g_snprintf(error_cause, 512, "Could not create the shared memory: %s", strerror(errno));
+		rtpforward_shm_free(shm);
+		janus_mutex_unlock(&session->shm_mutex);
+		return -1;
+	}
+	void *mapping = mmap(NULL, shm->size, PROT_READ | PROT_WRITE, MAP_SHARED, shm->memfd, 0);
+	if(mapping == MAP_FAILED) {
+		g_snprintf(error_cause, 512, "Could not map the shared memory: %s", strerror(errno));
+		rtpforward_shm_free(shm);
+		janus_mutex_unlock(&session->shm_mutex);
+		return -1;
+	}
+	shm->mapping = mapping;
+	rtpforward_shm_ring_init(&shm->writer, mapping, slot_count);
+	if(socket_path) {
+		shm->listener = rtpforward_shm_listen(shm->memfd, socket_path, error_cause);
+		if(!shm->listener) {
+			rtpforward_shm_free(shm);
+			janus_mutex_unlock(&session->shm_mutex);
+			return -1;
+		}
+		janus_mutex_lock(&shm_listeners_mutex);
+		shm_listeners = g_list_append(shm_listeners, shm->listener);
+		janus_mutex_unlock(&shm_listeners_mutex);
+		rtpforward_shm_wake_thread();
+	}
+	g_atomic_pointer_set(&session->shm, shm);
+	janus_mutex_unlock(&session->shm_mutex);
+	return 0;
+}
+
+/* Stops writing to the ring and closes its socket. Readers keep their mappings, but get no more packets.
+ * Returns FALSE if it wasn't started.
+ */
+static gboolean rtpforward_shm_stop(rtpforward_session *session) {
+	janus_mutex_lock(&session->shm_mutex);
+	rtpforward_shm *shm = session->shm;
+	g_atomic_pointer_set(&session->shm, NULL);
+	janus_mutex_unlock(&session->shm_mutex);
+	if(!shm)
+		return FALSE;
+	if(shm->listener) {
+		g_atomic_int_set(&shm->listener->closing, 1); // freed by the shm thread
+		rtpforward_shm_wake_thread();
+	}
+	rtpforward_shm_free(shm);
+	return TRUE;
+}
+
+static inline void rtpforward_shm_write(rtpforward_session *session, rtpforward_stream stream, char *buffer, int length, gboolean end_of_frame) {
+	if(!g_atomic_pointer_get(&session->shm))
+		return;
+	janus_mutex_lock(&session->shm_mutex);
+	rtpforward_shm *shm = session->shm;
+	if(shm) {
+		int res = rtpforward_shm_ring_write(&shm->writer, stream, end_of_frame ? RTPFORWARD_SHM_FLAG_END_OF_FRAME : 0,
+			janus_get_monotonic_time(), buffer, (guint16)MIN(length, G_MAXUINT16));
+		if(res < 0) {
+			RTPFORWARD_STAT_ADD(session->stats.shm_dropped, 1);
+		} else {
+			RTPFORWARD_STAT_ADD(session->stats.shm_packets, 1);
+			if(res > 0)
+				syscall(SYS_futex, &shm->writer.header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+		}
+	}
+	janus_mutex_unlock(&session->shm_mutex);
+}
+
+
+/* Frame mode */
+
+static void rtpforward_frame_assembler_free(rtpforward_frame_assembler *frames) {
+	if(!frames)
+		return;
+	if(frames->socket >= 0)
+		close(frames->socket);
+	g_free(frames->socket_path);
+	g_free(frames->arena);
+	g_free(frames);
+}
+
+/* Allocates an assembler for frames of up to max_kb, and connects to the SOCK_SEQPACKET socket at socket_path
+ * if given. Returns NULL with error_cause set on failure.
+ */
+static rtpforward_frame_assembler *rtpforward_frame_assembler_new(guint32 max_kb, const char *socket_path, char *error_cause) {
+	rtpforward_frame_assembler *frames = (rtpforward_frame_assembler *)g_malloc0(sizeof(rtpforward_frame_assembler));
+	frames->size = (gsize)max_kb * 1024;
+	frames->arena = g_malloc(RTPFORWARD_FRAME_HEADER_SIZE + frames->size);
+	frames->socket = -1;
+	if(!socket_path)
+		return frames;
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(address.sun_path)) {
+		g_snprintf(error_cause, 512, "Socket path too long: %s", socket_path);
+		rtpforward_frame_assembler_free(frames);
+		return NULL;
+	}
+	g_strlcpy(address.sun_path, socket_path, sizeof(address.sun_path));
+	frames->socket_path = g_strdup(socket_path);
+	frames->socket = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(frames->socket < 0 || connect(frames->socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		g_snprintf(error_cause, 512, "Could not connect to %s: %s", socket_path, strerror(errno));
+		rtpforward_frame_assembler_free(frames);
+		return NULL;
+	}
+	// A record must fit in the send buffer as a whole; the kernel caps this at net.core.wmem_max
+	int sndbuf = (int)MIN((gsize)G_MAXINT32 / 2, 2 * (RTPFORWARD_FRAME_HEADER_SIZE + frames->size));
+	setsockopt(frames->socket, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+	return frames;
+}
+
+static gboolean rtpforward_frame_append(rtpforward_frame_assembler *frames, const guint8 *data, gsize length) {
+	if(frames->length + length > frames->size)
+		return FALSE;
+	memcpy(frames->arena + RTPFORWARD_FRAME_HEADER_SIZE + frames->length, data, length);
+	frames->length += length;
+	return TRUE;
+}
+
+static gboolean rtpforward_frame_append_nal(rtpforward_frame_assembler *frames, const guint8 *nal, gsize length) {
+	static const guint8 start_code[4] = { 0, 0, 0, 1 };
+	guint8 type = nal[0] & 0x1f;
+	if(type == 5 || type == 7)
+		frames->keyframe = TRUE;
+	return rtpforward_frame_append(frames, start_code, sizeof(start_code)) && rtpforward_frame_append(frames, nal, length);
+}
+
+/* Returns the size of the VP8 payload descriptor, or -1 if it is truncated. */
+static int rtpforward_vp8_descriptor_size(const guint8 *payload, int length) {
+	int i = 1;
+	if(payload[0] & 0x80) {
+		if(length < 2)
+			return -1;
+		guint8 x = payload[1];
+		i = 2;
+		if(x & 0x80) {
+			if(i >= length)
+				return -1;
+			i += (payload[i] & 0x80) ? 2 : 1; // 7 or 15 bit PictureID
+		}
+		if(x & 0x40)
+			i++; // TL0PICIDX
+		if(x & 0x30)
+			i++; // TID, KEYIDX
+	}
+	return i < length ? i : -1;
+}
+
+/* Returns the size of the VP9 payload descriptor (flexible or not, with a scalability structure or not), or -1
+ * if it is truncated.
+ */
+static int rtpforward_vp9_descriptor_size(const guint8 *payload, int length) {
+	guint8 flags = payload[0];
+	int i = 1;
+	if(flags & 0x80) {
+		if(i >= length)
+			return -1;
+		i += (payload[i] & 0x80) ? 2 : 1; // 7 or 15 bit PictureID
+	}
+	if(flags & 0x20)
+		i += (flags & 0x10) ? 1 : 2; // layer indices, and TL0PICIDX in non-flexible mode
+	if((flags & 0x10) && (flags & 0x40)) {
+		int diffs = 0;
+		gboolean more;
+		do {
+			if(i >= length)
+				return -1;
+			more = payload[i++] & 0x01;
+		} while(more && ++diffs < 3);
+	}
+	if(flags & 0x02) {
+		if(i >= length)
+			return -1;
+		guint8 ss = payload[i++];
+		int spatial_layers = (ss >> 5) + 1;
+		if(ss & 0x10)
+			i += 4 * spatial_layers; // resolutions
+		if(ss & 0x08) {
+			if(i >= length)
+				return -1;
+			int pictures = payload[i++];
+			while(pictures-- > 0) {
+				if(i >= length)
+					return -1;
+				i += 1 + ((payload[i] >> 2) & 0x03);
+			}
+		}
+	}
+	return i < length ? i : -1;
+}
+
+static gboolean rtpforward_vp9_is_keyframe(const guint8 *frame) {
+	if((frame[0] >> 6) != 2)
+		return FALSE; // no frame marker
+	int profile = ((frame[0] >> 5) & 0x01) | (((frame[0] >> 4) & 0x01) << 1);
+	int bit = profile == 3 ? 5 : 4; // counted from the most significant bit, after the reserved one of profile 3
+	if((frame[0] >> (7 - bit)) & 0x01)
+		return FALSE; // show_existing_frame
+	bit++;
+	return ((frame[0] >> (7 - bit)) & 0x01) == 0;
+}
+
+/* Whether the payload may start a frame. For H.264 this also needs the previous frame to have ended right
+ * before it, as nothing in the payload marks the first packet of an access unit.
+ */
+static gboolean rtpforward_frame_starts(rtpforward_session *session, const guint8 *payload, int length) {
+	switch(session->vcodec) {
+		case CODEC_VP8:
+			return (payload[0] & 0x10) && (payload[0] & 0x07) == 0;
+		case CODEC_VP9:
+			return (payload[0] & 0x08) != 0;
+		case CODEC_H264:
+			return (payload[0] & 0x1f) != 28 || (length >= 2 && (payload[1] & 0x80));
+		default:
+			return FALSE;
+	}
+}
+
+/* Appends the frame data in the payload. Returns FALSE if it is malformed, of a packetization we don't handle,
+ * or doesn't fit.
+ */
+static gboolean rtpforward_frame_depacketize(rtpforward_session *session, rtpforward_frame_assembler *frames,
+		const guint8 *payload, int length) {
+	int offset;
+	switch(session->vcodec) {
+		case CODEC_VP8:
+			offset = rtpforward_vp8_descriptor_size(payload, length);
+			if(offset < 0)
+				return FALSE;
+			if(frames->length == 0)
+				frames->keyframe = (payload[offset] & 0x01) == 0;
+			return rtpforward_frame_append(frames, payload + offset, length - offset);
+		case CODEC_VP9:
+			offset = rtpforward_vp9_descriptor_size(payload, length);
+			if(offset < 0)
+				return FALSE;
+			if(frames->length == 0)
+				frames->keyframe = rtpforward_vp9_is_keyframe(payload + offset);
+			return rtpforward_frame_append(frames, payload + offset, length - offset);
+		case CODEC_H264: {
+			guint8 type = payload[0] & 0x1f;
+			if(type >= 1 && type <= 23)
+				return rtpforward_frame_append_nal(frames, payload, length);
+			if(type == 24) {
+				// STAP-A: 16 bit size, NAL unit, ...
+				offset = 1;
+				while(offset + 2 < length) {
+					int size = (payload[offset] << 8) | payload[offset + 1];
+					offset += 2;
+					if(size == 0 || offset + size > length || !rtpforward_frame_append_nal(frames, payload + offset, size))
+						return FALSE;
+					offset += size;
+				}
+				return offset == length;
+			}
+			if(type == 28 && length > 2) {
+				// FU-A: the NAL unit header is rebuilt from the indicator and the FU header
+				if(payload[1] & 0x80) {
+					guint8 header = (payload[0] & 0xe0) | (payload[1] & 0x1f);
+					if(!rtpforward_frame_append_nal(frames, &header, 1))
+						return FALSE;
+				}
+				return rtpforward_frame_append(frames, payload + 2, length - 2);
+			}
+			return FALSE;
+		}
+		default:
+			return FALSE;
+	}
+}
+
+/* Sends the assembled frame to the video port of every destination and to the frame socket. Must be called
+ * with frames_mutex held.
+ */
+static void rtpforward_frame_send(rtpforward_session *session, rtpforward_frame_assembler *frames) {
+	rtpforward_frame_header header;
+	header.version = RTPFORWARD_FRAME_VERSION;
+	header.codec = session->vcodec == CODEC_VP8 ? RTPFORWARD_FRAME_CODEC_VP8 :
+		(session->vcodec == CODEC_VP9 ? RTPFORWARD_FRAME_CODEC_VP9 : RTPFORWARD_FRAME_CODEC_H264);
+	header.flags = frames->keyframe ? RTPFORWARD_FRAME_FLAG_KEYFRAME : 0;
+	header.header_size = RTPFORWARD_FRAME_HEADER_SIZE;
+	header.rtp_timestamp = htonl(frames->timestamp);
+	header.ssrc = htonl(frames->ssrc);
+	header.first_seq = htons(frames->first_seq);
+	header.packets = htons(frames->packets);
+	header.length = htonl((guint32)frames->length);
+	memcpy(frames->arena, &header, RTPFORWARD_FRAME_HEADER_SIZE);
+	gsize size = RTPFORWARD_FRAME_HEADER_SIZE + frames->length;
+	RTPFORWARD_STAT_ADD(session->stats.frames, 1);
+
+	guint d;
+	janus_mutex_lock(&session->egress_mutex);
+	for(d = 0; session->sendsockfd >= 0 && d < session->destination_count; d++) {
+		rtpforward_destination *destination = &session->destinations[d];
+		if(!destination->enabled[STREAM_VIDEO_RTP])
+			continue;
+		if(size > RTPFORWARD_FRAME_UDP_MAX) {
+			RTPFORWARD_STAT_ADD(session->stats.frames_dropped, 1);
+			continue;
+		}
+		struct sockaddr_in addr = destination->addr;
+		addr.sin_port = htons(destination->ports[STREAM_VIDEO_RTP]);
+		if(sendto(session->sendsockfd, frames->arena, size, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			rtpforward_stats_send_error(&session->stats, errno);
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+
+	if(frames->socket >= 0 && send(frames->socket, frames->arena, size, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EMSGSIZE || errno == ENOBUFS) {
+			RTPFORWARD_STAT_ADD(session->stats.frames_dropped, 1);
+		} else {
+			JANUS_LOG(LOG_WARN, "%s Closing the frame socket %s: %s\n", RTPFORWARD_NAME, frames->socket_path, strerror(errno));
+			close(frames->socket);
+			frames->socket = -1;
+		}
+	}
+}
+
+/* Adds a video RTP packet, in sequence order, to the frame being assembled, and sends the frame once the packet
+ * with the marker bit completes it. Frames missing a packet are counted and dropped. Must be called with
+ * frames_mutex held.
+ */
+static void rtpforward_frame_add(rtpforward_session *session, rtpforward_frame_assembler *frames, char *buffer, int length) {
+	int payload_length = 0;
+	guint8 *payload = (guint8 *)janus_rtp_payload(buffer, length, &payload_length);
+	if(!payload || payload_length <= 0)
+		return;
+	janus_rtp_header *header = (janus_rtp_header *)buffer;
+	guint16 seq = ntohs(header->seq_number);
+	guint32 timestamp = ntohl(header->timestamp);
+	if(frames->active) {
+		if(timestamp != frames->timestamp) {
+			// The packet with the marker bit never came
+			RTPFORWARD_STAT_ADD(session->stats.frames_incomplete, 1);
+			frames->active = FALSE;
+		} else if(seq == (guint16)(frames->next_seq - 1)) {
+			return; // duplicate
+		} else if(seq != frames->next_seq) {
+			frames->broken = TRUE;
+		}
+	}
+	if(!frames->active) {
+		gboolean follows = frames->ended && seq == frames->next_seq;
+		frames->active = TRUE;
+		frames->broken = !rtpforward_frame_starts(session, payload, payload_length) ||
+			(session->vcodec == CODEC_H264 && !follows);
+		frames->keyframe = FALSE;
+		frames->length = 0;
+		frames->packets = 0;
+		frames->timestamp = timestamp;
+		frames->ssrc = ntohl(header->ssrc);
+		frames->first_seq = seq;
+	}
+	frames->packets++;
+	frames->next_seq = seq + 1;
+	frames->ended = FALSE;
+	if(!frames->broken && !rtpforward_frame_depacketize(session, frames, payload, payload_length))
+		frames->broken = TRUE;
+	if(header->markerbit) {
+		if(frames->broken) {
+			RTPFORWARD_STAT_ADD(session->stats.frames_incomplete, 1);
+		} else {
+			rtpforward_frame_send(session, frames);
+		}
+		frames->active = FALSE;
+		frames->ended = TRUE;
+	}
+}
+
+/* Whether the session's video goes out as frames. AV1 and H.265 can't be reassembled, and are forwarded as RTP. */
+static inline gboolean rtpforward_frame_mode(rtpforward_session *session) {
+	return g_atomic_pointer_get(&session->frames) != NULL && session->vcodec != CODEC_AV1 && session->vcodec != CODEC_H265;
+}
+
+/* Hands a video RTP packet to the assembler in frame mode. Returns FALSE if the session isn't in frame mode. */
+static inline gboolean rtpforward_frame_packet(rtpforward_session *session, char *buffer, int length) {
+	if(!rtpforward_frame_mode(session))
+		return FALSE;
+	janus_mutex_lock(&session->frames_mutex);
+	rtpforward_frame_assembler *frames = session->frames;
+	if(frames)
+		rtpforward_frame_add(session, frames, buffer, length);
+	janus_mutex_unlock(&session->frames_mutex);
+	return frames != NULL;
+}
+
+
+/* Multiplexing */
+
+static void rtpforward_mux_free(const janus_refcount *mux_ref) {
+	rtpforward_mux *mux = janus_refcount_containerof(mux_ref, rtpforward_mux, ref);
+	if(mux->fd >= 0)
+		close(mux->fd);
+	janus_mutex_destroy(&mux->mutex);
+	g_free(mux->buffer);
+	g_free(mux->pending);
+	g_free(mux->target);
+	g_free(mux);
+}
+
+/* Writes as much of what the stream socket has pending as it takes, and retries the rest on the timer.
+ * Closes the socket if it failed. Must be called with the mux mutex held.
+ */
+static void rtpforward_mux_drain(rtpforward_mux *mux, gint64 now) {
+	while(mux->fd >= 0 && mux->pending_length > 0) {
+		ssize_t written = send(mux->fd, mux->pending, mux->pending_length, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if(written < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				rtpforward_timer_schedule(&mux->timer, now + mux_latency_us);
+				return;
+			}
+			JANUS_LOG(LOG_WARN, "%s Closing the mux socket %s: %s\n", RTPFORWARD_NAME, mux->target, strerror(errno));
+			close(mux->fd);
+			mux->fd = -1;
+			mux->pending_length = 0;
+			return;
+		}
+		mux->pending_length -= written;
+		memmove(mux->pending, mux->pending + written, mux->pending_length);
+	}
+}
+
+/* Sends the message in the buffer and starts the next one. Must be called with the mux mutex held. */
+static void rtpforward_mux_flush(rtpforward_mux *mux, gint64 now) {
+	if(mux->count == 0)
+		return;
+	rtpforward_mux_header header;
+	header.version = RTPFORWARD_MUX_VERSION;
+	header.header_size = RTPFORWARD_MUX_HEADER_SIZE;
+	header.count = htons(mux->count);
+	header.length = htonl((guint32)(mux->length - RTPFORWARD_MUX_HEADER_SIZE));
+	header.time_us = htobe64((guint64)mux->first);
+	memcpy(mux->buffer, &header, RTPFORWARD_MUX_HEADER_SIZE);
+	mux->messages++;
+	if(!mux->stream) {
+		// Nobody listening yet (ECONNREFUSED) is as good as sent
+		if(send(mux->fd, mux->buffer, mux->length, 0) < 0 && errno != ECONNREFUSED)
+			mux->dropped_messages++;
+	} else if(mux->fd < 0 || mux->pending_length + mux->length > RTPFORWARD_MUX_PENDING_SIZE) {
+		mux->dropped_messages++;
+	} else {
+		// A message goes into the stream whole, or not at all, so the receiver stays in sync
+		memcpy(mux->pending + mux->pending_length, mux->buffer, mux->length);
+		mux->pending_length += mux->length;
+		rtpforward_mux_drain(mux, now);
+	}
+	mux->length = RTPFORWARD_MUX_HEADER_SIZE;
+	mux->count = 0;
+}
+
+static void rtpforward_mux_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_mux *mux = (rtpforward_mux *)timer->data;
+	janus_mutex_lock(&mux->mutex);
+	if(mux->count > 0 && now < mux->first + mux_latency_us) {
+		rtpforward_timer_schedule(timer, mux->first + mux_latency_us);
+	} else {
+		rtpforward_mux_flush(mux, now);
+		rtpforward_mux_drain(mux, now);
+	}
+	janus_mutex_unlock(&mux->mutex);
+}
+
+/* Adds a packet to the message being collected. Returns FALSE if it is too large for any message. */
+static gboolean rtpforward_mux_add(rtpforward_mux *mux, guint32 id, rtpforward_stream stream, char *buffer, int length, gboolean end_of_frame) {
+	if(RTPFORWARD_MUX_HEADER_SIZE + RTPFORWARD_MUX_RECORD_HEADER_SIZE + length > RTPFORWARD_MUX_SIZE_MAX)
+		return FALSE;
+	gint64 now = janus_get_monotonic_time();
+	janus_mutex_lock(&mux->mutex);
+	if(mux->count > 0 && (mux->length + RTPFORWARD_MUX_RECORD_HEADER_SIZE + length > mux_size || mux->count == G_MAXUINT16))
+		rtpforward_mux_flush(mux, now);
+	if(mux->count == 0) {
+		mux->first = now;
+		rtpforward_timer_schedule(&mux->timer, now + mux_latency_us);
+	}
+	rtpforward_mux_record record;
+	record.length = htons((guint16)length);
+	record.type = stream;
+	record.flags = end_of_frame ? RTPFORWARD_MUX_FLAG_END_OF_FRAME : 0;
+	record.stream_id = htonl(id);
+	record.time_offset_us = htonl((guint32)(now - mux->first));
+	memcpy(mux->buffer + mux->length, &record, RTPFORWARD_MUX_RECORD_HEADER_SIZE);
+	memcpy(mux->buffer + mux->length + RTPFORWARD_MUX_RECORD_HEADER_SIZE, buffer, length);
+	mux->length += RTPFORWARD_MUX_RECORD_HEADER_SIZE + length;
+	mux->count++;
+	if(mux->length >= mux_size)
+		rtpforward_mux_flush(mux, now);
+	janus_mutex_unlock(&mux->mutex);
+	return TRUE;
+}
+
+/* Returns the mux for the target, a UDP address or, if path is given, a Unix stream socket, creating it if no
+ * other session uses it yet. Returns NULL with error_cause set on failure.
+ */
+static rtpforward_mux *rtpforward_mux_get(struct sockaddr_in *addr, const char *path, char *error_cause) {
+	char target[128];
+	if(path) {
+		g_snprintf(target, sizeof(target), "unix:%s", path);
+	} else {
+		char address[INET_ADDRSTRLEN];
+		inet_ntop(AF_INET, &addr->sin_addr, address, sizeof(address));
+		g_snprintf(target, sizeof(target), "udp:%s:%d", address, ntohs(addr->sin_port));
+	}
+	janus_mutex_lock(&muxes_mutex);
+	rtpforward_mux *mux = (rtpforward_mux *)g_hash_table_lookup(muxes, target);
+	if(mux) {
+		mux->users++;
+		janus_refcount_increase(&mux->ref);
+		janus_mutex_unlock(&muxes_mutex);
+		return mux;
+	}
+	int fd;
+	if(path) {
+		struct sockaddr_un address;
+		memset(&address, 0, sizeof(address));
+		address.sun_family = AF_UNIX;
+		if(strlen(path) >= sizeof(address.sun_path)) {
+			janus_mutex_unlock(&muxes_mutex);
+			g_snprintf(error_cause, 512, "Socket path too long: %s", path);
+			return NULL;
+		}
+		g_strlcpy(address.sun_path, path, sizeof(address.sun_path));
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+		if(fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+		fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		if(fd >= 0 && IN_MULTICAST(ntohl(addr->sin_addr.s_addr)))
+			rtpforward_setup_multicast(fd, addr->sin_addr);
+		if(fd >= 0 && connect(fd, (struct sockaddr *)addr, sizeof(*addr)) < 0) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if(fd < 0) {
+		janus_mutex_unlock(&muxes_mutex);
+		g_snprintf(error_cause, 512, "Could not connect to %s: %s", target + (path ? 5 : 4), strerror(errno));
+		return NULL;
+	}
+	mux = (rtpforward_mux *)g_malloc0(sizeof(rtpforward_mux));
+	mux->target = g_strdup(target);
+	mux->fd = fd;
+	mux->stream = path != NULL;
+	mux->users = 1;
+	janus_mutex_init(&mux->mutex);
+	mux->buffer = g_malloc(RTPFORWARD_MUX_SIZE_MAX);
+	mux->length = RTPFORWARD_MUX_HEADER_SIZE;
+	if(mux->stream)
+		mux->pending = g_malloc(RTPFORWARD_MUX_PENDING_SIZE);
+	janus_refcount_init(&mux->ref, rtpforward_mux_free);
+	rtpforward_timer_init(&mux->timer, rtpforward_mux_timeout, mux, &mux->ref);
+	g_hash_table_insert(muxes, mux->target, mux);
+	janus_mutex_unlock(&muxes_mutex);
+	JANUS_LOG(LOG_INFO, "%s Multiplexing to %s\n", RTPFORWARD_NAME, mux->target);
+	return mux;
+}
+
+/* Releases a session's use of the mux. The last user sends what was collected and closes it. */
+static void rtpforward_mux_put(rtpforward_mux *mux) {
+	if(!mux)
+		return;
+	janus_mutex_lock(&muxes_mutex);
+	gboolean last = --mux->users == 0;
+	if(last)
+		g_hash_table_remove(muxes, mux->target);
+	janus_mutex_unlock(&muxes_mutex);
+	if(last) {
+		janus_mutex_lock(&mux->mutex);
+		rtpforward_mux_flush(mux, janus_get_monotonic_time());
+		janus_mutex_unlock(&mux->mutex);
+		rtpforward_timer_cancel(&mux->timer);
+	}
+	janus_refcount_decrease(&mux->ref);
+}
+
+/* Hands a packet to the session's mux. Returns FALSE if the session doesn't multiplex. */
+static inline gboolean rtpforward_mux_packet(rtpforward_session *session, rtpforward_stream stream, char *buffer, int length, gboolean end_of_frame) {
+	if(!g_atomic_pointer_get(&session->mux))
+		return FALSE;
+	janus_mutex_lock(&session->egress_mutex);
+	rtpforward_mux *mux = session->mux;
+	if(mux) {
+		if(rtpforward_mux_add(mux, session->mux_id, stream, buffer, length, end_of_frame)) {
+			RTPFORWARD_STAT_ADD(session->stats.mux_packets, 1);
+		} else {
+			RTPFORWARD_STAT_ADD(session->stats.mux_dropped, 1);
+		}
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+	return mux != NULL;
+}
+
+
+/* Forwards one packet to the destination ports of the given stream.
+ * With an egress worker, the packet is copied into the session's ring and sent by the worker.
+ * With batching enabled, the packet is copied into the staging area and sent later, in order.
+ * end_of_frame flushes the staging area immediately.
+ * In frame mode, video RTP goes to the frame assembler instead, and when multiplexing, everything else to the mux.
+ */
+static void rtpforward_send(rtpforward_session *session, rtpforward_stream stream, char *buffer, int length, gboolean end_of_frame) {
+	rtpforward_capture_packet(session, stream, buffer, length);
+	rtpforward_shm_write(session, stream, buffer, length, end_of_frame);
+	if((stream == STREAM_VIDEO_RTP && rtpforward_frame_packet(session, buffer, length)) ||
+			rtpforward_mux_packet(session, stream, buffer, length, end_of_frame)) {
+		rtpforward_stats_forwarded(&session->stats, stream, length);
+		return;
+	}
+
+	// Queued packets are counted by the egress worker, staged ones when the batch is flushed
+	rtpforward_egress_ring *ring = (rtpforward_egress_ring *)g_atomic_pointer_get(&session->egress_ring);
+	if(ring && length <= RTPFORWARD_MAX_PACKET_SIZE) {
+		if(rtpforward_egress_ring_push(ring, stream, buffer, length))
+			rtpforward_egress_worker_wake(session->egress_worker);
+		return;
+	}
+
+	if(session->batch_size > 1 || (session->gso && stream == STREAM_VIDEO_RTP)) {
+		janus_mutex_lock(&session->egress_mutex);
+		rtpforward_batch *batch = session->batch;
+		if(batch) {
+			if(length > RTPFORWARD_MAX_PACKET_SIZE) {
+				// Too big to stage: keep the order by flushing what we have before sending it directly
+				rtpforward_batch_flush(session);
+			} else {
+				rtpforward_batch_slot *slot = &batch->slots[batch->count];
+				memcpy(slot->buffer, buffer, length);
+				slot->length = length;
+				slot->stream = stream;
+				if(batch->count++ == 0) {
+					// A timer still armed for an already flushed batch is simply moved
+					batch->first_queued = janus_get_monotonic_time();
+					rtpforward_timer_schedule(&session->batch_timer, batch->first_queued + session->batch_latency_us);
+				}
+				if(end_of_frame || batch->count == batch->size)
+					rtpforward_batch_flush(session);
+				janus_mutex_unlock(&session->egress_mutex);
+				return;
+			}
+		}
+		janus_mutex_unlock(&session->egress_mutex);
+	}
+
+	// Sent right away, to all destinations with a single sendmmsg()
+	guint8 outcome = 0;
+	janus_mutex_lock(&session->egress_mutex);
+	if(session->sendsockfd >= 0) {
+		guint d;
+		session->vec.gso = FALSE;
+		for(d = 0; d < session->destination_count; d++) {
+			rtpforward_destination *destination = &session->destinations[d];
+			if(destination->enabled[stream])
+				outcome |= rtpforward_msgvec_add(&session->vec, session->sendsockfd, session, destination, stream, buffer, length) ?
+					RTPFORWARD_OUTCOME_TAKEN : RTPFORWARD_OUTCOME_DROPPED;
+		}
+		rtpforward_msgvec_send(&session->vec, session->sendsockfd, session);
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+	if(outcome != RTPFORWARD_OUTCOME_DROPPED)
+		rtpforward_stats_forwarded(&session->stats, stream, length);
+}
+
+
+/* Reorder buffers */
+
+static void rtpforward_reorder_timeout(rtpforward_timer *timer, gint64 now);
+
+static void rtpforward_reorder_init(rtpforward_reorder *reorder, rtpforward_session *session, rtpforward_stream stream) {
+	memset(reorder, 0, sizeof(*reorder));
+	reorder->session = session;
+	reorder->stream = stream;
+	rtpforward_timer_init(&reorder->timer, rtpforward_reorder_timeout, reorder, &session->ref);
+}
+
+// Sends the packet which is next in sequence, if it is there, and moves on. Must be called with reorder_mutex held.
+static void rtpforward_reorder_pop(rtpforward_reorder *reorder) {
+	rtpforward_reorder_slot *slot = &reorder->slots[reorder->next % RTPFORWARD_REORDER_SLOTS];
+	if(slot->present && slot->seq == reorder->next) {
+		rtpforward_send(reorder->session, reorder->stream, slot->buffer, slot->length, slot->end_of_frame);
+		slot->present = FALSE;
+		reorder->count--;
+	} else {
+		RTPFORWARD_STAT_ADD(reorder->session->stats.reorder_skipped[reorder->stream], 1);
+	}
+	reorder->next++;
+}
+
+// Sends all packets which are in sequence. Must be called with reorder_mutex held.
+static void rtpforward_reorder_advance(rtpforward_reorder *reorder) {
+	while(reorder->count > 0) {
+		rtpforward_reorder_slot *slot = &reorder->slots[reorder->next % RTPFORWARD_REORDER_SLOTS];
+		if(!slot->present || slot->seq != reorder->next)
+			break;
+		rtpforward_reorder_pop(reorder);
+	}
+}
+
+// The held packet which arrived first, or NULL if none is held
+static rtpforward_reorder_slot *rtpforward_reorder_oldest(rtpforward_reorder *reorder) {
+	rtpforward_reorder_slot *oldest = NULL;
+	guint i;
+	for(i = 0; i < RTPFORWARD_REORDER_SLOTS && reorder->count > 0; i++) {
+		rtpforward_reorder_slot *slot = &reorder->slots[i];
+		if(slot->present && (!oldest || slot->arrival < oldest->arrival))
+			oldest = slot;
+	}
+	return oldest;
+}
+
+// Sends everything held, in order. Must be called with reorder_mutex held.
+static void rtpforward_reorder_flush(rtpforward_reorder *reorder) {
+	while(reorder->slots && reorder->count > 0)
+		rtpforward_reorder_pop(reorder);
+}
+
+/* Queues one packet with the given extended sequence number and sends whatever is in sequence.
+ * Late packets and duplicates are dropped. Must be called with reorder_mutex held.
+ */
+static void rtpforward_reorder_push(rtpforward_reorder *reorder, guint32 seq, char *buffer, int length, gboolean end_of_frame) {
+	rtpforward_session *session = reorder->session;
+	if(length > RTPFORWARD_MAX_PACKET_SIZE) {
+		rtpforward_send(session, reorder->stream, buffer, length, end_of_frame);
+		return;
+	}
+	if(!reorder->started) {
+		reorder->started = TRUE;
+		reorder->next = seq;
+	}
+	if((gint32)(seq - reorder->next) < 0) {
+		// Already sent, or given up on
+		RTPFORWARD_STAT_ADD(session->stats.reorder_late[reorder->stream], 1);
+		return;
+	}
+	// Make room: stop waiting for the oldest missing packets
+	while(seq - reorder->next >= session->reorder_buffer_packets) {
+		if(reorder->count == 0) {
+			RTPFORWARD_STAT_ADD(session->stats.reorder_skipped[reorder->stream], seq - reorder->next - session->reorder_buffer_packets + 1);
+			reorder->next = seq - session->reorder_buffer_packets + 1;
+			break;
+		}
+		rtpforward_reorder_pop(reorder);
+	}
+
+	rtpforward_reorder_slot *slot = &reorder->slots[seq % RTPFORWARD_REORDER_SLOTS];
+	if(slot->present)
+		return; // duplicate
+	slot->present = TRUE;
+	slot->end_of_frame = end_of_frame;
+	slot->seq = seq;
+	slot->arrival = janus_get_monotonic_time();
+	slot->length = length;
+	memcpy(slot->buffer, buffer, length);
+	reorder->count++;
+
+	rtpforward_reorder_advance(reorder);
+	// Held alone behind a gap: this packet is the oldest one. Otherwise an older packet already armed the timer.
+	if(reorder->count == 1 && slot->present)
+		rtpforward_timer_schedule(&reorder->timer, slot->arrival + session->reorder_buffer_us);
+}
+
+static void rtpforward_reorder_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_reorder *reorder = (rtpforward_reorder *)timer->data;
+	rtpforward_session *session = reorder->session;
+	janus_mutex_lock(&session->reorder_mutex);
+	if(reorder->slots && !g_atomic_int_get(&session->destroyed)) {
+		rtpforward_reorder_slot *oldest;
+		while((oldest = rtpforward_reorder_oldest(reorder)) != NULL) {
+			if(oldest->arrival + session->reorder_buffer_us > now) {
+				rtpforward_timer_schedule(timer, oldest->arrival + session->reorder_buffer_us);
+				break;
+			}
+			// Waited long enough: give up on everything missing before it
+			guint32 seq = oldest->seq;
+			while((gint32)(seq - reorder->next) >= 0)
+				rtpforward_reorder_pop(reorder);
+			rtpforward_reorder_advance(reorder);
+		}
+	}
+	janus_mutex_unlock(&session->reorder_mutex);
+}
+
+// Replaces the slots after a configuration change, sending what is still held. Must be called with reorder_mutex held.
+static void rtpforward_reorder_configure(rtpforward_reorder *reorder, gboolean enabled) {
+	rtpforward_reorder_flush(reorder);
+	g_free(reorder->slots);
+	reorder->slots = enabled ? g_malloc0(RTPFORWARD_REORDER_SLOTS * sizeof(rtpforward_reorder_slot)) : NULL;
+	reorder->started = FALSE;
+	reorder->count = 0;
+}
+
+
+/* Keyframe requests */
+
+// Asks the browser for a keyframe. Must be called with keyframe_mutex held.
+static void rtpforward_request_keyframe(rtpforward_session *session, rtpforward_keyframe_request type) {
+	if(type == KEYFRAME_REQUEST_FIR) {
+		char buffer[20];
+		janus_rtcp_fir(buffer, sizeof(buffer), &session->fir_seqnr);
+		janus_plugin_rtcp rtcp = { .video = TRUE, .buffer = buffer, .length = sizeof(buffer) };
+		gateway->relay_rtcp(session->handle, &rtcp);
+	} else {
+		gateway->send_pli(session->handle);
+	}
+}
+
+static void rtpforward_keyframe_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_session *session = (rtpforward_session *)timer->data;
+	janus_mutex_lock(&session->keyframe_mutex);
+	if(session->recovering && !g_atomic_int_get(&session->destroyed) && !g_atomic_int_get(&session->hangingup)) {
+		JANUS_LOG(LOG_VERB, "%s Requesting keyframe after packet loss\n", RTPFORWARD_NAME);
+		rtpforward_request_keyframe(session, session->keyframe_request_on_loss);
+		RTPFORWARD_STAT_ADD(session->stats.keyframe_requests, 1);
+		session->keyframe_requested = now;
+		rtpforward_timer_schedule(timer, now + session->keyframe_backoff_us);
+		guint32 backoff_max = MAX(RTPFORWARD_KEYFRAME_REQUEST_BACKOFF_MAX_MS * 1000, session->keyframe_request_interval_us);
+		session->keyframe_backoff_us = MIN(session->keyframe_backoff_us * 2, backoff_max);
+	}
+	janus_mutex_unlock(&session->keyframe_mutex);
+}
+
+// Video was disabled because of packet loss: start requesting keyframes, if configured
+static void rtpforward_recovery_start(rtpforward_session *session) {
+	if(session->keyframe_request_on_loss == KEYFRAME_REQUEST_NONE)
+		return;
+	janus_mutex_lock(&session->keyframe_mutex);
+	if(!session->recovering) {
+		gint64 now = janus_get_monotonic_time();
+		session->recovering = TRUE;
+		session->recovery_started = now;
+		session->keyframe_backoff_us = session->keyframe_request_interval_us;
+		// The minimum interval also holds across recoveries. The timer thread sends the request.
+		rtpforward_timer_schedule(&session->keyframe_timer, MAX(now, session->keyframe_requested + session->keyframe_request_interval_us));
+	}
+	janus_mutex_unlock(&session->keyframe_mutex);
+}
+
+// A keyframe arrived: stop requesting keyframes
+static void rtpforward_recovery_done(rtpforward_session *session) {
+	if(!session->recovering)
+		return;
+	janus_mutex_lock(&session->keyframe_mutex);
+	if(session->recovering) {
+		session->recovering = FALSE;
+		rtpforward_timer_cancel(&session->keyframe_timer);
+		guint64 ms = (janus_get_monotonic_time() - session->recovery_started) / 1000;
+		RTPFORWARD_STAT_ADD(session->stats.recoveries, 1);
+		RTPFORWARD_STAT_ADD(session->stats.recovery_ms_total, ms);
+		__atomic_store_n(&session->stats.recovery_ms_last, ms, __ATOMIC_RELAXED);
+		if(ms > RTPFORWARD_STAT_GET(session->stats.recovery_ms_max))
+			__atomic_store_n(&session->stats.recovery_ms_max, ms, __ATOMIC_RELAXED);
+		JANUS_LOG(LOG_INFO, "%s Got a keyframe %"SCNu64" ms after disabling video\n", RTPFORWARD_NAME, ms);
+	}
+	janus_mutex_unlock(&session->keyframe_mutex);
+}
+
+
+/* Downstream RTCP feedback */
+
+/* Reads the messages of a compound RTCP packet a receiver sent. Only NACKs for video_ssrc are kept: the core
+ * relays them to the browser as video. Returns FALSE if it isn't RTCP.
+ */
+static gboolean rtpforward_feedback_parse(const guint8 *buffer, int length, guint32 video_ssrc, rtpforward_feedback_message *message) {
+	message->pli = message->fir = FALSE;
+	message->remb = 0;
+	message->nacks = 0;
+	message->nacks_foreign = 0;
+	message->nack_length = 0;
+	int offset = 0;
+	while(offset < length) {
+		const guint8 *rtcp = buffer + offset;
+		if(length - offset < 4 || (rtcp[0] >> 6) != 2 || rtcp[1] < 192 || rtcp[1] > 223)
+			return FALSE;
+		int size = (((rtcp[2] << 8) | rtcp[3]) + 1) * 4;
+		if(size > length - offset)
+			return FALSE;
+		guint8 type = rtcp[1], format = rtcp[0] & 0x1f;
+		if(type == 206 && format == 1 && size >= 12) {
+			message->pli = TRUE;
+		} else if(type == 206 && format == 4 && size >= 20) {
+			message->fir = TRUE;
+		} else if(type == 206 && format == 15 && size >= 20 && !memcmp(rtcp + 12, "REMB", 4)) {
+			guint64 bitrate = (guint64)(((rtcp[17] & 0x03) << 16) | (rtcp[18] << 8) | rtcp[19]) << (rtcp[17] >> 2);
+			guint32 value = (guint32)MIN(bitrate, G_MAXUINT32);
+			if(value > 0 && (message->remb == 0 || value < message->remb))
+				message->remb = value;
+		} else if(type == 205 && format == 1 && size >= 16) {
+			guint32 media_ssrc = ((guint32)rtcp[8] << 24) | (rtcp[9] << 16) | (rtcp[10] << 8) | rtcp[11];
+			if(video_ssrc == 0 || media_ssrc != video_ssrc) {
+				message->nacks_foreign++;
+				offset += size;
+				continue;
+			}
+			message->nacks++;
+			if(message->nack_length + size <= RTPFORWARD_FEEDBACK_NACK_SIZE) {
+				memcpy(message->nack + message->nack_length, rtcp, size);
+				message->nack_length += size;
+			}
+		}
+		offset += size;
+	}
+	return offset > 0;
+}
+
+/* Sends the keyframe request and REMB which are due, and arms the timer for those which aren't yet. Must be
+ * called with feedback_mutex held.
+ */
+static void rtpforward_feedback_flush(rtpforward_session *session, gint64 now) {
+	if(g_atomic_int_get(&session->destroyed) || g_atomic_int_get(&session->hangingup))
+		return;
+	gint64 next = 0;
+	if(session->feedback_keyframe_pending) {
+		gint64 due = session->feedback_keyframe_sent + session->feedback_keyframe_interval_us;
+		if(session->feedback_keyframe_sent == 0 || now >= due) {
+			JANUS_LOG(LOG_VERB, "%s Requesting keyframe for a receiver\n", RTPFORWARD_NAME);
+			janus_mutex_lock(&session->keyframe_mutex);
+			rtpforward_request_keyframe(session, session->feedback_fir ? KEYFRAME_REQUEST_FIR : KEYFRAME_REQUEST_PLI);
+			janus_mutex_unlock(&session->keyframe_mutex);
+			RTPFORWARD_STAT_ADD(session->stats.feedback_keyframe_requests, 1);
+			session->feedback_keyframe_pending = FALSE;
+			session->feedback_keyframe_sent = now;
+		} else {
+			next = due;
+		}
+	}
+	if(session->feedback_remb > 0) {
+		gint64 due = session->feedback_remb_sent + session->feedback_remb_interval_us;
+		if(session->feedback_remb_sent == 0 || now >= due) {
+			guint32 bitrate = session->feedback_remb;
+			session->feedback_remb_last = bitrate;
+			if(session->abr) {
+				// Whatever the receivers ask for, the egress takes no more than the estimate
+				bitrate = MIN(bitrate, session->abr_estimate_bps);
+				session->abr_sent_bps = bitrate;
+				session->abr_sent = now;
+			}
+			gateway->send_remb(session->handle, bitrate);
+			RTPFORWARD_STAT_ADD(session->stats.feedback_rembs, 1);
+			session->feedback_remb = 0;
+			session->feedback_remb_sent = now;
+		} else if(next == 0 || due < next) {
+			next = due;
+		}
+	}
+	if(next > 0)
+		rtpforward_timer_schedule(&session->feedback_timer, next);
+}
+
+static void rtpforward_feedback_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_session *session = (rtpforward_session *)timer->data;
+	janus_mutex_lock(&session->feedback_mutex);
+	rtpforward_feedback_flush(session, now);
+	janus_mutex_unlock(&session->feedback_mutex);
+}
+
+// Must be called with feedback_mutex held
+static void rtpforward_feedback_handle(rtpforward_session *session, rtpforward_feedback_message *message, gint64 now) {
+	if(message->pli || message->fir) {
+		// Receivers repeat their requests until a keyframe arrives: one request per interval is enough
+		if(session->feedback_keyframe_pending)
+			RTPFORWARD_STAT_ADD(session->stats.feedback_keyframe_coalesced, 1);
+		session->feedback_fir = (session->feedback_keyframe_pending && session->feedback_fir) || message->fir;
+		session->feedback_keyframe_pending = TRUE;
+	}
+	if(message->remb > 0 && (session->feedback_remb == 0 || message->remb < session->feedback_remb))
+		session->feedback_remb = message->remb; // the slowest receiver decides
+	if(message->nacks_foreign > 0)
+		RTPFORWARD_STAT_ADD(session->stats.feedback_nacks_dropped, message->nacks_foreign);
+	if(message->nacks > 0) {
+		if(now - session->feedback_nack_second >= G_USEC_PER_SEC) {
+			session->feedback_nack_second = now;
+			session->feedback_nack_count = 0;
+		}
+		// With rewritten headers, the sequence numbers of the receivers aren't those of the browser
+		if(session->rewrite_headers || message->nack_length == 0 ||
+				session->feedback_nack_count + message->nacks > RTPFORWARD_FEEDBACK_NACKS_PER_SECOND) {
+			RTPFORWARD_STAT_ADD(session->stats.feedback_nacks_dropped, message->nacks);
+		} else if(!g_atomic_int_get(&session->hangingup)) {
+			// The core puts in the SSRCs of the browser. Only video is retransmitted.
+			janus_plugin_rtcp rtcp = { .video = TRUE, .buffer = message->nack, .length = message->nack_length };
+			gateway->relay_rtcp(session->handle, &rtcp);
+			session->feedback_nack_count += message->nacks;
+			RTPFORWARD_STAT_ADD(session->stats.feedback_nacks, message->nacks);
+		}
+	}
+}
+
+// Whether a packet comes from the address of a destination. Receivers of multicast may be anywhere.
+static gboolean rtpforward_feedback_from_destination(rtpforward_session *session, struct sockaddr_in *from) {
+	gboolean known = FALSE;
+	guint d;
+	janus_mutex_lock(&session->egress_mutex);
+	for(d = 0; d < session->destination_count && !known; d++) {
+		in_addr_t addr = session->destinations[d].addr.sin_addr.s_addr;
+		known = addr == from->sin_addr.s_addr || IN_MULTICAST(ntohl(addr));
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+	return known;
+}
+
+// Reads what the receivers sent to the session's socket. Runs on the feedback thread.
+static void rtpforward_feedback_read(rtpforward_session *session, guint32 id) {
+	janus_mutex_lock(&session->feedback_mutex);
+	if(session->feedback_id != id) {
+		// The socket was replaced since the event
+		janus_mutex_unlock(&session->feedback_mutex);
+		return;
+	}
+	guint8 buffer[1500];
+	rtpforward_feedback_message message;
+	int i;
+	for(i = 0; i < RTPFORWARD_FEEDBACK_READS_MAX; i++) {
+		struct sockaddr_in from;
+		socklen_t from_length = sizeof(from);
+		ssize_t length = recvfrom(session->feedback_fd, buffer, sizeof(buffer), MSG_DONTWAIT, (struct sockaddr *)&from, &from_length);
+		if(length < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				JANUS_LOG(LOG_VERB, "%s Could not read RTCP feedback: %s\n", RTPFORWARD_NAME, strerror(errno));
+			break;
+		}
+		if(from.sin_family != AF_INET || !rtpforward_feedback_from_destination(session, &from) ||
+				!rtpforward_feedback_parse(buffer, (int)length, __atomic_load_n(&session->feedback_video_ssrc, __ATOMIC_RELAXED), &message)) {
+			RTPFORWARD_STAT_ADD(session->stats.feedback_invalid, 1);
+			continue;
+		}
+		RTPFORWARD_STAT_ADD(session->stats.feedback_packets, 1);
+		rtpforward_feedback_handle(session, &message, janus_get_monotonic_time());
+	}
+	rtpforward_feedback_flush(session, janus_get_monotonic_time());
+	janus_mutex_unlock(&session->feedback_mutex);
+}
+
+static void *rtpforward_feedback_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "%s Starting feedback thread\n", RTPFORWARD_NAME);
+	struct epoll_event events[RTPFORWARD_FEEDBACK_EVENTS];
+	while(!g_atomic_int_get(&stopping)) {
+		int count = epoll_wait(feedback_epoll_fd, events, RTPFORWARD_FEEDBACK_EVENTS, 1000);
+		if(count < 0 && errno != EINTR) {
+			JANUS_LOG(LOG_ERR, "%s Could not wait for RTCP feedback: %s\n", RTPFORWARD_NAME, strerror(errno));
+			break;
+		}
+		int i;
+		for(i = 0; i < count; i++) {
+			guint32 id = (guint32)events[i].data.u64;
+			if(id == 0) {
+				guint64 value;
+				if(read(feedback_eventfd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+					JANUS_LOG(LOG_WARN, "%s Could not read the feedback eventfd: %s\n", RTPFORWARD_NAME, strerror(errno));
+				continue;
+			}
+			janus_mutex_lock(&feedback_sessions_mutex);
+			rtpforward_session *session = (rtpforward_session *)g_hash_table_lookup(feedback_sessions, GUINT_TO_POINTER(id));
+			if(session)
+				janus_refcount_increase(&session->ref);
+			janus_mutex_unlock(&feedback_sessions_mutex);
+			if(session) {
+				rtpforward_feedback_read(session, id);
+				janus_refcount_decrease(&session->ref);
+			}
+		}
+	}
+	JANUS_LOG(LOG_VERB, "%s Leaving feedback thread\n", RTPFORWARD_NAME);
+	return NULL;
+}
+
+/* Watches the session's socket if it has rtcp_feedback. Must not be called with egress_mutex held. */
+static void rtpforward_feedback_start(rtpforward_session *session) {
+	janus_mutex_lock(&session->feedback_mutex);
+	if(session->feedback && session->feedback_id == 0 && feedback_epoll_fd >= 0) {
+		janus_mutex_lock(&session->egress_mutex);
+		int fd = session->sendsockfd;
+		janus_mutex_unlock(&session->egress_mutex);
+		janus_mutex_lock(&feedback_sessions_mutex);
+		guint32 id = feedback_next_id++;
+		if(id == 0) // 0 is the eventfd
+			id = feedback_next_id++;
+		struct epoll_event event = { .events = EPOLLIN, .data.u64 = id };
+		if(fd >= 0 && epoll_ctl(feedback_epoll_fd, EPOLL_CTL_ADD, fd, &event) == 0) {
+			janus_refcount_increase(&session->ref);
+			g_hash_table_insert(feedback_sessions, GUINT_TO_POINTER(id), session);
+			session->feedback_id = id;
+			session->feedback_fd = fd;
+		} else if(fd >= 0) {
+			JANUS_LOG(LOG_ERR, "%s Could not watch for RTCP feedback: %s\n", RTPFORWARD_NAME, strerror(errno));
+		}
+		janus_mutex_unlock(&feedback_sessions_mutex);
+	}
+	janus_mutex_unlock(&session->feedback_mutex);
+}
+
+/* Stops watching the session's socket, before it is closed. Must not be called with egress_mutex held. */
+static void rtpforward_feedback_stop(rtpforward_session *session) {
+	janus_mutex_lock(&session->feedback_mutex);
+	guint32 id = session->feedback_id;
+	if(id != 0) {
+		janus_mutex_lock(&feedback_sessions_mutex);
+		epoll_ctl(feedback_epoll_fd, EPOLL_CTL_DEL, session->feedback_fd, NULL);
+		g_hash_table_remove(feedback_sessions, GUINT_TO_POINTER(id));
+		janus_mutex_unlock(&feedback_sessions_mutex);
+		session->feedback_id = 0;
+		session->feedback_fd = -1;
+	}
+	janus_mutex_unlock(&session->feedback_mutex);
+	if(id != 0)
+		janus_refcount_decrease(&session->ref);
+}
+
+
+/* Adaptive bitrate */
+
+/* Tells the browser the estimate, or the last bitrate the receivers asked for if lower. Must be called with
+ * feedback_mutex held.
+ */
+static void rtpforward_abr_remb(rtpforward_session *session, gint64 now) {
+	guint32 bitrate = session->abr_estimate_bps;
+	if(session->feedback_remb_last > 0)
+		bitrate = MIN(bitrate, session->feedback_remb_last);
+	if(bitrate == session->abr_sent_bps ||
+			(session->abr_sent_bps > 0 && bitrate > session->abr_sent_bps && now - session->abr_sent < RTPFORWARD_ABR_REMB_INTERVAL_MS * 1000))
+		return;
+	gateway->send_remb(session->handle, bitrate);
+	RTPFORWARD_STAT_ADD(session->stats.abr_rembs, 1);
+	session->abr_sent_bps = bitrate;
+	session->abr_sent = now;
+}
+
+// Send errors and packets dropped by the egress so far
+static guint64 rtpforward_abr_errors(rtpforward_session *session) {
+	rtpforward_stats *stats = &session->stats;
+	guint64 errors = RTPFORWARD_STAT_GET(stats->errors_eagain) + RTPFORWARD_STAT_GET(stats->errors_enobufs) +
+		RTPFORWARD_STAT_GET(stats->paced_dropped);
+	rtpforward_egress_ring *ring = (rtpforward_egress_ring *)g_atomic_pointer_get(&session->egress_ring);
+	if(ring)
+		errors += (guint)g_atomic_int_get(&ring->dropped_oldest) + (guint)g_atomic_int_get(&ring->dropped_newest);
+	return errors;
+}
+
+// Updates the estimate from what happened since the last tick. Must be called with feedback_mutex held.
+static void rtpforward_abr_update(rtpforward_session *session, gint64 now) {
+	guint64 errors = rtpforward_abr_errors(session);
+	gboolean dropped = errors != session->abr_errors;
+	session->abr_errors = errors;
+	gboolean queued = FALSE;
+	rtpforward_egress_ring *ring = (rtpforward_egress_ring *)g_atomic_pointer_get(&session->egress_ring);
+	if(ring)
+		queued = (guint)(g_atomic_int_get(&ring->head) - g_atomic_int_get(&ring->tail)) > ring->size / 2;
+	gboolean slow_link = __atomic_exchange_n(&session->abr_slow_links, 0, __ATOMIC_RELAXED) > 0;
+	if(slow_link || dropped || queued) {
+		if(now - session->abr_decreased >= RTPFORWARD_ABR_DECREASE_INTERVAL_MS * 1000) {
+			session->abr_estimate_bps = MAX(session->abr_min_bps, (guint32)(session->abr_estimate_bps * RTPFORWARD_ABR_DECREASE));
+			session->abr_decreased = now;
+			RTPFORWARD_STAT_ADD(session->stats.abr_decreases, 1);
+			JANUS_LOG(LOG_VERB, "%s Congestion:%s%s%s; lowering the bitrate to %"SCNu32" kbps\n", RTPFORWARD_NAME,
+				slow_link ? " slow link" : "", dropped ? " send errors" : "", queued ? " queue" : "", session->abr_estimate_bps / 1000);
+		}
+	} else if(now - session->abr_decreased >= RTPFORWARD_ABR_HOLD_MS * 1000) {
+		guint32 step = MAX(session->abr_max_bps / RTPFORWARD_ABR_INCREASE_PER_SECOND / (1000 / RTPFORWARD_ABR_TICK_MS), 1);
+		session->abr_estimate_bps = MIN(session->abr_max_bps, session->abr_estimate_bps + step);
+	}
+	rtpforward_abr_remb(session, now);
+}
+
+static void rtpforward_abr_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_session *session = (rtpforward_session *)timer->data;
+	janus_mutex_lock(&session->feedback_mutex);
+	if(session->abr && !g_atomic_int_get(&session->destroyed) && !g_atomic_int_get(&session->hangingup)) {
+		rtpforward_abr_update(session, now);
+		rtpforward_timer_schedule(timer, now + RTPFORWARD_ABR_TICK_MS * 1000);
+	}
+	janus_mutex_unlock(&session->feedback_mutex);
+}
+
+/* Switches the controller on or off, or moves its floor and ceiling. Must be called with feedback_mutex held. */
+static void rtpforward_abr_configure(rtpforward_session *session, gboolean enabled, guint32 min_bps, guint32 max_bps) {
+	session->abr_min_bps = min_bps;
+	session->abr_max_bps = max_bps;
+	if(enabled && !session->abr) {
+		// Start at the ceiling, which the first REMB enforces, and cut from there
+		session->abr_estimate_bps = max_bps;
+		session->abr_sent_bps = 0;
+		session->abr_decreased = 0;
+		session->abr_errors = rtpforward_abr_errors(session);
+		g_atomic_int_set(&session->abr_slow_links, 0);
+		rtpforward_timer_schedule(&session->abr_timer, janus_get_monotonic_time() + RTPFORWARD_ABR_TICK_MS * 1000);
+	} else if(!enabled && session->abr) {
+		rtpforward_timer_cancel(&session->abr_timer);
+	}
+	session->abr = enabled;
+	session->abr_estimate_bps = MIN(MAX(session->abr_estimate_bps, min_bps), max_bps);
+}
+
+
+/* Keyframe detection */
+
+typedef enum rtpforward_keyframe_result {
+	KEYFRAME_UNKNOWN, // the packet doesn't tell
+	KEYFRAME_NO,
+	KEYFRAME_YES,
+} rtpforward_keyframe_result;
+
+static inline rtpforward_keyframe_result rtpforward_h264_nal_keyframe(guint8 nal) {
+	guint8 type = nal & 0x1f;
+	if(type == 5 || type == 7)
+		return KEYFRAME_YES; // IDR slice, or SPS
+	return type == 1 ? KEYFRAME_NO : KEYFRAME_UNKNOWN; // all slices of a picture are IDR or none
+}
+
+static inline rtpforward_keyframe_result rtpforward_h265_nal_keyframe(guint8 header) {
+	guint8 type = (header >> 1) & 0x3f;
+	if((type >= 16 && type <= 23) || type == 32 || type == 33)
+		return KEYFRAME_YES; // IRAP picture, or VPS or SPS
+	return type <= 9 ? KEYFRAME_NO : KEYFRAME_UNKNOWN; // other VCL NAL units: an IRAP picture has none
+}
+
+/* AV1 (RTP payload format for AV1): a packet is the aggregation header and OBU elements, each with a LEB128
+ * length but the last if W says how many there are. A new coded video sequence, or a sequence header, is a
+ * keyframe; a frame which doesn't follow a sequence header in the temporal unit is not.
+ */
+static rtpforward_keyframe_result rtpforward_av1_keyframe(const guint8 *payload, int length) {
+	guint8 aggregation = payload[0];
+	if(aggregation & 0x08)
+		return KEYFRAME_YES; // N: the first packet of a coded video sequence
+	int count = (aggregation >> 4) & 0x03, element = 0, offset = 1;
+	while(offset < length) {
+		int size = length - offset;
+		if(count == 0 || element < count - 1) {
+			// LEB128 length of the element
+			guint64 value = 0;
+			int i;
+			for(i = 0; i < 8; i++) {
+				if(offset >= length)
+					return KEYFRAME_UNKNOWN;
+				guint8 byte = payload[offset++];
+				value |= (guint64)(byte & 0x7f) << (7 * i);
+				if(!(byte & 0x80))
+					break;
+			}
+			if(i == 8 || value > (guint64)(length - offset))
+				return KEYFRAME_UNKNOWN;
+			size = (int)value;
+		}
+		// The first element continues an OBU of the previous packet if Z is set
+		if(size > 0 && !(element == 0 && (aggregation & 0x80))) {
+			guint8 type = (payload[offset] >> 3) & 0x0f;
+			if(type == 1)
+				return KEYFRAME_YES; // OBU_SEQUENCE_HEADER
+			if(type == 3 || type == 6)
+				return KEYFRAME_NO; // OBU_FRAME_HEADER, OBU_FRAME
+		}
+		offset += size;
+		element++;
+	}
+	return KEYFRAME_UNKNOWN;
+}
+
+/* Tells from one packet's payload whether its frame is a keyframe. VP8: the start of partition 0 with the key
+ * frame flag and start code of a key frame. VP9: the payload descriptor of the first packet of a frame (B set)
+ * without P, i.e. not inter-picture predicted; the scalability structure and the frame header aren't parsed.
+ * H.264: an IDR slice or SPS, in a single NAL unit, a STAP-A or the first FU-A. AV1: a new coded video
+ * sequence or a sequence header. H.265: an IRAP picture (IDR, CRA or BLA), VPS or SPS, in a single NAL unit,
+ * an AP or the first FU. H.264 and H.265 packets only need one header byte read per NAL unit: there are no
+ * start codes to search for in the RTP payload, aggregated units are length-prefixed and fragments repeat the type.
+ */
+static rtpforward_keyframe_result rtpforward_keyframe_parse(rtpforward_video_codec codec, const guint8 *payload, int length) {
+	if(length < 1)
+		return KEYFRAME_UNKNOWN;
+	if(codec == CODEC_VP8) {
+		// Only the start of partition 0 has the frame header
+		if(!(payload[0] & 0x10) || (payload[0] & 0x07))
+			return KEYFRAME_UNKNOWN;
+		int offset = rtpforward_vp8_descriptor_size(payload, length);
+		if(offset < 0 || length < offset + 6)
+			return KEYFRAME_UNKNOWN;
+		// Inverse key frame flag, and the start code of a key frame
+		const guint8 *frame = payload + offset;
+		return !(frame[0] & 0x01) && frame[3] == 0x9d && frame[4] == 0x01 && frame[5] == 0x2a ? KEYFRAME_YES : KEYFRAME_NO;
+	} else if(codec == CODEC_VP9) {
+		// The first packet of the picture tells whether it is inter-picture predicted
+		if(!(payload[0] & 0x08))
+			return KEYFRAME_UNKNOWN;
+		return (payload[0] & 0x40) ? KEYFRAME_NO : KEYFRAME_YES;
+	} else if(codec == CODEC_H264) {
+		if(length < 2)
+			return KEYFRAME_UNKNOWN;
+		guint8 type = payload[0] & 0x1f;
+		if(type == 24) {
+			rtpforward_keyframe_result result = KEYFRAME_UNKNOWN;
+			int offset = 1;
+			while(offset + 2 < length) {
+				rtpforward_keyframe_result nal = rtpforward_h264_nal_keyframe(payload[offset + 2]);
+				if(nal == KEYFRAME_YES)
+					return KEYFRAME_YES;
+				if(nal == KEYFRAME_NO)
+					result = KEYFRAME_NO;
+				offset += 2 + ((payload[offset] << 8) | payload[offset + 1]);
+			}
+			return result;
+		}
+		if(type == 28) {
+			rtpforward_keyframe_result nal = rtpforward_h264_nal_keyframe(payload[1]);
+			// A fragment other than the first is only trusted to rule a keyframe out
+			return (nal == KEYFRAME_YES && !(payload[1] & 0x80)) ? KEYFRAME_UNKNOWN : nal;
+		}
+		return rtpforward_h264_nal_keyframe(payload[0]);
+	} else if(codec == CODEC_AV1) {
+		return rtpforward_av1_keyframe(payload, length);
+	} else if(codec == CODEC_H265) {
+		if(length < 3)
+			return KEYFRAME_UNKNOWN;
+		guint8 type = (payload[0] >> 1) & 0x3f;
+		if(type == 48) {
+			// AP: 16 bit size, NAL unit, ... (without DONL, as sprop-max-don-diff is never negotiated)
+			rtpforward_keyframe_result result = KEYFRAME_UNKNOWN;
+			int offset = 2;
+			while(offset + 2 < length) {
+				rtpforward_keyframe_result nal = rtpforward_h265_nal_keyframe(payload[offset + 2]);
+				if(nal == KEYFRAME_YES)
+					return KEYFRAME_YES;
+				if(nal == KEYFRAME_NO)
+					result = KEYFRAME_NO;
+				offset += 2 + ((payload[offset] << 8) | payload[offset + 1]);
+			}
+			return result;
+		}
+		if(type == 49) {
+			// FU: the FU header has the type in the same bits as a NAL unit header, shifted by one
+			rtpforward_keyframe_result nal = rtpforward_h265_nal_keyframe((payload[2] & 0x3f) << 1);
+			return (nal == KEYFRAME_YES && !(payload[2] & 0x80)) ? KEYFRAME_UNKNOWN : nal;
+		}
+		return rtpforward_h265_nal_keyframe(payload[0]);
+	}
+	return KEYFRAME_UNKNOWN;
+}
+
+/* Whether anything uses the result of keyframe detection right now. */
+static inline gboolean rtpforward_keyframe_needed(rtpforward_session *session) {
+	return (session->enable_video_on_keyframe && !session->video_enabled) || session->recovering ||
+		session->gop_cache.arena != NULL;
+}
+
+/* Returns TRUE for the first packet found to belong to a keyframe. The packets of a frame share the RTP
+ * timestamp, and once a frame is known to be a keyframe or not, its other packets aren't looked at.
+ * Called from the media thread of the session only.
+ */
+static gboolean rtpforward_keyframe_detect(rtpforward_session *session, char *buffer, int length) {
+	guint32 timestamp = ntohl(((janus_rtp_header *)buffer)->timestamp);
+	if(session->keyframe_frame_known && timestamp == session->keyframe_frame_timestamp) {
+		if(session->keyframe_frame_decided)
+			return FALSE;
+	} else {
+		session->keyframe_frame_known = TRUE;
+		session->keyframe_frame_timestamp = timestamp;
+		session->keyframe_frame_decided = FALSE;
+	}
+	int plen = 0;
+	char *payload = janus_rtp_payload(buffer, length, &plen);
+	if(!payload)
+		return FALSE;
+	rtpforward_keyframe_result result = rtpforward_keyframe_parse(session->vcodec, (const guint8 *)payload, plen);
+	if(result != KEYFRAME_UNKNOWN)
+		session->keyframe_frame_decided = TRUE;
+	return result == KEYFRAME_YES;
+}
+
+
+/* GOP cache */
+
+/* Sends cached packets to the video port of every destination, starting at *offset, until at least
+ * max_bytes have been sent. Returns the number of packets sent. Must be called with gop_mutex held.
+ */
+static guint rtpforward_gop_cache_send(rtpforward_session *session, gsize *offset, gsize max_bytes) {
+	rtpforward_gop_cache *cache = &session->gop_cache;
+	guint sent = 0, d;
+	gsize bytes = 0;
+	janus_mutex_lock(&session->egress_mutex);
+	// Else only written to the shared-memory ring; in frame mode, the destinations only get whole frames
+	gboolean sending = session->sendsockfd >= 0 && !rtpforward_frame_mode(session) && !session->mux;
+	if(sending || session->mux || g_atomic_pointer_get(&session->shm)) {
+		session->vec.gso = session->gso;
+		while(*offset < cache->used && bytes < max_bytes) {
+			guint16 length;
+			memcpy(&length, cache->arena + *offset, sizeof(guint16));
+			char *buffer = (char *)cache->arena + *offset + sizeof(guint16);
+			rtpforward_capture_packet(session, STREAM_VIDEO_RTP, buffer, length);
+			rtpforward_shm_write(session, STREAM_VIDEO_RTP, buffer, length, FALSE);
+			if(session->mux) {
+				if(rtpforward_mux_add(session->mux, session->mux_id, STREAM_VIDEO_RTP, buffer, length, FALSE)) {
+					RTPFORWARD_STAT_ADD(session->stats.mux_packets, 1);
+				} else {
+					RTPFORWARD_STAT_ADD(session->stats.mux_dropped, 1);
+				}
+			}
+			for(d = 0; sending && d < session->destination_count; d++) {
+				rtpforward_destination *destination = &session->destinations[d];
+				if(destination->enabled[STREAM_VIDEO_RTP])
+					rtpforward_msgvec_add(&session->vec, session->sendsockfd, session, destination, STREAM_VIDEO_RTP, buffer, length);
+			}
+			*offset += sizeof(guint16) + length;
+			bytes += length;
+			sent++;
+		}
+		if(sending) {
+			rtpforward_msgvec_send(&session->vec, session->sendsockfd, session);
+			session->gso = session->vec.gso;
+		}
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+	RTPFORWARD_STAT_ADD(session->stats.gop_replayed_packets, sent);
+	return sent;
+}
+
+/* Stores a received video packet. During a paced replay, the live packets are left to the replay, which sends
+ * them after the older ones. One the replay can't take (a new keyframe, or a full or invalidated cache) ends
+ * it: what is left of it is sent right away, and the packet goes out live. Must be called with gop_mutex held.
+ */
+static void rtpforward_gop_cache_add(rtpforward_session *session, char *buffer, guint16 length, gboolean keyframe, guint32 timestamp) {
+	rtpforward_gop_cache *cache = &session->gop_cache;
+	// A keyframe spans several packets, which may all be detected as such: only restart on a new one
+	gboolean restart = keyframe && (!cache->valid || timestamp != cache->keyframe_timestamp);
+	if(cache->replaying && (restart || !cache->valid || cache->used + sizeof(guint16) + length > cache->size)) {
+		rtpforward_gop_cache_send(session, &cache->replay_offset, G_MAXSIZE);
+		cache->replaying = FALSE;
+	}
+	if(restart) {
+		cache->used = 0;
+		cache->count = 0;
+		cache->valid = TRUE;
+		cache->keyframe_timestamp = timestamp;
+		cache->generation++;
+	}
+	if(!cache->valid || cache->used + sizeof(guint16) + length > cache->size)
+		return;
+	memcpy(cache->arena + cache->used, &length, sizeof(guint16));
+	memcpy(cache->arena + cache->used + sizeof(guint16), buffer, length);
+	cache->used += sizeof(guint16) + length;
+	cache->count++;
+}
+
+static void rtpforward_gop_replay_timeout(rtpforward_timer *timer, gint64 now) {
+	rtpforward_session *session = (rtpforward_session *)timer->data;
+	rtpforward_gop_cache *cache = &session->gop_cache;
+	janus_mutex_lock(&session->gop_mutex);
+	if(cache->replaying && !g_atomic_int_get(&session->destroyed)) {
+		if(cache->generation != cache->replay_generation) {
+			// The cache restarted, which already ended the replay
+			cache->replaying = FALSE;
+		} else {
+			gsize budget = (gsize)cache->replay_kbps * RTPFORWARD_GOP_REPLAY_TICK_US / 8000;
+			rtpforward_gop_cache_send(session, &cache->replay_offset, MAX(budget, 1));
+			if(cache->replay_offset < cache->used) {
+				rtpforward_timer_schedule(timer, now + RTPFORWARD_GOP_REPLAY_TICK_US);
+			} else {
+				cache->replaying = FALSE;
+			}
+		}
+	}
+	janus_mutex_unlock(&session->gop_mutex);
+}
+
+/* Replays the cached packets, at line rate or paced at replay_kbps. Returns the number of cached packets,
+ * 0 if there is nothing to replay. Packets already queued for sending (in the egress queue or a pacer, or
+ * by a media thread which has just cached them) may still go out after the replay, as duplicates.
+ */
+static guint rtpforward_gop_replay(rtpforward_session *session) {
+	rtpforward_gop_cache *cache = &session->gop_cache;
+	guint count = 0;
+	janus_mutex_lock(&session->gop_mutex);
+	if(cache->arena && cache->valid && cache->count > 0) {
+		count = cache->count;
+		RTPFORWARD_STAT_ADD(session->stats.gop_replays, 1);
+		/* The video packets held by the reorder buffer are sent now rather than after the replay, and while
+		 * a paced replay holds back the live packets, the buffer must not wait for them.
+		 */
+		janus_mutex_lock(&session->reorder_mutex);
+		if(session->reorder_video.slots) {
+			rtpforward_reorder_flush(&session->reorder_video);
+			session->reorder_video.started = FALSE;
+		}
+		janus_mutex_unlock(&session->reorder_mutex);
+		if(cache->replay_kbps == 0) {
+			// Holding gop_mutex makes the live packets wait until the replay has been sent
+			gsize offset = 0;
+			rtpforward_gop_cache_send(session, &offset, G_MAXSIZE);
+			cache->replaying = FALSE;
+		} else {
+			cache->replay_offset = 0;
+			cache->replay_generation = cache->generation;
+			cache->replaying = TRUE;
+			rtpforward_timer_schedule(&cache->replay_timer, janus_get_monotonic_time());
+		}
+	}
+	janus_mutex_unlock(&session->gop_mutex);
+	if(count > 0)
+		JANUS_LOG(LOG_VERB, "%s Replaying %u cached video packets\n", RTPFORWARD_NAME, count);
+	return count;
+}
+
+
+static json_t *rtpforward_stats_stream_json(rtpforward_stats *stats, rtpforward_stream stream) {
+	json_t *json = json_object();
+	json_object_set_new(json, "packets", json_integer(RTPFORWARD_STAT_GET(stats->packets[stream])));
+	json_object_set_new(json, "bytes", json_integer(RTPFORWARD_STAT_GET(stats->bytes[stream])));
+	if(stream == STREAM_AUDIO_RTP || stream == STREAM_VIDEO_RTP) {
+		json_object_set_new(json, "lost", json_integer(RTPFORWARD_STAT_GET(stats->lost[stream])));
+		json_object_set_new(json, "late", json_integer(RTPFORWARD_STAT_GET(stats->late[stream])));
+		json_object_set_new(json, "duplicates", json_integer(RTPFORWARD_STAT_GET(stats->duplicates[stream])));
+		json_object_set_new(json, "reorder_late", json_integer(RTPFORWARD_STAT_GET(stats->reorder_late[stream])));
+		json_object_set_new(json, "reorder_skipped", json_integer(RTPFORWARD_STAT_GET(stats->reorder_skipped[stream])));
+	}
+	return json;
+}
+
+static void rtpforward_handler_stats_update(gint64 us) {
+	RTPFORWARD_STAT_ADD(handler_stats.negotiations, 1);
+	RTPFORWARD_STAT_ADD(handler_stats.negotiation_us_total, us);
+	__atomic_store_n(&handler_stats.negotiation_us_last, us, __ATOMIC_RELAXED);
+	guint64 max = RTPFORWARD_STAT_GET(handler_stats.negotiation_us_max);
+	while((guint64)us > max && !__atomic_compare_exchange_n(&handler_stats.negotiation_us_max, &max, us, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Plugin-wide counters of the handler threads, for query_session and the "stats" request
+static json_t *rtpforward_handler_stats_json(void) {
+	json_t *json = json_object();
+	gint queued = 0;
+	guint h;
+	for(h = 0; h < handler_threads; h++)
+		queued += MAX(g_async_queue_length(handlers[h].messages), 0);
+	json_object_set_new(json, "threads", json_integer(handler_threads));
+	json_object_set_new(json, "queued", json_integer(queued));
+	json_object_set_new(json, "negotiations", json_integer(RTPFORWARD_STAT_GET(handler_stats.negotiations)));
+	json_object_set_new(json, "negotiation_us_last", json_integer(RTPFORWARD_STAT_GET(handler_stats.negotiation_us_last)));
+	json_object_set_new(json, "negotiation_us_max", json_integer(RTPFORWARD_STAT_GET(handler_stats.negotiation_us_max)));
+	json_object_set_new(json, "negotiation_us_total", json_integer(RTPFORWARD_STAT_GET(handler_stats.negotiation_us_total)));
+	json_object_set_new(json, "sdp_cache_hits", json_integer(RTPFORWARD_STAT_GET(handler_stats.sdp_cache_hits)));
+	json_object_set_new(json, "sdp_cache_misses", json_integer(RTPFORWARD_STAT_GET(handler_stats.sdp_cache_misses)));
+	janus_mutex_lock(&sdp_cache_mutex);
+	json_object_set_new(json, "sdp_cache_entries", json_integer(g_queue_get_length(&sdp_cache_lru)));
+	janus_mutex_unlock(&sdp_cache_mutex);
+	return json;
+}
+
+// Snapshot of the session's counters, for query_session and the "stats" request
+static json_t *rtpforward_stats_json(rtpforward_session *session) {
+	rtpforward_stats *stats = &session->stats;
+	json_t *json = json_object();
+	json_object_set_new(json, "audio_rtp", rtpforward_stats_stream_json(stats, STREAM_AUDIO_RTP));
+	json_object_set_new(json, "audio_rtcp", rtpforward_stats_stream_json(stats, STREAM_AUDIO_RTCP));
+	json_object_set_new(json, "video_rtp", rtpforward_stats_stream_json(stats, STREAM_VIDEO_RTP));
+	json_object_set_new(json, "video_rtcp", rtpforward_stats_stream_json(stats, STREAM_VIDEO_RTCP));
+	json_object_set_new(json, "simulated_drops", json_integer(RTPFORWARD_STAT_GET(stats->simulated_drops)));
+	json_object_set_new(json, "video_disabled_on_loss", json_integer(RTPFORWARD_STAT_GET(stats->video_disabled_on_loss)));
+	json_object_set_new(json, "keyframes", json_integer(RTPFORWARD_STAT_GET(stats->keyframes)));
+	json_object_set_new(json, "keyframe_requests", json_integer(RTPFORWARD_STAT_GET(stats->keyframe_requests)));
+	json_object_set_new(json, "recoveries", json_integer(RTPFORWARD_STAT_GET(stats->recoveries)));
+	json_object_set_new(json, "recovery_ms_last", json_integer(RTPFORWARD_STAT_GET(stats->recovery_ms_last)));
+	json_object_set_new(json, "recovery_ms_max", json_integer(RTPFORWARD_STAT_GET(stats->recovery_ms_max)));
+	json_object_set_new(json, "recovery_ms_total", json_integer(RTPFORWARD_STAT_GET(stats->recovery_ms_total)));
+	json_object_set_new(json, "gop_replays", json_integer(RTPFORWARD_STAT_GET(stats->gop_replays)));
+	json_object_set_new(json, "gop_replayed_packets", json_integer(RTPFORWARD_STAT_GET(stats->gop_replayed_packets)));
+	json_object_set_new(json, "capture_packets", json_integer(RTPFORWARD_STAT_GET(stats->capture_packets)));
+	json_object_set_new(json, "capture_dropped", json_integer(RTPFORWARD_STAT_GET(stats->capture_dropped)));
+	json_object_set_new(json, "capture_failures", json_integer(RTPFORWARD_STAT_GET(stats->capture_failures)));
+	json_object_set_new(json, "shm_packets", json_integer(RTPFORWARD_STAT_GET(stats->shm_packets)));
+	json_object_set_new(json, "shm_dropped", json_integer(RTPFORWARD_STAT_GET(stats->shm_dropped)));
+	json_object_set_new(json, "paced_packets", json_integer(RTPFORWARD_STAT_GET(stats->paced_packets)));
+	json_object_set_new(json, "paced_delay_us_total", json_integer(RTPFORWARD_STAT_GET(stats->paced_delay_us_total)));
+	json_object_set_new(json, "paced_delay_us_max", json_integer(RTPFORWARD_STAT_GET(stats->paced_delay_us_max)));
+	json_object_set_new(json, "paced_dropped", json_integer(RTPFORWARD_STAT_GET(stats->paced_dropped)));
+	json_object_set_new(json, "frames", json_integer(RTPFORWARD_STAT_GET(stats->frames)));
+	json_object_set_new(json, "frames_incomplete", json_integer(RTPFORWARD_STAT_GET(stats->frames_incomplete)));
+	json_object_set_new(json, "frames_dropped", json_integer(RTPFORWARD_STAT_GET(stats->frames_dropped)));
+	json_object_set_new(json, "mux_packets", json_integer(RTPFORWARD_STAT_GET(stats->mux_packets)));
+	json_object_set_new(json, "mux_dropped", json_integer(RTPFORWARD_STAT_GET(stats->mux_dropped)));
+	json_object_set_new(json, "feedback_packets", json_integer(RTPFORWARD_STAT_GET(stats->feedback_packets)));
+	json_object_set_new(json, "feedback_invalid", json_integer(RTPFORWARD_STAT_GET(stats->feedback_invalid)));
+	json_object_set_new(json, "feedback_keyframe_requests", json_integer(RTPFORWARD_STAT_GET(stats->feedback_keyframe_requests)));
+	json_object_set_new(json, "feedback_keyframe_coalesced", json_integer(RTPFORWARD_STAT_GET(stats->feedback_keyframe_coalesced)));
+	json_object_set_new(json, "feedback_rembs", json_integer(RTPFORWARD_STAT_GET(stats->feedback_rembs)));
+	json_object_set_new(json, "feedback_nacks", json_integer(RTPFORWARD_STAT_GET(stats->feedback_nacks)));
+	json_object_set_new(json, "feedback_nacks_dropped", json_integer(RTPFORWARD_STAT_GET(stats->feedback_nacks_dropped)));
+	json_object_set_new(json, "slow_links", json_integer(RTPFORWARD_STAT_GET(stats->slow_links)));
+	janus_mutex_lock(&session->feedback_mutex);
+	if(session->abr) {
+		json_t *abr = json_object();
+		json_object_set_new(abr, "estimate_kbps", json_integer(session->abr_estimate_bps / 1000));
+		json_object_set_new(abr, "remb_kbps", json_integer(session->abr_sent_bps / 1000));
+		json_object_set_new(abr, "min_kbps", json_integer(session->abr_min_bps / 1000));
+		json_object_set_new(abr, "max_kbps", json_integer(session->abr_max_bps / 1000));
+		json_object_set_new(abr, "decreases", json_integer(RTPFORWARD_STAT_GET(stats->abr_decreases)));
+		json_object_set_new(abr, "rembs", json_integer(RTPFORWARD_STAT_GET(stats->abr_rembs)));
+		json_object_set_new(json, "adaptive_bitrate", abr);
+	}
+	janus_mutex_unlock(&session->feedback_mutex);
+
+	json_t *errors = json_object();
+	json_object_set_new(errors, "eagain", json_integer(RTPFORWARD_STAT_GET(stats->errors_eagain)));
+	json_object_set_new(errors, "enobufs", json_integer(RTPFORWARD_STAT_GET(stats->errors_enobufs)));
+	json_object_set_new(errors, "econnrefused", json_integer(RTPFORWARD_STAT_GET(stats->errors_econnrefused)));
+	json_object_set_new(errors, "other", json_integer(RTPFORWARD_STAT_GET(stats->errors_other)));
+	json_object_set_new(json, "send_errors", errors);
+
+	janus_mutex_lock(&session->egress_mutex);
+	if(session->mux) {
+		json_t *mux = json_object();
+		janus_mutex_lock(&session->mux->mutex);
+		json_object_set_new(mux, "target", json_string(session->mux->target));
+		json_object_set_new(mux, "id", json_integer(session->mux_id));
+		json_object_set_new(mux, "messages", json_integer(session->mux->messages));
+		json_object_set_new(mux, "dropped_messages", json_integer(session->mux->dropped_messages));
+		janus_mutex_unlock(&session->mux->mutex);
+		json_object_set_new(json, "mux", mux);
+	}
+	janus_mutex_unlock(&session->egress_mutex);
+
+	rtpforward_egress_ring *ring = (rtpforward_egress_ring *)g_atomic_pointer_get(&session->egress_ring);
+	if(ring) {
+		json_object_set_new(json, "egress_dropped_oldest", json_integer(g_atomic_int_get(&ring->dropped_oldest)));
+		json_object_set_new(json, "egress_dropped_newest", json_integer(g_atomic_int_get(&ring->dropped_newest)));
+	}
+	json_object_set_new(json, "uring_fallbacks", json_integer(RTPFORWARD_STAT_GET(stats->uring_fallbacks)));
+
+	json_t *histogram = json_array();
+	int i;
+	for(i = 0; i < RTPFORWARD_STATS_HISTOGRAM_BUCKETS; i++)
+		json_array_append_new(histogram, json_integer(RTPFORWARD_STAT_GET(stats->incoming_rtp_ns[i])));
+	json_object_set_new(json, "incoming_rtp_ns_log2", histogram);
+	return json;
+}
+
+
+int rtpforward_init(janus_callbacks *callback, const char *config_path) {
+	if(g_atomic_int_get(&stopping)) {
+		return -1;
+	}
+
+	if(callback == NULL || config_path == NULL) {
+		/* Invalid arguments */
+		return -1;
+	}
+
+	/* Read the optional configuration file */
+	char *egress_cpus = NULL;
+	char filename[255];
+	g_snprintf(filename, 255, "%s/%s.jcfg", config_path, RTPFORWARD_PACKAGE);
+	JANUS_LOG(LOG_VERB, "%s Configuration file: %s\n", RTPFORWARD_NAME, filename);
+	janus_config *config = janus_config_parse(filename);
+	if(config != NULL) {
+		janus_config_print(config);
+		janus_config_category *config_general = janus_config_get_create(config, NULL, janus_config_type_category, "general");
+
+		janus_config_item *item = janus_config_get(config, config_general, janus_config_type_item, "egress_threads");
+		if(item && item->value) {
+			int value = atoi(item->value);
+			if(value < 0 || value > RTPFORWARD_EGRESS_THREADS_MAX) {
+				JANUS_LOG(LOG_WARN, "%s Invalid egress_threads %s, sending from the media threads\n", RTPFORWARD_NAME, item->value);
+			} else {
+				egress_threads = value;
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "handler_threads");
+		if(item && item->value) {
+			int value = atoi(item->value);
+			if(value < 1 || value > RTPFORWARD_HANDLER_THREADS_MAX) {
+				JANUS_LOG(LOG_WARN, "%s Invalid handler_threads %s (must be between 1 and %d), using %d\n",
+					RTPFORWARD_NAME, item->value, RTPFORWARD_HANDLER_THREADS_MAX, RTPFORWARD_HANDLER_THREADS_DEFAULT);
+			} else {
+				handler_threads = value;
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "sdp_cache_size");
+		if(item && item->value) {
+			int value = atoi(item->value);
+			if(value < 0 || value > RTPFORWARD_SDP_CACHE_SIZE_MAX) {
+				JANUS_LOG(LOG_WARN, "%s Invalid sdp_cache_size %s (must be between 0 and %d), using %d\n",
+					RTPFORWARD_NAME, item->value, RTPFORWARD_SDP_CACHE_SIZE_MAX, RTPFORWARD_SDP_CACHE_SIZE_DEFAULT);
+			} else {
+				sdp_cache_size = value;
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "egress_cpus");
+		if(item && item->value)
+			egress_cpus = g_strdup(item->value);
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "egress_queue_size");
+		if(item && item->value) {
+			int value = atoi(item->value);
+			if(value < 2 || value > RTPFORWARD_EGRESS_QUEUE_SIZE_MAX || (value & (value - 1))) {
+				JANUS_LOG(LOG_WARN, "%s Invalid egress_queue_size %s (must be a power of two up to %d), using %d\n",
+					RTPFORWARD_NAME, item->value, RTPFORWARD_EGRESS_QUEUE_SIZE_MAX, RTPFORWARD_EGRESS_QUEUE_SIZE_DEFAULT);
+			} else {
+				egress_queue_size = value;
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "egress_backend");
+		if(item && item->value) {
+			if(!strcmp(item->value, "io_uring")) {
+				egress_backend = EGRESS_BACKEND_IO_URING;
+			} else if(!strcmp(item->value, "sendmmsg")) {
+				egress_backend = EGRESS_BACKEND_SENDMMSG;
+			} else {
+				JANUS_LOG(LOG_WARN, "%s Invalid egress_backend %s, using sendmmsg\n", RTPFORWARD_NAME, item->value);
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "pacing_txtime");
+		if(item && item->value)
+			pacing_txtime = janus_is_true(item->value);
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "mux_size");
+		if(item && item->value) {
+			int value = atoi(item->value);
+			if(value < 64 || value > RTPFORWARD_MUX_SIZE_MAX) {
+				JANUS_LOG(LOG_WARN, "%s Invalid mux_size %s (must be between 64 and %d), using %d\n",
+					RTPFORWARD_NAME, item->value, RTPFORWARD_MUX_SIZE_MAX, RTPFORWARD_MUX_SIZE_DEFAULT);
+			} else {
+				mux_size = value;
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "mux_latency_us");
+		if(item && item->value) {
+			int value = atoi(item->value);
+			if(value < 1 || value > RTPFORWARD_MUX_LATENCY_US_MAX) {
+				JANUS_LOG(LOG_WARN, "%s Invalid mux_latency_us %s (must be between 1 and %d), using %d\n",
+					RTPFORWARD_NAME, item->value, RTPFORWARD_MUX_LATENCY_US_MAX, RTPFORWARD_MUX_LATENCY_US_DEFAULT);
+			} else {
+				mux_latency_us = value;
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "capture_dir");
+		if(item && item->value && *item->value) {
+			if(!g_path_is_absolute(item->value) || !g_file_test(item->value, G_FILE_TEST_IS_DIR)) {
+				JANUS_LOG(LOG_WARN, "%s Invalid capture_dir %s (must be an existing directory, given as an absolute path), captures are disabled\n",
+					RTPFORWARD_NAME, item->value);
+			} else {
+				capture_dir = g_strdup(item->value);
+			}
+		}
+
+		item = janus_config_get(config, config_general, janus_config_type_item, "egress_overflow");
+		if(item && item->value) {
+			if(!strcmp(item->value, "drop-newest")) {
+				egress_overflow = OVERFLOW_DROP_NEWEST;
+			} else if(!strcmp(item->value, "drop-oldest")) {
+				egress_overflow = OVERFLOW_DROP_OLDEST;
+			} else {
+				JANUS_LOG(LOG_WARN, "%s Invalid egress_overflow %s, using drop-oldest\n", RTPFORWARD_NAME, item->value);
+			}
+		}
+
+		janus_config_destroy(config);
+		config = NULL;
+	}
+	if(egress_backend == EGRESS_BACKEND_IO_URING && egress_threads == 0) {
+		// io_uring is driven by the egress workers
+		egress_threads = 1;
+	}
+
+	guint shard;
+	for(shard = 0; shard < RTPFORWARD_SESSION_SHARDS; shard++) {
+		session_shards[shard].sessions = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)rtpforward_session_destroy);
+		janus_mutex_init(&session_shards[shard].mutex);
+	}
+	reaper_queue = g_async_queue_new();
+	sdp_cache = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)rtpforward_sdp_answer_free);
+	muxes = g_hash_table_new(g_str_hash, g_str_equal);
+	gateway = callback;
+	janus_condition_init(&timer_cond);
+	janus_condition_init(&capture_cond);
+
+	GError *error = NULL;
+
+	handlers = g_malloc0(handler_threads * sizeof(rtpforward_handler));
+	guint h;
+	for(h = 0; h < handler_threads; h++) {
+		handlers[h].id = h;
+		handlers[h].messages = g_async_queue_new_full((GDestroyNotify) rtpforward_message_free);
+	}
+	for(h = 0; h < handler_threads; h++) {
+		char name[32];
+		g_snprintf(name, sizeof(name), "rtpforward handler %u", h);
+		handlers[h].thread = g_thread_try_new(name, rtpforward_handler_thread, &handlers[h], &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the message handler thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
+			return -1;
+		}
+	}
+
+	timer_thread = g_thread_try_new("rtpforward timer thread", rtpforward_timer_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the timer thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
+		return -1;
+	}
+
+	capture_thread = g_thread_try_new("rtpforward capture thread", rtpforward_capture_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the capture thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
+		return -1;
+	}
+
+	reaper_thread = g_thread_try_new("rtpforward reaper thread", rtpforward_reaper_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the reaper thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
+		return -1;
+	}
+
+	shm_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(shm_eventfd < 0) {
+		JANUS_LOG(LOG_ERR, "%s Could not create the eventfd of the shm thread: %s\n", RTPFORWARD_NAME, strerror(errno));
+		return -1;
+	}
+	shm_thread = g_thread_try_new("rtpforward shm thread", rtpforward_shm_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the shm thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
+		return -1;
+	}
+
+	feedback_sessions = g_hash_table_new(NULL, NULL);
+	feedback_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	feedback_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	struct epoll_event wake = { .events = EPOLLIN, .data.u64 = 0 };
+	if(feedback_epoll_fd < 0 || feedback_eventfd < 0 || epoll_ctl(feedback_epoll_fd, EPOLL_CTL_ADD, feedback_eventfd, &wake) < 0) {
+		JANUS_LOG(LOG_ERR, "%s Could not set up the epoll instance of the feedback thread: %s\n", RTPFORWARD_NAME, strerror(errno));
+		return -1;
+	}
+	feedback_thread = g_thread_try_new("rtpforward feedback thread", rtpforward_feedback_thread, NULL, &error);
+	if(error != NULL) {
+		JANUS_LOG(LOG_ERR, "%s Got error %d (%s) trying to launch the feedback thread...\n", RTPFORWARD_NAME, error->code, error->message ? error->message : "??");
+		return -1;
+	}
+
+	int res = rtpforward_egress_workers_start(egress_cpus);
+	g_free(egress_cpus);
+	if(res < 0)
+		return -1;
+
+	g_atomic_int_set(&initialized, 1);
+	JANUS_LOG(LOG_INFO, "%s initialized!\n", RTPFORWARD_NAME);
+	return 0;
+}
+
+
+void rtpforward_destroy(void) {
+	JANUS_LOG(LOG_INFO, "%s destroying...\n", RTPFORWARD_NAME);
+
+	if(!g_atomic_int_get(&initialized))
+		return;
+	g_atomic_int_set(&stopping, 1);
+
+	guint h;
+	for(h = 0; h < handler_threads; h++) {
+		if(handlers[h].thread != NULL) {
+			g_async_queue_push(handlers[h].messages, &exit_message);
+			g_thread_join(handlers[h].thread);
+			handlers[h].thread = NULL;
+		}
+	}
+	if(watchdog_thread != NULL) {
+		g_thread_join(watchdog_thread);
+		watchdog_thread = NULL;
+	}
+	if(reaper_thread != NULL) {
+		// Sessions already queued are still reaped, while the other threads are around
+		g_async_queue_push(reaper_queue, &reaper_exit);
+		g_thread_join(reaper_thread);
+		reaper_thread = NULL;
+	}
+	if(timer_thread != NULL) {
+		janus_mutex_lock(&timer_mutex);
+		janus_condition_signal(&timer_cond);
+		janus_mutex_unlock(&timer_mutex);
+		g_thread_join(timer_thread);
+		timer_thread = NULL;
+	}
+	if(capture_thread != NULL) {
+		// The capture thread finishes the files still open
+		janus_mutex_lock(&capture_mutex);
+		janus_condition_signal(&capture_cond);
+		janus_mutex_unlock(&capture_mutex);
+		g_thread_join(capture_thread);
+		capture_thread = NULL;
+	}
+	if(shm_thread != NULL) {
+		// The shm thread closes and removes the sockets still open
+		rtpforward_shm_wake_thread();
+		g_thread_join(shm_thread);
+		shm_thread = NULL;
+	}
+	if(shm_eventfd >= 0) {
+		close(shm_eventfd);
+		shm_eventfd = -1;
+	}
+	if(feedback_thread != NULL) {
+		guint64 one = 1;
+		if(write(feedback_eventfd, &one, sizeof(one)) < 0)
+			JANUS_LOG(LOG_WARN, "%s Could not wake up the feedback thread: %s\n", RTPFORWARD_NAME, strerror(errno));
+		g_thread_join(feedback_thread);
+		feedback_thread = NULL;
+	}
+	if(feedback_epoll_fd >= 0) {
+		close(feedback_epoll_fd);
+		feedback_epoll_fd = -1;
+	}
+	if(feedback_eventfd >= 0) {
+		close(feedback_eventfd);
+		feedback_eventfd = -1;
+	}
+	rtpforward_egress_workers_stop();
+
+	guint shard;
+	for(shard = 0; shard < RTPFORWARD_SESSION_SHARDS; shard++) {
+		janus_mutex_lock(&session_shards[shard].mutex);
+		g_hash_table_destroy(session_shards[shard].sessions);
+		session_shards[shard].sessions = NULL;
+		janus_mutex_unlock(&session_shards[shard].mutex);
+	}
+	for(h = 0; h < handler_threads; h++)
+		g_async_queue_unref(handlers[h].messages);
+	g_free(handlers);
+	handlers = NULL;
+	janus_mutex_lock(&sdp_cache_mutex);
+	g_queue_init(&sdp_cache_lru);
+	g_hash_table_destroy(sdp_cache);
+	sdp_cache = NULL;
+	janus_mutex_unlock(&sdp_cache_mutex);
+	janus_mutex_lock(&muxes_mutex);
+	g_hash_table_destroy(muxes);
+	muxes = NULL;
+	janus_mutex_unlock(&muxes_mutex);
+	janus_mutex_lock(&feedback_sessions_mutex);
+	g_hash_table_destroy(feedback_sessions);
+	feedback_sessions = NULL;
+	janus_mutex_unlock(&feedback_sessions_mutex);
+	g_async_queue_unref(reaper_queue);
+	reaper_queue = NULL;
+	g_free(capture_dir);
+	capture_dir = NULL;
+
+	g_atomic_int_set(&initialized, 0);
+	g_atomic_int_set(&stopping, 0);
+
+	JANUS_LOG(LOG_INFO, "%s destroyed!\n", RTPFORWARD_NAME);
+}
+
+int rtpforward_get_api_compatibility(void) {
+	return JANUS_PLUGIN_API_VERSION;
+}
+
+int rtpforward_get_version(void) {
+	return RTPFORWARD_VERSION;
+}
+
+const char *rtpforward_get_version_string(void) {
+	return RTPFORWARD_VERSION_STRING;
+}
+
+const char *rtpforward_get_description(void) {
+	return RTPFORWARD_DESCRIPTION;
+}
+
+const char *rtpforward_get_name(void) {
+	return RTPFORWARD_NAME;
+}
+
+const char *rtpforward_get_author(void) {
+	return RTPFORWARD_AUTHOR;
+}
+
+const char *rtpforward_get_package(void) {
+	return RTPFORWARD_PACKAGE;
+}
+
+void rtpforward_create_session(janus_plugin_session *handle, int *error) {
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
+		*error = -1;
+		return;
+	}
+
+	rtpforward_session *session = (rtpforward_session *)g_malloc0(sizeof(rtpforward_session));
+	session->handle = handle;
+	janus_refcount_init(&session->ref, rtpforward_session_free);
+
+
+	session->sendsockfd = -1;
+	session->destination_count = 0;
+	session->destination_next_id = 1; // 0 is the destination set by "configure"
+
+	strcpy(session->negotiate_acodec, "opus");
+	strcpy(session->negotiate_vcodec, "vp8");
+
+	session->video_enabled = TRUE;
+	session->audio_enabled = TRUE;
+	session->enable_video_on_keyframe = FALSE;
+	session->disable_video_on_packetloss = FALSE;
+
+	memset(&session->seqwin_video, 0, sizeof(rtpforward_seqwin));
+	memset(&session->seqwin_audio, 0, sizeof(rtpforward_seqwin));
+	session->reorder_tolerance = RTPFORWARD_REORDER_TOLERANCE_DEFAULT;
+
+	session->fir_seqnr = 0;
+	session->keyframe_request_on_loss = KEYFRAME_REQUEST_NONE;
+	session->keyframe_request_interval_us = RTPFORWARD_KEYFRAME_REQUEST_INTERVAL_MS_DEFAULT * 1000;
+	session->recovering = FALSE;
+	session->keyframe_requested = 0;
+	rtpforward_timer_init(&session->keyframe_timer, rtpforward_keyframe_timeout, session, &session->ref);
+	janus_mutex_init(&session->keyframe_mutex);
+
+	memset(&session->gop_cache, 0, sizeof(rtpforward_gop_cache));
+	rtpforward_timer_init(&session->gop_cache.replay_timer, rtpforward_gop_replay_timeout, session, &session->ref);
+	janus_mutex_init(&session->gop_mutex);
+	janus_mutex_init(&session->shm_mutex);
+	janus_mutex_init(&session->frames_mutex);
+	session->feedback_fd = -1;
+	session->feedback_keyframe_interval_us = RTPFORWARD_FEEDBACK_KEYFRAME_INTERVAL_MS_DEFAULT * 1000;
+	session->feedback_remb_interval_us = RTPFORWARD_FEEDBACK_REMB_INTERVAL_MS_DEFAULT * 1000;
+	rtpforward_timer_init(&session->feedback_timer, rtpforward_feedback_timeout, session, &session->ref);
+	session->abr_min_bps = RTPFORWARD_ABR_MIN_KBPS_DEFAULT * 1000;
+	session->abr_max_bps = RTPFORWARD_ABR_MAX_KBPS_DEFAULT * 1000;
+	rtpforward_timer_init(&session->abr_timer, rtpforward_abr_timeout, session, &session->ref);
+	janus_mutex_init(&session->feedback_mutex);
+	session->mux_id = (guint32)g_atomic_int_add((gint *)&mux_next_id, 1);
+
+	session->drop_permille = 0;
+	session->drop_video_packets = 0;
+	session->drop_audio_packets = 0;
+
+	session->gso = FALSE;
+	session->batch_size = 1;
+	session->batch_latency_us = RTPFORWARD_BATCH_LATENCY_US_DEFAULT;
+	session->batch = NULL;
+	janus_mutex_init(&session->egress_mutex);
+
+	session->egress_worker = NULL;
+	session->egress_ring = NULL;
+	g_atomic_int_set(&session->egress_detached, 0);
+	session->egress_buffer_index = -1;
+	session->egress_inflight = 0;
+	rtpforward_timer_init(&session->batch_timer, rtpforward_batch_timeout, session, &session->ref);
+	rtpforward_timer_init(&session->pacing_timer, rtpforward_pacing_timeout, session, &session->ref);
+
+	session->reorder_buffer_us = 0;
+	session->reorder_buffer_packets = RTPFORWARD_REORDER_SLOTS;
+	rtpforward_reorder_init(&session->reorder_video, session, STREAM_VIDEO_RTP);
+	rtpforward_reorder_init(&session->reorder_audio, session, STREAM_AUDIO_RTP);
+	janus_mutex_init(&session->reorder_mutex);
+
+	janus_rtp_switching_context_reset(&session->context);
+	session->rewrite_headers = FALSE;
+	session->rewrite_pt[0] = session->rewrite_pt[1] = -1;
+
+	g_atomic_int_set(&session->destroyed, 0);
+	g_atomic_int_set(&session->hangingup, 0);
+
+	rtpforward_session_shard *shard = rtpforward_session_shard_get(handle);
+	janus_mutex_lock(&shard->mutex);
+	handle->plugin_handle = session;
+	g_hash_table_insert(shard->sessions, handle, session);
+	janus_mutex_unlock(&shard->mutex);
+
+	JANUS_LOG(LOG_INFO, "%s Session created.\n", RTPFORWARD_NAME);
+	return;
+}
+
+
+void rtpforward_destroy_session(janus_plugin_session *handle, int *error) {
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
+		*error = -1;
+		return;
+	}
+	rtpforward_session_shard *shard = rtpforward_session_shard_get(handle);
+	janus_mutex_lock(&shard->mutex);
+	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
+	if(!session) {
+		janus_mutex_unlock(&shard->mutex);
+		JANUS_LOG(LOG_ERR, "%s rtpforward_destroy_session: No session associated with this handle...\n", RTPFORWARD_NAME);
+		*error = -2;
+		return;
+	}
+
+	JANUS_LOG(LOG_INFO, "%s Destroy session...\n", RTPFORWARD_NAME);
+	janus_refcount_increase(&session->ref); // for the reaper
+	g_hash_table_remove(shard->sessions, handle); // marks the session as destroyed
+	janus_mutex_unlock(&shard->mutex);
+
+	// Anything that may wait is left to the reaper thread, unless it is behind
+	if(g_async_queue_length(reaper_queue) >= RTPFORWARD_REAPER_BACKLOG_MAX)
+		rtpforward_session_reap(session);
+	else
+		g_async_queue_push(reaper_queue, session);
+	return;
+}
+
+// Releases what a destroyed session holds. Runs on the reaper thread.
+static void rtpforward_session_reap(rtpforward_session *session) {
+	rtpforward_egress_detach(session); // the worker drops its reference on its own time
+	rtpforward_timer_cancel(&session->batch_timer);
+	rtpforward_timer_cancel(&session->pacing_timer);
+	rtpforward_timer_cancel(&session->reorder_video.timer);
+	rtpforward_timer_cancel(&session->reorder_audio.timer);
+	rtpforward_timer_cancel(&session->keyframe_timer);
+	rtpforward_timer_cancel(&session->gop_cache.replay_timer);
+	rtpforward_timer_cancel(&session->feedback_timer);
+	rtpforward_timer_cancel(&session->abr_timer);
+	rtpforward_capture_stop(session);
+	rtpforward_shm_stop(session);
+	janus_mutex_lock(&session->frames_mutex);
+	rtpforward_frame_assembler *frames = session->frames;
+	g_atomic_pointer_set(&session->frames, NULL);
+	janus_mutex_unlock(&session->frames_mutex);
+	rtpforward_frame_assembler_free(frames);
+	rtpforward_feedback_stop(session);
+	janus_mutex_lock(&session->egress_mutex);
+	if(session->batch)
+		session->batch->count = 0; // drop what is still staged
+	close(session->sendsockfd);
+	session->sendsockfd = -1;
+	rtpforward_mux *mux = session->mux;
+	g_atomic_pointer_set(&session->mux, NULL);
+	janus_mutex_unlock(&session->egress_mutex);
+	rtpforward_mux_put(mux);
+	JANUS_LOG(LOG_INFO, "%s Session destroyed.\n", RTPFORWARD_NAME);
+	janus_refcount_decrease(&session->ref);
+}
+
+static void *rtpforward_reaper_thread(void *data) {
+	JANUS_LOG(LOG_VERB, "%s Starting reaper thread\n", RTPFORWARD_NAME);
+	gpointer item;
+	while((item = g_async_queue_pop(reaper_queue)) != &reaper_exit)
+		rtpforward_session_reap((rtpforward_session *)item);
+	JANUS_LOG(LOG_VERB, "%s Leaving reaper thread\n", RTPFORWARD_NAME);
+	return NULL;
+}
+
+json_t *rtpforward_query_session(janus_plugin_session *handle) {
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+		return NULL;
+	rtpforward_session_shard *shard = rtpforward_session_shard_get(handle);
+	janus_mutex_lock(&shard->mutex);
+	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
+	if(!session) {
+		janus_mutex_unlock(&shard->mutex);
+		JANUS_LOG(LOG_ERR, "%s rtpforward_query_session: No session associated with this handle...\n", RTPFORWARD_NAME);
+		return NULL;
+	}
+	janus_refcount_increase(&session->ref);
+	janus_mutex_unlock(&shard->mutex);
+
+	json_t *info = json_object();
+	json_object_set_new(info, "stats", rtpforward_stats_json(session));
+	json_object_set_new(info, "handlers", rtpforward_handler_stats_json());
+	janus_refcount_decrease(&session->ref);
+	return info;
+}
+
+
+
+// Request keys of the destination ports, by stream
+static const char *rtpforward_port_keys[STREAM_COUNT] = {
+	"sendport_audio_rtp", "sendport_audio_rtcp", "sendport_video_rtp", "sendport_video_rtcp"
+};
+
+// Applies the optional "audio", "video" and "rtcp" switches. Returns the first invalid key, or NULL.
+static const char *rtpforward_destination_parse(rtpforward_destination *destination, json_t *body) {
+	const char *keys[] = { "audio", "video", "rtcp" };
+	gboolean *flags[] = { &destination->audio, &destination->video, &destination->rtcp };
+	guint i;
+	for(i = 0; i < G_N_ELEMENTS(keys); i++) {
+		json_t *flag = json_object_get(body, keys[i]);
+		if(!flag)
+			continue;
+		if(!json_is_boolean(flag))
+			return keys[i];
+		*flags[i] = json_is_true(flag);
+	}
+	rtpforward_destination_update(destination);
+	return NULL;
+}
+
+/* Reads the optional "pacing_kbps" and "pacing_burst_kb" into rate_kbps and burst, which start out as the current
+ * pacing of the destination. Returns FALSE with error_cause set if one is invalid.
+ */
+static gboolean rtpforward_pacing_parse(rtpforward_destination *destination, json_t *body, guint32 *rate_kbps, guint32 *burst, char *error_cause) {
+	*rate_kbps = destination->pacer ? destination->pacer->rate_kbps : 0;
+	*burst = destination->pacer ? destination->pacer->burst : RTPFORWARD_PACING_BURST_KB_DEFAULT * 1024;
+	json_t *value = json_object_get(body, "pacing_kbps");
+	if(value) {
+		if(!json_is_integer(value) || json_integer_value(value) < 0 || json_integer_value(value) > RTPFORWARD_PACING_KBPS_MAX) {
+			g_snprintf(error_cause, 512, "JSON error: Invalid element: pacing_kbps (must be between 0 and %d)", RTPFORWARD_PACING_KBPS_MAX);
+			return FALSE;
+		}
+		*rate_kbps = (guint32)json_integer_value(value);
+	}
+	value = json_object_get(body, "pacing_burst_kb");
+	if(value) {
+		if(!json_is_integer(value) || json_integer_value(value) < 1 || json_integer_value(value) > RTPFORWARD_PACING_BURST_KB_MAX) {
+			g_snprintf(error_cause, 512, "JSON error: Invalid element: pacing_burst_kb (must be between 1 and %d)", RTPFORWARD_PACING_BURST_KB_MAX);
+			return FALSE;
+		}
+		*burst = (guint32)json_integer_value(value) * 1024;
+	}
+	return TRUE;
+}
+
+static json_t *rtpforward_destination_json(rtpforward_destination *destination) {
+	json_t *json = json_object();
+	json_object_set_new(json, "destination_id", json_integer(destination->id));
+	json_object_set_new(json, "sendipv4", json_string(inet_ntoa(destination->addr.sin_addr)));
+	rtpforward_stream stream;
+	for(stream = 0; stream < STREAM_COUNT; stream++)
+		json_object_set_new(json, rtpforward_port_keys[stream], json_integer(destination->ports[stream]));
+	json_object_set_new(json, "audio", destination->audio ? json_true() : json_false());
+	json_object_set_new(json, "video", destination->video ? json_true() : json_false());
+	json_object_set_new(json, "rtcp", destination->rtcp ? json_true() : json_false());
+	if(destination->pacer) {
+		json_object_set_new(json, "pacing_kbps", json_integer(destination->pacer->rate_kbps));
+		json_object_set_new(json, "pacing_burst_kb", json_integer(destination->pacer->burst / 1024));
+	}
+	return json;
+}
+
+// Sets the socket options for sending to a multicast address
+static void rtpforward_setup_multicast(int fd, struct in_addr addr) {
+	uint8_t ttl = 0; // do not route UDP packets outside of local host
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+
+	struct in_addr mcast_iface_addr;
+	// We explicitly choose the multicast network interface, otherwise the kernel will choose for us.
+	// We go for the software loopback interface for low latency. A physical ethernet card could add latency.
+	mcast_iface_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	JANUS_LOG(LOG_WARN, "%s: This rtpforward session will multicast to IP multicast address %s "
+	"because you specified it. The IP_MULTICAST_TTL option has been set to 0 (zero), which "
+	"SHOULD cause at least the first router (the Linux kernel) to NOT forward the UDP packets. "
+	"The behavior is is however OS-specific. You SHOULD verify that the UDP packets "
+	"are not inadvertenly forwarded into network zones where the security/privacy of the packets "
+	"could be compromised.\n", RTPFORWARD_NAME, inet_ntoa(addr));
+
+	JANUS_LOG(LOG_WARN, "%s: Will multicast from network interface with IP %s\n", RTPFORWARD_NAME, inet_ntoa(mcast_iface_addr));
+
+	setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mcast_iface_addr, sizeof(mcast_iface_addr));
+}
+
+struct janus_plugin_result *rtpforward_handle_message(janus_plugin_session *handle, char *transaction, json_t *body, json_t *jsep) {
+	JANUS_LOG(LOG_INFO, "%s rtpforward_handle_message.\n", RTPFORWARD_NAME);
+
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+		// Synchronous
+		return janus_plugin_result_new(JANUS_PLUGIN_ERROR, g_atomic_int_get(&stopping) ? "Shutting down" : "Plugin not initialized", NULL);
+
+
+	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
+	int error_code = 0;
+	char *error_cause = g_malloc0(512);
+	json_t *response = NULL;
+
+	json_t *enable_video_on_keyframe = json_object_get(body, "enable_video_on_keyframe");
+	if (enable_video_on_keyframe) {
+		session->enable_video_on_keyframe = (gboolean)json_is_true(enable_video_on_keyframe);
+		JANUS_LOG(LOG_INFO, "%s session->enable_video_on_keyframe %s\n", RTPFORWARD_NAME, (session->enable_video_on_keyframe ? "TRUE" : "FALSE"));
+	}
+
+	json_t *disable_video_on_packetloss = json_object_get(body, "disable_video_on_packetloss");
+	if (disable_video_on_packetloss) {
+		session->disable_video_on_packetloss = (gboolean)json_is_true(disable_video_on_packetloss);
+		JANUS_LOG(LOG_INFO, "%s session->disable_video_on_packetloss %s\n", RTPFORWARD_NAME, (session->disable_video_on_packetloss ? "TRUE" : "FALSE"));
+	}
+
+	json_t *keyframe_request_on_loss = json_object_get(body, "keyframe_request_on_loss");
+	if (keyframe_request_on_loss) {
+		const char *value = json_string_value(keyframe_request_on_loss);
+		rtpforward_keyframe_request type;
+		if (value && !strcmp(value, "pli")) {
+			type = KEYFRAME_REQUEST_PLI;
+		} else if (value && !strcmp(value, "fir")) {
+			type = KEYFRAME_REQUEST_FIR;
+		} else if (value && !strcmp(value, "none")) {
+			type = KEYFRAME_REQUEST_NONE;
+		} else {
+			JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: keyframe_request_on_loss\n", RTPFORWARD_NAME);
+			error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "JSON error: Invalid element: keyframe_request_on_loss (must be \"pli\", \"fir\" or \"none\")");
+			goto respond;
+		}
+		janus_mutex_lock(&session->keyframe_mutex);
+		session->keyframe_request_on_loss = type;
+		if (type == KEYFRAME_REQUEST_NONE)
+			session->recovering = FALSE;
+		janus_mutex_unlock(&session->keyframe_mutex);
+		JANUS_LOG(LOG_INFO, "%s session->keyframe_request_on_loss=%s\n", RTPFORWARD_NAME, value);
+	}
+
+	json_t *keyframe_request_interval_ms = json_object_get(body, "keyframe_request_interval_ms");
+	if (keyframe_request_interval_ms) {
+		json_int_t value = json_integer_value(keyframe_request_interval_ms);
+		if (value < 1 || value > 60 * 1000) {
+			JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: keyframe_request_interval_ms\n", RTPFORWARD_NAME);
+			error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "JSON error: Invalid element: keyframe_request_interval_ms (must be between 1 and 60000)");
+			goto respond;
+		}
+		janus_mutex_lock(&session->keyframe_mutex);
+		session->keyframe_request_interval_us = (guint32)value * 1000;
+		janus_mutex_unlock(&session->keyframe_mutex);
+		JANUS_LOG(LOG_INFO, "%s session->keyframe_request_interval_ms=%d\n", RTPFORWARD_NAME, (int)value);
+	}
+
+	json_t *reorder_tolerance = json_object_get(body, "reorder_tolerance");
+	if (reorder_tolerance) {
+		json_int_t value = json_integer_value(reorder_tolerance);
+		if (!json_is_integer(reorder_tolerance) || value < 0 || value >= RTPFORWARD_SEQWIN_SIZE) {
+			JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: reorder_tolerance\n", RTPFORWARD_NAME);
+			error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "JSON error: Invalid element: reorder_tolerance (must be between 0 and %d)", RTPFORWARD_SEQWIN_SIZE - 1);
+			goto respond;
+		}
+		session->reorder_tolerance = (guint16)value;
+		JANUS_LOG(LOG_INFO, "%s session->reorder_tolerance=%d\n", RTPFORWARD_NAME, session->reorder_tolerance);
+	}
+
+	json_t *drop_probability = json_object_get(body, "drop_probability");
+	if (drop_probability) {
+		session->drop_permille = (guint16)json_integer_value(drop_probability);
+		JANUS_LOG(LOG_INFO, "%s session->drop_permille=%d\n", RTPFORWARD_NAME, session->drop_permille);
+	}
+
+	json_t *drop_video_packets = json_object_get(body, "drop_video_packets");
 	if (drop_video_packets) {
 		session->drop_video_packets = (guint16)json_integer_value(drop_video_packets);
 		JANUS_LOG(LOG_INFO, "%s session->drop_video_packets=%d\n", RTPFORWARD_NAME, session->drop_video_packets);
@@ -414,147 +4804,811 @@ struct janus_plugin_result *rtpforward_handle_message(janus_plugin_session *hand
 
 	json_t *video_enabled = json_object_get(body, "video_enabled");
 	if (video_enabled) {
+		gboolean was_enabled = session->video_enabled;
 		session->video_enabled = (gboolean)json_is_true(video_enabled);
+		if (session->video_enabled && !was_enabled)
+			rtpforward_gop_replay(session); // a decodable picture right away
 		JANUS_LOG(LOG_INFO, "%s session->video_enabled=%s\n", RTPFORWARD_NAME, session->video_enabled ? "TRUE" : "FALSE");
 	}
 
-	json_t *audio_enabled = json_object_get(body, "audio_enabled");
-	if (audio_enabled) {
-		session->audio_enabled = (gboolean)json_is_true(audio_enabled);
-		JANUS_LOG(LOG_INFO, "%s session->audio_enabled=%s\n", RTPFORWARD_NAME, session->audio_enabled ? "TRUE" : "FALSE");
-	}
+	json_t *audio_enabled = json_object_get(body, "audio_enabled");
+	if (audio_enabled) {
+		session->audio_enabled = (gboolean)json_is_true(audio_enabled);
+		JANUS_LOG(LOG_INFO, "%s session->audio_enabled=%s\n", RTPFORWARD_NAME, session->audio_enabled ? "TRUE" : "FALSE");
+	}
+
+
+	json_t *request = json_object_get(body, "request");
+	if (request) {
+		const char *request_text = json_string_value(request);
+
+		if(!strcmp(request_text, "configure")) {
+			/* Everything is validated, and what can fail is set up, before the session is changed, so a request
+			 * which fails leaves the session as it was. */
+
+			const char *acodec = NULL, *vcodec = NULL;
+			const char *negotiate_acodec = json_string_value(json_object_get(body, "negotiate_acodec"));
+			if (negotiate_acodec) {
+				// For supported audio codecs, see sdp-utils.c
+				if (!strcmp(negotiate_acodec, "pcmu")) {
+					acodec = "pcmu";
+				} else if (!strcmp(negotiate_acodec, "pcma")) {
+					acodec = "pcma";
+				} else if (!strcmp(negotiate_acodec, "g722")) {
+					acodec = "g722";
+				} else if (!strcmp(negotiate_acodec, "isac16")) {
+					acodec = "isac16";
+				} else if (!strcmp(negotiate_acodec, "isac32")) {
+					acodec = "isac32";
+				} else {
+					// "opus" or default
+					acodec = "opus";
+				}
+			}
+
+			const char *negotiate_vcodec = json_string_value(json_object_get(body, "negotiate_vcodec"));
+			if (negotiate_vcodec) {
+				// For supported video codecs, see sdp-utils.c
+				if (!strcmp(negotiate_vcodec, "h264")) {
+					vcodec = "h264";
+				} else if (!strcmp(negotiate_vcodec, "vp9")) {
+					vcodec = "vp9";
+				} else if (!strcmp(negotiate_vcodec, "av1")) {
+					vcodec = "av1";
+				} else if (!strcmp(negotiate_vcodec, "h265")) {
+					vcodec = "h265";
+				} else {
+					// "vp8" or default
+					vcodec = "vp8";
+				}
+			}
+
+			guint16 sendport_video_rtp = (guint16)json_integer_value(json_object_get(body, "sendport_video_rtp"));
+			if (sendport_video_rtp) {
+				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_video_rtp);
+			} else {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_video_rtp\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_video_rtp");
+				goto respond;
+			}
+
+			guint16 sendport_video_rtcp = (guint16)json_integer_value(json_object_get(body, "sendport_video_rtcp"));
+			if (sendport_video_rtcp) {
+				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_video_rtcp);
+			} else {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_video_rtcp\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_video_rtcp");
+				goto respond;
+			}
+
+			guint16 sendport_audio_rtp = (guint16)json_integer_value(json_object_get(body, "sendport_audio_rtp"));
+			if (sendport_audio_rtp) {
+				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_audio_rtp);
+			} else {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_audio_rtp\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_audio_rtp");
+				goto respond;
+			}
+
+			guint16 sendport_audio_rtcp = (guint16)json_integer_value(json_object_get(body, "sendport_audio_rtcp"));
+			if (sendport_audio_rtcp) {
+				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_audio_rtcp);
+			} else {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_audio_rtcp\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_audio_rtcp");
+				goto respond;
+			}
+
+			const char *sendipv4 = json_string_value(json_object_get(body, "sendipv4"));
+			if (sendipv4) {
+				JANUS_LOG(LOG_INFO, "%s Will forward to IPv4 %s\n", RTPFORWARD_NAME, sendipv4);
+			} else {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendipv4\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: sendipv4");
+				goto respond;
+			}
+
+			json_t *rewrite_headers = json_object_get(body, "rewrite_headers");
+			if (rewrite_headers && !json_is_boolean(rewrite_headers)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: rewrite_headers\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: rewrite_headers (must be a boolean)");
+				goto respond;
+			}
+			const char *rewrite_pt_keys[] = { "rewrite_audio_pt", "rewrite_video_pt" };
+			json_t *rewrite_pt[2];
+			int media;
+			for (media = 0; media < 2; media++) {
+				rewrite_pt[media] = json_object_get(body, rewrite_pt_keys[media]);
+				json_int_t value = json_integer_value(rewrite_pt[media]);
+				if (rewrite_pt[media] && (!json_is_integer(rewrite_pt[media]) || value < -1 || value > 127)) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: %s\n", RTPFORWARD_NAME, rewrite_pt_keys[media]);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: %s (must be between 0 and 127, or -1 to keep it)", rewrite_pt_keys[media]);
+					goto respond;
+				}
+			}
+
+			json_t *batch_size = json_object_get(body, "batch_size");
+			if (batch_size) {
+				json_int_t value = json_integer_value(batch_size);
+				if (value < 1 || value > RTPFORWARD_BATCH_SIZE_MAX) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: batch_size\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: batch_size (must be between 1 and %d)", RTPFORWARD_BATCH_SIZE_MAX);
+					goto respond;
+				}
+			}
+
+			json_t *batch_latency_us = json_object_get(body, "batch_latency_us");
+			if (batch_latency_us) {
+				json_int_t value = json_integer_value(batch_latency_us);
+				if (value < 0 || value > G_USEC_PER_SEC) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: batch_latency_us\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: batch_latency_us (must be between 0 and %d)", G_USEC_PER_SEC);
+					goto respond;
+				}
+			}
+
+			json_t *reorder_buffer_ms = json_object_get(body, "reorder_buffer_ms");
+			if (reorder_buffer_ms) {
+				json_int_t value = json_integer_value(reorder_buffer_ms);
+				if (value < 0 || value > RTPFORWARD_REORDER_MS_MAX) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: reorder_buffer_ms\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: reorder_buffer_ms (must be between 0 and %d)", RTPFORWARD_REORDER_MS_MAX);
+					goto respond;
+				}
+			}
+
+			json_t *reorder_buffer_packets = json_object_get(body, "reorder_buffer_packets");
+			if (reorder_buffer_packets) {
+				json_int_t value = json_integer_value(reorder_buffer_packets);
+				if (value < 1 || value > RTPFORWARD_REORDER_SLOTS) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: reorder_buffer_packets\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: reorder_buffer_packets (must be between 1 and %d)", RTPFORWARD_REORDER_SLOTS);
+					goto respond;
+				}
+			}
+
+			json_t *gop_cache_kb = json_object_get(body, "gop_cache_kb");
+			if (gop_cache_kb) {
+				json_int_t value = json_integer_value(gop_cache_kb);
+				if (value < 0 || value > RTPFORWARD_GOP_CACHE_KB_MAX) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: gop_cache_kb\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: gop_cache_kb (must be between 0 and %d)", RTPFORWARD_GOP_CACHE_KB_MAX);
+					goto respond;
+				}
+			}
+
+			json_t *gop_replay_kbps = json_object_get(body, "gop_replay_kbps");
+			if (gop_replay_kbps && json_integer_value(gop_replay_kbps) < 0) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: gop_replay_kbps\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: gop_replay_kbps (must not be negative)");
+				goto respond;
+			}
+
+			json_t *video_frames = json_object_get(body, "video_frames");
+			json_t *frame_max_kb = json_object_get(body, "frame_max_kb");
+			json_t *frame_socket = json_object_get(body, "frame_socket");
+			if (video_frames && !json_is_boolean(video_frames)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: video_frames\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: video_frames (must be a boolean)");
+				goto respond;
+			}
+			if (frame_max_kb && (!json_is_integer(frame_max_kb) || json_integer_value(frame_max_kb) < 1 ||
+					json_integer_value(frame_max_kb) > RTPFORWARD_FRAME_KB_MAX)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: frame_max_kb\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: frame_max_kb (must be between 1 and %d)", RTPFORWARD_FRAME_KB_MAX);
+				goto respond;
+			}
+			if (frame_socket && !json_is_string(frame_socket)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: frame_socket\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: frame_socket (must be a string)");
+				goto respond;
+			}
+			json_t *gso = json_object_get(body, "gso");
+			if (gso && !json_is_boolean(gso)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: gso\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: gso (must be a boolean)");
+				goto respond;
+			}
+
+			json_t *mux_port = json_object_get(body, "mux_port");
+			json_t *mux_socket = json_object_get(body, "mux_socket");
+			json_t *mux_id = json_object_get(body, "mux_id");
+			if (mux_port && (!json_is_integer(mux_port) || json_integer_value(mux_port) < 1 || json_integer_value(mux_port) > 65535)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: mux_port\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: mux_port (must be between 1 and 65535)");
+				goto respond;
+			}
+			if (mux_socket && (!json_is_string(mux_socket) || mux_port)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: mux_socket\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: mux_socket (must be a string, and not given with mux_port)");
+				goto respond;
+			}
+			if (mux_id && (!json_is_integer(mux_id) || json_integer_value(mux_id) < 0 || json_integer_value(mux_id) > G_MAXUINT32)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: mux_id\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: mux_id (must be between 0 and %u)", G_MAXUINT32);
+				goto respond;
+			}
+
+			json_t *rtcp_feedback = json_object_get(body, "rtcp_feedback");
+			json_t *rtcp_feedback_port = json_object_get(body, "rtcp_feedback_port");
+			if (rtcp_feedback && !json_is_boolean(rtcp_feedback)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: rtcp_feedback\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: rtcp_feedback (must be a boolean)");
+				goto respond;
+			}
+			if (rtcp_feedback_port && (!json_is_integer(rtcp_feedback_port) || json_integer_value(rtcp_feedback_port) < 0 ||
+					json_integer_value(rtcp_feedback_port) > 65535)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: rtcp_feedback_port\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: rtcp_feedback_port (must be between 0 and 65535)");
+				goto respond;
+			}
+			json_t *adaptive_bitrate = json_object_get(body, "adaptive_bitrate");
+			if (adaptive_bitrate && !json_is_boolean(adaptive_bitrate)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: adaptive_bitrate\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: adaptive_bitrate (must be a boolean)");
+				goto respond;
+			}
+			const char *abr_kbps_keys[] = { "adaptive_bitrate_min_kbps", "adaptive_bitrate_max_kbps" };
+			json_t *abr_kbps[2];
+			for (media = 0; media < 2; media++) {
+				abr_kbps[media] = json_object_get(body, abr_kbps_keys[media]);
+				json_int_t value = json_integer_value(abr_kbps[media]);
+				if (abr_kbps[media] && (!json_is_integer(abr_kbps[media]) || value < 1 || value > RTPFORWARD_ABR_KBPS_MAX)) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: %s\n", RTPFORWARD_NAME, abr_kbps_keys[media]);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: %s (must be between 1 and %d)", abr_kbps_keys[media], RTPFORWARD_ABR_KBPS_MAX);
+					goto respond;
+				}
+			}
+			janus_mutex_lock(&session->feedback_mutex);
+			guint32 abr_min_bps = abr_kbps[0] ? (guint32)json_integer_value(abr_kbps[0]) * 1000 : session->abr_min_bps;
+			guint32 abr_max_bps = abr_kbps[1] ? (guint32)json_integer_value(abr_kbps[1]) * 1000 : session->abr_max_bps;
+			janus_mutex_unlock(&session->feedback_mutex);
+			if (abr_min_bps > abr_max_bps) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: adaptive_bitrate_min_kbps\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: adaptive_bitrate_min_kbps (must not be above adaptive_bitrate_max_kbps)");
+				goto respond;
+			}
+
+			const char *feedback_interval_keys[] = { "rtcp_feedback_keyframe_interval_ms", "rtcp_feedback_remb_interval_ms" };
+			json_t *feedback_interval[2];
+			for (media = 0; media < 2; media++) {
+				feedback_interval[media] = json_object_get(body, feedback_interval_keys[media]);
+				json_int_t value = json_integer_value(feedback_interval[media]);
+				if (feedback_interval[media] && (!json_is_integer(feedback_interval[media]) || value < 1 || value > RTPFORWARD_FEEDBACK_INTERVAL_MS_MAX)) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: %s\n", RTPFORWARD_NAME, feedback_interval_keys[media]);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: %s (must be between 1 and %d)", feedback_interval_keys[media], RTPFORWARD_FEEDBACK_INTERVAL_MS_MAX);
+					goto respond;
+				}
+			}
+			// Pacing last, as it starts out from the current pacing of the destination with id 0
+			guint32 pacing_kbps, pacing_burst;
+			rtpforward_destination current;
+			memset(&current, 0, sizeof(current));
+			janus_mutex_lock(&session->egress_mutex);
+			int index = rtpforward_destination_find(session, 0);
+			if (index >= 0)
+				current.pacer = session->destinations[index].pacer;
+			gboolean pacing_valid = rtpforward_pacing_parse(&current, body, &pacing_kbps, &pacing_burst, error_cause);
+			janus_mutex_unlock(&session->egress_mutex);
+			if (!pacing_valid) {
+				JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				goto respond;
+			}
+
+			rtpforward_frame_assembler *frames = NULL;
+			if (video_frames && json_is_true(video_frames)) {
+				guint32 max_kb = frame_max_kb ? (guint32)json_integer_value(frame_max_kb) : RTPFORWARD_FRAME_KB_DEFAULT;
+				frames = rtpforward_frame_assembler_new(max_kb, json_string_value(frame_socket), error_cause);
+				if (!frames) {
+					JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+					error_code = RTPFORWARD_ERROR_FRAMES_FAILED;
+					goto respond;
+				}
+			}
+			// Like the destination, the mux target is replaced by every configure
+			rtpforward_mux *mux = NULL;
+			if (mux_port || mux_socket) {
+				struct sockaddr_in mux_addr;
+				memset(&mux_addr, 0, sizeof(mux_addr));
+				mux_addr.sin_family = AF_INET;
+				mux_addr.sin_addr.s_addr = inet_addr(sendipv4);
+				mux_addr.sin_port = htons((guint16)json_integer_value(mux_port));
+				mux = rtpforward_mux_get(&mux_addr, json_string_value(mux_socket), error_cause);
+				if (!mux) {
+					rtpforward_frame_assembler_free(frames);
+					JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+					error_code = RTPFORWARD_ERROR_MUX_FAILED;
+					goto respond;
+				}
+			}
+
+			// Nothing can fail from here on, but the sockets
+			if (acodec)
+				strcpy(session->negotiate_acodec, acodec);
+			if (vcodec)
+				strcpy(session->negotiate_vcodec, vcodec);
+			for (media = 0; media < 2; media++) {
+				if (rewrite_pt[media])
+					session->rewrite_pt[media] = (gint8)json_integer_value(rewrite_pt[media]);
+			}
+			if (rewrite_headers && json_is_true(rewrite_headers) != session->rewrite_headers) {
+				if (json_is_true(rewrite_headers)) {
+					// Start over from the next packets
+					janus_rtp_switching_context_reset(&session->context);
+					session->rewrite_ssrc[0] = session->rewrite_ssrc[1] = 0;
+				}
+				session->rewrite_headers = json_is_true(rewrite_headers);
+				JANUS_LOG(LOG_INFO, "%s Will %s RTP headers\n", RTPFORWARD_NAME, session->rewrite_headers ? "rewrite" : "no longer rewrite");
+			}
+			if (batch_size) {
+				JANUS_LOG(LOG_INFO, "%s Will send in batches of up to %d packets\n", RTPFORWARD_NAME, (int)json_integer_value(batch_size));
+				session->batch_size = (guint16)json_integer_value(batch_size);
+			}
+			if (batch_latency_us) {
+				JANUS_LOG(LOG_INFO, "%s Batches will wait at most %d us\n", RTPFORWARD_NAME, (int)json_integer_value(batch_latency_us));
+				session->batch_latency_us = (guint32)json_integer_value(batch_latency_us);
+			}
+			if (reorder_buffer_ms || reorder_buffer_packets) {
+				janus_mutex_lock(&session->reorder_mutex);
+				if (reorder_buffer_ms)
+					session->reorder_buffer_us = (guint32)json_integer_value(reorder_buffer_ms) * 1000;
+				if (reorder_buffer_packets)
+					session->reorder_buffer_packets = (guint16)json_integer_value(reorder_buffer_packets);
+				JANUS_LOG(LOG_INFO, "%s Reorder buffers will hold packets for at most %d ms, and span at most %d packets\n", RTPFORWARD_NAME,
+					(int)(session->reorder_buffer_us / 1000), (int)session->reorder_buffer_packets);
+				rtpforward_reorder_configure(&session->reorder_video, session->reorder_buffer_us > 0);
+				rtpforward_reorder_configure(&session->reorder_audio, session->reorder_buffer_us > 0);
+				janus_mutex_unlock(&session->reorder_mutex);
+			}
+
+			janus_mutex_lock(&session->gop_mutex);
+			if (gop_cache_kb) {
+				gsize size = (gsize)json_integer_value(gop_cache_kb) * 1024;
+				if (size != session->gop_cache.size) {
+					JANUS_LOG(LOG_INFO, "%s Will cache up to %d kB of video since the last keyframe\n", RTPFORWARD_NAME, (int)(size / 1024));
+					g_free(session->gop_cache.arena);
+					session->gop_cache.arena = size ? g_malloc(size) : NULL;
+					session->gop_cache.size = size;
+					session->gop_cache.used = 0;
+					session->gop_cache.count = 0;
+					session->gop_cache.valid = FALSE;
+					session->gop_cache.replaying = FALSE;
+					session->gop_cache.generation++;
+				}
+			}
+			if (gop_replay_kbps)
+				session->gop_cache.replay_kbps = (guint32)json_integer_value(gop_replay_kbps);
+			janus_mutex_unlock(&session->gop_mutex);
+
+			if (video_frames) {
+				if (frames)
+					JANUS_LOG(LOG_INFO, "%s Will send whole video frames of up to %d kB%s%s\n", RTPFORWARD_NAME,
+						frame_max_kb ? (int)json_integer_value(frame_max_kb) : RTPFORWARD_FRAME_KB_DEFAULT,
+						frame_socket ? ", also to " : "", frame_socket ? json_string_value(frame_socket) : "");
+				janus_mutex_lock(&session->frames_mutex);
+				rtpforward_frame_assembler *old = session->frames;
+				g_atomic_pointer_set(&session->frames, frames);
+				janus_mutex_unlock(&session->frames_mutex);
+				rtpforward_frame_assembler_free(old);
+			}
 
+			// The socket is replaced below: stop reading from it first
+			rtpforward_feedback_stop(session);
+			janus_mutex_lock(&session->feedback_mutex);
+			if (rtcp_feedback)
+				session->feedback = json_is_true(rtcp_feedback);
+			if (rtcp_feedback_port)
+				session->feedback_port = (guint16)json_integer_value(rtcp_feedback_port);
+			if (feedback_interval[0])
+				session->feedback_keyframe_interval_us = (guint32)json_integer_value(feedback_interval[0]) * 1000;
+			if (feedback_interval[1])
+				session->feedback_remb_interval_us = (guint32)json_integer_value(feedback_interval[1]) * 1000;
+			if (!session->feedback)
+				session->feedback_remb_last = 0;
+			rtpforward_abr_configure(session, adaptive_bitrate ? json_is_true(adaptive_bitrate) : session->abr, abr_min_bps, abr_max_bps);
+			gboolean feedback = session->feedback;
+			guint16 feedback_port = session->feedback_port;
+			janus_mutex_unlock(&session->feedback_mutex);
+
+			janus_mutex_lock(&session->egress_mutex);
+
+			// send what is still staged
+			rtpforward_batch_flush(session);
+
+			// replace the destination with id 0, or insert it before those added with "add_destination"
+			index = rtpforward_destination_find(session, 0);
+			if (index < 0) {
+				memmove(&session->destinations[1], &session->destinations[0], session->destination_count * sizeof(rtpforward_destination));
+				session->destination_count++;
+				index = 0;
+				session->destinations[0].pacer = NULL;
+			}
+			rtpforward_destination *destination = &session->destinations[index];
+			rtpforward_pacer_configure(session, destination, pacing_kbps, pacing_burst);
+			rtpforward_mux *old_mux = session->mux;
+			g_atomic_pointer_set(&session->mux, mux);
+			if (mux_id)
+				session->mux_id = (guint32)json_integer_value(mux_id);
+			rtpforward_pacer *pacer = destination->pacer;
+			memset(destination, 0, sizeof(rtpforward_destination));
+			destination->pacer = pacer;
+			destination->addr.sin_family = AF_INET;
+			destination->addr.sin_addr.s_addr = inet_addr(sendipv4);
+			destination->ports[STREAM_AUDIO_RTP] = sendport_audio_rtp;
+			destination->ports[STREAM_AUDIO_RTCP] = sendport_audio_rtcp;
+			destination->ports[STREAM_VIDEO_RTP] = sendport_video_rtp;
+			destination->ports[STREAM_VIDEO_RTCP] = sendport_video_rtcp;
+			destination->audio = destination->video = destination->rtcp = TRUE;
+			rtpforward_destination_update(destination);
 
-	json_t *request = json_object_get(body, "request");
-	if (request) {
-		const char *request_text = json_string_value(request);
+			// close socket if already open
+			if (session->sendsockfd) {
+				close(session->sendsockfd);
+				session->sendsockfd = -1;
+			}
 
-		if(!strcmp(request_text, "configure")) {
+			// create and configure socket
+			session->sendsockfd = socket(AF_INET, SOCK_DGRAM, 0);
 
-			const char *negotiate_acodec = json_string_value(json_object_get(body, "negotiate_acodec"));
-			if (negotiate_acodec) {
-				// For supported audio codecs, see sdp-utils.c
-				if (!strcmp(negotiate_acodec, "pcmu")) {
-					strcpy(session->negotiate_acodec, "pcmu");
-				} else if (!strcmp(negotiate_acodec, "pcma")) {
-					strcpy(session->negotiate_acodec, "pcma");
-				} else if (!strcmp(negotiate_acodec, "g722")) {
-					strcpy(session->negotiate_acodec, "g722");
-				} else if (!strcmp(negotiate_acodec, "isac16")) {
-					strcpy(session->negotiate_acodec, "isac16");
-				} else if (!strcmp(negotiate_acodec, "isac32")) {
-					strcpy(session->negotiate_acodec, "isac32");
+			int feedback_error = 0;
+			if (feedback && session->sendsockfd >= 0) {
+				// All packets go out from this port, so the receivers know where to send their RTCP
+				struct sockaddr_in local;
+				memset(&local, 0, sizeof(local));
+				local.sin_family = AF_INET;
+				local.sin_addr.s_addr = htonl(INADDR_ANY);
+				local.sin_port = htons(feedback_port);
+				if (bind(session->sendsockfd, (struct sockaddr *)&local, sizeof(local)) < 0)
+					feedback_error = errno;
+			}
+
+			session->txtime = FALSE;
+			if (pacing_txtime && session->sendsockfd >= 0) {
+				// The transmit times are only honored by the fq qdisc, which keeps CLOCK_MONOTONIC like Janus does
+				struct sock_txtime txtime = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+				if (setsockopt(session->sendsockfd, SOL_SOCKET, SO_TXTIME, &txtime, sizeof(txtime)) < 0) {
+					JANUS_LOG(LOG_WARN, "%s SO_TXTIME is not supported (%s), pacing with the timer\n", RTPFORWARD_NAME, strerror(errno));
 				} else {
-					// "opus" or default
-					strcpy(session->negotiate_acodec, "opus");
+					session->txtime = TRUE;
 				}
 			}
 
-			const char *negotiate_vcodec = json_string_value(json_object_get(body, "negotiate_vcodec"));
-			if (negotiate_vcodec) {
-				// For supported video codecs, see sdp-utils.c
-				if (!strcmp(negotiate_vcodec, "h264")) {
-					strcpy(session->negotiate_vcodec, "h264");
-				} else if (!strcmp(negotiate_vcodec, "vp9")) {
-					strcpy(session->negotiate_vcodec, "vp9");
+			session->gso = gso ? json_is_true(gso) : session->gso;
+			if (session->gso && session->sendsockfd >= 0) {
+				// Kernels before 4.18 don't know UDP_SEGMENT. A segment size of 0 only tests for it.
+				int segment_size = 0;
+				if (setsockopt(session->sendsockfd, SOL_UDP, UDP_SEGMENT, &segment_size, sizeof(segment_size)) < 0) {
+					JANUS_LOG(LOG_WARN, "%s UDP GSO is not supported (%s), sending video packets individually\n", RTPFORWARD_NAME, strerror(errno));
+					session->gso = FALSE;
 				} else {
-					// "vp8" or default
-					strcpy(session->negotiate_vcodec, "vp8");
+					JANUS_LOG(LOG_INFO, "%s Will send video frames with UDP GSO\n", RTPFORWARD_NAME);
 				}
 			}
 
-			guint16 sendport_video_rtp = (guint16)json_integer_value(json_object_get(body, "sendport_video_rtp"));
-			if (sendport_video_rtp) {
-				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_video_rtp);
-				session->sendport_video_rtp = sendport_video_rtp;
-			} else {
-				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_video_rtp\n", RTPFORWARD_NAME);
-				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
-				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_video_rtp");
+			// replace the staging area
+			rtpforward_batch_free(session->batch);
+			session->batch = rtpforward_batch_new(session->batch_size, session->gso);
+			janus_mutex_unlock(&session->egress_mutex);
+			rtpforward_mux_put(old_mux);
+			if (session->sendsockfd < 0) { // error
+				JANUS_LOG(LOG_ERR, "%s Could not create sending socket\n", RTPFORWARD_NAME);
+				error_code = 99; // TODO: define this
+				g_snprintf(error_cause, 512, "Could not create sending socket");
 				goto respond;
 			}
-
-			guint16 sendport_video_rtcp = (guint16)json_integer_value(json_object_get(body, "sendport_video_rtcp"));
-			if (sendport_video_rtcp) {
-				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_video_rtcp);
-				session->sendport_video_rtcp = sendport_video_rtcp;
-			} else {
-				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_video_rtcp\n", RTPFORWARD_NAME);
-				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
-				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_video_rtcp");
-				goto respond;
+			guint d;
+			for (d = 0; d < session->destination_count; d++) {
+				if (IN_MULTICAST(ntohl(session->destinations[d].addr.sin_addr.s_addr)))
+					rtpforward_setup_multicast(session->sendsockfd, session->destinations[d].addr.sin_addr);
 			}
 
-			guint16 sendport_audio_rtp = (guint16)json_integer_value(json_object_get(body, "sendport_audio_rtp"));
-			if (sendport_audio_rtp) {
-				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_audio_rtp);
-				session->sendport_audio_rtp = sendport_audio_rtp;
-			} else {
-				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_audio_rtp\n", RTPFORWARD_NAME);
-				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
-				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_audio_rtp");
-				goto respond;
-			}
+			rtpforward_egress_attach(session);
+			rtpforward_gop_replay(session);
 
-			guint16 sendport_audio_rtcp = (guint16)json_integer_value(json_object_get(body, "sendport_audio_rtcp"));
-			if (sendport_audio_rtcp) {
-				JANUS_LOG(LOG_INFO, "%s Will forward to port %d\n", RTPFORWARD_NAME, sendport_audio_rtcp);
-				session->sendport_audio_rtcp = sendport_audio_rtcp;
-			} else {
-				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendport_audio_rtcp\n", RTPFORWARD_NAME);
-				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
-				g_snprintf(error_cause, 512, "JSON error: Missing element: sendport_audio_rtcp");
-				goto respond;
+			response = json_object();
+			json_object_set_new(response, "configured", json_string("ok"));
+			if (mux)
+				json_object_set_new(response, "mux_id", json_integer(session->mux_id));
+			if (feedback_error) {
+				// The new configuration is live and forwarding works, but the receivers can't be told where to send RTCP
+				JANUS_LOG(LOG_WARN, "%s Could not bind to port %d for RTCP feedback: %s\n", RTPFORWARD_NAME, feedback_port, strerror(feedback_error));
+				char warning[512];
+				g_snprintf(warning, sizeof(warning), "Could not bind to port %d for RTCP feedback: %s", feedback_port, strerror(feedback_error));
+				json_object_set_new(response, "warning", json_string(warning));
+			} else if (feedback) {
+				rtpforward_feedback_start(session);
+				struct sockaddr_in local;
+				socklen_t local_length = sizeof(local);
+				if (getsockname(session->sendsockfd, (struct sockaddr *)&local, &local_length) == 0)
+					json_object_set_new(response, "rtcp_feedback_port", json_integer(ntohs(local.sin_port)));
 			}
+			goto respond;
 
+		} else if (!strcmp(request_text, "add_destination")) {
 			const char *sendipv4 = json_string_value(json_object_get(body, "sendipv4"));
-			if (sendipv4) {
-				JANUS_LOG(LOG_INFO, "%s Will forward to IPv4 %s\n", RTPFORWARD_NAME, sendipv4);
-				session->sendsockaddr.sin_addr.s_addr = inet_addr(sendipv4);
-			} else {
+			if (!sendipv4) {
 				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: sendipv4\n", RTPFORWARD_NAME);
 				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
 				g_snprintf(error_cause, 512, "JSON error: Missing element: sendipv4");
 				goto respond;
 			}
+			rtpforward_destination destination;
+			memset(&destination, 0, sizeof(destination));
+			destination.addr.sin_family = AF_INET;
+			destination.addr.sin_addr.s_addr = inet_addr(sendipv4);
+			rtpforward_stream stream;
+			for (stream = 0; stream < STREAM_COUNT; stream++) {
+				destination.ports[stream] = (guint16)json_integer_value(json_object_get(body, rtpforward_port_keys[stream]));
+				if (!destination.ports[stream]) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: %s\n", RTPFORWARD_NAME, rtpforward_port_keys[stream]);
+					error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Missing element: %s", rtpforward_port_keys[stream]);
+					goto respond;
+				}
+			}
+			destination.audio = destination.video = destination.rtcp = TRUE;
+			const char *invalid = rtpforward_destination_parse(&destination, body);
+			if (invalid) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: %s\n", RTPFORWARD_NAME, invalid);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: %s (must be a boolean)", invalid);
+				goto respond;
+			}
+			guint32 pacing_kbps, pacing_burst;
+			if (!rtpforward_pacing_parse(&destination, body, &pacing_kbps, &pacing_burst, error_cause)) {
+				JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				goto respond;
+			}
 
-			// close socket if already open
-			if (session->sendsockfd) {
-				close(session->sendsockfd);
-				session->sendsockfd = -1;
+			janus_mutex_lock(&session->egress_mutex);
+			// keep room for the destination of "configure"
+			guint limit = RTPFORWARD_DESTINATIONS_MAX - (rtpforward_destination_find(session, 0) < 0 ? 1 : 0);
+			if (session->destination_count >= limit) {
+				janus_mutex_unlock(&session->egress_mutex);
+				JANUS_LOG(LOG_ERR, "%s Too many destinations\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_TOO_MANY_DESTINATIONS;
+				g_snprintf(error_cause, 512, "Too many destinations (at most %d)", RTPFORWARD_DESTINATIONS_MAX);
+				goto respond;
 			}
+			destination.id = session->destination_next_id++;
+			session->destinations[session->destination_count++] = destination;
+			rtpforward_pacer_configure(session, &session->destinations[session->destination_count - 1], pacing_kbps, pacing_burst);
+			if (session->sendsockfd >= 0 && IN_MULTICAST(ntohl(destination.addr.sin_addr.s_addr)))
+				rtpforward_setup_multicast(session->sendsockfd, destination.addr.sin_addr);
+			janus_mutex_unlock(&session->egress_mutex);
+
+			JANUS_LOG(LOG_INFO, "%s Added destination %u: %s\n", RTPFORWARD_NAME, destination.id, sendipv4);
+			response = json_object();
+			json_object_set_new(response, "destination_id", json_integer(destination.id));
+			goto respond;
 
-			// create and configure socket
-			session->sendsockfd = socket(AF_INET, SOCK_DGRAM, 0);
-			if (session->sendsockfd < 0) { // error
-				JANUS_LOG(LOG_ERR, "%s Could not create sending socket\n", RTPFORWARD_NAME);
-				error_code = 99; // TODO: define this
-				g_snprintf(error_cause, 512, "Could not create sending socket");
+		} else if (!strcmp(request_text, "configure_destination") || !strcmp(request_text, "remove_destination")) {
+			json_t *destination_id = json_object_get(body, "destination_id");
+			if (!destination_id || !json_is_integer(destination_id)) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: destination_id\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: destination_id");
+				goto respond;
+			}
+			guint id = (guint)json_integer_value(destination_id);
+
+			janus_mutex_lock(&session->egress_mutex);
+			int index = rtpforward_destination_find(session, id);
+			if (index < 0) {
+				janus_mutex_unlock(&session->egress_mutex);
+				JANUS_LOG(LOG_ERR, "%s No such destination %u\n", RTPFORWARD_NAME, id);
+				error_code = RTPFORWARD_ERROR_NO_SUCH_DESTINATION;
+				g_snprintf(error_cause, 512, "No such destination (%u)", id);
+				goto respond;
+			}
+			if (!strcmp(request_text, "remove_destination")) {
+				// Packets already handed to the kernel are not affected, those waiting in its pacer are dropped
+				if(session->destinations[index].pacer)
+					RTPFORWARD_STAT_ADD(session->stats.paced_dropped, session->destinations[index].pacer->count);
+				g_free(session->destinations[index].pacer);
+				session->destination_count--;
+				memmove(&session->destinations[index], &session->destinations[index + 1],
+					(session->destination_count - index) * sizeof(rtpforward_destination));
+				janus_mutex_unlock(&session->egress_mutex);
+				JANUS_LOG(LOG_INFO, "%s Removed destination %u\n", RTPFORWARD_NAME, id);
+				response = json_object();
+				goto respond;
+			}
+			rtpforward_destination destination = session->destinations[index];
+			const char *invalid = rtpforward_destination_parse(&destination, body);
+			if (invalid) {
+				janus_mutex_unlock(&session->egress_mutex);
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: %s\n", RTPFORWARD_NAME, invalid);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: %s (must be a boolean)", invalid);
 				goto respond;
 			}
-			if (IN_MULTICAST(ntohl(inet_addr(sendipv4)))) {
-				uint8_t ttl = 0; // do not route UDP packets outside of local host
-				setsockopt(session->sendsockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+			guint32 pacing_kbps, pacing_burst;
+			if (!rtpforward_pacing_parse(&destination, body, &pacing_kbps, &pacing_burst, error_cause)) {
+				janus_mutex_unlock(&session->egress_mutex);
+				JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				goto respond;
+			}
+			session->destinations[index] = destination;
+			rtpforward_pacer_configure(session, &session->destinations[index], pacing_kbps, pacing_burst);
+			response = rtpforward_destination_json(&session->destinations[index]);
+			janus_mutex_unlock(&session->egress_mutex);
+			goto respond;
 
-				struct in_addr mcast_iface_addr;
-				// We explicitly choose the multicast network interface, otherwise the kernel will choose for us.
-				// We go for the software loopback interface for low latency. A physical ethernet card could add latency.
-				mcast_iface_addr.s_addr = htonl(INADDR_LOOPBACK);
+		} else if (!strcmp(request_text, "list_destinations")) {
+			json_t *list = json_array();
+			guint d;
+			janus_mutex_lock(&session->egress_mutex);
+			for (d = 0; d < session->destination_count; d++)
+				json_array_append_new(list, rtpforward_destination_json(&session->destinations[d]));
+			janus_mutex_unlock(&session->egress_mutex);
+			response = json_object();
+			json_object_set_new(response, "destinations", list);
+			goto respond;
 
-				JANUS_LOG(LOG_WARN, "%s: This rtpforward session will multicast to IP multicast address %s "
-				"because you specified it. The IP_MULTICAST_TTL option has been set to 0 (zero), which "
-				"SHOULD cause at least the first router (the Linux kernel) to NOT forward the UDP packets. "
-				"The behavior is is however OS-specific. You SHOULD verify that the UDP packets "
-				"are not inadvertenly forwarded into network zones where the security/privacy of the packets "
-				"could be compromised.\n", RTPFORWARD_NAME, inet_ntoa(session->sendsockaddr.sin_addr));
+		} else if (!strcmp(request_text, "replay_gop")) {
+			guint count = rtpforward_gop_replay(session);
+			response = json_object();
+			json_object_set_new(response, "replayed", json_integer(count));
+			goto respond;
 
-				JANUS_LOG(LOG_WARN, "%s: Will multicast from network interface with IP %s\n", RTPFORWARD_NAME, inet_ntoa(mcast_iface_addr));
+		} else if (!strcmp(request_text, "capture")) {
+			const char *action = json_string_value(json_object_get(body, "action"));
+			if (!action || (strcmp(action, "start") && strcmp(action, "stop"))) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: action\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: action (must be \"start\" or \"stop\")");
+				goto respond;
+			}
+			if (!strcmp(action, "stop")) {
+				if (!rtpforward_capture_stop(session)) {
+					error_code = RTPFORWARD_ERROR_CAPTURE_FAILED;
+					g_snprintf(error_cause, 512, "Not capturing");
+					goto respond;
+				}
+				response = json_object();
+				json_object_set_new(response, "capture", json_string("stopped"));
+				goto respond;
+			}
+			const char *name = json_string_value(json_object_get(body, "name"));
+			if (!name || !*name) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Missing element: name\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_MISSING_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Missing element: name");
+				goto respond;
+			}
+			// A name, not a path: the files stay in capture_dir
+			if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..") || !strcmp(name, ".pcap")) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: name\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: name (must be a file name, not a path)");
+				goto respond;
+			}
+			json_int_t max_file_mb = RTPFORWARD_CAPTURE_FILE_MB_DEFAULT;
+			json_t *value = json_object_get(body, "max_file_mb");
+			if (value) {
+				max_file_mb = json_integer_value(value);
+				if (!json_is_integer(value) || max_file_mb < 1 || max_file_mb > RTPFORWARD_CAPTURE_FILE_MB_MAX) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: max_file_mb\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: max_file_mb (must be between 1 and %d)", RTPFORWARD_CAPTURE_FILE_MB_MAX);
+					goto respond;
+				}
+			}
+			json_int_t max_file_seconds = 0;
+			value = json_object_get(body, "max_file_seconds");
+			if (value) {
+				max_file_seconds = json_integer_value(value);
+				if (!json_is_integer(value) || max_file_seconds < 0) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: max_file_seconds\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: max_file_seconds (must be a positive integer)");
+					goto respond;
+				}
+			}
+			if (rtpforward_capture_start(session, name, (gsize)max_file_mb * 1024 * 1024, (gint64)max_file_seconds * G_USEC_PER_SEC, error_cause) < 0) {
+				JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+				error_code = RTPFORWARD_ERROR_CAPTURE_FAILED;
+				goto respond;
+			}
+			JANUS_LOG(LOG_INFO, "%s Capturing forwarded packets to %s in %s\n", RTPFORWARD_NAME, name, capture_dir);
+			response = json_object();
+			json_object_set_new(response, "capture", json_string("started"));
+			goto respond;
 
-				setsockopt(session->sendsockfd, IPPROTO_IP, IP_MULTICAST_IF, &mcast_iface_addr, sizeof(mcast_iface_addr));
+		} else if (!strcmp(request_text, "shm")) {
+			const char *action = json_string_value(json_object_get(body, "action"));
+			if (!action || (strcmp(action, "start") && strcmp(action, "stop"))) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: action\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: action (must be \"start\" or \"stop\")");
+				goto respond;
+			}
+			if (!strcmp(action, "stop")) {
+				if (!rtpforward_shm_stop(session)) {
+					error_code = RTPFORWARD_ERROR_SHM_FAILED;
+					g_snprintf(error_cause, 512, "Shared memory not started");
+					goto respond;
+				}
+				JANUS_LOG(LOG_INFO, "%s Stopped forwarding to shared memory\n", RTPFORWARD_NAME);
+				response = json_object();
+				json_object_set_new(response, "shm", json_string("stopped"));
+				goto respond;
+			}
+			json_int_t slots = RTPFORWARD_SHM_SLOTS_DEFAULT;
+			json_t *value = json_object_get(body, "slots");
+			if (value) {
+				slots = json_integer_value(value);
+				if (!json_is_integer(value) || slots < RTPFORWARD_SHM_SLOTS_MIN || slots > RTPFORWARD_SHM_SLOTS_MAX || (slots & (slots - 1))) {
+					JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: slots\n", RTPFORWARD_NAME);
+					error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+					g_snprintf(error_cause, 512, "JSON error: Invalid element: slots (must be a power of two between %d and %d)", RTPFORWARD_SHM_SLOTS_MIN, RTPFORWARD_SHM_SLOTS_MAX);
+					goto respond;
+				}
+			}
+			value = json_object_get(body, "socket");
+			if (value && (!json_is_string(value) || !*json_string_value(value))) {
+				JANUS_LOG(LOG_ERR, "%s JSON error: Invalid element: socket\n", RTPFORWARD_NAME);
+				error_code = RTPFORWARD_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "JSON error: Invalid element: socket (must be a path)");
+				goto respond;
+			}
+			const char *socket_path = value ? json_string_value(value) : NULL;
+			if (rtpforward_shm_start(session, (guint32)slots, socket_path, error_cause) < 0) {
+				JANUS_LOG(LOG_ERR, "%s %s\n", RTPFORWARD_NAME, error_cause);
+				error_code = RTPFORWARD_ERROR_SHM_FAILED;
+				goto respond;
 			}
+			// Only read under shm_mutex, as a concurrent stop may free it
+			janus_mutex_lock(&session->shm_mutex);
+			char *path = session->shm ? g_strdup_printf("/proc/%d/fd/%d", getpid(), session->shm->memfd) : NULL;
+			janus_mutex_unlock(&session->shm_mutex);
+			JANUS_LOG(LOG_INFO, "%s Forwarding to shared memory %s%s%s\n", RTPFORWARD_NAME, path ? path : "",
+				socket_path ? ", passed on by " : "", socket_path ? socket_path : "");
+			response = json_object();
+			json_object_set_new(response, "shm", json_string("started"));
+			if (path)
+				json_object_set_new(response, "path", json_string(path));
+			if (socket_path)
+				json_object_set_new(response, "socket", json_string(socket_path));
+			json_object_set_new(response, "slots", json_integer(slots));
+			json_object_set_new(response, "slot_size", json_integer(sizeof(rtpforward_shm_slot)));
+			g_free(path);
+			goto respond;
 
+		} else if (!strcmp(request_text, "stats")) {
 			response = json_object();
-			json_object_set_new(response, "configured", json_string("ok"));
+			json_object_set_new(response, "stats", rtpforward_stats_json(session));
+			json_object_set_new(response, "handlers", rtpforward_handler_stats_json());
 			goto respond;
 
 		} else if (!strcmp(request_text, "pli")) {
@@ -563,7 +5617,9 @@ struct janus_plugin_result *rtpforward_handle_message(janus_plugin_session *hand
 			goto respond;
 
 		} else if (!strcmp(request_text, "fir")) {
-			gateway->send_pli(session->handle);
+			janus_mutex_lock(&session->keyframe_mutex);
+			rtpforward_request_keyframe(session, KEYFRAME_REQUEST_FIR);
+			janus_mutex_unlock(&session->keyframe_mutex);
 			response = json_object();
 			goto respond;
 
@@ -593,7 +5649,8 @@ struct janus_plugin_result *rtpforward_handle_message(janus_plugin_session *hand
 	msg->transaction = transaction;
 	msg->body = body; // guaranteed by Janus to be an object
 	msg->jsep = jsep;
-	g_async_queue_push(messages, msg);
+	msg->queued = janus_get_monotonic_time();
+	g_async_queue_push(handlers[rtpforward_handle_hash(handle) % handler_threads].messages, msg);
 	return janus_plugin_result_new(JANUS_PLUGIN_OK_WAIT, "Processing asynchronously", NULL);
 
 respond:
@@ -632,38 +5689,171 @@ void rtpforward_setup_media(janus_plugin_session *handle) {
 	JANUS_LOG(LOG_INFO, "%s WebRTC media is now available.\n", RTPFORWARD_NAME);
 }
 
-void rtpforward_incoming_rtp(janus_plugin_session *handle, janus_plugin_rtp *packet) {
-	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle; // simple and fast. echotest does the same.
+/* Registers a received sequence number and extends it to 32 bits. *lost is set to the number of packets
+ * which have now been missing for longer than the reorder tolerance. A packet which turns up after that is
+ * SEQ_LATE_LOST, unless it is older than the window, which doesn't tell anymore whether it was counted.
+ */
+static rtpforward_seq_status rtpforward_seqwin_update(rtpforward_seqwin *win, guint16 seq, guint tolerance, guint *lost, guint32 *extended) {
+	*lost = 0;
+	gint32 delta = (gint16)(seq - (guint16)win->highest);
+	if(!win->started || delta > RTPFORWARD_SEQ_MAX_DROPOUT || -delta > RTPFORWARD_SEQ_MAX_DROPOUT) {
+		// First packet, or the sender restarted its sequence
+		win->highest = win->started ? win->highest + delta : seq;
+		win->started = TRUE;
+		win->received = G_MAXUINT64; // nothing before this packet is missing
+		win->counted = 0;
+		*extended = win->highest;
+		return SEQ_IN_ORDER;
+	}
+
+	if(delta > 0) {
+		guint32 udelta = (guint32)delta;
+		/* Missing packets which leave the window are counted now, should the tolerance have been lowered since
+		 * they arrived, and so are those of the gap opened by this packet which don't fit into the window. */
+		guint64 leaving = udelta < RTPFORWARD_SEQWIN_SIZE ? ~(G_MAXUINT64 >> udelta) : G_MAXUINT64;
+		*lost += __builtin_popcountll(~win->received & ~win->counted & leaving);
+		if(udelta > RTPFORWARD_SEQWIN_SIZE)
+			*lost += udelta - RTPFORWARD_SEQWIN_SIZE;
+		win->received = (udelta < RTPFORWARD_SEQWIN_SIZE ? win->received << udelta : 0) | 1;
+		win->counted = udelta < RTPFORWARD_SEQWIN_SIZE ? win->counted << udelta : 0;
+		// Everything missing while more than tolerance newer packets arrived
+		guint64 expired = ~win->received & ~win->counted & (G_MAXUINT64 << tolerance << 1);
+		*lost += __builtin_popcountll(expired);
+		win->counted |= expired;
+		win->highest += udelta;
+		*extended = win->highest;
+		return SEQ_IN_ORDER;
+	}
+
+	guint32 age = (guint32)-delta;
+	*extended = win->highest - age;
+	if(age >= RTPFORWARD_SEQWIN_SIZE)
+		return SEQ_LATE; // long given up on
+	guint64 bit = G_GUINT64_CONSTANT(1) << age;
+	if(win->received & bit)
+		return SEQ_DUPLICATE;
+	win->received |= bit;
+	if(win->counted & bit) {
+		win->counted &= ~bit;
+		return SEQ_LATE_LOST;
+	}
+	return SEQ_LATE;
+}
+
+// Sends an RTP packet, through the stream's reorder buffer if enabled
+static void rtpforward_forward(rtpforward_session *session, rtpforward_reorder *reorder, guint32 seq, rtpforward_seq_status status,
+		char *buffer, int length, gboolean end_of_frame) {
+	if(session->reorder_buffer_us > 0) {
+		janus_mutex_lock(&session->reorder_mutex);
+		if(reorder->slots) {
+			if(status != SEQ_DUPLICATE)
+				rtpforward_reorder_push(reorder, seq, buffer, length, end_of_frame);
+			janus_mutex_unlock(&session->reorder_mutex);
+			return;
+		}
+		janus_mutex_unlock(&session->reorder_mutex);
+	}
+	rtpforward_send(session, reorder->stream, buffer, length, end_of_frame);
+}
 
-	if (session->sendsockfd < 0) return; // not yet configured: skip if no socket open
+/* Rewrites the header in place so that each stream keeps its first SSRC, and its sequence numbers and timestamps
+ * continue across renegotiations and ICE restarts. Also sets the fixed payload types, if any.
+ */
+static void rtpforward_rewrite_rtp(rtpforward_session *session, janus_rtp_header *header, gboolean video) {
+	int media = video ? 1 : 0;
+	if (session->rewrite_headers) {
+		guint32 ssrc = ntohl(header->ssrc), timestamp = ntohl(header->timestamp);
+		guint32 last_ssrc = video ? session->context.v_last_ssrc : session->context.a_last_ssrc;
+		if (!session->rewrite_ssrc[media]) {
+			session->rewrite_ssrc[media] = ssrc;
+		} else if (ssrc != last_ssrc) {
+			JANUS_LOG(LOG_INFO, "%s %s SSRC changed from %u to %u, still forwarding as %u\n", RTPFORWARD_NAME,
+				video ? "Video" : "Audio", last_ssrc, ssrc, session->rewrite_ssrc[media]);
+		}
+		// The step is ignored: the timestamp gap is derived from the time since the last packet
+		janus_rtp_header_update(header, &session->context, video, 0);
+		header->ssrc = htonl(session->rewrite_ssrc[media]);
+		session->rewrite_ts_offset[media] = ntohl(header->timestamp) - timestamp;
+	}
+	if (session->rewrite_pt[media] >= 0)
+		header->type = session->rewrite_pt[media];
+}
 
-	struct sockaddr_in addr = session->sendsockaddr;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
+/* Gives the sender reports, source descriptions and goodbyes of the current SSRC the rewritten SSRC, and the
+ * sender reports the rewritten RTP timestamp, so receivers can still synchronize audio and video. In place.
+ */
+static void rtpforward_rewrite_rtcp(rtpforward_session *session, char *buffer, int length, gboolean video) {
+	int media = video ? 1 : 0;
+	guint32 current = video ? session->context.v_last_ssrc : session->context.a_last_ssrc;
+	if (!session->rewrite_headers || !session->rewrite_ssrc[media])
+		return;
+	int offset = 0;
+	while (offset + 8 <= length) {
+		guint8 *rtcp = (guint8 *)buffer + offset;
+		int size = ((rtcp[2] << 8) + rtcp[3] + 1) * 4;
+		if (size > length - offset)
+			break;
+		guint8 type = rtcp[1];
+		guint32 ssrc;
+		memcpy(&ssrc, rtcp + 4, sizeof(ssrc));
+		// The SSRC follows the header in all of them, unless an SDES or BYE has no chunks
+		if (ntohl(ssrc) == current && (type == 200 || ((type == 202 || type == 203) && (rtcp[0] & 0x1f) > 0))) {
+			ssrc = htonl(session->rewrite_ssrc[media]);
+			memcpy(rtcp + 4, &ssrc, sizeof(ssrc));
+			if (type == 200 && size >= 20) {
+				guint32 timestamp;
+				memcpy(&timestamp, rtcp + 16, sizeof(timestamp));
+				timestamp = htonl(ntohl(timestamp) + session->rewrite_ts_offset[media]);
+				memcpy(rtcp + 16, &timestamp, sizeof(timestamp));
+			}
+		}
+		offset += size;
+	}
+}
 
-	if (session->drop_permille > g_random_int_range(0,1000))
+static void rtpforward_forward_rtp(rtpforward_session *session, janus_plugin_rtp *packet) {
+	if (session->drop_permille > g_random_int_range(0,1000)) {
+		RTPFORWARD_STAT_ADD(session->stats.simulated_drops, 1);
 		return; // simulate bad connection
+	}
 
 	janus_rtp_header *header = (janus_rtp_header *)packet->buffer;
+	if (session->rewrite_headers || session->rewrite_pt[packet->video ? 1 : 0] >= 0)
+		rtpforward_rewrite_rtp(session, header, packet->video);
 	guint16 seqn_current = ntohs(header->seq_number);
 
 	if (packet->video) { // VIDEO
 
+		// Receivers NACK the SSRC they get, which without rewritten headers is the browser's
+		guint32 ssrc = ntohl(header->ssrc);
+		if (ssrc != __atomic_load_n(&session->feedback_video_ssrc, __ATOMIC_RELAXED))
+			__atomic_store_n(&session->feedback_video_ssrc, ssrc, __ATOMIC_RELAXED);
+
 		if (session->drop_video_packets > 0) {
 			session->drop_video_packets--;
+			RTPFORWARD_STAT_ADD(session->stats.simulated_drops, 1);
 			return;
 		}
 
-		guint16 seqnr_last = session->seqnr_video_last;
-		guint16 missed = seqn_current - seqnr_last - (guint16)1;
-		if (
-			!seqnr_last || // first packet
-			seqn_current < seqnr_last // guint16 has wrapped (TODO: this also ignores packet misordering)
-		) {
-			missed = 0;
+		guint missed = 0;
+		guint32 seq_extended = 0;
+		rtpforward_seq_status status = rtpforward_seqwin_update(&session->seqwin_video, seqn_current, session->reorder_tolerance, &missed, &seq_extended);
+		if (status == SEQ_LATE || status == SEQ_LATE_LOST) {
+			RTPFORWARD_STAT_ADD(session->stats.late[STREAM_VIDEO_RTP], 1);
+			if (status == SEQ_LATE_LOST)
+				RTPFORWARD_STAT_SUB(session->stats.lost[STREAM_VIDEO_RTP], 1);
+		} else if (status == SEQ_DUPLICATE) {
+			RTPFORWARD_STAT_ADD(session->stats.duplicates[STREAM_VIDEO_RTP], 1);
 		}
 
 		if (missed) {
-			JANUS_LOG(LOG_WARN, "%s Missed %d video packets before sequence number %d\n", RTPFORWARD_NAME, missed, seqn_current);
+			JANUS_LOG(LOG_WARN, "%s Lost %u video packets (at sequence number %d)\n", RTPFORWARD_NAME, missed, seqn_current);
+			RTPFORWARD_STAT_ADD(session->stats.lost[STREAM_VIDEO_RTP], missed);
+			if (session->gop_cache.arena) {
+				janus_mutex_lock(&session->gop_mutex);
+				session->gop_cache.valid = FALSE; // not decodable anymore until the next keyframe
+				janus_mutex_unlock(&session->gop_mutex);
+			}
 
 			// We have missed at least one packet.
 			// Some downstream decoders could be sensitive to packet loss.
@@ -672,81 +5862,95 @@ void rtpforward_incoming_rtp(janus_plugin_session *handle, janus_plugin_rtp *pac
 			if (session->disable_video_on_packetloss && session->video_enabled) {
 				JANUS_LOG(LOG_WARN, "%s Disabling video forwarding because of packet loss\n", RTPFORWARD_NAME);
 				session->video_enabled = FALSE;
+				RTPFORWARD_STAT_ADD(session->stats.video_disabled_on_loss, 1);
+				rtpforward_recovery_start(session);
 			}
 		}
 
 		// Detect keyframes and maybe re-enable video.
-		gboolean is_keyframe;
-		int plen = 0;
-		char *payload = janus_rtp_payload(packet->buffer, packet->length, &plen);
-		if (session->vcodec == CODEC_VP8) {
-			is_keyframe = janus_vp8_is_keyframe(payload, plen);
-		} else if (session->vcodec == CODEC_VP9) {
-			is_keyframe = janus_vp9_is_keyframe(payload, plen);
-		} else if (session->vcodec == CODEC_H264) {
-			is_keyframe = janus_h264_is_keyframe(payload, plen);
-		}
+		gboolean is_keyframe = rtpforward_keyframe_needed(session) && rtpforward_keyframe_detect(session, packet->buffer, packet->length);
 		if (is_keyframe) {
 			JANUS_LOG(LOG_DBG, "%s Received keyframe\n", RTPFORWARD_NAME);
+			RTPFORWARD_STAT_ADD(session->stats.keyframes, 1);
+			rtpforward_recovery_done(session);
 			if (session->enable_video_on_keyframe && !session->video_enabled) {
 				JANUS_LOG(LOG_WARN, "%s Enabling video forwarding because of keyframe\n", RTPFORWARD_NAME);
 				session->video_enabled = TRUE;
 			}
 		}
 
-		session->seqnr_video_last = seqn_current;
+		gboolean replaying = FALSE;
+		if (session->gop_cache.arena) {
+			janus_mutex_lock(&session->gop_mutex);
+			if (session->gop_cache.arena && status != SEQ_DUPLICATE)
+				rtpforward_gop_cache_add(session, packet->buffer, packet->length, is_keyframe, ntohl(header->timestamp));
+			// A paced replay sends this packet in order, after the cached ones
+			replaying = session->gop_cache.replaying;
+			janus_mutex_unlock(&session->gop_mutex);
+		}
 
-		if (!session->video_enabled)
+		if (!session->video_enabled || replaying)
 			return;
 
-		addr.sin_port = htons(session->sendport_video_rtp);
+		// the marker bit ends a video frame: don't hold back its packets
+		rtpforward_forward(session, &session->reorder_video, seq_extended, status, packet->buffer, packet->length, header->markerbit);
 
 
 	} else { // AUDIO
 		if (session->drop_audio_packets > 0) {
 			session->drop_audio_packets--;
+			RTPFORWARD_STAT_ADD(session->stats.simulated_drops, 1);
 			return;
 		}
 
-		guint16 seqnr_last = session->seqnr_audio_last;
-		guint16 missed = seqn_current - seqnr_last - (guint16)1;
-		if (
-			!seqnr_last || // first packet
-			seqn_current < seqnr_last // guint16 has wrapped (TODO: this also ignores packet misordering)
-		) {
-			missed = 0;
+		guint missed = 0;
+		guint32 seq_extended = 0;
+		rtpforward_seq_status status = rtpforward_seqwin_update(&session->seqwin_audio, seqn_current, session->reorder_tolerance, &missed, &seq_extended);
+		if (status == SEQ_LATE || status == SEQ_LATE_LOST) {
+			RTPFORWARD_STAT_ADD(session->stats.late[STREAM_AUDIO_RTP], 1);
+			if (status == SEQ_LATE_LOST)
+				RTPFORWARD_STAT_SUB(session->stats.lost[STREAM_AUDIO_RTP], 1);
+		} else if (status == SEQ_DUPLICATE) {
+			RTPFORWARD_STAT_ADD(session->stats.duplicates[STREAM_AUDIO_RTP], 1);
 		}
 
 		if (missed) {
-			JANUS_LOG(LOG_WARN, "%s Missed %d audio packets before sequence number %d\n", RTPFORWARD_NAME, missed, seqn_current);
+			JANUS_LOG(LOG_WARN, "%s Lost %u audio packets (at sequence number %d)\n", RTPFORWARD_NAME, missed, seqn_current);
+			RTPFORWARD_STAT_ADD(session->stats.lost[STREAM_AUDIO_RTP], missed);
 		}
 
-		session->seqnr_audio_last = seqn_current;
-
 		if (!session->audio_enabled)
 			return;
 
-		addr.sin_port = htons(session->sendport_audio_rtp);
+		rtpforward_forward(session, &session->reorder_audio, seq_extended, status, packet->buffer, packet->length, FALSE);
 	}
+}
 
-	// forward to the selected UDP port
-	int numsent = sendto(session->sendsockfd, packet->buffer, packet->length, 0, (struct sockaddr*)&addr, addrlen);
+void rtpforward_incoming_rtp(janus_plugin_session *handle, janus_plugin_rtp *packet) {
+	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle; // simple and fast. echotest does the same.
+
+	if (session->sendsockfd < 0 && !g_atomic_pointer_get(&session->shm)) return; // not yet configured: skip if no socket open nor ring
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rtpforward_forward_rtp(session, packet);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	guint64 ns = (guint64)(end.tv_sec - start.tv_sec) * 1000000000 + end.tv_nsec - start.tv_nsec;
+	int bucket = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (bucket >= RTPFORWARD_STATS_HISTOGRAM_BUCKETS)
+		bucket = RTPFORWARD_STATS_HISTOGRAM_BUCKETS - 1;
+	RTPFORWARD_STAT_ADD(session->stats.incoming_rtp_ns[bucket], 1);
 }
 
 void rtpforward_incoming_rtcp(janus_plugin_session *handle, janus_plugin_rtcp *packet) {
 	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
-	if (session->sendsockfd < 0) return;
-	struct sockaddr_in addr = session->sendsockaddr;
-	socklen_t addrlen = sizeof(struct sockaddr_in);
+	if (session->sendsockfd < 0 && !g_atomic_pointer_get(&session->shm)) return;
 
-	if (packet->video) {
-		addr.sin_port = htons(session->sendport_video_rtcp);
-	} else {
-		addr.sin_port = htons(session->sendport_audio_rtcp);
-	}
+	rtpforward_rewrite_rtcp(session, packet->buffer, packet->length, packet->video);
 
 	// forward to the selected UDP port
-	int numsent = sendto(session->sendsockfd, packet->buffer, packet->length, 0, (struct sockaddr*)&addr, addrlen);
+	rtpforward_send(session, packet->video ? STREAM_VIDEO_RTCP : STREAM_AUDIO_RTCP, packet->buffer, packet->length, FALSE);
 }
 
 void rtpforward_incoming_data(janus_plugin_session *handle, janus_plugin_data *packet) {
@@ -755,26 +5959,292 @@ void rtpforward_incoming_data(janus_plugin_session *handle, janus_plugin_data *p
 
 void rtpforward_slow_link(janus_plugin_session *handle, int uplink, int video) {
 	JANUS_LOG(LOG_INFO, "%s Slow link detected.\n", RTPFORWARD_NAME);
+	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
+	if (!session || g_atomic_int_get(&session->destroyed))
+		return;
+	// The plugin sends the browser no media, so either way it is about the media from the browser
+	RTPFORWARD_STAT_ADD(session->stats.slow_links, 1);
+	__atomic_fetch_add(&session->abr_slow_links, 1, __ATOMIC_RELAXED);
 }
 
 void rtpforward_hangup_media(janus_plugin_session *handle) {
 	JANUS_LOG(LOG_INFO, "%s hangup media.\n", RTPFORWARD_NAME);
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+		return;
+	rtpforward_session_shard *shard = rtpforward_session_shard_get(handle);
+	janus_mutex_lock(&shard->mutex);
+	rtpforward_session *session = (rtpforward_session *)handle->plugin_handle;
+	if(!session || g_atomic_int_get(&session->destroyed)) {
+		janus_mutex_unlock(&shard->mutex);
+		return;
+	}
+	janus_refcount_increase(&session->ref);
+	janus_mutex_unlock(&shard->mutex);
+
+	// Stops the keyframe requests, receiver feedback and bitrate timers until the next PeerConnection
+	g_atomic_int_set(&session->hangingup, 1);
+	janus_mutex_lock(&session->keyframe_mutex);
+	session->recovering = FALSE;
+	rtpforward_timer_cancel(&session->keyframe_timer);
+	janus_mutex_unlock(&session->keyframe_mutex);
+	janus_refcount_decrease(&session->ref);
+}
+
+
+
+
+/* SDP answer cache */
+
+static void rtpforward_sdp_answer_free(rtpforward_sdp_answer *answer) {
+	guint i;
+	for(i = 0; i < answer->line_count; i++)
+		g_free(answer->lines[i].text);
+	g_free(answer->lines);
+	g_free(answer->key);
+	g_free(answer);
+}
+
+static void rtpforward_sdp_offer_free(rtpforward_sdp_offer *offer) {
+	if(!offer)
+		return;
+	g_strfreev(offer->lines);
+	g_free(offer->key);
+	g_free(offer);
+}
+
+// Splits an SDP into lines without their CR
+static gchar **rtpforward_sdp_lines(const char *sdp) {
+	gchar **lines = g_strsplit(sdp, "\n", -1), **line;
+	for(line = lines; *line; line++) {
+		gsize length = strlen(*line);
+		if(length > 0 && (*line)[length - 1] == '\r')
+			(*line)[length - 1] = '\0';
+	}
+	return lines;
+}
+
+static rtpforward_sdp_line_kind rtpforward_sdp_line_kind_of(const char *line) {
+	if(g_str_has_prefix(line, "o="))
+		return SDP_LINE_ORIGIN;
+	if(g_str_has_prefix(line, "s="))
+		return SDP_LINE_SESSION_NAME;
+	if(g_str_has_prefix(line, "c="))
+		return SDP_LINE_CONNECTION;
+	if(g_str_has_prefix(line, "a=mid:"))
+		return SDP_LINE_MID;
+	return SDP_LINE_LITERAL;
+}
+
+// ICE and DTLS attributes, and others which don't make it into the answer of the plugin
+static gboolean rtpforward_sdp_line_is_transport(const char *line) {
+	static const char *prefixes[] = {
+		"a=ice-ufrag:", "a=ice-pwd:", "a=ice-options:", "a=fingerprint:", "a=setup:", "a=tls-id:",
+		"a=candidate:", "a=end-of-candidates", "a=rtcp:", "a=group:", "a=ssrc:", "a=ssrc-group:",
+		"a=msid:", "a=msid-semantic:", NULL
+	};
+	const char **prefix;
+	for(prefix = prefixes; *prefix; prefix++) {
+		if(g_str_has_prefix(line, *prefix))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Returns where the offer's line of the given kind is, or -1
+static int rtpforward_sdp_offer_line(rtpforward_sdp_offer *offer, rtpforward_sdp_line_kind kind, guint media) {
+	switch(kind) {
+		case SDP_LINE_ORIGIN:
+			return media == 0 ? offer->origin : -1;
+		case SDP_LINE_SESSION_NAME:
+			return media == 0 ? offer->session_name : -1;
+		case SDP_LINE_CONNECTION:
+			return offer->connection[media];
+		case SDP_LINE_MID:
+			return offer->mid[media];
+		default:
+			return -1;
+	}
+}
+
+// Whether a line of the answer carries a value of the offer's line, like its origin session ID or address
+static gboolean rtpforward_sdp_line_derived(const char *line, const char *offer_line) {
+	gchar **tokens = g_strsplit(offer_line + 2, " ", -1), **token;
+	gboolean derived = FALSE;
+	for(token = tokens; *token && !derived; token++) {
+		// Short tokens like "IN", "IP4" or a version number are found in any line
+		if(strlen(*token) > 3 && strstr(line + 2, *token))
+			derived = TRUE;
+	}
+	g_strfreev(tokens);
+	return derived;
+}
+
+/* Takes an offer apart into its shape and its own lines. Returns NULL if it has too many m-lines to be cached. */
+static rtpforward_sdp_offer *rtpforward_sdp_offer_new(const char *sdp, const char *acodec, const char *vcodec) {
+	rtpforward_sdp_offer *offer = g_malloc0(sizeof(rtpforward_sdp_offer));
+	offer->lines = rtpforward_sdp_lines(sdp);
+	offer->origin = offer->session_name = -1;
+	memset(offer->connection, -1, sizeof(offer->connection));
+	memset(offer->mid, -1, sizeof(offer->mid));
+	GString *key = g_string_new(NULL);
+	int i;
+	for(i = 0; offer->lines[i]; i++) {
+		const char *line = offer->lines[i];
+		if(!*line || rtpforward_sdp_line_is_transport(line))
+			continue;
+		if(g_str_has_prefix(line, "m=") && ++offer->media_count > RTPFORWARD_SDP_MEDIA_MAX) {
+			g_string_free(key, TRUE);
+			rtpforward_sdp_offer_free(offer);
+			return NULL;
+		}
+		switch(rtpforward_sdp_line_kind_of(line)) {
+			case SDP_LINE_ORIGIN:
+				offer->origin = i;
+				break;
+			case SDP_LINE_SESSION_NAME:
+				offer->session_name = i;
+				break;
+			case SDP_LINE_CONNECTION:
+				offer->connection[offer->media_count] = i;
+				break;
+			case SDP_LINE_MID:
+				offer->mid[offer->media_count] = i;
+				break;
+			default:
+				g_string_append(key, line);
+				g_string_append_c(key, '\n');
+				continue;
+		}
+		// Only whether the line is there belongs to the shape
+		g_string_append_len(key, line, 2);
+		g_string_append(key, "*\n");
+	}
+	g_string_append_printf(key, "%s %s", acodec, vcodec);
+	offer->key = g_string_free(key, FALSE);
+	return offer;
+}
+
+/* Turns an answer into a template for offers of the same shape. Returns NULL if the answer contains anything of
+ * the offer that can't be substituted, so it has to be generated anew every time.
+ */
+static rtpforward_sdp_answer *rtpforward_sdp_answer_new(rtpforward_sdp_offer *offer, const char *sdp) {
+	gchar **lines = rtpforward_sdp_lines(sdp);
+	rtpforward_sdp_answer *answer = g_malloc0(sizeof(rtpforward_sdp_answer));
+	answer->lines = g_malloc0(g_strv_length(lines) * sizeof(rtpforward_sdp_template_line));
+	guint media = 0;
+	int i;
+	for(i = 0; lines[i]; i++) {
+		const char *line = lines[i];
+		if(!*line)
+			continue;
+		if(rtpforward_sdp_line_is_transport(line) || (g_str_has_prefix(line, "m=") && ++media > offer->media_count))
+			goto uncacheable;
+		rtpforward_sdp_template_line *template_line = &answer->lines[answer->line_count++];
+		template_line->media = media;
+		rtpforward_sdp_line_kind kind = rtpforward_sdp_line_kind_of(line);
+		int index = rtpforward_sdp_offer_line(offer, kind, media);
+		if(index >= 0 && !strcmp(line, offer->lines[index])) {
+			template_line->kind = kind;
+		} else if(index >= 0 && rtpforward_sdp_line_derived(line, offer->lines[index])) {
+			goto uncacheable; // made from the offer's line, but not a copy of it
+		} else {
+			template_line->kind = SDP_LINE_LITERAL;
+			template_line->text = g_strdup(line);
+		}
+	}
+	g_strfreev(lines);
+	answer->key = g_strdup(offer->key);
+	return answer;
+
+uncacheable:
+	g_strfreev(lines);
+	rtpforward_sdp_answer_free(answer);
+	return NULL;
+}
+
+static char *rtpforward_sdp_answer_render(rtpforward_sdp_answer *answer, rtpforward_sdp_offer *offer) {
+	GString *sdp = g_string_new(NULL);
+	guint i;
+	for(i = 0; i < answer->line_count; i++) {
+		rtpforward_sdp_template_line *line = &answer->lines[i];
+		const char *text = line->text;
+		if(line->kind != SDP_LINE_LITERAL) {
+			int index = rtpforward_sdp_offer_line(offer, line->kind, line->media);
+			if(index < 0) {
+				g_string_free(sdp, TRUE);
+				return NULL;
+			}
+			text = offer->lines[index];
+		}
+		g_string_append(sdp, text);
+		g_string_append(sdp, "\r\n");
+	}
+	return g_string_free(sdp, FALSE);
 }
 
+/* Returns the answer to an offer of a known shape, and the codecs it negotiates, or NULL. */
+static char *rtpforward_sdp_cache_lookup(rtpforward_sdp_offer *offer, char *acodec, char *vcodec) {
+	if(sdp_cache_size == 0)
+		return NULL;
+	char *sdp = NULL;
+	janus_mutex_lock(&sdp_cache_mutex);
+	rtpforward_sdp_answer *answer = g_hash_table_lookup(sdp_cache, offer->key);
+	if(answer) {
+		g_queue_unlink(&sdp_cache_lru, &answer->link);
+		g_queue_push_head_link(&sdp_cache_lru, &answer->link);
+		sdp = rtpforward_sdp_answer_render(answer, offer);
+		g_strlcpy(acodec, answer->acodec, RTPFORWARD_CODEC_STR_LEN);
+		g_strlcpy(vcodec, answer->vcodec, RTPFORWARD_CODEC_STR_LEN);
+	}
+	janus_mutex_unlock(&sdp_cache_mutex);
+	if(sdp)
+		RTPFORWARD_STAT_ADD(handler_stats.sdp_cache_hits, 1);
+	else
+		RTPFORWARD_STAT_ADD(handler_stats.sdp_cache_misses, 1);
+	return sdp;
+}
 
+static void rtpforward_sdp_cache_insert(rtpforward_sdp_offer *offer, const char *sdp, const char *acodec, const char *vcodec) {
+	if(sdp_cache_size == 0 || !sdp)
+		return;
+	rtpforward_sdp_answer *answer = rtpforward_sdp_answer_new(offer, sdp);
+	if(!answer) {
+		JANUS_LOG(LOG_VERB, "%s The answer can't be cached\n", RTPFORWARD_NAME);
+		return;
+	}
+	g_strlcpy(answer->acodec, acodec, RTPFORWARD_CODEC_STR_LEN);
+	g_strlcpy(answer->vcodec, vcodec, RTPFORWARD_CODEC_STR_LEN);
+	answer->link.data = answer;
+	janus_mutex_lock(&sdp_cache_mutex);
+	if(g_hash_table_lookup(sdp_cache, answer->key)) {
+		// Another handler thread was faster
+		janus_mutex_unlock(&sdp_cache_mutex);
+		rtpforward_sdp_answer_free(answer);
+		return;
+	}
+	g_hash_table_insert(sdp_cache, answer->key, answer);
+	g_queue_push_head_link(&sdp_cache_lru, &answer->link);
+	while(g_queue_get_length(&sdp_cache_lru) > sdp_cache_size) {
+		GList *oldest = g_queue_peek_tail_link(&sdp_cache_lru);
+		g_queue_unlink(&sdp_cache_lru, oldest);
+		g_hash_table_remove(sdp_cache, ((rtpforward_sdp_answer *)oldest->data)->key);
+	}
+	janus_mutex_unlock(&sdp_cache_mutex);
+}
 
 
 /* Thread to handle incoming messages */
 static void *rtpforward_handler_thread(void *data) {
-	JANUS_LOG(LOG_VERB, "%s Starting msg handler thread\n", RTPFORWARD_NAME);
+	rtpforward_handler *handler = (rtpforward_handler *)data;
+	JANUS_LOG(LOG_VERB, "%s Starting msg handler thread %u\n", RTPFORWARD_NAME, handler->id);
 	rtpforward_message *msg = NULL;
 	int error_code = 0;
 	char *error_cause = g_malloc0(512);
 	json_t *body = NULL;
 
 
-	while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
-		msg = g_async_queue_pop(messages);
+	while(!g_atomic_int_get(&stopping)) {
+		msg = g_async_queue_pop(handler->messages);
 
 		if(msg == NULL)
 			continue;
@@ -785,29 +6255,34 @@ static void *rtpforward_handler_thread(void *data) {
 			continue;
 		}
 
-		janus_mutex_lock(&sessions_mutex);
+		rtpforward_session_shard *shard = rtpforward_session_shard_get(msg->handle);
+		janus_mutex_lock(&shard->mutex);
 		rtpforward_session *session = (rtpforward_session *)msg->handle->plugin_handle;
 		if(!session) {
-			janus_mutex_unlock(&sessions_mutex);
+			janus_mutex_unlock(&shard->mutex);
 			JANUS_LOG(LOG_ERR, "%s rtpforward_handler_thread: No session associated with this handle...\n", RTPFORWARD_NAME);
 			rtpforward_message_free(msg);
 			continue;
 		}
 		if(session->destroyed) {
-			janus_mutex_unlock(&sessions_mutex);
+			janus_mutex_unlock(&shard->mutex);
 			rtpforward_message_free(msg);
 			continue;
 		}
-		janus_mutex_unlock(&sessions_mutex);
-
-		char *jsondump;
-		jsondump = json_dumps(msg->jsep, 0);
-		JANUS_LOG(LOG_INFO, "%s rtpforward_handler_thread JSEP %s\n", RTPFORWARD_NAME, jsondump);
-		free(jsondump);
-
-		jsondump = json_dumps(msg->body, 0);
-		JANUS_LOG(LOG_INFO, "%s rtpforward_handler_thread BODY %s\n", RTPFORWARD_NAME, jsondump);
-		free(jsondump);
+		janus_refcount_increase(&session->ref);
+		janus_mutex_unlock(&shard->mutex);
+
+		// Offers are large: only serialize them if they are going to be logged
+		if(janus_log_level >= LOG_INFO) {
+			char *jsondump;
+			jsondump = json_dumps(msg->jsep, 0);
+			JANUS_LOG(LOG_INFO, "%s rtpforward_handler_thread JSEP %s\n", RTPFORWARD_NAME, jsondump);
+			free(jsondump);
+
+			jsondump = json_dumps(msg->body, 0);
+			JANUS_LOG(LOG_INFO, "%s rtpforward_handler_thread BODY %s\n", RTPFORWARD_NAME, jsondump);
+			free(jsondump);
+		}
 
 		/* Handle request */
 		error_code = 0;
@@ -818,36 +6293,50 @@ static void *rtpforward_handler_thread(void *data) {
 
 			JANUS_LOG(LOG_INFO, "%s SDP OFFER ASYNC: %s\n", RTPFORWARD_NAME, msg_sdp);
 
-			char error_str[512];
-			janus_sdp *offer = janus_sdp_parse(msg_sdp, error_str, sizeof(error_str));
-			if(offer == NULL) {
-				JANUS_LOG(LOG_ERR, "%s Error parsing offer: %s\n", RTPFORWARD_NAME, error_str);
-				error_code = RTPFORWARD_ERROR_INVALID_SDP;
-				g_snprintf(error_cause, 512, "Error parsing offer: %s", error_str);
-				goto error;;
-			}
-
-			janus_sdp *answer = janus_sdp_generate_answer(offer,
-				JANUS_SDP_OA_AUDIO, TRUE,
-				JANUS_SDP_OA_AUDIO_DIRECTION, JANUS_SDP_RECVONLY,
-				JANUS_SDP_OA_AUDIO_CODEC, session->negotiate_acodec,
-
-				JANUS_SDP_OA_VIDEO, TRUE,
-				JANUS_SDP_OA_VIDEO_DIRECTION, JANUS_SDP_RECVONLY,
-				JANUS_SDP_OA_VIDEO_CODEC, session->negotiate_vcodec,
-
-				JANUS_SDP_OA_DATA, FALSE,
-				JANUS_SDP_OA_DONE
-			);
-			janus_sdp_destroy(offer);
-
-			const char *negotiated_acodec, *negotiated_vcodec;
-			negotiated_acodec = NULL;
-			negotiated_vcodec = NULL;
+			// An offer of a known shape only needs its own lines put into the cached answer
+			char negotiated_acodec[RTPFORWARD_CODEC_STR_LEN] = "", negotiated_vcodec[RTPFORWARD_CODEC_STR_LEN] = "";
+			rtpforward_sdp_offer *shape = msg_sdp ? rtpforward_sdp_offer_new(msg_sdp, session->negotiate_acodec, session->negotiate_vcodec) : NULL;
+			char *sdp_answer = shape ? rtpforward_sdp_cache_lookup(shape, negotiated_acodec, negotiated_vcodec) : NULL;
+			if(sdp_answer == NULL) {
+				char error_str[512];
+				janus_sdp *offer = janus_sdp_parse(msg_sdp, error_str, sizeof(error_str));
+				if(offer == NULL) {
+					rtpforward_sdp_offer_free(shape);
+					JANUS_LOG(LOG_ERR, "%s Error parsing offer: %s\n", RTPFORWARD_NAME, error_str);
+					error_code = RTPFORWARD_ERROR_INVALID_SDP;
+					g_snprintf(error_cause, 512, "Error parsing offer: %s", error_str);
+					goto error;;
+				}
 
-			janus_sdp_find_first_codecs(answer, &negotiated_acodec, &negotiated_vcodec);
+				janus_sdp *answer = janus_sdp_generate_answer(offer,
+					JANUS_SDP_OA_AUDIO, TRUE,
+					JANUS_SDP_OA_AUDIO_DIRECTION, JANUS_SDP_RECVONLY,
+					JANUS_SDP_OA_AUDIO_CODEC, session->negotiate_acodec,
+
+					JANUS_SDP_OA_VIDEO, TRUE,
+					JANUS_SDP_OA_VIDEO_DIRECTION, JANUS_SDP_RECVONLY,
+					JANUS_SDP_OA_VIDEO_CODEC, session->negotiate_vcodec,
+
+					JANUS_SDP_OA_DATA, FALSE,
+					JANUS_SDP_OA_DONE
+				);
+				janus_sdp_destroy(offer);
+
+				const char *acodec = NULL, *vcodec = NULL;
+				janus_sdp_find_first_codecs(answer, &acodec, &vcodec);
+				if(acodec)
+					g_strlcpy(negotiated_acodec, acodec, sizeof(negotiated_acodec));
+				if(vcodec)
+					g_strlcpy(negotiated_vcodec, vcodec, sizeof(negotiated_vcodec));
+
+				sdp_answer = janus_sdp_write(answer);
+				janus_sdp_destroy(answer);
+				if(shape)
+					rtpforward_sdp_cache_insert(shape, sdp_answer, negotiated_acodec, negotiated_vcodec);
+			}
+			rtpforward_sdp_offer_free(shape);
 
-			if (negotiated_vcodec) {
+			if (*negotiated_vcodec) {
 				if (!strcmp(negotiated_vcodec, "vp8")) {
 					JANUS_LOG(LOG_INFO, "%s Negotiated video codec is VP8\n", RTPFORWARD_NAME);
 					session->vcodec = CODEC_VP8;
@@ -857,15 +6346,18 @@ static void *rtpforward_handler_thread(void *data) {
 				} else if (!strcmp(negotiated_vcodec, "h264")) {
 					JANUS_LOG(LOG_INFO, "%s Negotiated video codec is H264\n", RTPFORWARD_NAME);
 					session->vcodec = CODEC_H264;
+				} else if (!strcmp(negotiated_vcodec, "av1")) {
+					JANUS_LOG(LOG_INFO, "%s Negotiated video codec is AV1\n", RTPFORWARD_NAME);
+					session->vcodec = CODEC_AV1;
+				} else if (!strcmp(negotiated_vcodec, "h265")) {
+					JANUS_LOG(LOG_INFO, "%s Negotiated video codec is H265\n", RTPFORWARD_NAME);
+					session->vcodec = CODEC_H265;
 				}
 			} else {
 				JANUS_LOG(LOG_INFO, "%s No video for this session\n", RTPFORWARD_NAME);
 				session->vcodec = CODEC_NONE;
 			}
 
-			char *sdp_answer = janus_sdp_write(answer);
-			janus_sdp_destroy(answer);
-
 			const char *type = "answer";
 			json_t *jsep = json_pack("{ssss}", "type", type, "sdp", sdp_answer);
 
@@ -875,9 +6367,15 @@ static void *rtpforward_handler_thread(void *data) {
 
 			// How long will the gateway take to push the reply?
 			g_atomic_int_set(&session->hangingup, 0);
+			// The bitrate timer stopped when the previous PeerConnection hung up
+			janus_mutex_lock(&session->feedback_mutex);
+			if(session->abr)
+				rtpforward_timer_schedule(&session->abr_timer, janus_get_monotonic_time() + RTPFORWARD_ABR_TICK_MS * 1000);
+			janus_mutex_unlock(&session->feedback_mutex);
 			int res = gateway->push_event(msg->handle, &rtpforward_plugin, msg->transaction, response, jsep);
 			JANUS_LOG(LOG_VERB, "  >> Pushing event: %d\n", res);
 			g_free(sdp_answer);
+			rtpforward_handler_stats_update(janus_get_monotonic_time() - msg->queued);
 
 			// The Janus core increases the references to both the message and jsep *json_t objects.
 			json_decref(response);
@@ -886,6 +6384,7 @@ static void *rtpforward_handler_thread(void *data) {
 	} // if jsep in message
 
 
+		janus_refcount_decrease(&session->ref);
 		rtpforward_message_free(msg);
 
 		continue;
@@ -899,12 +6398,13 @@ error:
 			json_object_set_new(event, "error", json_string(error_cause));
 			int ret = gateway->push_event(msg->handle, &rtpforward_plugin, msg->transaction, event, NULL);
 			JANUS_LOG(LOG_VERB, "  >> %d (%s)\n", ret, janus_get_api_error(ret));
+			janus_refcount_decrease(&session->ref);
 			rtpforward_message_free(msg);
 			/* We don't need the event anymore */
 			json_decref(event);
 		}
 	}
 	g_free(error_cause);
-	JANUS_LOG(LOG_VERB, "%s Leaving msg handler thread\n", RTPFORWARD_NAME);
+	JANUS_LOG(LOG_VERB, "%s Leaving msg handler thread %u\n", RTPFORWARD_NAME, handler->id);
 	return NULL;
 }
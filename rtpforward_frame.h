@@ -0,0 +1,65 @@
+/*! \file   rtpforward_frame.h
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Framing of the assembled video frames of the rtpforward plugin
+ *
+ * \details In frame mode, the plugin reassembles the video RTP packets of a
+ * session into complete frames and sends each one as a single message: a UDP
+ * datagram to the video RTP port of the destinations, or a record on a Unix
+ * SOCK_SEQPACKET socket. Each message is this header followed by the frame:
+ * VP8 and VP9 frames as the encoder produced them, H.264 access units in
+ * Annex B format, each NAL unit with a 4-byte start code. All header fields
+ * are in network byte order.
+*/
+
+#ifndef RTPFORWARD_FRAME_H
+#define RTPFORWARD_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define RTPFORWARD_FRAME_VERSION 1
+#define RTPFORWARD_FRAME_HEADER_SIZE 20
+
+#define RTPFORWARD_FRAME_CODEC_VP8 1
+#define RTPFORWARD_FRAME_CODEC_VP9 2
+#define RTPFORWARD_FRAME_CODEC_H264 3
+
+#define RTPFORWARD_FRAME_FLAG_KEYFRAME 0x01
+
+typedef struct rtpforward_frame_header {
+	uint8_t version;
+	uint8_t codec; // RTPFORWARD_FRAME_CODEC_*
+	uint8_t flags; // RTPFORWARD_FRAME_FLAG_*
+	uint8_t header_size; // the frame starts here
+	uint32_t rtp_timestamp;
+	uint32_t ssrc;
+	uint16_t first_seq; // RTP sequence number of the first packet of the frame
+	uint16_t packets; // number of RTP packets the frame was assembled from
+	uint32_t length; // of the frame, without the header
+} rtpforward_frame_header;
+
+/* Reads the header of a received message. Returns a pointer to the frame, or NULL if the message is not a
+ * complete frame of a known version.
+ */
+static inline const uint8_t *rtpforward_frame_parse(const uint8_t *message, size_t size, rtpforward_frame_header *header) {
+	if(size < RTPFORWARD_FRAME_HEADER_SIZE || message[0] != RTPFORWARD_FRAME_VERSION || message[3] < RTPFORWARD_FRAME_HEADER_SIZE ||
+			message[3] > size)
+		return NULL;
+	memcpy(header, message, RTPFORWARD_FRAME_HEADER_SIZE);
+	header->rtp_timestamp = ntohl(header->rtp_timestamp);
+	header->ssrc = ntohl(header->ssrc);
+	header->first_seq = ntohs(header->first_seq);
+	header->packets = ntohs(header->packets);
+	header->length = ntohl(header->length);
+	if(header->length != size - header->header_size)
+		return NULL;
+	return message + header->header_size;
+}
+
+#endif
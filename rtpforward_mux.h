@@ -0,0 +1,91 @@
+/*! \file   rtpforward_mux.h
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Multiplexed framing of the rtpforward plugin
+ *
+ * \details With many sessions of small packets, like Opus audio, the cost of
+ * forwarding is in the number of packets rather than bytes. Sessions
+ * configured with the same mux target have their RTP and RTCP packets packed
+ * into shared messages, each a header followed by records: a record header
+ * and the packet as it would have been sent on its own. A message is sent
+ * when it is full, or when its first record has waited long enough.
+ *
+ * Over UDP, each datagram is one message. Over a Unix stream socket, the
+ * messages follow each other, and the length in the header tells where the
+ * next one starts. All header fields are in network byte order.
+*/
+
+#ifndef RTPFORWARD_MUX_H
+#define RTPFORWARD_MUX_H
+
+#include <endian.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#define RTPFORWARD_MUX_VERSION 1
+#define RTPFORWARD_MUX_HEADER_SIZE 16
+#define RTPFORWARD_MUX_RECORD_HEADER_SIZE 12
+
+/* Packet types, in the order of the plugin's sendport_* keys */
+#define RTPFORWARD_MUX_TYPE_AUDIO_RTP 0
+#define RTPFORWARD_MUX_TYPE_AUDIO_RTCP 1
+#define RTPFORWARD_MUX_TYPE_VIDEO_RTP 2
+#define RTPFORWARD_MUX_TYPE_VIDEO_RTCP 3
+
+#define RTPFORWARD_MUX_FLAG_END_OF_FRAME 0x01 // the last packet of a video frame, as far as the plugin knows
+
+typedef struct rtpforward_mux_header {
+	uint8_t version;
+	uint8_t header_size; // the records start here
+	uint16_t count; // of records
+	uint32_t length; // of the records
+	uint64_t time_us; // CLOCK_MONOTONIC of the plugin when the first record was added
+} rtpforward_mux_header;
+
+typedef struct rtpforward_mux_record {
+	uint16_t length; // of the packet, which follows
+	uint8_t type; // RTPFORWARD_MUX_TYPE_*
+	uint8_t flags; // RTPFORWARD_MUX_FLAG_*
+	uint32_t stream_id; // mux_id of the session
+	uint32_t time_offset_us; // when the plugin got the packet, after time_us of the message
+} rtpforward_mux_record;
+
+/* Reads the header at the start of a message, or of the bytes read so far from a stream socket. Returns the
+ * size of the whole message, 0 if fewer than RTPFORWARD_MUX_HEADER_SIZE bytes were given, or -1 if it is not a
+ * message of a known version.
+ */
+static inline long rtpforward_mux_parse_header(const uint8_t *message, size_t size, rtpforward_mux_header *header) {
+	if(size < RTPFORWARD_MUX_HEADER_SIZE)
+		return 0;
+	memcpy(header, message, RTPFORWARD_MUX_HEADER_SIZE);
+	if(header->version != RTPFORWARD_MUX_VERSION || header->header_size < RTPFORWARD_MUX_HEADER_SIZE)
+		return -1;
+	header->count = ntohs(header->count);
+	header->length = ntohl(header->length);
+	header->time_us = be64toh(header->time_us);
+	return (long)header->header_size + header->length;
+}
+
+/* Reads the record at *cursor, and moves the cursor to the next one. Returns a pointer to the packet, or NULL
+ * at the end of the message or if the record is truncated.
+ */
+static inline const uint8_t *rtpforward_mux_next(const uint8_t **cursor, const uint8_t *end, rtpforward_mux_record *record) {
+	if(end - *cursor < RTPFORWARD_MUX_RECORD_HEADER_SIZE)
+		return NULL;
+	memcpy(record, *cursor, RTPFORWARD_MUX_RECORD_HEADER_SIZE);
+	record->length = ntohs(record->length);
+	record->stream_id = ntohl(record->stream_id);
+	record->time_offset_us = ntohl(record->time_offset_us);
+	const uint8_t *packet = *cursor + RTPFORWARD_MUX_RECORD_HEADER_SIZE;
+	if(end - packet < record->length)
+		return NULL;
+	*cursor = packet + record->length;
+	return packet;
+}
+
+#endif
@@ -0,0 +1,141 @@
+/*! \file   rtpforward_shm.h
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Layout of the shared-memory egress ring of the rtpforward plugin
+ *
+ * \details A session can write its forwarded packets into a ring in a
+ * memfd, which any number of processes on the same host map and read, with
+ * no copy through the network stack. The plugin is the only writer; readers
+ * never block it and are never waited for. Each slot is guarded by a
+ * sequence number, so a reader which is lapped by the writer notices, and
+ * knows how many packets it lost.
+ *
+ * The plugin writes with rtpforward_shm_ring_write(); readers should use
+ * the library in rtpforward_shm_reader.h, which implements the other half
+ * of the protocol. Only the waiters field is written by readers.
+ *
+ * Readers map the ring writable, to register as waiters, so any of them can
+ * scribble over the header. The writer therefore never reads back what it
+ * published: the geometry and the write position it works with are kept in
+ * its own rtpforward_shm_writer, and a bogus waiters count only costs it
+ * needless wakeups. Readers check the geometry once, when they map the ring,
+ * and then also keep their own copy.
+*/
+
+#ifndef RTPFORWARD_SHM_H
+#define RTPFORWARD_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define RTPFORWARD_SHM_MAGIC 0x48535052 // "RPSH" in little endian
+#define RTPFORWARD_SHM_VERSION 1
+#define RTPFORWARD_SHM_DATA_SIZE 1504 // makes a slot 1536 bytes
+
+/* Streams, in the order of the plugin's sendport_* keys */
+#define RTPFORWARD_SHM_STREAM_AUDIO_RTP 0
+#define RTPFORWARD_SHM_STREAM_AUDIO_RTCP 1
+#define RTPFORWARD_SHM_STREAM_VIDEO_RTP 2
+#define RTPFORWARD_SHM_STREAM_VIDEO_RTCP 3
+
+#define RTPFORWARD_SHM_FLAG_END_OF_FRAME 0x01 // the last packet of a video frame, as far as the plugin knows
+
+typedef struct rtpforward_shm_header {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t header_size; // the slots start here
+	uint32_t slot_count; // a power of two
+	uint32_t slot_size;
+	uint64_t head; // number of packets written, packet n goes to slot n % slot_count
+	uint32_t futex; // incremented after every packet, for readers to wait on
+	uint32_t waiters; // readers waiting on futex
+	uint64_t dropped; // packets too large for a slot
+	uint8_t reserved[24];
+} rtpforward_shm_header;
+
+typedef struct rtpforward_shm_slot {
+	uint64_t sequence; // 2n+1 while packet n is being written, 2n+2 once it is complete
+	uint64_t timestamp_us; // CLOCK_MONOTONIC when the packet was forwarded
+	uint32_t rtp_timestamp; // RTP streams only
+	uint32_t ssrc; // RTP streams only
+	uint16_t rtp_seq; // RTP streams only
+	uint16_t length;
+	uint8_t stream;
+	uint8_t flags;
+	uint8_t reserved[2];
+	uint8_t data[RTPFORWARD_SHM_DATA_SIZE];
+} rtpforward_shm_slot;
+
+#define RTPFORWARD_SHM_SIZE(slot_count) (sizeof(rtpforward_shm_header) + (size_t)(slot_count) * sizeof(rtpforward_shm_slot))
+
+/* The writer's own view of a ring, outside of the shared memory */
+typedef struct rtpforward_shm_writer {
+	rtpforward_shm_header *header;
+	rtpforward_shm_slot *slots;
+	uint32_t slot_count;
+	uint64_t head;
+	uint64_t dropped;
+} rtpforward_shm_writer;
+
+/* Slot of the given packet, in a ring of slot_count slots starting at slots */
+static inline rtpforward_shm_slot *rtpforward_shm_slot_at(rtpforward_shm_slot *slots, uint32_t slot_count, uint64_t position) {
+	return &slots[position & (slot_count - 1)];
+}
+
+/* Lays out a new ring of slot_count slots, a power of two, in the given memory of RTPFORWARD_SHM_SIZE(slot_count) bytes. */
+static inline void rtpforward_shm_ring_init(rtpforward_shm_writer *writer, void *memory, uint32_t slot_count) {
+	rtpforward_shm_header *header = (rtpforward_shm_header *)memory;
+	memset(header, 0, sizeof(*header));
+	header->magic = RTPFORWARD_SHM_MAGIC;
+	header->version = RTPFORWARD_SHM_VERSION;
+	header->header_size = sizeof(rtpforward_shm_header);
+	header->slot_count = slot_count;
+	header->slot_size = sizeof(rtpforward_shm_slot);
+	writer->header = header;
+	writer->slots = (rtpforward_shm_slot *)((uint8_t *)memory + sizeof(rtpforward_shm_header));
+	writer->slot_count = slot_count;
+	writer->head = 0;
+	writer->dropped = 0;
+}
+
+/* Writes one packet. Must not be called by several threads at once. Returns 1 if readers are waiting and have
+ * to be woken with FUTEX_WAKE on header->futex, 0 if not, and -1 if the packet is too large.
+ */
+static inline int rtpforward_shm_ring_write(rtpforward_shm_writer *writer, uint8_t stream, uint8_t flags,
+		uint64_t timestamp_us, const void *data, uint16_t length) {
+	rtpforward_shm_header *header = writer->header;
+	if(length > RTPFORWARD_SHM_DATA_SIZE) {
+		__atomic_store_n(&header->dropped, ++writer->dropped, __ATOMIC_RELAXED);
+		return -1;
+	}
+	uint64_t position = writer->head;
+	rtpforward_shm_slot *slot = rtpforward_shm_slot_at(writer->slots, writer->slot_count, position);
+	__atomic_store_n(&slot->sequence, 2 * position + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->timestamp_us = timestamp_us;
+	slot->stream = stream;
+	slot->flags = flags;
+	slot->length = length;
+	const uint8_t *bytes = (const uint8_t *)data;
+	if((stream == RTPFORWARD_SHM_STREAM_AUDIO_RTP || stream == RTPFORWARD_SHM_STREAM_VIDEO_RTP) && length >= 12) {
+		slot->rtp_seq = (uint16_t)((bytes[2] << 8) | bytes[3]);
+		slot->rtp_timestamp = ((uint32_t)bytes[4] << 24) | (bytes[5] << 16) | (bytes[6] << 8) | bytes[7];
+		slot->ssrc = ((uint32_t)bytes[8] << 24) | (bytes[9] << 16) | (bytes[10] << 8) | bytes[11];
+	} else {
+		slot->rtp_seq = 0;
+		slot->rtp_timestamp = 0;
+		slot->ssrc = 0;
+	}
+	memcpy(slot->data, data, length);
+	__atomic_store_n(&slot->sequence, 2 * position + 2, __ATOMIC_RELEASE);
+	writer->head = position + 1;
+	__atomic_store_n(&header->head, writer->head, __ATOMIC_RELEASE);
+	// Pairs with the readers incrementing waiters before they wait, so no wakeup is missed
+	__atomic_fetch_add(&header->futex, 1, __ATOMIC_SEQ_CST);
+	return __atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST) > 0;
+}
+
+#endif
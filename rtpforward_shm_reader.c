@@ -0,0 +1,223 @@
+/*! \file   rtpforward_shm_reader.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Reader of the shared-memory egress ring of the rtpforward plugin
+ *
+ * \details See rtpforward_shm_reader.h
+*/
+
+#include "rtpforward_shm_reader.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+struct rtpforward_shm_reader {
+	rtpforward_shm_header *header;
+	size_t size;
+	// The geometry as checked when mapping, as other readers could change the header later
+	rtpforward_shm_slot *slots;
+	uint32_t slot_count;
+	uint64_t position; // next packet to read
+	uint64_t lost;
+};
+
+static int rtpforward_shm_futex_wait(uint32_t *futex, uint32_t value, const struct timespec *timeout) {
+	return (int)syscall(SYS_futex, futex, FUTEX_WAIT, value, timeout, NULL, 0);
+}
+
+static int64_t rtpforward_shm_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+rtpforward_shm_reader *rtpforward_shm_reader_open_fd(int fd) {
+	struct stat st;
+	if(fstat(fd, &st) < 0)
+		return NULL;
+	if((size_t)st.st_size < sizeof(rtpforward_shm_header)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	// Read-write, as waiting readers register in the header
+	void *mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(mapping == MAP_FAILED)
+		return NULL;
+	rtpforward_shm_header *header = (rtpforward_shm_header *)mapping;
+	// Read once, so the count checked is the one used
+	uint32_t slot_count = __atomic_load_n(&header->slot_count, __ATOMIC_RELAXED);
+	if(header->magic != RTPFORWARD_SHM_MAGIC || header->version != RTPFORWARD_SHM_VERSION ||
+			header->header_size != sizeof(rtpforward_shm_header) || header->slot_size != sizeof(rtpforward_shm_slot) ||
+			slot_count == 0 || (slot_count & (slot_count - 1)) != 0 ||
+			(size_t)st.st_size < RTPFORWARD_SHM_SIZE(slot_count)) {
+		munmap(mapping, st.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+	rtpforward_shm_reader *reader = calloc(1, sizeof(rtpforward_shm_reader));
+	if(!reader) {
+		munmap(mapping, st.st_size);
+		return NULL;
+	}
+	reader->header = header;
+	reader->size = st.st_size;
+	reader->slots = (rtpforward_shm_slot *)((uint8_t *)mapping + sizeof(rtpforward_shm_header));
+	reader->slot_count = slot_count;
+	reader->position = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+	return reader;
+}
+
+rtpforward_shm_reader *rtpforward_shm_reader_open_path(const char *path) {
+	int fd = open(path, O_RDWR | O_CLOEXEC);
+	if(fd < 0)
+		return NULL;
+	rtpforward_shm_reader *reader = rtpforward_shm_reader_open_fd(fd);
+	int error = errno;
+	close(fd);
+	errno = error;
+	return reader;
+}
+
+rtpforward_shm_reader *rtpforward_shm_reader_connect(const char *socket_path) {
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(address.sun_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	strcpy(address.sun_path, socket_path);
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(sock < 0)
+		return NULL;
+	if(connect(sock, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		int error = errno;
+		close(sock);
+		errno = error;
+		return NULL;
+	}
+	char byte;
+	struct iovec iov = { .iov_base = &byte, .iov_len = 1 };
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	ssize_t received = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+	int error = errno;
+	close(sock);
+	if(received <= 0) {
+		errno = received == 0 ? ECONNRESET : error;
+		return NULL;
+	}
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if(!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+			cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+		errno = EPROTO;
+		return NULL;
+	}
+	int fd;
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+	rtpforward_shm_reader *reader = rtpforward_shm_reader_open_fd(fd);
+	error = errno;
+	close(fd);
+	errno = error;
+	return reader;
+}
+
+int rtpforward_shm_reader_read(rtpforward_shm_reader *reader, rtpforward_shm_packet *packet, int timeout_ms) {
+	rtpforward_shm_header *header = reader->header;
+	int64_t deadline = timeout_ms >= 0 ? rtpforward_shm_now_ms() + timeout_ms : 0;
+	for(;;) {
+		uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+		if(reader->position < head) {
+			if(head - reader->position > reader->slot_count) {
+				// Lapped while we were away, the oldest packet still in the ring is head - slot_count
+				reader->lost += head - reader->slot_count - reader->position;
+				reader->position = head - reader->slot_count;
+			}
+			rtpforward_shm_slot *slot = rtpforward_shm_slot_at(reader->slots, reader->slot_count, reader->position);
+			uint64_t expected = 2 * reader->position + 2;
+			uint64_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+			if(sequence == expected) {
+				packet->sequence = reader->position;
+				packet->timestamp_us = slot->timestamp_us;
+				packet->rtp_timestamp = slot->rtp_timestamp;
+				packet->ssrc = slot->ssrc;
+				packet->rtp_seq = slot->rtp_seq;
+				packet->stream = slot->stream;
+				packet->flags = slot->flags;
+				packet->length = slot->length;
+				if(packet->length > RTPFORWARD_SHM_DATA_SIZE)
+					packet->length = RTPFORWARD_SHM_DATA_SIZE;
+				memcpy(packet->data, slot->data, packet->length);
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if(__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == expected) {
+					reader->position++;
+					return 1;
+				}
+			}
+			// The writer is overwriting this slot with a newer packet: skip to the oldest one it won't touch next
+			head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+			uint64_t next = head + 1 > reader->slot_count ? head + 1 - reader->slot_count : 0;
+			if(next <= reader->position)
+				next = reader->position + 1;
+			reader->lost += next - reader->position;
+			reader->position = next;
+			continue;
+		}
+		if(timeout_ms == 0)
+			return 0;
+		struct timespec timeout, *wait = NULL;
+		if(timeout_ms > 0) {
+			int64_t left = deadline - rtpforward_shm_now_ms();
+			if(left <= 0)
+				return 0;
+			timeout.tv_sec = left / 1000;
+			timeout.tv_nsec = (left % 1000) * 1000000;
+			wait = &timeout;
+		}
+		uint32_t value = __atomic_load_n(&header->futex, __ATOMIC_SEQ_CST);
+		__atomic_fetch_add(&header->waiters, 1, __ATOMIC_SEQ_CST);
+		if(__atomic_load_n(&header->head, __ATOMIC_SEQ_CST) == reader->position &&
+				rtpforward_shm_futex_wait(&header->futex, value, wait) < 0 &&
+				errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+			__atomic_fetch_sub(&header->waiters, 1, __ATOMIC_SEQ_CST);
+			return -1;
+		}
+		__atomic_fetch_sub(&header->waiters, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+uint64_t rtpforward_shm_reader_lost(rtpforward_shm_reader *reader) {
+	return reader->lost;
+}
+
+uint64_t rtpforward_shm_reader_dropped(rtpforward_shm_reader *reader) {
+	return __atomic_load_n(&reader->header->dropped, __ATOMIC_RELAXED);
+}
+
+void rtpforward_shm_reader_close(rtpforward_shm_reader *reader) {
+	if(!reader)
+		return;
+	munmap(reader->header, reader->size);
+	free(reader);
+}
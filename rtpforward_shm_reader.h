@@ -0,0 +1,64 @@
+/*! \file   rtpforward_shm_reader.h
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Reader of the shared-memory egress ring of the rtpforward plugin
+ *
+ * \details Plain C with no dependencies, to be copied into consumers like
+ * GStreamer elements. A reader gets every packet written after it opened the
+ * ring, in order, unless the plugin laps it, in which case the
+ * overwritten packets are skipped and counted. Readers don't affect the
+ * plugin or each other. A reader must only be used by one thread at a time.
+ *
+ * The ring is found either through the path the plugin returns for the
+ * session (/proc/<pid>/fd/<fd>, which needs the permission to look into the
+ * Janus process), or through the Unix socket the session listens on, which
+ * passes the memfd on to whoever connects.
+*/
+
+#ifndef RTPFORWARD_SHM_READER_H
+#define RTPFORWARD_SHM_READER_H
+
+#include <stdint.h>
+
+#include "rtpforward_shm.h"
+
+typedef struct rtpforward_shm_reader rtpforward_shm_reader;
+
+typedef struct rtpforward_shm_packet {
+	uint64_t sequence; // position in the ring, one more for each packet the plugin wrote
+	uint64_t timestamp_us; // CLOCK_MONOTONIC when the plugin forwarded the packet
+	uint32_t rtp_timestamp;
+	uint32_t ssrc;
+	uint16_t rtp_seq;
+	uint16_t length;
+	uint8_t stream; // RTPFORWARD_SHM_STREAM_*
+	uint8_t flags; // RTPFORWARD_SHM_FLAG_*
+	uint8_t data[RTPFORWARD_SHM_DATA_SIZE];
+} rtpforward_shm_packet;
+
+/* Maps the ring in the given memfd, which stays owned by the caller. Returns NULL with errno set on failure. */
+rtpforward_shm_reader *rtpforward_shm_reader_open_fd(int fd);
+
+/* Opens and maps the ring at the given path, like /proc/<pid>/fd/<fd>. */
+rtpforward_shm_reader *rtpforward_shm_reader_open_path(const char *path);
+
+/* Gets the ring from the Unix socket of a session. */
+rtpforward_shm_reader *rtpforward_shm_reader_connect(const char *socket_path);
+
+/* Copies the next packet. Waits for up to timeout_ms milliseconds if there is none yet, forever if negative.
+ * Returns 1 if a packet was read, 0 on timeout, -1 on error.
+ */
+int rtpforward_shm_reader_read(rtpforward_shm_reader *reader, rtpforward_shm_packet *packet, int timeout_ms);
+
+/* Number of packets overwritten before they could be read. */
+uint64_t rtpforward_shm_reader_lost(rtpforward_shm_reader *reader);
+
+/* Number of packets the plugin couldn't write, as they were too large. */
+uint64_t rtpforward_shm_reader_dropped(rtpforward_shm_reader *reader);
+
+void rtpforward_shm_reader_close(rtpforward_shm_reader *reader);
+
+#endif
@@ -0,0 +1,287 @@
+/*! \file   rtpforward_uring.c
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Minimal io_uring wrapper for the rtpforward egress workers
+ *
+ * \details See rtpforward_uring.h
+*/
+
+#include "rtpforward_uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+static int rtpforward_uring_setup(unsigned entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int rtpforward_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int rtpforward_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void rtpforward_uring_probe(rtpforward_uring *ring) {
+	size_t len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, len);
+	if(!probe)
+		return;
+	if(rtpforward_uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) {
+#if defined(HAVE_DECL_IORING_OP_SEND_ZC) && HAVE_DECL_IORING_OP_SEND_ZC
+		if(probe->ops_len > IORING_OP_SEND_ZC && (probe->ops[IORING_OP_SEND_ZC].flags & IO_URING_OP_SUPPORTED))
+			ring->send_zc = 1;
+#endif
+	}
+	free(probe);
+}
+
+int rtpforward_uring_init(rtpforward_uring *ring, unsigned entries) {
+	struct io_uring_params params;
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = -1;
+
+	int fd = rtpforward_uring_setup(entries, &params);
+	if(fd < 0)
+		return -errno;
+	ring->fd = fd;
+
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_ring_size > ring->sq_ring_size)
+			ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED) {
+		ring->sq_ring = NULL;
+		goto error;
+	}
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(ring->cq_ring == MAP_FAILED) {
+			ring->cq_ring = NULL;
+			goto error;
+		}
+	}
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		ring->sqes = NULL;
+		goto error;
+	}
+
+	char *sq = (char *)ring->sq_ring;
+	ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+	ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+	ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+	ring->sq_entries = *(unsigned *)(sq + params.sq_off.ring_entries);
+	ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+	char *cq = (char *)ring->cq_ring;
+	ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+	ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+	ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	// The submission array maps 1:1 to the submission entries
+	unsigned i;
+	for(i = 0; i < ring->sq_entries; i++)
+		ring->sq_array[i] = i;
+
+	rtpforward_uring_probe(ring);
+	return 0;
+
+error:
+	{
+		int error = -errno;
+		rtpforward_uring_exit(ring);
+		return error;
+	}
+}
+
+void rtpforward_uring_exit(rtpforward_uring *ring) {
+	if(ring->sqes)
+		munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_ring && ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	if(ring->sq_ring)
+		munmap(ring->sq_ring, ring->sq_ring_size);
+	if(ring->fd >= 0)
+		close(ring->fd);
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+int rtpforward_uring_register_eventfd(rtpforward_uring *ring, int eventfd) {
+	if(rtpforward_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &eventfd, 1) < 0)
+		return -errno;
+	return 0;
+}
+
+int rtpforward_uring_register_buffers(rtpforward_uring *ring, unsigned count) {
+#if defined(HAVE_DECL_IORING_RSRC_REGISTER_SPARSE) && HAVE_DECL_IORING_RSRC_REGISTER_SPARSE
+	struct io_uring_rsrc_register reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.nr = count;
+	reg.flags = IORING_RSRC_REGISTER_SPARSE;
+	if(rtpforward_uring_register(ring->fd, IORING_REGISTER_BUFFERS2, &reg, sizeof(reg)) < 0)
+		return -errno;
+	ring->buffers = count;
+	return 0;
+#else
+	// Sparse buffer tables need the headers of Linux 5.19
+	return -EOPNOTSUPP;
+#endif
+}
+
+int rtpforward_uring_set_buffer(rtpforward_uring *ring, unsigned index, void *base, size_t length) {
+	if(index >= ring->buffers)
+		return -EINVAL;
+	struct iovec iov = { .iov_base = base, .iov_len = base ? length : 0 };
+	struct io_uring_rsrc_update2 update;
+	memset(&update, 0, sizeof(update));
+	update.offset = index;
+	update.data = (unsigned long long)(uintptr_t)&iov;
+	update.nr = 1;
+	if(rtpforward_uring_register(ring->fd, IORING_REGISTER_BUFFERS_UPDATE, &update, sizeof(update)) < 0)
+		return -errno;
+	return 0;
+}
+
+struct io_uring_sqe *rtpforward_uring_get_sqe(rtpforward_uring *ring) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail + ring->sq_pending;
+	if(tail - head >= ring->sq_entries)
+		return NULL;
+	struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sq_pending++;
+	return sqe;
+}
+
+void rtpforward_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned long long user_data) {
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(uintptr_t)msg;
+	sqe->len = 1;
+	sqe->user_data = user_data;
+}
+
+void rtpforward_uring_prep_send_zc(struct io_uring_sqe *sqe, int fd, const void *buf, size_t length,
+		const struct sockaddr *addr, socklen_t addrlen, int buf_index, unsigned long long user_data) {
+#if defined(HAVE_DECL_IORING_OP_SEND_ZC) && HAVE_DECL_IORING_OP_SEND_ZC
+	sqe->opcode = IORING_OP_SEND_ZC;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long long)(uintptr_t)buf;
+	sqe->len = (unsigned)length;
+	sqe->addr2 = (unsigned long long)(uintptr_t)addr;
+	sqe->addr_len = (unsigned short)addrlen;
+	if(buf_index >= 0) {
+		sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+		sqe->buf_index = (unsigned short)buf_index;
+	}
+	sqe->user_data = user_data;
+#endif
+}
+
+int rtpforward_uring_submit(rtpforward_uring *ring, unsigned wait_nr) {
+	unsigned submitted = ring->sq_pending;
+	if(submitted > 0) {
+		__atomic_store_n(ring->sq_tail, *ring->sq_tail + submitted, __ATOMIC_RELEASE);
+		ring->sq_pending = 0;
+	}
+	if(submitted == 0 && wait_nr == 0)
+		return 0;
+	int res;
+	do {
+		res = rtpforward_uring_enter(ring->fd, submitted, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0);
+	} while(res < 0 && errno == EINTR);
+	return res < 0 ? -errno : res;
+}
+
+unsigned rtpforward_uring_reap(rtpforward_uring *ring,
+		void (*callback)(unsigned long long user_data, int res, unsigned flags, void *data), void *data) {
+	unsigned head = *ring->cq_head;
+	unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	unsigned count = tail - head;
+	for(; head != tail; head++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		callback(cqe->user_data, cqe->res, cqe->flags, data);
+	}
+	if(count > 0)
+		__atomic_store_n(ring->cq_head, tail, __ATOMIC_RELEASE);
+	return count;
+}
+
+int rtpforward_uring_has_completions(rtpforward_uring *ring) {
+	return *ring->cq_head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+#else /* HAVE_LINUX_IO_URING_H */
+
+/* Built without io_uring support */
+
+int rtpforward_uring_init(rtpforward_uring *ring, unsigned entries) {
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+	return -ENOSYS;
+}
+
+void rtpforward_uring_exit(rtpforward_uring *ring) {
+}
+
+int rtpforward_uring_register_eventfd(rtpforward_uring *ring, int eventfd) {
+	return -ENOSYS;
+}
+
+int rtpforward_uring_register_buffers(rtpforward_uring *ring, unsigned count) {
+	return -ENOSYS;
+}
+
+int rtpforward_uring_set_buffer(rtpforward_uring *ring, unsigned index, void *base, size_t length) {
+	return -ENOSYS;
+}
+
+struct io_uring_sqe *rtpforward_uring_get_sqe(rtpforward_uring *ring) {
+	return NULL;
+}
+
+void rtpforward_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned long long user_data) {
+}
+
+void rtpforward_uring_prep_send_zc(struct io_uring_sqe *sqe, int fd, const void *buf, size_t length,
+		const struct sockaddr *addr, socklen_t addrlen, int buf_index, unsigned long long user_data) {
+}
+
+int rtpforward_uring_submit(rtpforward_uring *ring, unsigned wait_nr) {
+	return -ENOSYS;
+}
+
+unsigned rtpforward_uring_reap(rtpforward_uring *ring,
+		void (*callback)(unsigned long long user_data, int res, unsigned flags, void *data), void *data) {
+	return 0;
+}
+
+int rtpforward_uring_has_completions(rtpforward_uring *ring) {
+	return 0;
+}
+
+#endif /* HAVE_LINUX_IO_URING_H */
@@ -0,0 +1,94 @@
+/*! \file   rtpforward_uring.h
+ *
+ * \author Michael Karl Franzl
+ *
+ * \copyright GNU General Public License v3
+ *
+ * \brief  Minimal io_uring wrapper for the rtpforward egress workers
+ *
+ * \details Talks to the kernel through the raw system calls, so no liburing
+ * is needed. Only what the egress path uses is covered: sending datagrams
+ * with IORING_OP_SENDMSG or IORING_OP_SEND_ZC, optionally from registered
+ * buffers, and reaping completions in batches. A ring must only be used by
+ * one thread at a time.
+*/
+
+#ifndef RTPFORWARD_URING_H
+#define RTPFORWARD_URING_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#else
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif
+
+/* Completion flags of zero-copy sends, missing in older headers */
+#ifndef IORING_CQE_F_MORE
+#define IORING_CQE_F_MORE (1U << 1)
+#endif
+#ifndef IORING_CQE_F_NOTIF
+#define IORING_CQE_F_NOTIF (1U << 3)
+#endif
+
+typedef struct rtpforward_uring {
+	int fd;
+	/* Submission queue */
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	unsigned sq_pending; /* prepared, but not yet published to the kernel */
+	struct io_uring_sqe *sqes;
+	/* Completion queue */
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned cq_mask;
+	struct io_uring_cqe *cqes;
+	/* Mappings */
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;
+	size_t cq_ring_size;
+	size_t sqes_size;
+	/* Capabilities */
+	int send_zc; /* IORING_OP_SEND_ZC is supported */
+	unsigned buffers; /* number of sparse registered buffer slots, 0 if unsupported */
+} rtpforward_uring;
+
+/* Sets up a ring with at least the given number of submission entries. Returns 0 or -errno. */
+int rtpforward_uring_init(rtpforward_uring *ring, unsigned entries);
+void rtpforward_uring_exit(rtpforward_uring *ring);
+
+/* Makes the kernel signal every completion on the given eventfd */
+int rtpforward_uring_register_eventfd(rtpforward_uring *ring, int eventfd);
+/* Registers an empty table of buffer slots, to be filled with rtpforward_uring_set_buffer(). Returns -EOPNOTSUPP
+ * if built against headers older than Linux 5.19, which can't register sparse tables. */
+int rtpforward_uring_register_buffers(rtpforward_uring *ring, unsigned count);
+/* Points the buffer slot at the given memory, or clears it if base is NULL */
+int rtpforward_uring_set_buffer(rtpforward_uring *ring, unsigned index, void *base, size_t length);
+
+/* Returns a zeroed submission entry, or NULL if the submission queue is full */
+struct io_uring_sqe *rtpforward_uring_get_sqe(rtpforward_uring *ring);
+/* Sends the datagram described by msg. msg must stay valid until its completion. */
+void rtpforward_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *msg, unsigned long long user_data);
+/* Zero-copy send. buf and addr must stay valid until the final completion (the notification).
+ * buf_index is the registered buffer slot which contains buf, or -1. */
+void rtpforward_uring_prep_send_zc(struct io_uring_sqe *sqe, int fd, const void *buf, size_t length,
+	const struct sockaddr *addr, socklen_t addrlen, int buf_index, unsigned long long user_data);
+/* Publishes the prepared entries to the kernel and optionally waits for completions.
+ * Returns the number of submitted entries or -errno. */
+int rtpforward_uring_submit(rtpforward_uring *ring, unsigned wait_nr);
+
+/* Calls callback for every available completion and frees them all at once. Returns their number.
+ * res is the result of the operation, flags the IORING_CQE_F_* flags. */
+unsigned rtpforward_uring_reap(rtpforward_uring *ring,
+	void (*callback)(unsigned long long user_data, int res, unsigned flags, void *data), void *data);
+/* Whether completions are waiting to be reaped */
+int rtpforward_uring_has_completions(rtpforward_uring *ring);
+
+#endif